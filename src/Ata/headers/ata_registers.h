@@ -79,7 +79,8 @@ typedef enum _ATA_REGISTER
 #define ATA_PRD_ENTRY_PREDEFINED_SIZE           8
 #define ATA_PRD_ALIGNMENT                       4
 
-#define ATA_DMA_MAX_PHYSICAL_LEN                (64 * KB_SIZE - 1)
+// the PRD table is placed in a single page
+#define ATA_DMA_MAX_PRD_ENTRIES                 (PAGE_SIZE / ATA_PRD_ENTRY_PREDEFINED_SIZE)
 #define ATA_DMA_PHYSICAL_BOUNDARY               (64 * KB_SIZE)
 #define ATA_DMA_MAX_PHYSICAL_ADDRESS            MAX_DWORD
 #define ATA_DMA_ALIGNMENT                       4
@@ -327,6 +327,8 @@ _AtaPrepareDmaTransfer(
     DWORD i;
     PHYSICAL_ADDRESS prdtPa;
     DWORD bytesRemaining;
+    DWORD bytesForPair;
+    DWORD noOfPrdEntries;
     DWORD allocationSize;
 
     LOG_FUNC_START;
@@ -344,6 +346,8 @@ _AtaPrepareDmaTransfer(
     prdtPa = NULL;
     bytesRemaining = SectorCount * SECTOR_SIZE;
     indexInPrdEntries = 0;
+    bytesForPair = 0;
+    noOfPrdEntries = 0;
     allocationSize = 0;
 
     status = IoAllocateMdl(Buffer,byteCount,NULL,&pMdl);
@@ -356,9 +360,37 @@ _AtaPrepareDmaTransfer(
     noOfMdlTranslationEntries = IoMdlGetNumberOfPairs(pMdl);
     ASSERT( 0 != noOfMdlTranslationEntries );
 
-    // we allocate twice as many entries because we may have translations which cross
-    // the 64KB boundary => we will split such translations into 2 distinct PRD entries
-    allocationSize = sizeof(PRD_ENTRY) * noOfMdlTranslationEntries * 2;
+    // a PRD entry cannot cross a 64KB boundary => each translation is split
+    // into as many PRD entries as 64KB regions it touches
+    for (i = 0; i < noOfMdlTranslationEntries; ++i)
+    {
+        MDL_TRANSLATION_PAIR* pCurPair = IoMdlGetTranslationPair(pMdl, i);
+        ASSERT(NULL != pCurPair);
+
+        status = _AtaValidateTranslationPair(pCurPair);
+        if (!SUCCEEDED(status))
+        {
+            IoFreeMdl(pMdl);
+            return status;
+        }
+
+        bytesForPair = min(pCurPair->NumberOfBytes, bytesRemaining);
+        noOfPrdEntries = noOfPrdEntries +
+            (DWORD)((AlignAddressUpper(PtrOffset(pCurPair->Address, bytesForPair), ATA_DMA_PHYSICAL_BOUNDARY) -
+                     AlignAddressLower(pCurPair->Address, ATA_DMA_PHYSICAL_BOUNDARY)) / ATA_DMA_PHYSICAL_BOUNDARY);
+        bytesRemaining = bytesRemaining - bytesForPair;
+    }
+    ASSERT(0 == bytesRemaining);
+
+    if (noOfPrdEntries > ATA_DMA_MAX_PRD_ENTRIES)
+    {
+        LOG_ERROR("Transfer needs 0x%x PRD entries, at most 0x%x are supported\n", noOfPrdEntries, ATA_DMA_MAX_PRD_ENTRIES);
+        IoFreeMdl(pMdl);
+        return STATUS_DEVICE_DMA_PHYSICAL_SPAN_TOO_LARGE;
+    }
+
+    allocationSize = sizeof(PRD_ENTRY) * noOfPrdEntries;
+    bytesRemaining = byteCount;
 
     __try
     {
@@ -374,46 +406,37 @@ _AtaPrepareDmaTransfer(
 
         for (i = 0; i < noOfMdlTranslationEntries; ++i)
         {
-            WORD byteCountForPrd;
-            WORD byteCountForAlignment;
+            PHYSICAL_ADDRESS currentAddress;
+            DWORD bytesForPrd;
 
             MDL_TRANSLATION_PAIR* pCurPair = IoMdlGetTranslationPair(pMdl, i);
             ASSERT(NULL != pCurPair);
 
-            status = _AtaValidateTranslationPair(pCurPair);
-            if (!SUCCEEDED(status))
-            {
-                __leave;
-            }
-
-            byteCountForPrd = (WORD)min(pCurPair->NumberOfBytes, bytesRemaining);
-            byteCountForAlignment = 0;
+            currentAddress = pCurPair->Address;
+            bytesForPair = min(pCurPair->NumberOfBytes, bytesRemaining);
 
-            if (!IsInSameBoundary(pCurPair->Address, byteCountForPrd, ATA_DMA_PHYSICAL_BOUNDARY))
+            while (bytesForPair != 0)
             {
-                byteCountForAlignment = (WORD)(ATA_DMA_PHYSICAL_BOUNDARY - AddressOffset(pCurPair->Address, ATA_DMA_PHYSICAL_BOUNDARY));
+                // stop at the next 64KB boundary, a whole 64KB region is
+                // described with a byte count of 0
+                bytesForPrd = (DWORD)min(bytesForPair, ATA_DMA_PHYSICAL_BOUNDARY - AddressOffset(currentAddress, ATA_DMA_PHYSICAL_BOUNDARY));
+                ASSERT(indexInPrdEntries < noOfPrdEntries);
 
                 // warning C4311: 'type cast': pointer truncation from 'PHYSICAL_ADDRESS' to 'DWORD'
 #pragma warning(suppress:4311)
-                prdTable[indexInPrdEntries].PhysicalAddress = (DWORD)pCurPair->Address;
-                prdTable[indexInPrdEntries].ByteCount = byteCountForAlignment;
+                prdTable[indexInPrdEntries].PhysicalAddress = (DWORD)currentAddress;
+                prdTable[indexInPrdEntries].ByteCount = (WORD)bytesForPrd;
                 prdTable[indexInPrdEntries].LastEntry = 0;
 
                 indexInPrdEntries++;
-            }
 
-            // warning C4311: 'type cast': pointer truncation from 'PHYSICAL_ADDRESS' to 'DWORD'
-#pragma warning(suppress:4311)
-            prdTable[indexInPrdEntries].PhysicalAddress = (DWORD)pCurPair->Address + byteCountForAlignment;
-            prdTable[indexInPrdEntries].ByteCount = byteCountForPrd - byteCountForAlignment;
-            prdTable[indexInPrdEntries].LastEntry = 0;
-
-            // increment lbaOffset
-            bytesRemaining = bytesRemaining - byteCountForPrd;
-
-            indexInPrdEntries++;
+                currentAddress = PtrOffset(currentAddress, bytesForPrd);
+                bytesForPair = bytesForPair - bytesForPrd;
+                bytesRemaining = bytesRemaining - bytesForPrd;
+            }
         }
 
+        ASSERT(indexInPrdEntries == noOfPrdEntries);
         ASSERT(0 == bytesRemaining);
 
         // mark last entry
@@ -486,9 +509,9 @@ _AtaValidateTranslationPair(
         return STATUS_DEVICE_DATA_ALIGNMENT_ERROR;
     }
 
-    if (TranslationPair->NumberOfBytes > ATA_DMA_MAX_PHYSICAL_LEN)
+    if ((QWORD)TranslationPair->Address + TranslationPair->NumberOfBytes > (QWORD)ATA_DMA_MAX_PHYSICAL_ADDRESS + 1)
     {
-        return STATUS_DEVICE_DMA_PHYSICAL_SPAN_TOO_LARGE;
+        return STATUS_DEVICE_DMA_PHYSICAL_ADDRESS_TOO_HIGH;
     }
 
     if (!IsAddressAligned(TranslationPair->NumberOfBytes, ATA_DMA_ALIGNMENT))
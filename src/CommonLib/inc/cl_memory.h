@@ -1,6 +1,36 @@
 #pragma once
 
 C_HEADER_START
+// CPU features the memory and string routines may use, until MemorySetCpuFeatures is
+// called none of them is used
+#define CL_MEMORY_FEATURE_ERMS          0x1     // enhanced rep movsb/stosb
+#define CL_MEMORY_FEATURE_SSE2          0x2     // the XMM state is enabled
+#define CL_MEMORY_FEATURE_AVX2          0x4     // the YMM state is enabled
+#define CL_MEMORY_FEATURE_SSE42         0x8     // PCMPISTRI, requires SSE2
+
+//******************************************************************************
+// Function:     MemorySetCpuFeatures
+// Description:  Selects the implementations used by the memory and string
+//               routines. Large blocks are handled with rep movsb/stosb if ERMS
+//               is available, medium ones with the widest vector loop available.
+//               Strings are scanned 16 bytes at a time with SSE2 and compared
+//               with PCMPISTRI if SSE4.2 is also available.
+// Returns:      void
+// Parameter:    IN DWORD Features - combination of CL_MEMORY_FEATURE_*, the
+//               vector features must be given only if the OS saves the
+//               corresponding register state.
+// NOTE:         Must be called before other CPUs use the memory routines.
+//******************************************************************************
+void
+MemorySetCpuFeatures(
+    IN                          DWORD Features
+    );
+
+DWORD
+MemoryGetCpuFeatures(
+    void
+    );
+
 //******************************************************************************
 // Function:        memset
 // Description:     Sets bytes in a memory area to a value.
@@ -39,8 +69,8 @@ cl_memcpy(
 
 //******************************************************************************
 // Function:     memmove
-// Description:  Executes slower than memcpy but it can be used for overlapped
-//               memory regions.
+// Description:  Can be used for overlapped memory regions, the copy is done
+//               backwards if Destination starts inside Source.
 // Returns:      void
 // Parameter:    OUT PVOID Destination
 // Parameter:    IN PVOID Source
@@ -55,6 +85,42 @@ cl_memmove(
     IN                          QWORD   Count
     );
 
+//******************************************************************************
+// Function:     pagezero
+// Description:  Zeroes whole pages using non-temporal stores: the data goes
+//               straight to memory and does not evict the cache lines of the
+//               running code. Meant for pages which will not be read soon by
+//               the current CPU.
+// Returns:      void
+// Parameter:    OUT PVOID Address - page aligned
+// Parameter:    IN QWORD Size - multiple of PAGE_SIZE
+// NOTE:         The stores are fenced => they are visible before any store
+//               which follows the call.
+//******************************************************************************
+void
+cl_pagezero(
+    OUT_WRITES_BYTES_ALL(Size)  PVOID   Address,
+    IN                          QWORD   Size
+    );
+
+//******************************************************************************
+// Function:     pagecopy
+// Description:  Copies whole pages, the destination is written with
+//               non-temporal stores. The regions must not overlap.
+// Returns:      void
+// Parameter:    OUT PVOID Destination - page aligned
+// Parameter:    IN PVOID Source - page aligned
+// Parameter:    IN QWORD Size - multiple of PAGE_SIZE
+// NOTE:         The stores are fenced => they are visible before any store
+//               which follows the call.
+//******************************************************************************
+void
+cl_pagecopy(
+    OUT_WRITES_BYTES_ALL(Size)  PVOID   Destination,
+    IN_READS(Size)              void*   Source,
+    IN                          QWORD   Size
+    );
+
 
 //******************************************************************************
 // Function:        memcmp
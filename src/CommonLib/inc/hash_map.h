@@ -0,0 +1,275 @@
+#pragma once
+//******************************************************************************
+// Hash map
+//
+//
+// The hash map associates QWORD keys with non-NULL pointers. Unlike the
+// HASH_TABLE it is not intrusive and it grows as needed: its memory is obtained
+// through the allocation function received when initializing the map.
+//
+// The map uses open addressing: the slots are split in groups of 16 and each
+// slot has a control byte which either marks it as empty or deleted or holds 7
+// bits of the hash of its key. A lookup compares all the control bytes of a
+// group at once (with SSE2 when the XMM state is enabled, with 64 bit
+// arithmetic otherwise) and only reads the slots whose control byte matches,
+// the keys are kept in the slots => a lookup usually touches a single cache
+// line of control bytes and a single cache line of slots.
+//
+// When the map becomes too full a new table is allocated and the elements are
+// moved to it a few groups at a time by the following insertions, so no single
+// insertion has to rehash all the elements. Until all of them are moved the
+// lookups also search the old table.
+//
+// Lets see a usage example in which we map process IDs to processes:
+//
+// HASH_MAP map;
+//
+// status = HashMapInit(&map, 0, MyAllocFunction, MyFreeFunction, NULL);
+//
+// 1. Insertion - replaces the value if the key is already present
+//
+// status = HashMapInsert(&map, pProcess->Id, pProcess, NULL);
+//
+// 2. Lookup
+//
+// pProcess = HashMapLookup(&map, pid);
+//
+// 3. Removal
+//
+// pProcess = HashMapRemove(&map, pid);
+//
+// 4. Iteration - the element returned may be removed from the map, no
+//    elements may be inserted until the iteration ends
+//
+// HASH_MAP_ITERATOR it;
+// QWORD key;
+//
+// HashMapIteratorInit(&map, &it);
+//
+// while ((pProcess = HashMapIteratorNext(&it, &key)) != NULL)
+// {
+//      // do whatever with the element
+// }
+//
+// 5. Destruction
+//
+// HashMapUninit(&map);
+//
+// The map is not synchronized, the caller must serialize the operations which
+// modify it with any other operation.
+//******************************************************************************
+
+C_HEADER_START
+#include "ref_cnt.h"
+
+//******************************************************************************
+// Function:     FUNC_HashMapAlloc
+// Description:  Allocates memory for the tables of a hash map.
+// Returns:      PVOID - NULL if the memory could not be allocated
+// Parameter:    IN DWORD Size
+// Parameter:    IN_OPT PVOID Context - the context given to HashMapInit
+//******************************************************************************
+typedef
+PTR_SUCCESS
+PVOID
+(__cdecl FUNC_HashMapAlloc)(
+    IN      DWORD           Size,
+    IN_OPT  PVOID           Context
+    );
+
+typedef FUNC_HashMapAlloc*          PFUNC_HashMapAlloc;
+
+typedef struct _HASH_MAP_SLOT
+{
+    QWORD                       Key;
+    PVOID                       Value;
+} HASH_MAP_SLOT, *PHASH_MAP_SLOT;
+
+typedef struct _HASH_MAP_TABLE
+{
+    // Capacity control bytes, the slots follow them in the same allocation
+    PBYTE                       Control;
+    PHASH_MAP_SLOT              Slots;
+
+    // Power of 2 and a multiple of the group size, 0 if not allocated
+    DWORD                       Capacity;
+
+    DWORD                       NumberOfElements;
+    DWORD                       NumberOfDeleted;
+} HASH_MAP_TABLE, *PHASH_MAP_TABLE;
+
+typedef struct _HASH_MAP
+{
+    // All the insertions are done in this table
+    HASH_MAP_TABLE              Table;
+
+    // Table whose elements are being moved to Table, its capacity is 0 if no
+    // resize is in progress
+    HASH_MAP_TABLE              OldTable;
+
+    // The groups of OldTable below this index were already moved
+    DWORD                       NextGroupToMove;
+
+    PFUNC_HashMapAlloc          AllocFunction;
+    PFUNC_FreeFunction          FreeFunction;
+    PVOID                       AllocContext;
+} HASH_MAP, *PHASH_MAP;
+
+typedef struct _HASH_MAP_ITERATOR
+{
+    PHASH_MAP                   HashMap;
+
+    // Indexes the slots of OldTable followed by the ones of Table
+    DWORD                       Position;
+} HASH_MAP_ITERATOR, *PHASH_MAP_ITERATOR;
+
+//******************************************************************************
+// Function:     HashMapInit
+// Description:  Initializes an empty hash map.
+// Returns:      STATUS
+// Parameter:    OUT PHASH_MAP HashMap
+// Parameter:    IN DWORD InitialElements - Number of elements which fit in the
+//               map before it needs to grow, if 0 the first table is only
+//               allocated by the first insertion.
+// Parameter:    IN PFUNC_HashMapAlloc AllocFunction
+// Parameter:    IN PFUNC_FreeFunction FreeFunction - Frees the memory returned
+//               by AllocFunction
+// Parameter:    IN_OPT PVOID Context - Passed to both functions
+//******************************************************************************
+STATUS
+HashMapInit(
+    OUT     PHASH_MAP           HashMap,
+    IN      DWORD               InitialElements,
+    IN      PFUNC_HashMapAlloc  AllocFunction,
+    IN      PFUNC_FreeFunction  FreeFunction,
+    IN_OPT  PVOID               Context
+    );
+
+//******************************************************************************
+// Function:     HashMapUninit
+// Description:  Frees the memory used by the map, the values are not touched.
+// Returns:      void
+// Parameter:    INOUT PHASH_MAP HashMap
+//******************************************************************************
+void
+HashMapUninit(
+    INOUT   PHASH_MAP           HashMap
+    );
+
+//******************************************************************************
+// Function:     HashMapClear
+// Description:  Removes all the elements from the map, optionally calling a
+//               free function for each value. The memory of the map is kept.
+// Returns:      void
+// Parameter:    INOUT PHASH_MAP HashMap
+// Parameter:    IN_OPT PFUNC_FreeFunction FreeFunction
+// Parameter:    IN_OPT PVOID FreeContext
+//******************************************************************************
+void
+HashMapClear(
+    INOUT   PHASH_MAP           HashMap,
+    IN_OPT  PFUNC_FreeFunction  FreeFunction,
+    IN_OPT  PVOID               FreeContext
+    );
+
+//******************************************************************************
+// Function:     HashMapSize
+// Description:
+// Returns:      DWORD - Number of elements in the map
+// Parameter:    IN PHASH_MAP HashMap
+//******************************************************************************
+DWORD
+HashMapSize(
+    IN      PHASH_MAP           HashMap
+    );
+
+//******************************************************************************
+// Function:     HashMapInsert
+// Description:  Associates Value with Key, replacing the previous value if the
+//               key is already present.
+// Returns:      STATUS - STATUS_HEAP_INSUFFICIENT_RESOURCES if the map is full
+//               and a larger table could not be allocated
+// Parameter:    INOUT PHASH_MAP HashMap
+// Parameter:    IN QWORD Key
+// Parameter:    IN PVOID Value - must not be NULL
+// Parameter:    OUT_OPT PVOID* PreviousValue - NULL if the key was not present
+//******************************************************************************
+STATUS
+HashMapInsert(
+    INOUT   PHASH_MAP           HashMap,
+    IN      QWORD               Key,
+    IN      PVOID               Value,
+    OUT_OPT PVOID*              PreviousValue
+    );
+
+//******************************************************************************
+// Function:     HashMapLookup
+// Description:  Searches for the value associated with Key.
+// Returns:      PVOID - NULL if the key is not present
+// Parameter:    IN PHASH_MAP HashMap
+// Parameter:    IN QWORD Key
+//******************************************************************************
+PTR_SUCCESS
+PVOID
+HashMapLookup(
+    IN      PHASH_MAP           HashMap,
+    IN      QWORD               Key
+    );
+
+//******************************************************************************
+// Function:     HashMapRemove
+// Description:  Removes Key from the map.
+// Returns:      PVOID - The value which was associated with the key, NULL if
+//               the key is not present
+// Parameter:    INOUT PHASH_MAP HashMap
+// Parameter:    IN QWORD Key
+//******************************************************************************
+PTR_SUCCESS
+PVOID
+HashMapRemove(
+    INOUT   PHASH_MAP           HashMap,
+    IN      QWORD               Key
+    );
+
+//******************************************************************************
+// Function:     HashMapIteratorInit
+// Description:  Initializes an iterator over the map.
+// Returns:      void
+// Parameter:    IN PHASH_MAP HashMap
+// Parameter:    OUT PHASH_MAP_ITERATOR Iterator
+// NOTE:         There is no guarantee regarding the order in which the map is
+//               traversed.
+//******************************************************************************
+void
+HashMapIteratorInit(
+    IN      PHASH_MAP           HashMap,
+    OUT     PHASH_MAP_ITERATOR  Iterator
+    );
+
+//******************************************************************************
+// Function:     HashMapIteratorNext
+// Description:  Returns the next element in the map.
+// Returns:      PVOID - The value of the element, NULL if there are no more
+//               elements
+// Parameter:    INOUT PHASH_MAP_ITERATOR Iterator
+// Parameter:    OUT_OPT QWORD* Key - The key of the element
+//******************************************************************************
+PTR_SUCCESS
+PVOID
+HashMapIteratorNext(
+    INOUT   PHASH_MAP_ITERATOR  Iterator,
+    OUT_OPT QWORD*              Key
+    );
+
+//******************************************************************************
+// Function:     HashMapHashKey
+// Description:  Mixes all the bits of Key into a 64 bit hash, each bit of the
+//               key affects all the bits of the result.
+// Returns:      QWORD
+// Parameter:    IN QWORD Key
+//******************************************************************************
+QWORD
+HashMapHashKey(
+    IN      QWORD               Key
+    );
+C_HEADER_END
@@ -0,0 +1,98 @@
+#pragma once
+//******************************************************************************
+// Interlocked singly linked list
+//
+//
+// A LIFO list which may be pushed to and popped from concurrently by any number
+// of CPUs without taking a lock. The header holds the first entry together with
+// a depth and a sequence number which are all updated by a single 16 byte
+// compare exchange (CMPXCHG16B). Every operation increments the sequence => a
+// pop which read the first entry and its successor before the entry was popped
+// and pushed back by another CPU (the ABA problem) fails its compare exchange
+// and retries.
+//
+// A pop reads the link of the first entry before knowing it still owns it =>
+// the memory of an entry must remain mapped while a pop may be in progress
+// (i.e. the entries must come from a pool or be part of structures which are
+// never unmapped).
+//
+// The list entries are CL_SLIST_ENTRY structures which are embedded in the
+// elements, just like with the non-interlocked list in slist.h.
+//******************************************************************************
+
+C_HEADER_START
+#include "slist.h"
+
+typedef struct __declspec(align(16)) _CL_SLIST_HEADER
+{
+    PCL_SLIST_ENTRY volatile    First;
+
+    volatile DWORD              Depth;
+
+    // Incremented on every operation, only used to detect changes
+    volatile DWORD              Sequence;
+} CL_SLIST_HEADER, *PCL_SLIST_HEADER;
+STATIC_ASSERT(sizeof(CL_SLIST_HEADER) == 2 * sizeof(QWORD));
+
+//******************************************************************************
+// Function:     ClInitializeInterlockedSListHead
+// Description:  Initializes an empty list.
+// Returns:      void
+// Parameter:    OUT PCL_SLIST_HEADER ListHead - must be 16 byte aligned
+//******************************************************************************
+void
+ClInitializeInterlockedSListHead(
+    OUT     PCL_SLIST_HEADER    ListHead
+    );
+
+//******************************************************************************
+// Function:     ClInterlockedPushEntrySList
+// Description:  Inserts Entry at the front of the list.
+// Returns:      PCL_SLIST_ENTRY - The previous first entry of the list, NULL if
+//               the list was empty
+// Parameter:    INOUT PCL_SLIST_HEADER ListHead
+// Parameter:    INOUT PCL_SLIST_ENTRY Entry
+//******************************************************************************
+PCL_SLIST_ENTRY
+ClInterlockedPushEntrySList(
+    INOUT   PCL_SLIST_HEADER    ListHead,
+    INOUT   PCL_SLIST_ENTRY     Entry
+    );
+
+//******************************************************************************
+// Function:     ClInterlockedPopEntrySList
+// Description:  Removes the first entry of the list.
+// Returns:      PCL_SLIST_ENTRY - NULL if the list is empty
+// Parameter:    INOUT PCL_SLIST_HEADER ListHead
+//******************************************************************************
+PTR_SUCCESS
+PCL_SLIST_ENTRY
+ClInterlockedPopEntrySList(
+    INOUT   PCL_SLIST_HEADER    ListHead
+    );
+
+//******************************************************************************
+// Function:     ClInterlockedFlushSList
+// Description:  Removes all the entries of the list at once.
+// Returns:      PCL_SLIST_ENTRY - The first of the removed entries, they remain
+//               linked through their Next fields, NULL if the list was empty
+// Parameter:    INOUT PCL_SLIST_HEADER ListHead
+//******************************************************************************
+PTR_SUCCESS
+PCL_SLIST_ENTRY
+ClInterlockedFlushSList(
+    INOUT   PCL_SLIST_HEADER    ListHead
+    );
+
+//******************************************************************************
+// Function:     ClQueryDepthSList
+// Description:  The result is only a snapshot, entries may be pushed or popped
+//               concurrently.
+// Returns:      DWORD - Number of entries in the list
+// Parameter:    IN PCL_SLIST_HEADER ListHead
+//******************************************************************************
+DWORD
+ClQueryDepthSList(
+    IN      PCL_SLIST_HEADER    ListHead
+    );
+C_HEADER_END
@@ -0,0 +1,83 @@
+#pragma once
+//******************************************************************************
+// Multi-producer single-consumer queue
+//
+//
+// A FIFO queue in which any number of CPUs may insert elements without taking
+// a lock, while a single consumer (usually a worker thread) removes them. An
+// insertion is a single atomic exchange of the queue's tail followed by a
+// store which links the previous tail to the new element.
+//
+// Between these two steps the element is not yet reachable by the consumer =>
+// MpscQueuePop may return NULL although an insertion has already started. A
+// consumer which waits for an event signaled by the producers after they
+// insert must clear the event and pop once more before waiting again, this way
+// no element is left in the queue:
+//
+// while ((pEntry = MpscQueuePop(&queue)) == NULL)
+// {
+//      ExEventClearSignal(&newElementsEvent);
+//
+//      if ((pEntry = MpscQueuePop(&queue)) != NULL) break;
+//
+//      ExEventWaitForSignal(&newElementsEvent);
+// }
+//
+// The elements embed a CL_SLIST_ENTRY, just like the elements of a list.
+//******************************************************************************
+
+C_HEADER_START
+#include "slist.h"
+
+typedef struct _MPSC_QUEUE
+{
+    // The last element inserted, exchanged by the producers
+    PCL_SLIST_ENTRY volatile    Head;
+
+    // The next element to be removed, only used by the consumer
+    PCL_SLIST_ENTRY             Tail;
+
+    // Element which is in the queue whenever the consumer would otherwise
+    // remove the last element => Head never becomes NULL
+    CL_SLIST_ENTRY              Stub;
+} MPSC_QUEUE, *PMPSC_QUEUE;
+
+//******************************************************************************
+// Function:     MpscQueueInit
+// Description:  Initializes an empty queue.
+// Returns:      void
+// Parameter:    OUT PMPSC_QUEUE Queue
+//******************************************************************************
+void
+MpscQueueInit(
+    OUT     PMPSC_QUEUE         Queue
+    );
+
+//******************************************************************************
+// Function:     MpscQueuePush
+// Description:  Inserts Entry at the end of the queue. May be called
+//               concurrently by any number of CPUs.
+// Returns:      void
+// Parameter:    INOUT PMPSC_QUEUE Queue
+// Parameter:    INOUT PCL_SLIST_ENTRY Entry
+//******************************************************************************
+void
+MpscQueuePush(
+    INOUT   PMPSC_QUEUE         Queue,
+    INOUT   PCL_SLIST_ENTRY     Entry
+    );
+
+//******************************************************************************
+// Function:     MpscQueuePop
+// Description:  Removes the first element of the queue. Only a single CPU may
+//               call this function at a time.
+// Returns:      PCL_SLIST_ENTRY - NULL if the queue is empty or if the first
+//               element is still being inserted
+// Parameter:    INOUT PMPSC_QUEUE Queue
+//******************************************************************************
+PTR_SUCCESS
+PCL_SLIST_ENTRY
+MpscQueuePop(
+    INOUT   PMPSC_QUEUE         Queue
+    );
+C_HEADER_END
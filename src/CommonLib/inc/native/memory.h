@@ -8,6 +8,8 @@
 #define memzero             cl_memzero
 #define memcpy              cl_memcpy
 #define memmove             cl_memmove
+#define pagezero            cl_pagezero
+#define pagecopy            cl_pagecopy
 #define memcmp              cl_memcmp
 #define rmemcmp             cl_rmemcmp
 #define memscan             cl_memscan
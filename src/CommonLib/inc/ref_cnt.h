@@ -59,6 +59,19 @@ RfcReference(
     INOUT   REF_COUNT*              Object
     );
 
+//******************************************************************************
+// Function:     RfcTryReference
+// Description:  Increments the reference count of the object only if it did not
+//               already reach 0. Used when the object is found through a
+//               structure from which it is removed only by its FreeFunction.
+// Returns:      BOOLEAN - TRUE if the object was referenced
+// Parameter:    INOUT REF_COUNT * Object
+//******************************************************************************
+BOOLEAN
+RfcTryReference(
+    INOUT   REF_COUNT*              Object
+    );
+
 //******************************************************************************
 // Function:     RfcReference
 // Description:  Decrements the reference count of the object
@@ -46,6 +46,34 @@ __movsq(
     IN                                          QWORD   Count
     );
 
+void
+__stosb(
+    OUT_WRITES_BYTES_ALL(Count)                 PBYTE   Destination,
+    IN                                          BYTE    Data,
+    IN                                          QWORD   Count
+    );
+
+void
+__stosq(
+    OUT_WRITES_BYTES_ALL(Count*sizeof(QWORD))   PQWORD  Destination,
+    IN                                          QWORD   Data,
+    IN                                          QWORD   Count
+    );
+
+_Success_(return != 0)
+BOOLEAN
+_BitScanForward(
+    OUT  DWORD*  Index,
+    IN   DWORD   Mask
+    );
+
+_Success_(return != 0)
+BOOLEAN
+_BitScanReverse(
+    OUT  DWORD*  Index,
+    IN   DWORD   Mask
+    );
+
 _Success_(return == 0)
 VMX_RESULT
 __vmx_vmread(
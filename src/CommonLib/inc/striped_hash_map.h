@@ -0,0 +1,194 @@
+#pragma once
+//******************************************************************************
+// Striped hash map
+//
+//
+// A HASH_MAP which may be used concurrently from multiple CPUs. The keys are
+// distributed over STRIPED_HASH_MAP_NO_OF_STRIPES independent hash maps (the
+// stripes), each of them protected by its own RW spinlock and placed in its own
+// cache lines => lookups only take a stripe lock shared and operations on keys
+// which fall in different stripes never contend for the same lock.
+//
+// Each stripe grows independently so a resize never blocks the whole map.
+//
+// The lock of a stripe is a spinlock => the callbacks executed while it is held
+// (see StripedHashMapLookup and StripedHashMapExecuteForEach) must be short and
+// must not block. The allocation function must also be usable with the
+// interrupts disabled.
+//
+// Because a value may be removed (and its object destroyed) by another CPU as
+// soon as the stripe lock is released, objects which are looked up should be
+// referenced from the lookup callback, while the stripe lock is still held:
+//
+// static
+// BOOLEAN
+// (__cdecl _ReferenceProcess)(
+//      IN      QWORD       Key,
+//      IN      PVOID       Value,
+//      IN_OPT  PVOID       Context
+//      )
+// {
+//      return RfcTryReference(&((PPROCESS)Value)->RefCnt);
+// }
+//
+// pProcess = StripedHashMapLookup(&map, pid, _ReferenceProcess, NULL);
+//******************************************************************************
+
+C_HEADER_START
+#include "hash_map.h"
+#include "lock_common.h"
+
+// Power of 2
+#define STRIPED_HASH_MAP_NO_OF_STRIPES          16
+
+//******************************************************************************
+// Function:     FUNC_StripedHashMapFunction
+// Description:  Called for an element of the map while the lock of its stripe
+//               is held.
+// Returns:      BOOLEAN - For lookups FALSE makes the lookup fail, for
+//               iterations FALSE stops the iteration
+// Parameter:    IN QWORD Key
+// Parameter:    IN PVOID Value
+// Parameter:    IN_OPT PVOID Context
+//******************************************************************************
+typedef
+BOOLEAN
+(__cdecl FUNC_StripedHashMapFunction)(
+    IN      QWORD           Key,
+    IN      PVOID           Value,
+    IN_OPT  PVOID           Context
+    );
+
+typedef FUNC_StripedHashMapFunction*    PFUNC_StripedHashMapFunction;
+
+// Aligned to a cache line so the CPUs working on different stripes do not
+// invalidate each other's lines
+typedef struct __declspec(align(64)) _STRIPED_HASH_MAP_STRIPE
+{
+    RW_SPINLOCK                 Lock;
+
+    _Guarded_by_(Lock)
+    HASH_MAP                    HashMap;
+} STRIPED_HASH_MAP_STRIPE, *PSTRIPED_HASH_MAP_STRIPE;
+
+typedef struct _STRIPED_HASH_MAP
+{
+    STRIPED_HASH_MAP_STRIPE     Stripes[STRIPED_HASH_MAP_NO_OF_STRIPES];
+} STRIPED_HASH_MAP, *PSTRIPED_HASH_MAP;
+
+//******************************************************************************
+// Function:     StripedHashMapInit
+// Description:  Initializes an empty map, no memory is allocated until the
+//               first insertion.
+// Returns:      STATUS
+// Parameter:    OUT PSTRIPED_HASH_MAP HashMap
+// Parameter:    IN PFUNC_HashMapAlloc AllocFunction
+// Parameter:    IN PFUNC_FreeFunction FreeFunction
+// Parameter:    IN_OPT PVOID Context - Passed to both functions
+//******************************************************************************
+STATUS
+StripedHashMapInit(
+    OUT     PSTRIPED_HASH_MAP   HashMap,
+    IN      PFUNC_HashMapAlloc  AllocFunction,
+    IN      PFUNC_FreeFunction  FreeFunction,
+    IN_OPT  PVOID               Context
+    );
+
+//******************************************************************************
+// Function:     StripedHashMapUninit
+// Description:  Frees the memory used by the map, the values are not touched.
+//               No other operation may be in progress.
+// Returns:      void
+// Parameter:    INOUT PSTRIPED_HASH_MAP HashMap
+//******************************************************************************
+void
+StripedHashMapUninit(
+    INOUT   PSTRIPED_HASH_MAP   HashMap
+    );
+
+//******************************************************************************
+// Function:     StripedHashMapSize
+// Description:  The result is only a snapshot, elements may be inserted or
+//               removed concurrently.
+// Returns:      DWORD - Number of elements in the map
+// Parameter:    IN PSTRIPED_HASH_MAP HashMap
+//******************************************************************************
+DWORD
+StripedHashMapSize(
+    IN      PSTRIPED_HASH_MAP   HashMap
+    );
+
+//******************************************************************************
+// Function:     StripedHashMapInsert
+// Description:  Associates Value with Key, replacing the previous value if the
+//               key is already present.
+// Returns:      STATUS - STATUS_HEAP_INSUFFICIENT_RESOURCES if the stripe is
+//               full and a larger table could not be allocated
+// Parameter:    INOUT PSTRIPED_HASH_MAP HashMap
+// Parameter:    IN QWORD Key
+// Parameter:    IN PVOID Value - must not be NULL
+// Parameter:    OUT_OPT PVOID* PreviousValue - NULL if the key was not present
+//******************************************************************************
+STATUS
+StripedHashMapInsert(
+    INOUT   PSTRIPED_HASH_MAP   HashMap,
+    IN      QWORD               Key,
+    IN      PVOID               Value,
+    OUT_OPT PVOID*              PreviousValue
+    );
+
+//******************************************************************************
+// Function:     StripedHashMapLookup
+// Description:  Searches for the value associated with Key.
+// Returns:      PVOID - NULL if the key is not present or if Function returned
+//               FALSE
+// Parameter:    IN PSTRIPED_HASH_MAP HashMap
+// Parameter:    IN QWORD Key
+// Parameter:    IN_OPT PFUNC_StripedHashMapFunction Function - Called for the
+//               value found before the stripe lock is released, usually to
+//               reference it.
+// Parameter:    IN_OPT PVOID Context - Passed to Function
+//******************************************************************************
+PTR_SUCCESS
+PVOID
+StripedHashMapLookup(
+    IN      PSTRIPED_HASH_MAP               HashMap,
+    IN      QWORD                           Key,
+    IN_OPT  PFUNC_StripedHashMapFunction    Function,
+    IN_OPT  PVOID                           Context
+    );
+
+//******************************************************************************
+// Function:     StripedHashMapRemove
+// Description:  Removes Key from the map.
+// Returns:      PVOID - The value which was associated with the key, NULL if
+//               the key is not present
+// Parameter:    INOUT PSTRIPED_HASH_MAP HashMap
+// Parameter:    IN QWORD Key
+//******************************************************************************
+PTR_SUCCESS
+PVOID
+StripedHashMapRemove(
+    INOUT   PSTRIPED_HASH_MAP   HashMap,
+    IN      QWORD               Key
+    );
+
+//******************************************************************************
+// Function:     StripedHashMapExecuteForEach
+// Description:  Calls Function for each element of the map, stripe by stripe.
+//               Each stripe is locked shared while its elements are visited =>
+//               Function may not modify the map.
+// Returns:      BOOLEAN - FALSE if Function stopped the iteration
+// Parameter:    IN PSTRIPED_HASH_MAP HashMap
+// Parameter:    IN PFUNC_StripedHashMapFunction Function
+// Parameter:    IN_OPT PVOID Context
+// NOTE:         There is no guarantee regarding the order in which the map is
+//               traversed.
+//******************************************************************************
+BOOLEAN
+StripedHashMapExecuteForEach(
+    IN      PSTRIPED_HASH_MAP               HashMap,
+    IN      PFUNC_StripedHashMapFunction    Function,
+    IN_OPT  PVOID                           Context
+    );
+C_HEADER_END
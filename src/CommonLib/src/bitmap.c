@@ -321,8 +321,7 @@ _BitmapScanInternal(
 {
     DWORD i, j;
     DWORD lastIndex;
-    DWORD firstIndex;
-    BOOLEAN found;
+    BYTE skippedByte;
 
     ASSERT( NULL != Bitmap );
     ASSERT( 0 != ConsecutiveBits );
@@ -336,25 +335,41 @@ _BitmapScanInternal(
     }
 
     lastIndex = FirstInvalidBitIndex - ConsecutiveBits;
-    firstIndex = StartIndex;
-    found = FALSE;
 
-    for (i = firstIndex; i <= lastIndex; ++i)
+    // a byte with this value does not contain a single bit we search for
+    skippedByte = Set ? 0 : MAX_BYTE;
+
+    i = StartIndex;
+    while (i <= lastIndex)
     {
-        found = TRUE;
+        if (0 == i % BITMAP_ENTRY_BITS)
+        {
+            // skip the whole bytes which cannot be part of the run, memscan
+            // compares a block of bytes at a time
+            i = i + (DWORD) memscan(&Bitmap->BitmapBuffer[i / BITMAP_ENTRY_BITS],
+                                    (FirstInvalidBitIndex - i) / BITMAP_ENTRY_BITS,
+                                    skippedByte) * BITMAP_ENTRY_BITS;
+            if (i > lastIndex)
+            {
+                break;
+            }
+        }
+
         for (j = 0; j < ConsecutiveBits; ++j)
         {
             if (Set != _BitmapGetBit(Bitmap->BitmapBuffer, i + j))
             {
-                found = FALSE;
                 break;
             }
         }
 
-        if (found)
+        if (ConsecutiveBits == j)
         {
             return i;
         }
+
+        // none of the runs starting before the mismatched bit can be valid
+        i = i + j + 1;
     }
 
     return MAX_DWORD;
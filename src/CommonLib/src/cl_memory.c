@@ -1,88 +1,466 @@
 #include "common_lib.h"
 #include "cl_memory.h"
+#include <immintrin.h>
 
 extern void CpuClearDirectionFlag();
 
-_At_buffer_( address, i, size, _Post_satisfies_( ((PBYTE)address)[i] == value ))
+// Blocks at least this large are set or copied with rep stosb/movsb if the
+// CPU has enhanced fast strings, below this the start-up cost of the
+// microcode is higher than that of a vector loop
+#define CL_MEMORY_REP_THRESHOLD             (2 * KB_SIZE)
+
+#define CL_MEMORY_SSE2_BLOCK                sizeof(__m128i)
+#define CL_MEMORY_AVX2_BLOCK                sizeof(__m256i)
+#define CL_MEMORY_CACHE_LINE                64
+
+#define CL_MEMORY_BYTE_PATTERN(Value)       ((QWORD)(Value) * 0x0101'0101'0101'0101ULL)
+
+// Written once before the other CPUs are started
+static DWORD                                m_memoryFeatures = 0;
+
+__forceinline
+static
+BOOLEAN
+_MemoryIsFeatureSelected(
+    IN                          DWORD Feature
+    )
+{
+    return IsBooleanFlagOn(m_memoryFeatures, Feature);
+}
+
+// Sets blocks smaller than CL_MEMORY_SSE2_BLOCK using two overlapping
+// stores of the widest size which fits
+__forceinline
+static
 void
-cl_memset(
-    OUT_WRITES_BYTES_ALL(size)  PVOID address,
-    IN                          BYTE value,
-    IN                          DWORD size
+_MemorySetSmall(
+    OUT_WRITES_BYTES_ALL(Count) PBYTE   Destination,
+    IN                          BYTE    Value,
+    IN                          QWORD   Count
     )
 {
-    DWORD i;
+    QWORD pattern = CL_MEMORY_BYTE_PATTERN(Value);
 
-    // validate parameters
-    // size validation is done implicitly in the for loop
-    if (NULL == address)
+    ASSERT(Count < CL_MEMORY_SSE2_BLOCK);
+
+    if (Count >= sizeof(QWORD))
     {
-        return;
+        *((PQWORD)Destination) = pattern;
+        *((PQWORD)(Destination + Count - sizeof(QWORD))) = pattern;
+    }
+    else if (Count >= sizeof(DWORD))
+    {
+        *((PDWORD)Destination) = (DWORD)pattern;
+        *((PDWORD)(Destination + Count - sizeof(DWORD))) = (DWORD)pattern;
+    }
+    else if (Count >= sizeof(WORD))
+    {
+        *((PWORD)Destination) = (WORD)pattern;
+        *((PWORD)(Destination + Count - sizeof(WORD))) = (WORD)pattern;
+    }
+    else if (Count != 0)
+    {
+        *Destination = Value;
+    }
+}
+
+// Copies blocks smaller than CL_MEMORY_SSE2_BLOCK, all the data is loaded
+// before anything is stored => the regions may overlap
+__forceinline
+static
+void
+_MemoryCopySmall(
+    OUT_WRITES_BYTES_ALL(Count) PBYTE       Destination,
+    IN_READS(Count)             const BYTE* Source,
+    IN                          QWORD       Count
+    )
+{
+    ASSERT(Count < CL_MEMORY_SSE2_BLOCK);
+
+    if (Count >= sizeof(QWORD))
+    {
+        QWORD first = *((const QWORD*)Source);
+        QWORD last = *((const QWORD*)(Source + Count - sizeof(QWORD)));
+
+        *((PQWORD)Destination) = first;
+        *((PQWORD)(Destination + Count - sizeof(QWORD))) = last;
+    }
+    else if (Count >= sizeof(DWORD))
+    {
+        DWORD first = *((const DWORD*)Source);
+        DWORD last = *((const DWORD*)(Source + Count - sizeof(DWORD)));
+
+        *((PDWORD)Destination) = first;
+        *((PDWORD)(Destination + Count - sizeof(DWORD))) = last;
     }
+    else if (Count >= sizeof(WORD))
+    {
+        WORD first = *((const WORD*)Source);
+        WORD last = *((const WORD*)(Source + Count - sizeof(WORD)));
 
-    for (i = 0; i < size; ++i)
+        *((PWORD)Destination) = first;
+        *((PWORD)(Destination + Count - sizeof(WORD))) = last;
+    }
+    else if (Count != 0)
     {
-        ((BYTE*)address)[i] = value;
+        *Destination = *Source;
     }
 }
 
-_At_buffer_(Destination, i, Count,
-            _Post_satisfies_(((PBYTE)Destination)[i] == ((PBYTE)Source)[i]))
+static
 void
-cl_memcpy(
-    OUT_WRITES_BYTES_ALL(Count) PVOID   Destination,
-    IN_READS(Count)             void*   Source,
+_MemorySetSse2(
+    OUT_WRITES_BYTES_ALL(Count) PBYTE   Destination,
+    IN                          BYTE    Value,
     IN                          QWORD   Count
     )
 {
-    PBYTE dst;
-    PBYTE src;
+    __m128i pattern;
+    QWORD i;
+
+    ASSERT(Count >= CL_MEMORY_SSE2_BLOCK);
+
+    pattern = _mm_set1_epi8((char)Value);
+
+    for (i = 0; i + 4 * CL_MEMORY_SSE2_BLOCK <= Count; i += 4 * CL_MEMORY_SSE2_BLOCK)
+    {
+        _mm_storeu_si128((__m128i*)(Destination + i), pattern);
+        _mm_storeu_si128((__m128i*)(Destination + i + CL_MEMORY_SSE2_BLOCK), pattern);
+        _mm_storeu_si128((__m128i*)(Destination + i + 2 * CL_MEMORY_SSE2_BLOCK), pattern);
+        _mm_storeu_si128((__m128i*)(Destination + i + 3 * CL_MEMORY_SSE2_BLOCK), pattern);
+    }
+
+    for (; i + CL_MEMORY_SSE2_BLOCK <= Count; i += CL_MEMORY_SSE2_BLOCK)
+    {
+        _mm_storeu_si128((__m128i*)(Destination + i), pattern);
+    }
+
+    // the last partial block overlaps bytes which were already set
+    if (i < Count)
+    {
+        _mm_storeu_si128((__m128i*)(Destination + Count - CL_MEMORY_SSE2_BLOCK), pattern);
+    }
+}
+
+static
+void
+_MemorySetAvx2(
+    OUT_WRITES_BYTES_ALL(Count) PBYTE   Destination,
+    IN                          BYTE    Value,
+    IN                          QWORD   Count
+    )
+{
+    __m256i pattern;
+    QWORD i;
+
+    ASSERT(Count >= CL_MEMORY_AVX2_BLOCK);
+
+    pattern = _mm256_set1_epi8((char)Value);
+
+    for (i = 0; i + 4 * CL_MEMORY_AVX2_BLOCK <= Count; i += 4 * CL_MEMORY_AVX2_BLOCK)
+    {
+        _mm256_storeu_si256((__m256i*)(Destination + i), pattern);
+        _mm256_storeu_si256((__m256i*)(Destination + i + CL_MEMORY_AVX2_BLOCK), pattern);
+        _mm256_storeu_si256((__m256i*)(Destination + i + 2 * CL_MEMORY_AVX2_BLOCK), pattern);
+        _mm256_storeu_si256((__m256i*)(Destination + i + 3 * CL_MEMORY_AVX2_BLOCK), pattern);
+    }
+
+    for (; i + CL_MEMORY_AVX2_BLOCK <= Count; i += CL_MEMORY_AVX2_BLOCK)
+    {
+        _mm256_storeu_si256((__m256i*)(Destination + i), pattern);
+    }
+
+    if (i < Count)
+    {
+        _mm256_storeu_si256((__m256i*)(Destination + Count - CL_MEMORY_AVX2_BLOCK), pattern);
+    }
+
+    // avoid the penalty of mixing legacy SSE and VEX instructions
+    _mm256_zeroupper();
+}
+
+// The last block is loaded before anything is stored and each block is
+// loaded before the previous ones are stored => the regions may overlap if
+// Destination is below Source
+static
+void
+_MemoryCopyForwardSse2(
+    OUT_WRITES_BYTES_ALL(Count) PBYTE       Destination,
+    IN_READS(Count)             const BYTE* Source,
+    IN                          QWORD       Count
+    )
+{
+    __m128i last;
+    QWORD i;
+
+    ASSERT(Count >= CL_MEMORY_SSE2_BLOCK);
+
+    last = _mm_loadu_si128((const __m128i*)(Source + Count - CL_MEMORY_SSE2_BLOCK));
+
+    for (i = 0; i + 2 * CL_MEMORY_SSE2_BLOCK <= Count; i += 2 * CL_MEMORY_SSE2_BLOCK)
+    {
+        __m128i first = _mm_loadu_si128((const __m128i*)(Source + i));
+        __m128i second = _mm_loadu_si128((const __m128i*)(Source + i + CL_MEMORY_SSE2_BLOCK));
+
+        _mm_storeu_si128((__m128i*)(Destination + i), first);
+        _mm_storeu_si128((__m128i*)(Destination + i + CL_MEMORY_SSE2_BLOCK), second);
+    }
+
+    for (; i + CL_MEMORY_SSE2_BLOCK <= Count; i += CL_MEMORY_SSE2_BLOCK)
+    {
+        _mm_storeu_si128((__m128i*)(Destination + i), _mm_loadu_si128((const __m128i*)(Source + i)));
+    }
+
+    _mm_storeu_si128((__m128i*)(Destination + Count - CL_MEMORY_SSE2_BLOCK), last);
+}
+
+static
+void
+_MemoryCopyForwardAvx2(
+    OUT_WRITES_BYTES_ALL(Count) PBYTE       Destination,
+    IN_READS(Count)             const BYTE* Source,
+    IN                          QWORD       Count
+    )
+{
+    __m256i last;
+    QWORD i;
+
+    ASSERT(Count >= CL_MEMORY_AVX2_BLOCK);
+
+    last = _mm256_loadu_si256((const __m256i*)(Source + Count - CL_MEMORY_AVX2_BLOCK));
+
+    for (i = 0; i + 2 * CL_MEMORY_AVX2_BLOCK <= Count; i += 2 * CL_MEMORY_AVX2_BLOCK)
+    {
+        __m256i first = _mm256_loadu_si256((const __m256i*)(Source + i));
+        __m256i second = _mm256_loadu_si256((const __m256i*)(Source + i + CL_MEMORY_AVX2_BLOCK));
+
+        _mm256_storeu_si256((__m256i*)(Destination + i), first);
+        _mm256_storeu_si256((__m256i*)(Destination + i + CL_MEMORY_AVX2_BLOCK), second);
+    }
+
+    for (; i + CL_MEMORY_AVX2_BLOCK <= Count; i += CL_MEMORY_AVX2_BLOCK)
+    {
+        _mm256_storeu_si256((__m256i*)(Destination + i), _mm256_loadu_si256((const __m256i*)(Source + i)));
+    }
+
+    _mm256_storeu_si256((__m256i*)(Destination + Count - CL_MEMORY_AVX2_BLOCK), last);
+
+    _mm256_zeroupper();
+}
+
+// Mirror of _MemoryCopyForwardSse2, used when Destination starts inside
+// Source
+static
+void
+_MemoryCopyBackwardSse2(
+    OUT_WRITES_BYTES_ALL(Count) PBYTE       Destination,
+    IN_READS(Count)             const BYTE* Source,
+    IN                          QWORD       Count
+    )
+{
+    __m128i first;
+    QWORD i;
+
+    ASSERT(Count >= CL_MEMORY_SSE2_BLOCK);
+
+    first = _mm_loadu_si128((const __m128i*)Source);
+
+    for (i = Count; i >= CL_MEMORY_SSE2_BLOCK; i -= CL_MEMORY_SSE2_BLOCK)
+    {
+        _mm_storeu_si128((__m128i*)(Destination + i - CL_MEMORY_SSE2_BLOCK),
+                         _mm_loadu_si128((const __m128i*)(Source + i - CL_MEMORY_SSE2_BLOCK)));
+    }
+
+    _mm_storeu_si128((__m128i*)Destination, first);
+}
+
+static
+void
+_MemoryCopyBackwardAvx2(
+    OUT_WRITES_BYTES_ALL(Count) PBYTE       Destination,
+    IN_READS(Count)             const BYTE* Source,
+    IN                          QWORD       Count
+    )
+{
+    __m256i first;
+    QWORD i;
+
+    ASSERT(Count >= CL_MEMORY_AVX2_BLOCK);
+
+    first = _mm256_loadu_si256((const __m256i*)Source);
+
+    for (i = Count; i >= CL_MEMORY_AVX2_BLOCK; i -= CL_MEMORY_AVX2_BLOCK)
+    {
+        _mm256_storeu_si256((__m256i*)(Destination + i - CL_MEMORY_AVX2_BLOCK),
+                            _mm256_loadu_si256((const __m256i*)(Source + i - CL_MEMORY_AVX2_BLOCK)));
+    }
+
+    _mm256_storeu_si256((__m256i*)Destination, first);
+
+    _mm256_zeroupper();
+}
+
+// Without vector support a QWORD is copied at a time, the bytes below the
+// last QWORD boundary are copied at the end
+static
+void
+_MemoryCopyBackwardScalar(
+    OUT_WRITES_BYTES_ALL(Count) PBYTE       Destination,
+    IN_READS(Count)             const BYTE* Source,
+    IN                          QWORD       Count
+    )
+{
+    QWORD i;
+
+    for (i = Count; i >= sizeof(QWORD); i -= sizeof(QWORD))
+    {
+        *((PQWORD)(Destination + i - sizeof(QWORD))) = *((const QWORD*)(Source + i - sizeof(QWORD)));
+    }
+
+    while (i != 0)
+    {
+        --i;
+        Destination[i] = Source[i];
+    }
+}
+
+// Safe for overlapping regions as long as Destination is below Source
+static
+void
+_MemoryCopyForward(
+    OUT_WRITES_BYTES_ALL(Count) PBYTE       Destination,
+    IN_READS(Count)             const BYTE* Source,
+    IN                          QWORD       Count
+    )
+{
     QWORD alignedCount;
     QWORD unalignedCount;
 
-    if( (NULL == Destination) || (NULL == Source))
+    if (Count < CL_MEMORY_SSE2_BLOCK)
     {
+        _MemoryCopySmall(Destination, Source, Count);
+        return;
+    }
+
+    if (Count >= CL_MEMORY_REP_THRESHOLD && _MemoryIsFeatureSelected(CL_MEMORY_FEATURE_ERMS))
+    {
+        CpuClearDirectionFlag();
+
+        __movsb(Destination, (PVOID)Source, Count);
+        return;
+    }
+
+    if (Count >= CL_MEMORY_AVX2_BLOCK && _MemoryIsFeatureSelected(CL_MEMORY_FEATURE_AVX2))
+    {
+        _MemoryCopyForwardAvx2(Destination, Source, Count);
+        return;
+    }
+
+    if (_MemoryIsFeatureSelected(CL_MEMORY_FEATURE_SSE2))
+    {
+        _MemoryCopyForwardSse2(Destination, Source, Count);
         return;
     }
 
     unalignedCount = Count & 0x7;
     alignedCount = Count - unalignedCount;
 
-    dst = (PBYTE)Destination;
-    src = (PBYTE)Source;
+    // the head is copied first, the QWORDs are read above the bytes written
+    _MemoryCopySmall(Destination, Source, unalignedCount);
+
+    ASSERT(IsAddressAligned(alignedCount, sizeof(QWORD)));
+
+    CpuClearDirectionFlag();
+
+    __movsq(Destination + unalignedCount, (PVOID)(Source + unalignedCount), alignedCount / sizeof(QWORD));
+}
+
+void
+MemorySetCpuFeatures(
+    IN                          DWORD Features
+    )
+{
+    m_memoryFeatures = Features;
+}
+
+DWORD
+MemoryGetCpuFeatures(
+    void
+    )
+{
+    return m_memoryFeatures;
+}
+
+_At_buffer_( address, i, size, _Post_satisfies_( ((PBYTE)address)[i] == value ))
+void
+cl_memset(
+    OUT_WRITES_BYTES_ALL(size)  PVOID address,
+    IN                          BYTE value,
+    IN                          DWORD size
+    )
+{
+    PBYTE dst;
+    QWORD pattern;
 
-    if (unalignedCount & 0x4)
+    // validate parameters
+    if (NULL == address)
     {
-        *((PDWORD)dst) = *((PDWORD)src);
-        dst = dst + sizeof(DWORD);
-        src = src + sizeof(DWORD);
+        return;
     }
 
-    if (unalignedCount & 0x2)
+    dst = address;
+
+    if (size < CL_MEMORY_SSE2_BLOCK)
     {
-        *((PWORD)dst) = *((PWORD)src);
-        dst = dst + sizeof(WORD);
-        src = src + sizeof(WORD);
+        _MemorySetSmall(dst, value, size);
+        return;
     }
 
-    if (unalignedCount & 0x1)
+    if (size >= CL_MEMORY_REP_THRESHOLD && _MemoryIsFeatureSelected(CL_MEMORY_FEATURE_ERMS))
     {
-        *((PBYTE)dst) = *((PBYTE)src);
-        dst = dst + sizeof(BYTE);
-        src = src + sizeof(BYTE);
+        CpuClearDirectionFlag();
+
+        __stosb(dst, value, size);
+        return;
     }
 
-    if (0 != alignedCount)
+    if (size >= CL_MEMORY_AVX2_BLOCK && _MemoryIsFeatureSelected(CL_MEMORY_FEATURE_AVX2))
     {
-        ASSERT(IsAddressAligned(alignedCount, sizeof(QWORD)));
+        _MemorySetAvx2(dst, value, size);
+        return;
+    }
 
-        dst = (PBYTE)Destination + unalignedCount;
-        src = (PBYTE)Source + unalignedCount;
+    if (_MemoryIsFeatureSelected(CL_MEMORY_FEATURE_SSE2))
+    {
+        _MemorySetSse2(dst, value, size);
+        return;
+    }
 
-        CpuClearDirectionFlag();
+    pattern = CL_MEMORY_BYTE_PATTERN(value);
+
+    CpuClearDirectionFlag();
 
-        __movsq(dst, src, alignedCount / sizeof(QWORD));
+    __stosq((PQWORD)dst, pattern, size / sizeof(QWORD));
+
+    // the last QWORD overlaps bytes which were already set
+    *((PQWORD)(dst + size - sizeof(QWORD))) = pattern;
+}
+
+_At_buffer_(Destination, i, Count,
+            _Post_satisfies_(((PBYTE)Destination)[i] == ((PBYTE)Source)[i]))
+void
+cl_memcpy(
+    OUT_WRITES_BYTES_ALL(Count) PVOID   Destination,
+    IN_READS(Count)             void*   Source,
+    IN                          QWORD   Count
+    )
+{
+    if( (NULL == Destination) || (NULL == Source))
+    {
+        return;
     }
+
+    _MemoryCopyForward(Destination, Source, Count);
 }
 
 _At_buffer_(Destination, i, Count,
@@ -96,7 +474,6 @@ cl_memmove(
 {
     PBYTE dst;
     const BYTE* src;
-    QWORD i;
 
     if ((NULL == Destination) || (NULL == Source))
     {
@@ -106,10 +483,120 @@ cl_memmove(
     dst = Destination;
     src = Source;
 
-    for (i = 0; i < Count; ++i)
+    if (dst == src)
+    {
+        return;
+    }
+
+    // if Destination is below Source or past its end the forward copy never
+    // overwrites bytes which were not read yet
+    if ((QWORD)(dst - src) >= Count)
+    {
+        _MemoryCopyForward(dst, src, Count);
+        return;
+    }
+
+    if (Count < CL_MEMORY_SSE2_BLOCK)
+    {
+        _MemoryCopySmall(dst, src, Count);
+    }
+    else if (Count >= CL_MEMORY_AVX2_BLOCK && _MemoryIsFeatureSelected(CL_MEMORY_FEATURE_AVX2))
+    {
+        _MemoryCopyBackwardAvx2(dst, src, Count);
+    }
+    else if (_MemoryIsFeatureSelected(CL_MEMORY_FEATURE_SSE2))
+    {
+        _MemoryCopyBackwardSse2(dst, src, Count);
+    }
+    else
+    {
+        _MemoryCopyBackwardScalar(dst, src, Count);
+    }
+}
+
+void
+cl_pagezero(
+    OUT_WRITES_BYTES_ALL(Size)  PVOID   Address,
+    IN                          QWORD   Size
+    )
+{
+    PBYTE dst;
+    QWORD i;
+
+    ASSERT(IsAddressAligned(Address, PAGE_SIZE));
+    ASSERT(IsAddressAligned(Size, PAGE_SIZE));
+
+    dst = Address;
+
+    if (_MemoryIsFeatureSelected(CL_MEMORY_FEATURE_SSE2))
+    {
+        __m128i zero = _mm_setzero_si128();
+
+        for (i = 0; i < Size; i += CL_MEMORY_CACHE_LINE)
+        {
+            _mm_stream_si128((__m128i*)(dst + i), zero);
+            _mm_stream_si128((__m128i*)(dst + i + CL_MEMORY_SSE2_BLOCK), zero);
+            _mm_stream_si128((__m128i*)(dst + i + 2 * CL_MEMORY_SSE2_BLOCK), zero);
+            _mm_stream_si128((__m128i*)(dst + i + 3 * CL_MEMORY_SSE2_BLOCK), zero);
+        }
+    }
+    else
+    {
+        // movnti only uses general purpose registers => it is available even
+        // if the XMM state is not enabled
+        for (i = 0; i < Size; i += sizeof(QWORD))
+        {
+            _mm_stream_si64x((INT64*)(dst + i), 0);
+        }
+    }
+
+    // non-temporal stores are weakly ordered
+    _mm_sfence();
+}
+
+void
+cl_pagecopy(
+    OUT_WRITES_BYTES_ALL(Size)  PVOID   Destination,
+    IN_READS(Size)              void*   Source,
+    IN                          QWORD   Size
+    )
+{
+    PBYTE dst;
+    const BYTE* src;
+    QWORD i;
+
+    ASSERT(IsAddressAligned(Destination, PAGE_SIZE));
+    ASSERT(IsAddressAligned(Source, PAGE_SIZE));
+    ASSERT(IsAddressAligned(Size, PAGE_SIZE));
+
+    dst = Destination;
+    src = Source;
+
+    if (_MemoryIsFeatureSelected(CL_MEMORY_FEATURE_SSE2))
+    {
+        for (i = 0; i < Size; i += CL_MEMORY_CACHE_LINE)
+        {
+            __m128i first = _mm_load_si128((const __m128i*)(src + i));
+            __m128i second = _mm_load_si128((const __m128i*)(src + i + CL_MEMORY_SSE2_BLOCK));
+            __m128i third = _mm_load_si128((const __m128i*)(src + i + 2 * CL_MEMORY_SSE2_BLOCK));
+            __m128i fourth = _mm_load_si128((const __m128i*)(src + i + 3 * CL_MEMORY_SSE2_BLOCK));
+
+            _mm_stream_si128((__m128i*)(dst + i), first);
+            _mm_stream_si128((__m128i*)(dst + i + CL_MEMORY_SSE2_BLOCK), second);
+            _mm_stream_si128((__m128i*)(dst + i + 2 * CL_MEMORY_SSE2_BLOCK), third);
+            _mm_stream_si128((__m128i*)(dst + i + 3 * CL_MEMORY_SSE2_BLOCK), fourth);
+        }
+    }
+    else
     {
-        dst[i] = src[i];
+        for (i = 0; i < Size; i += sizeof(QWORD))
+        {
+            _mm_stream_si64x((INT64*)(dst + i), *((const INT64*)(src + i)));
+        }
     }
+
+    // non-temporal stores are weakly ordered
+    _mm_sfence();
 }
 
 int
@@ -119,7 +606,7 @@ cl_memcmp(
     IN                      DWORD size
     )
 {
-    INT64 i = size;
+    DWORD i;
     const BYTE* p1;
     const BYTE* p2;
 
@@ -129,11 +616,53 @@ cl_memcmp(
         return size;
     }
 
-
     p1 = ptr1;
     p2 = ptr2;
+    i = 0;
+
+    // the vector loops only skip the equal blocks, the first difference is
+    // located by the byte loop
+    if (_MemoryIsFeatureSelected(CL_MEMORY_FEATURE_AVX2))
+    {
+        for (; i + CL_MEMORY_AVX2_BLOCK <= size; i += CL_MEMORY_AVX2_BLOCK)
+        {
+            __m256i eq = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p1 + i)),
+                                           _mm256_loadu_si256((const __m256i*)(p2 + i)));
+
+            if ((DWORD)_mm256_movemask_epi8(eq) != MAX_DWORD)
+            {
+                break;
+            }
+        }
+
+        _mm256_zeroupper();
+    }
+
+    if (_MemoryIsFeatureSelected(CL_MEMORY_FEATURE_SSE2))
+    {
+        for (; i + CL_MEMORY_SSE2_BLOCK <= size; i += CL_MEMORY_SSE2_BLOCK)
+        {
+            __m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p1 + i)),
+                                        _mm_loadu_si128((const __m128i*)(p2 + i)));
+
+            if ((DWORD)_mm_movemask_epi8(eq) != MAX_WORD)
+            {
+                break;
+            }
+        }
+    }
+    else
+    {
+        for (; i + sizeof(QWORD) <= size; i += sizeof(QWORD))
+        {
+            if (*((const QWORD*)(p1 + i)) != *((const QWORD*)(p2 + i)))
+            {
+                break;
+            }
+        }
+    }
 
-    for (i = 0; i < size; ++i)
+    for (; i < size; ++i)
     {
         if (p1[i] != p2[i])
         {
@@ -192,8 +721,53 @@ cl_memscan(
     }
 
     pData = buffer;
+    i = 0;
+
+    if (_MemoryIsFeatureSelected(CL_MEMORY_FEATURE_AVX2))
+    {
+        __m256i pattern = _mm256_set1_epi8((char)value);
+
+        for (; i + CL_MEMORY_AVX2_BLOCK <= size; i += CL_MEMORY_AVX2_BLOCK)
+        {
+            __m256i eq = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(pData + i)), pattern);
+
+            if ((DWORD)_mm256_movemask_epi8(eq) != MAX_DWORD)
+            {
+                break;
+            }
+        }
+
+        _mm256_zeroupper();
+    }
+
+    if (_MemoryIsFeatureSelected(CL_MEMORY_FEATURE_SSE2))
+    {
+        __m128i pattern = _mm_set1_epi8((char)value);
+
+        for (; i + CL_MEMORY_SSE2_BLOCK <= size; i += CL_MEMORY_SSE2_BLOCK)
+        {
+            __m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(pData + i)), pattern);
+
+            if ((DWORD)_mm_movemask_epi8(eq) != MAX_WORD)
+            {
+                break;
+            }
+        }
+    }
+    else
+    {
+        QWORD pattern = CL_MEMORY_BYTE_PATTERN(value);
+
+        for (; i + sizeof(QWORD) <= size; i += sizeof(QWORD))
+        {
+            if (*((const QWORD*)(pData + i)) != pattern)
+            {
+                break;
+            }
+        }
+    }
 
-    for (i = 0; i < size; ++i)
+    for (; i < size; ++i)
     {
         if (pData[i] != value)
         {
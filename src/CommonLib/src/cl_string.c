@@ -1,39 +1,90 @@
 #include "common_lib.h"
 #include "cl_string.h"
 #include "strutils.h"
+#include <immintrin.h>
 
 // 64 characters needed in case of %B specifier
 // with NULL terminator => 65 characters are required
 #define VSNPRINTF_BUFFER_SIZE               65
 
-int
-cl_strcmp(
-    IN_Z  char* str1,
-    IN_Z  char* str2
+#define CL_STRING_BLOCK                     sizeof(__m128i)
+#define CL_STRING_BLOCK_MASK                MAX_WORD
+
+// PCMPISTRI mode which returns the index of the first byte which differs or
+// which ends only one of the strings, 16 if there is no such byte
+#define CL_STRING_CMP_MODE                  (_SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_EACH | \
+                                             _SIDD_NEGATIVE_POLARITY | _SIDD_LEAST_SIGNIFICANT)
+
+__forceinline
+static
+BOOLEAN
+_StringIsFeatureSelected(
+    IN          DWORD       Feature
     )
 {
-    DWORD i;
+    return IsBooleanFlagOn(MemoryGetCpuFeatures(), Feature);
+}
 
-    if (NULL == str1)
-    {
-        return STATUS_INVALID_PARAMETER1;
-    }
+// An unaligned block may be loaded only if it does not cross into the next
+// page, which may not be mapped even if the string ends before it
+__forceinline
+static
+BOOLEAN
+_StringCanLoadBlock(
+    IN          const char* Address
+    )
+{
+    return ((QWORD)Address & (PAGE_SIZE - 1)) <= PAGE_SIZE - CL_STRING_BLOCK;
+}
 
-    if (NULL == str2)
-    {
-        return STATUS_INVALID_PARAMETER2;
-    }
+__forceinline
+static
+DWORD
+_StringMatchMask(
+    IN          __m128i     Block,
+    IN          __m128i     Value
+    )
+{
+    return (DWORD)_mm_movemask_epi8(_mm_cmpeq_epi8(Block, Value));
+}
+
+// Same as applying tolower on each byte, except the terminators which are
+// left untouched
+__forceinline
+static
+__m128i
+_StringToLowerSse2(
+    IN          __m128i     Block
+    )
+{
+    __m128i terminators = _mm_cmpeq_epi8(Block, _mm_setzero_si128());
+
+    return _mm_or_si128(Block, _mm_andnot_si128(terminators, _mm_set1_epi8(LOWER_UPPER_DIFF)));
+}
+
+static
+int
+_StringCompareScalar(
+    IN_Z        char*       str1,
+    IN_Z        char*       str2,
+    IN          BOOLEAN     IgnoreCase
+    )
+{
+    DWORD i;
 
     i = 0;
 
     while (('\0' != str1[i]) && ('\0' != str2[i]))
     {
-        if (str1[i] > str2[i])
+        char c1 = IgnoreCase ? tolower(str1[i]) : str1[i];
+        char c2 = IgnoreCase ? tolower(str2[i]) : str2[i];
+
+        if (c1 > c2)
         {
             return 1;
         }
 
-        if (str1[i] < str2[i])
+        if (c1 < c2)
         {
             return -1;
         }
@@ -56,57 +107,218 @@ cl_strcmp(
     return 0;
 }
 
+// Skips the common prefix of the strings 16 bytes at a time, the result is
+// then given by the scalar comparison of the remaining characters
+static
 int
-cl_stricmp(
-    IN_Z  char* str1,
-    IN_Z  char* str2
+_StringCompareSimd(
+    IN_Z        char*       str1,
+    IN_Z        char*       str2,
+    IN          BOOLEAN     IgnoreCase
     )
 {
-    DWORD i;
+    BOOLEAN bUsePcmpistri;
+    QWORD i;
 
-    if (NULL == str1)
+    bUsePcmpistri = _StringIsFeatureSelected(CL_MEMORY_FEATURE_SSE42);
+
+    for (i = 0; ; i += CL_STRING_BLOCK)
     {
-        return STATUS_INVALID_PARAMETER1;
+        __m128i first;
+        __m128i second;
+        DWORD index;
+
+        if (!_StringCanLoadBlock(str1 + i) || !_StringCanLoadBlock(str2 + i))
+        {
+            // step over the page boundary one character at a time
+            DWORD j;
+
+            for (j = 0; j < CL_STRING_BLOCK; ++j)
+            {
+                char c1 = IgnoreCase ? tolower(str1[i + j]) : str1[i + j];
+                char c2 = IgnoreCase ? tolower(str2[i + j]) : str2[i + j];
+
+                if ('\0' == str1[i + j] || '\0' == str2[i + j] || c1 != c2)
+                {
+                    return _StringCompareScalar(str1 + i + j, str2 + i + j, IgnoreCase);
+                }
+            }
+
+            continue;
+        }
+
+        first = _mm_loadu_si128((const __m128i*)(str1 + i));
+        second = _mm_loadu_si128((const __m128i*)(str2 + i));
+
+        if (IgnoreCase)
+        {
+            first = _StringToLowerSse2(first);
+            second = _StringToLowerSse2(second);
+        }
+
+        if (bUsePcmpistri)
+        {
+            index = _mm_cmpistri(first, second, CL_STRING_CMP_MODE);
+            if (index < CL_STRING_BLOCK)
+            {
+                return _StringCompareScalar(str1 + i + index, str2 + i + index, IgnoreCase);
+            }
+
+            // no difference and the second string ends => both end at the
+            // same position
+            if (_mm_cmpistrz(first, second, CL_STRING_CMP_MODE))
+            {
+                return 0;
+            }
+        }
+        else
+        {
+            DWORD mask;
+
+            mask = (_StringMatchMask(first, second) ^ CL_STRING_BLOCK_MASK)
+                 | _StringMatchMask(first, _mm_setzero_si128());
+            if (0 != mask)
+            {
+                _BitScanForward(&index, mask);
+                return _StringCompareScalar(str1 + i + index, str2 + i + index, IgnoreCase);
+            }
+        }
     }
+}
 
-    if (NULL == str2)
+// Aligned blocks never cross a page boundary => the bytes read before the
+// start of the string and after its terminator are on pages already accessed
+static
+DWORD
+_StringLengthSse2(
+    IN_Z        char*       str
+    )
+{
+    const char* pBlock;
+    DWORD mask;
+    DWORD index;
+
+    pBlock = (const char*)AlignAddressLower(str, CL_STRING_BLOCK);
+    mask = _StringMatchMask(_mm_load_si128((const __m128i*)pBlock), _mm_setzero_si128())
+         & (CL_STRING_BLOCK_MASK << (str - pBlock));
+
+    while (0 == mask)
     {
-        return STATUS_INVALID_PARAMETER2;
+        pBlock += CL_STRING_BLOCK;
+        mask = _StringMatchMask(_mm_load_si128((const __m128i*)pBlock), _mm_setzero_si128());
     }
 
-    i = 0;
+    _BitScanForward(&index, mask);
 
-    while (('\0' != str1[i]) && ('\0' != str2[i]))
+    return (DWORD)(pBlock + index - str);
+}
+
+static
+const
+char*
+_StringFindCharSse2(
+    IN_Z        char*       str,
+    IN          char        c,
+    IN          BOOLEAN     Last
+    )
+{
+    const char* pBlock;
+    const char* pResult;
+    __m128i value;
+    DWORD startMask;
+
+    ASSERT('\0' != c);
+
+    pBlock = (const char*)AlignAddressLower(str, CL_STRING_BLOCK);
+    pResult = str;
+    value = _mm_set1_epi8(c);
+    startMask = CL_STRING_BLOCK_MASK << (str - pBlock);
+
+    for (;;)
     {
-        char c1 = tolower(str1[i]);
-        char c2 = tolower(str2[i]);
+        __m128i data;
+        DWORD zeroMask;
+        DWORD charMask;
+        DWORD index;
 
-        if (c1 > c2)
+        data = _mm_load_si128((const __m128i*)pBlock);
+        zeroMask = _StringMatchMask(data, _mm_setzero_si128()) & startMask;
+        charMask = _StringMatchMask(data, value) & startMask;
+
+        if (0 != zeroMask)
         {
-            return 1;
+            // ignore the matches after the terminator
+            charMask &= zeroMask ^ (zeroMask - 1);
         }
 
-        if (c1 < c2)
+        if (0 != charMask)
         {
-            return -1;
+            if (!Last)
+            {
+                _BitScanForward(&index, charMask);
+                return pBlock + index;
+            }
+
+            _BitScanReverse(&index, charMask);
+            pResult = pBlock + index;
         }
 
-        ++i;
+        if (0 != zeroMask)
+        {
+            return pResult;
+        }
+
+        pBlock += CL_STRING_BLOCK;
+        startMask = CL_STRING_BLOCK_MASK;
     }
+}
 
-    // it means the second string is over but the first still has
-    // some characters
-    if ('\0' != str1[i])
+int
+cl_strcmp(
+    IN_Z  char* str1,
+    IN_Z  char* str2
+    )
+{
+    if (NULL == str1)
     {
-        return 1;
+        return STATUS_INVALID_PARAMETER1;
     }
 
-    if ('\0' != str2[i])
+    if (NULL == str2)
     {
-        return -1;
+        return STATUS_INVALID_PARAMETER2;
     }
 
-    return 0;
+    if (_StringIsFeatureSelected(CL_MEMORY_FEATURE_SSE2))
+    {
+        return _StringCompareSimd(str1, str2, FALSE);
+    }
+
+    return _StringCompareScalar(str1, str2, FALSE);
+}
+
+int
+cl_stricmp(
+    IN_Z  char* str1,
+    IN_Z  char* str2
+    )
+{
+    if (NULL == str1)
+    {
+        return STATUS_INVALID_PARAMETER1;
+    }
+
+    if (NULL == str2)
+    {
+        return STATUS_INVALID_PARAMETER2;
+    }
+
+    if (_StringIsFeatureSelected(CL_MEMORY_FEATURE_SSE2))
+    {
+        return _StringCompareSimd(str1, str2, TRUE);
+    }
+
+    return _StringCompareScalar(str1, str2, TRUE);
 }
 
 int
@@ -236,6 +448,17 @@ cl_strchr(
         return NULL;
     }
 
+    // the terminator is never matched
+    if ('\0' == c)
+    {
+        return str;
+    }
+
+    if (_StringIsFeatureSelected(CL_MEMORY_FEATURE_SSE2))
+    {
+        return _StringFindCharSse2(str, c, FALSE);
+    }
+
     i = 0;
 
     while ('\0' != str[i])
@@ -265,6 +488,17 @@ cl_strrchr(
         return NULL;
     }
 
+    // the terminator is never matched
+    if ('\0' == c)
+    {
+        return str;
+    }
+
+    if (_StringIsFeatureSelected(CL_MEMORY_FEATURE_SSE2))
+    {
+        return _StringFindCharSse2(str, c, TRUE);
+    }
+
     i = 0;
     charIndex = str;
 
@@ -338,6 +572,11 @@ cl_strlen(
         return INVALID_STRING_SIZE;
     }
 
+    if (_StringIsFeatureSelected(CL_MEMORY_FEATURE_SSE2))
+    {
+        return _StringLengthSse2(str);
+    }
+
     i = 0;
 
     while ('\0' != str[i])
@@ -0,0 +1,733 @@
+#include "common_lib.h"
+#include "hash_map.h"
+#include <immintrin.h>
+
+#define HASH_MAP_GROUP_SIZE             16
+#define HASH_MAP_MIN_CAPACITY           HASH_MAP_GROUP_SIZE
+
+// Each insertion which finds a resize in progress moves this many groups
+#define HASH_MAP_GROUPS_TO_MOVE         2
+
+// Control byte values, a full slot holds the low 7 bits of the hash of its key
+#define HASH_MAP_CTRL_EMPTY             0x80
+#define HASH_MAP_CTRL_DELETED           0xFE
+
+#define HASH_MAP_H2_MASK                0x7F
+
+// Both the empty and the deleted control bytes have the MSB set
+#define HASH_MAP_IS_SLOT_FULL(Ctrl)     (0 == ((Ctrl) & HASH_MAP_CTRL_EMPTY))
+
+#define HASH_MAP_LSB_BYTES              0x0101'0101'0101'0101ULL
+#define HASH_MAP_MSB_BYTES              0x8080'8080'8080'8080ULL
+
+// Gathers the most significant bits of the bytes of a QWORD in its top byte
+#define HASH_MAP_GATHER_MSB             0x0102'0408'1020'4080ULL
+
+STATIC_ASSERT(HASH_MAP_GROUP_SIZE == sizeof(__m128i));
+
+// Both the used and the deleted slots make the probe sequences longer, once
+// they occupy more than 7/8 of the table a new one is allocated
+__forceinline
+static
+DWORD
+_HashMapMaxLoad(
+    IN      DWORD               Capacity
+    )
+{
+    return Capacity - Capacity / 8;
+}
+
+__forceinline
+static
+BYTE
+_HashMapH2(
+    IN      QWORD               Hash
+    )
+{
+    return (BYTE)(Hash & HASH_MAP_H2_MASK);
+}
+
+// Converts the most significant bits of the bytes of a group into a mask
+// with one bit per slot, the same as movemask does
+__forceinline
+static
+DWORD
+_HashMapGatherMask(
+    IN      QWORD               Low,
+    IN      QWORD               High
+    )
+{
+    return (DWORD)(((Low & HASH_MAP_MSB_BYTES) >> 7) * HASH_MAP_GATHER_MSB >> 56)
+         | (DWORD)(((High & HASH_MAP_MSB_BYTES) >> 7) * HASH_MAP_GATHER_MSB >> 56) << 8;
+}
+
+// Returns the slots whose control byte may be H2, without SSE2 the result may
+// also contain slots which do not match => the keys must always be compared
+__forceinline
+static
+DWORD
+_HashMapGroupMatch(
+    IN      const BYTE*         Group,
+    IN      BYTE                H2,
+    IN      BOOLEAN             UseSse2
+    )
+{
+    QWORD low;
+    QWORD high;
+
+    if (UseSse2)
+    {
+        return (DWORD)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)Group),
+                                                       _mm_set1_epi8(H2)));
+    }
+
+    // a byte of the XOR is 0 where the control byte equals H2
+    low = ((const QWORD*)Group)[0] ^ (HASH_MAP_LSB_BYTES * H2);
+    high = ((const QWORD*)Group)[1] ^ (HASH_MAP_LSB_BYTES * H2);
+
+    return _HashMapGatherMask((low - HASH_MAP_LSB_BYTES) & ~low,
+                              (high - HASH_MAP_LSB_BYTES) & ~high);
+}
+
+__forceinline
+static
+DWORD
+_HashMapGroupMatchEmpty(
+    IN      const BYTE*         Group,
+    IN      BOOLEAN             UseSse2
+    )
+{
+    QWORD low;
+    QWORD high;
+
+    if (UseSse2)
+    {
+        return (DWORD)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)Group),
+                                                       _mm_set1_epi8((char)HASH_MAP_CTRL_EMPTY)));
+    }
+
+    // only the empty bytes have the MSB set and bit 1 clear
+    low = ((const QWORD*)Group)[0];
+    high = ((const QWORD*)Group)[1];
+
+    return _HashMapGatherMask(low & ~(low << 6), high & ~(high << 6));
+}
+
+__forceinline
+static
+DWORD
+_HashMapGroupMatchEmptyOrDeleted(
+    IN      const BYTE*         Group,
+    IN      BOOLEAN             UseSse2
+    )
+{
+    if (UseSse2)
+    {
+        return (DWORD)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)Group));
+    }
+
+    return _HashMapGatherMask(((const QWORD*)Group)[0], ((const QWORD*)Group)[1]);
+}
+
+__forceinline
+static
+BOOLEAN
+_HashMapUseSse2(
+    void
+    )
+{
+    return IsBooleanFlagOn(MemoryGetCpuFeatures(), CL_MEMORY_FEATURE_SSE2);
+}
+
+// The groups are probed in triangular steps (1, 2, 3...) starting from the
+// one selected by the high bits of the hash, because the number of groups is a
+// power of 2 all of them are visited
+static
+PHASH_MAP_SLOT
+_HashMapFind(
+    IN      PHASH_MAP_TABLE     Table,
+    IN      QWORD               Key,
+    IN      QWORD               Hash,
+    IN      BOOLEAN             UseSse2
+    )
+{
+    DWORD groupMask;
+    DWORD group;
+    DWORD step;
+
+    if (0 == Table->NumberOfElements)
+    {
+        return NULL;
+    }
+
+    groupMask = Table->Capacity / HASH_MAP_GROUP_SIZE - 1;
+    group = (DWORD)(Hash >> 7) & groupMask;
+
+    for (step = 1; ; ++step)
+    {
+        const BYTE* pGroup = Table->Control + group * HASH_MAP_GROUP_SIZE;
+        DWORD mask;
+        DWORD index;
+
+        mask = _HashMapGroupMatch(pGroup, _HashMapH2(Hash), UseSse2);
+        while (0 != mask)
+        {
+            PHASH_MAP_SLOT pSlot;
+
+            _BitScanForward(&index, mask);
+
+            pSlot = &Table->Slots[group * HASH_MAP_GROUP_SIZE + index];
+            if (pGroup[index] == _HashMapH2(Hash) && pSlot->Key == Key)
+            {
+                return pSlot;
+            }
+
+            mask &= mask - 1;
+        }
+
+        // an insertion would have used the empty slot => the key is not in
+        // any of the following groups
+        if (0 != _HashMapGroupMatchEmpty(pGroup, UseSse2))
+        {
+            return NULL;
+        }
+
+        ASSERT(step <= groupMask);
+        group = (group + step) & groupMask;
+    }
+}
+
+// The caller must have checked that the key is not present
+static
+void
+_HashMapInsertNew(
+    INOUT   PHASH_MAP_TABLE     Table,
+    IN      QWORD               Key,
+    IN      PVOID               Value,
+    IN      QWORD               Hash,
+    IN      BOOLEAN             UseSse2
+    )
+{
+    DWORD groupMask;
+    DWORD group;
+    DWORD step;
+
+    ASSERT(Table->NumberOfElements + Table->NumberOfDeleted < Table->Capacity - 1);
+
+    groupMask = Table->Capacity / HASH_MAP_GROUP_SIZE - 1;
+    group = (DWORD)(Hash >> 7) & groupMask;
+
+    for (step = 1; ; ++step)
+    {
+        PBYTE pGroup = Table->Control + group * HASH_MAP_GROUP_SIZE;
+        DWORD mask;
+        DWORD index;
+
+        mask = _HashMapGroupMatchEmptyOrDeleted(pGroup, UseSse2);
+        if (0 != mask)
+        {
+            _BitScanForward(&index, mask);
+
+            if (HASH_MAP_CTRL_DELETED == pGroup[index])
+            {
+                Table->NumberOfDeleted--;
+            }
+
+            pGroup[index] = _HashMapH2(Hash);
+            Table->Slots[group * HASH_MAP_GROUP_SIZE + index].Key = Key;
+            Table->Slots[group * HASH_MAP_GROUP_SIZE + index].Value = Value;
+            Table->NumberOfElements++;
+
+            return;
+        }
+
+        ASSERT(step <= groupMask);
+        group = (group + step) & groupMask;
+    }
+}
+
+static
+void
+_HashMapEraseSlot(
+    INOUT   PHASH_MAP_TABLE     Table,
+    IN      PHASH_MAP_SLOT      Slot,
+    IN      BOOLEAN             KeepProbeChains,
+    IN      BOOLEAN             UseSse2
+    )
+{
+    DWORD index;
+    PBYTE pGroup;
+
+    index = (DWORD)(Slot - Table->Slots);
+    pGroup = Table->Control + AlignAddressLower(index, HASH_MAP_GROUP_SIZE);
+
+    // if the group still has an empty slot no probe sequence ever continued
+    // past it => the slot can become empty instead of deleted
+    if (!KeepProbeChains && 0 != _HashMapGroupMatchEmpty(pGroup, UseSse2))
+    {
+        Table->Control[index] = HASH_MAP_CTRL_EMPTY;
+    }
+    else
+    {
+        Table->Control[index] = HASH_MAP_CTRL_DELETED;
+        Table->NumberOfDeleted++;
+    }
+
+    Table->NumberOfElements--;
+}
+
+static
+void
+_HashMapFreeTable(
+    INOUT   PHASH_MAP           HashMap,
+    INOUT   PHASH_MAP_TABLE     Table
+    )
+{
+    if (0 != Table->Capacity)
+    {
+        HashMap->FreeFunction(Table->Control, HashMap->AllocContext);
+    }
+
+    memzero(Table, sizeof(HASH_MAP_TABLE));
+}
+
+static
+STATUS
+_HashMapAllocTable(
+    IN      PHASH_MAP           HashMap,
+    IN      DWORD               Capacity,
+    OUT     PHASH_MAP_TABLE     Table
+    )
+{
+    PBYTE pBuffer;
+
+    ASSERT(Capacity >= HASH_MAP_MIN_CAPACITY && IsAddressAligned(Capacity, HASH_MAP_GROUP_SIZE));
+    ASSERT(Capacity <= MAX_DWORD / (sizeof(BYTE) + sizeof(HASH_MAP_SLOT)));
+
+    pBuffer = HashMap->AllocFunction(Capacity * (sizeof(BYTE) + sizeof(HASH_MAP_SLOT)), HashMap->AllocContext);
+    if (NULL == pBuffer)
+    {
+        return STATUS_HEAP_INSUFFICIENT_RESOURCES;
+    }
+
+    memset(pBuffer, HASH_MAP_CTRL_EMPTY, Capacity);
+
+    Table->Control = pBuffer;
+    Table->Slots = (PHASH_MAP_SLOT)(pBuffer + Capacity);
+    Table->Capacity = Capacity;
+    Table->NumberOfElements = 0;
+    Table->NumberOfDeleted = 0;
+
+    return STATUS_SUCCESS;
+}
+
+// Smallest capacity in which NumberOfElements do not exceed the maximum load
+static
+DWORD
+_HashMapCapacityForElements(
+    IN      DWORD               NumberOfElements
+    )
+{
+    DWORD capacity;
+
+    capacity = HASH_MAP_MIN_CAPACITY;
+
+    while (_HashMapMaxLoad(capacity) <= NumberOfElements)
+    {
+        ASSERT(capacity <= MAX_DWORD / 2);
+        capacity *= 2;
+    }
+
+    return capacity;
+}
+
+static
+void
+_HashMapMoveGroups(
+    INOUT   PHASH_MAP           HashMap,
+    IN      DWORD               NumberOfGroups,
+    IN      BOOLEAN             UseSse2
+    )
+{
+    PHASH_MAP_TABLE pOld;
+    DWORD groupCount;
+    DWORD lastGroup;
+
+    pOld = &HashMap->OldTable;
+    if (0 == pOld->Capacity)
+    {
+        return;
+    }
+
+    groupCount = pOld->Capacity / HASH_MAP_GROUP_SIZE;
+    lastGroup = (DWORD)min((QWORD)HashMap->NextGroupToMove + NumberOfGroups, groupCount);
+
+    for (; HashMap->NextGroupToMove < lastGroup && 0 != pOld->NumberOfElements; HashMap->NextGroupToMove++)
+    {
+        DWORD first = HashMap->NextGroupToMove * HASH_MAP_GROUP_SIZE;
+
+        for (DWORD i = first; i < first + HASH_MAP_GROUP_SIZE; ++i)
+        {
+            PHASH_MAP_SLOT pSlot = &pOld->Slots[i];
+
+            if (!HASH_MAP_IS_SLOT_FULL(pOld->Control[i]))
+            {
+                continue;
+            }
+
+            _HashMapInsertNew(&HashMap->Table, pSlot->Key, pSlot->Value, HashMapHashKey(pSlot->Key), UseSse2);
+
+            // the keys of the following groups may have been probed through
+            // this slot => it must remain a tombstone
+            _HashMapEraseSlot(pOld, pSlot, TRUE, UseSse2);
+        }
+    }
+
+    if (0 == pOld->NumberOfElements)
+    {
+        _HashMapFreeTable(HashMap, pOld);
+        HashMap->NextGroupToMove = 0;
+    }
+}
+
+// Replaces the table with one in which the current elements take at most half
+// of the maximum load: when the table is full of elements it doubles, when it
+// is mostly full of tombstones it is rebuilt at the same or a smaller size
+static
+STATUS
+_HashMapGrow(
+    INOUT   PHASH_MAP           HashMap,
+    IN      BOOLEAN             UseSse2
+    )
+{
+    HASH_MAP_TABLE newTable;
+    STATUS status;
+
+    // finish the previous resize first
+    _HashMapMoveGroups(HashMap, MAX_DWORD, UseSse2);
+    ASSERT(0 == HashMap->OldTable.Capacity);
+
+    status = _HashMapAllocTable(HashMap,
+                                _HashMapCapacityForElements(HashMap->Table.NumberOfElements
+                                                            + HashMap->Table.NumberOfElements / 2 + 1),
+                                &newTable);
+    if (!SUCCEEDED(status))
+    {
+        return status;
+    }
+
+    HashMap->OldTable = HashMap->Table;
+    HashMap->Table = newTable;
+    HashMap->NextGroupToMove = 0;
+
+    // the new table must not fill up before the insertions move all the old
+    // elements, this only happens if a large table holds a few elements
+    if (_HashMapMaxLoad(HashMap->Table.Capacity) - HashMap->OldTable.NumberOfElements
+        <= HashMap->OldTable.Capacity / HASH_MAP_GROUP_SIZE / HASH_MAP_GROUPS_TO_MOVE + 1)
+    {
+        _HashMapMoveGroups(HashMap, MAX_DWORD, UseSse2);
+    }
+    else if (0 == HashMap->OldTable.NumberOfElements)
+    {
+        _HashMapFreeTable(HashMap, &HashMap->OldTable);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+STATUS
+HashMapInit(
+    OUT     PHASH_MAP           HashMap,
+    IN      DWORD               InitialElements,
+    IN      PFUNC_HashMapAlloc  AllocFunction,
+    IN      PFUNC_FreeFunction  FreeFunction,
+    IN_OPT  PVOID               Context
+    )
+{
+    if (NULL == HashMap)
+    {
+        return STATUS_INVALID_PARAMETER1;
+    }
+
+    if (NULL == AllocFunction)
+    {
+        return STATUS_INVALID_PARAMETER3;
+    }
+
+    if (NULL == FreeFunction)
+    {
+        return STATUS_INVALID_PARAMETER4;
+    }
+
+    memzero(HashMap, sizeof(HASH_MAP));
+
+    HashMap->AllocFunction = AllocFunction;
+    HashMap->FreeFunction = FreeFunction;
+    HashMap->AllocContext = Context;
+
+    if (0 == InitialElements)
+    {
+        return STATUS_SUCCESS;
+    }
+
+    return _HashMapAllocTable(HashMap, _HashMapCapacityForElements(InitialElements), &HashMap->Table);
+}
+
+void
+HashMapUninit(
+    INOUT   PHASH_MAP           HashMap
+    )
+{
+    ASSERT(HashMap != NULL);
+
+    _HashMapFreeTable(HashMap, &HashMap->OldTable);
+    _HashMapFreeTable(HashMap, &HashMap->Table);
+}
+
+void
+HashMapClear(
+    INOUT   PHASH_MAP           HashMap,
+    IN_OPT  PFUNC_FreeFunction  FreeFunction,
+    IN_OPT  PVOID               FreeContext
+    )
+{
+    ASSERT(HashMap != NULL);
+
+    if (FreeFunction != NULL)
+    {
+        HASH_MAP_ITERATOR it;
+        PVOID pValue;
+
+        HashMapIteratorInit(HashMap, &it);
+
+        while ((pValue = HashMapIteratorNext(&it, NULL)) != NULL)
+        {
+            FreeFunction(pValue, FreeContext);
+        }
+    }
+
+    _HashMapFreeTable(HashMap, &HashMap->OldTable);
+    HashMap->NextGroupToMove = 0;
+
+    if (0 != HashMap->Table.Capacity)
+    {
+        memset(HashMap->Table.Control, HASH_MAP_CTRL_EMPTY, HashMap->Table.Capacity);
+        HashMap->Table.NumberOfElements = 0;
+        HashMap->Table.NumberOfDeleted = 0;
+    }
+}
+
+DWORD
+HashMapSize(
+    IN      PHASH_MAP           HashMap
+    )
+{
+    ASSERT(HashMap != NULL);
+
+    return HashMap->Table.NumberOfElements + HashMap->OldTable.NumberOfElements;
+}
+
+STATUS
+HashMapInsert(
+    INOUT   PHASH_MAP           HashMap,
+    IN      QWORD               Key,
+    IN      PVOID               Value,
+    OUT_OPT PVOID*              PreviousValue
+    )
+{
+    PHASH_MAP_SLOT pSlot;
+    QWORD hash;
+    BOOLEAN bUseSse2;
+    PHASH_MAP_TABLE pTable;
+
+    ASSERT(HashMap != NULL);
+    ASSERT(Value != NULL);
+
+    hash = HashMapHashKey(Key);
+    bUseSse2 = _HashMapUseSse2();
+    pTable = &HashMap->Table;
+
+    if (PreviousValue != NULL)
+    {
+        *PreviousValue = NULL;
+    }
+
+    pSlot = _HashMapFind(pTable, Key, hash, bUseSse2);
+    if (NULL == pSlot)
+    {
+        pSlot = _HashMapFind(&HashMap->OldTable, Key, hash, bUseSse2);
+    }
+
+    if (pSlot != NULL)
+    {
+        if (PreviousValue != NULL)
+        {
+            *PreviousValue = pSlot->Value;
+        }
+
+        pSlot->Value = Value;
+
+        return STATUS_SUCCESS;
+    }
+
+    _HashMapMoveGroups(HashMap, HASH_MAP_GROUPS_TO_MOVE, bUseSse2);
+
+    if (pTable->NumberOfElements + pTable->NumberOfDeleted >= _HashMapMaxLoad(pTable->Capacity))
+    {
+        STATUS status = _HashMapGrow(HashMap, bUseSse2);
+
+        // a fuller table is only slower, at least one slot must always remain
+        // empty for the lookups to end
+        if (!SUCCEEDED(status)
+            && pTable->NumberOfElements + pTable->NumberOfDeleted + 1 >= pTable->Capacity)
+        {
+            return status;
+        }
+    }
+
+    _HashMapInsertNew(pTable, Key, Value, hash, bUseSse2);
+
+    return STATUS_SUCCESS;
+}
+
+PTR_SUCCESS
+PVOID
+HashMapLookup(
+    IN      PHASH_MAP           HashMap,
+    IN      QWORD               Key
+    )
+{
+    PHASH_MAP_SLOT pSlot;
+    QWORD hash;
+    BOOLEAN bUseSse2;
+
+    ASSERT(HashMap != NULL);
+
+    hash = HashMapHashKey(Key);
+    bUseSse2 = _HashMapUseSse2();
+
+    pSlot = _HashMapFind(&HashMap->Table, Key, hash, bUseSse2);
+    if (NULL == pSlot)
+    {
+        pSlot = _HashMapFind(&HashMap->OldTable, Key, hash, bUseSse2);
+    }
+
+    return (pSlot != NULL) ? pSlot->Value : NULL;
+}
+
+PTR_SUCCESS
+PVOID
+HashMapRemove(
+    INOUT   PHASH_MAP           HashMap,
+    IN      QWORD               Key
+    )
+{
+    PHASH_MAP_SLOT pSlot;
+    PHASH_MAP_TABLE pTable;
+    QWORD hash;
+    BOOLEAN bUseSse2;
+    PVOID pValue;
+
+    ASSERT(HashMap != NULL);
+
+    hash = HashMapHashKey(Key);
+    bUseSse2 = _HashMapUseSse2();
+
+    pTable = &HashMap->Table;
+    pSlot = _HashMapFind(pTable, Key, hash, bUseSse2);
+    if (NULL == pSlot)
+    {
+        pTable = &HashMap->OldTable;
+        pSlot = _HashMapFind(pTable, Key, hash, bUseSse2);
+    }
+
+    if (NULL == pSlot)
+    {
+        return NULL;
+    }
+
+    pValue = pSlot->Value;
+
+    // the old table is never freed here so an iteration may remove the
+    // element it has just returned
+    _HashMapEraseSlot(pTable, pSlot, pTable == &HashMap->OldTable, bUseSse2);
+
+    return pValue;
+}
+
+void
+HashMapIteratorInit(
+    IN      PHASH_MAP           HashMap,
+    OUT     PHASH_MAP_ITERATOR  Iterator
+    )
+{
+    ASSERT(HashMap != NULL);
+    ASSERT(Iterator != NULL);
+
+    Iterator->HashMap = HashMap;
+    Iterator->Position = 0;
+}
+
+PTR_SUCCESS
+PVOID
+HashMapIteratorNext(
+    INOUT   PHASH_MAP_ITERATOR  Iterator,
+    OUT_OPT QWORD*              Key
+    )
+{
+    PHASH_MAP pMap;
+
+    ASSERT(Iterator != NULL);
+
+    pMap = Iterator->HashMap;
+
+    while (Iterator->Position < pMap->OldTable.Capacity + pMap->Table.Capacity)
+    {
+        PHASH_MAP_TABLE pTable;
+        DWORD index;
+
+        if (Iterator->Position < pMap->OldTable.Capacity)
+        {
+            pTable = &pMap->OldTable;
+            index = Iterator->Position;
+        }
+        else
+        {
+            pTable = &pMap->Table;
+            index = Iterator->Position - pMap->OldTable.Capacity;
+        }
+
+        Iterator->Position++;
+
+        if (HASH_MAP_IS_SLOT_FULL(pTable->Control[index]))
+        {
+            if (Key != NULL)
+            {
+                *Key = pTable->Slots[index].Key;
+            }
+
+            return pTable->Slots[index].Value;
+        }
+    }
+
+    return NULL;
+}
+
+// The finalizer of SplitMix64
+QWORD
+HashMapHashKey(
+    IN      QWORD               Key
+    )
+{
+    QWORD hash;
+
+    hash = Key;
+
+    hash ^= hash >> 30;
+    hash *= 0xBF58'476D'1CE4'E5B9ULL;
+    hash ^= hash >> 27;
+    hash *= 0x94D0'49BB'1331'11EBULL;
+    hash ^= hash >> 31;
+
+    return hash;
+}
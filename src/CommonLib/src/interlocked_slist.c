@@ -0,0 +1,135 @@
+#include "common_lib.h"
+#include "interlocked_slist.h"
+#include <intrin.h>
+
+// Tries to replace the header with the one described by the parameters,
+// Expected is updated with the current value of the header on failure
+static
+__forceinline
+BOOLEAN
+_ClSListCompareExchange(
+    INOUT   PCL_SLIST_HEADER    ListHead,
+    IN      PCL_SLIST_ENTRY     First,
+    IN      DWORD               Depth,
+    INOUT   PCL_SLIST_HEADER    Expected
+    )
+{
+    CL_SLIST_HEADER newHeader;
+
+    newHeader.First = First;
+    newHeader.Depth = Depth;
+    newHeader.Sequence = Expected->Sequence + 1;
+
+    return 0 != _InterlockedCompareExchange128((volatile __int64*) ListHead,
+                                               ((__int64*) &newHeader)[1],
+                                               ((__int64*) &newHeader)[0],
+                                               (__int64*) Expected);
+}
+
+// The two halves are not read atomically, a torn value only makes the
+// following compare exchange fail and return the consistent one
+static
+__forceinline
+void
+_ClSListReadHeader(
+    IN      PCL_SLIST_HEADER    ListHead,
+    OUT     PCL_SLIST_HEADER    Header
+    )
+{
+    Header->First = ListHead->First;
+    Header->Depth = ListHead->Depth;
+    Header->Sequence = ListHead->Sequence;
+}
+
+void
+ClInitializeInterlockedSListHead(
+    OUT     PCL_SLIST_HEADER    ListHead
+    )
+{
+    ASSERT(NULL != ListHead);
+    ASSERT(IsAddressAligned(ListHead, sizeof(CL_SLIST_HEADER)));
+
+    memzero(ListHead, sizeof(CL_SLIST_HEADER));
+}
+
+PCL_SLIST_ENTRY
+ClInterlockedPushEntrySList(
+    INOUT   PCL_SLIST_HEADER    ListHead,
+    INOUT   PCL_SLIST_ENTRY     Entry
+    )
+{
+    CL_SLIST_HEADER header;
+
+    ASSERT(NULL != ListHead);
+    ASSERT(NULL != Entry);
+
+    _ClSListReadHeader(ListHead, &header);
+
+    do
+    {
+        ASSERT(header.Depth < MAX_DWORD);
+
+        Entry->Next = header.First;
+    } while (!_ClSListCompareExchange(ListHead, Entry, header.Depth + 1, &header));
+
+    return header.First;
+}
+
+PTR_SUCCESS
+PCL_SLIST_ENTRY
+ClInterlockedPopEntrySList(
+    INOUT   PCL_SLIST_HEADER    ListHead
+    )
+{
+    CL_SLIST_HEADER header;
+
+    ASSERT(NULL != ListHead);
+
+    _ClSListReadHeader(ListHead, &header);
+
+    do
+    {
+        if (NULL == header.First)
+        {
+            return NULL;
+        }
+
+        // the entry may be popped by another CPU before our compare exchange,
+        // in that case the value read here is discarded
+    } while (!_ClSListCompareExchange(ListHead, header.First->Next, header.Depth - 1, &header));
+
+    return header.First;
+}
+
+PTR_SUCCESS
+PCL_SLIST_ENTRY
+ClInterlockedFlushSList(
+    INOUT   PCL_SLIST_HEADER    ListHead
+    )
+{
+    CL_SLIST_HEADER header;
+
+    ASSERT(NULL != ListHead);
+
+    _ClSListReadHeader(ListHead, &header);
+
+    do
+    {
+        if (NULL == header.First)
+        {
+            return NULL;
+        }
+    } while (!_ClSListCompareExchange(ListHead, NULL, 0, &header));
+
+    return header.First;
+}
+
+DWORD
+ClQueryDepthSList(
+    IN      PCL_SLIST_HEADER    ListHead
+    )
+{
+    ASSERT(NULL != ListHead);
+
+    return ListHead->Depth;
+}
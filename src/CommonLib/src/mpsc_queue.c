@@ -0,0 +1,102 @@
+#include "common_lib.h"
+#include "mpsc_queue.h"
+#include <intrin.h>
+
+// The link is written by a producer while the consumer reads it => it must
+// be read from memory each time
+static
+__forceinline
+PCL_SLIST_ENTRY
+_MpscQueueReadNext(
+    IN      PCL_SLIST_ENTRY     Entry
+    )
+{
+    return *(PCL_SLIST_ENTRY volatile*) &Entry->Next;
+}
+
+void
+MpscQueueInit(
+    OUT     PMPSC_QUEUE         Queue
+    )
+{
+    ASSERT(NULL != Queue);
+
+    Queue->Stub.Next = NULL;
+    Queue->Head = &Queue->Stub;
+    Queue->Tail = &Queue->Stub;
+}
+
+void
+MpscQueuePush(
+    INOUT   PMPSC_QUEUE         Queue,
+    INOUT   PCL_SLIST_ENTRY     Entry
+    )
+{
+    PCL_SLIST_ENTRY pPrevious;
+
+    ASSERT(NULL != Queue);
+    ASSERT(NULL != Entry);
+
+    Entry->Next = NULL;
+
+    pPrevious = _InterlockedExchangePointer((PVOID volatile*) &Queue->Head, Entry);
+
+    // until this store the consumer sees the queue ending at pPrevious
+    *(PCL_SLIST_ENTRY volatile*) &pPrevious->Next = Entry;
+}
+
+PTR_SUCCESS
+PCL_SLIST_ENTRY
+MpscQueuePop(
+    INOUT   PMPSC_QUEUE         Queue
+    )
+{
+    PCL_SLIST_ENTRY pTail;
+    PCL_SLIST_ENTRY pNext;
+
+    ASSERT(NULL != Queue);
+
+    pTail = Queue->Tail;
+    pNext = _MpscQueueReadNext(pTail);
+
+    if (pTail == &Queue->Stub)
+    {
+        // the stub is never returned, skip it
+        if (NULL == pNext)
+        {
+            return NULL;
+        }
+
+        Queue->Tail = pNext;
+        pTail = pNext;
+        pNext = _MpscQueueReadNext(pNext);
+    }
+
+    if (NULL != pNext)
+    {
+        Queue->Tail = pNext;
+        return pTail;
+    }
+
+    if (pTail != Queue->Head)
+    {
+        // a producer exchanged the head but did not yet link its element to
+        // pTail, pTail cannot be removed before its successor is known
+        return NULL;
+    }
+
+    // pTail is the last element => insert the stub after it so the queue does
+    // not become empty when pTail is removed
+    MpscQueuePush(Queue, &Queue->Stub);
+
+    pNext = _MpscQueueReadNext(pTail);
+    if (NULL != pNext)
+    {
+        Queue->Tail = pNext;
+        return pTail;
+    }
+
+    // another producer inserted its element before the stub and did not link
+    // it yet
+    return NULL;
+}
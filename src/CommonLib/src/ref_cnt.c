@@ -55,6 +55,35 @@ RfcReference(
     return newRefCount;
 }
 
+BOOLEAN
+RfcTryReference(
+    INOUT   REF_COUNT*              Object
+    )
+{
+    DWORD refCount;
+
+    ASSERT(NULL != Object);
+
+    refCount = Object->ReferenceCount;
+
+    while (0 != refCount)
+    {
+        DWORD prevRefCount;
+
+        ASSERT_INFO(MAX_DWORD - 1 > refCount, "Reached max reference count");
+
+        prevRefCount = (DWORD)_InterlockedCompareExchange(&Object->ReferenceCount, refCount + 1, refCount);
+        if (prevRefCount == refCount)
+        {
+            return TRUE;
+        }
+
+        refCount = prevRefCount;
+    }
+
+    return FALSE;
+}
+
 SIZE_SUCCESS
 DWORD
 RfcDereference(
@@ -0,0 +1,204 @@
+#include "common_lib.h"
+#include "lock_common.h"
+#include "striped_hash_map.h"
+
+#ifndef _COMMONLIB_NO_LOCKS_
+
+STATIC_ASSERT(0 == (STRIPED_HASH_MAP_NO_OF_STRIPES & (STRIPED_HASH_MAP_NO_OF_STRIPES - 1)));
+
+static
+__forceinline
+PSTRIPED_HASH_MAP_STRIPE
+_StripedHashMapGetStripe(
+    IN      PSTRIPED_HASH_MAP   HashMap,
+    IN      QWORD               Key
+    )
+{
+    // the HASH_MAP uses the low bits of the hash to place the key in the
+    // stripe, the stripe is selected using bits it does not use
+    return &HashMap->Stripes[(HashMapHashKey(Key) >> 32) & (STRIPED_HASH_MAP_NO_OF_STRIPES - 1)];
+}
+
+STATUS
+StripedHashMapInit(
+    OUT     PSTRIPED_HASH_MAP   HashMap,
+    IN      PFUNC_HashMapAlloc  AllocFunction,
+    IN      PFUNC_FreeFunction  FreeFunction,
+    IN_OPT  PVOID               Context
+    )
+{
+    STATUS status;
+
+    if (NULL == HashMap)
+    {
+        return STATUS_INVALID_PARAMETER1;
+    }
+
+    status = STATUS_SUCCESS;
+
+    for (DWORD i = 0; i < STRIPED_HASH_MAP_NO_OF_STRIPES; ++i)
+    {
+        RwSpinlockInit(&HashMap->Stripes[i].Lock);
+
+        status = HashMapInit(&HashMap->Stripes[i].HashMap, 0, AllocFunction, FreeFunction, Context);
+        if (!SUCCEEDED(status))
+        {
+            // parameter validation failed, it fails the same way for all stripes
+            ASSERT(0 == i);
+            break;
+        }
+    }
+
+    return status;
+}
+
+void
+StripedHashMapUninit(
+    INOUT   PSTRIPED_HASH_MAP   HashMap
+    )
+{
+    ASSERT(HashMap != NULL);
+
+    for (DWORD i = 0; i < STRIPED_HASH_MAP_NO_OF_STRIPES; ++i)
+    {
+        HashMapUninit(&HashMap->Stripes[i].HashMap);
+    }
+}
+
+DWORD
+StripedHashMapSize(
+    IN      PSTRIPED_HASH_MAP   HashMap
+    )
+{
+    DWORD size;
+
+    ASSERT(HashMap != NULL);
+
+    size = 0;
+
+    for (DWORD i = 0; i < STRIPED_HASH_MAP_NO_OF_STRIPES; ++i)
+    {
+        INTR_STATE oldState;
+
+        RwSpinlockAcquireShared(&HashMap->Stripes[i].Lock, &oldState);
+        size += HashMapSize(&HashMap->Stripes[i].HashMap);
+        RwSpinlockReleaseShared(&HashMap->Stripes[i].Lock, oldState);
+    }
+
+    return size;
+}
+
+STATUS
+StripedHashMapInsert(
+    INOUT   PSTRIPED_HASH_MAP   HashMap,
+    IN      QWORD               Key,
+    IN      PVOID               Value,
+    OUT_OPT PVOID*              PreviousValue
+    )
+{
+    PSTRIPED_HASH_MAP_STRIPE pStripe;
+    INTR_STATE oldState;
+    STATUS status;
+
+    ASSERT(HashMap != NULL);
+
+    pStripe = _StripedHashMapGetStripe(HashMap, Key);
+
+    RwSpinlockAcquireExclusive(&pStripe->Lock, &oldState);
+    status = HashMapInsert(&pStripe->HashMap, Key, Value, PreviousValue);
+    RwSpinlockReleaseExclusive(&pStripe->Lock, oldState);
+
+    return status;
+}
+
+PTR_SUCCESS
+PVOID
+StripedHashMapLookup(
+    IN      PSTRIPED_HASH_MAP               HashMap,
+    IN      QWORD                           Key,
+    IN_OPT  PFUNC_StripedHashMapFunction    Function,
+    IN_OPT  PVOID                           Context
+    )
+{
+    PSTRIPED_HASH_MAP_STRIPE pStripe;
+    INTR_STATE oldState;
+    PVOID pValue;
+
+    ASSERT(HashMap != NULL);
+
+    pStripe = _StripedHashMapGetStripe(HashMap, Key);
+
+    RwSpinlockAcquireShared(&pStripe->Lock, &oldState);
+
+    pValue = HashMapLookup(&pStripe->HashMap, Key);
+    if (pValue != NULL && Function != NULL)
+    {
+        if (!Function(Key, pValue, Context))
+        {
+            pValue = NULL;
+        }
+    }
+
+    RwSpinlockReleaseShared(&pStripe->Lock, oldState);
+
+    return pValue;
+}
+
+PTR_SUCCESS
+PVOID
+StripedHashMapRemove(
+    INOUT   PSTRIPED_HASH_MAP   HashMap,
+    IN      QWORD               Key
+    )
+{
+    PSTRIPED_HASH_MAP_STRIPE pStripe;
+    INTR_STATE oldState;
+    PVOID pValue;
+
+    ASSERT(HashMap != NULL);
+
+    pStripe = _StripedHashMapGetStripe(HashMap, Key);
+
+    RwSpinlockAcquireExclusive(&pStripe->Lock, &oldState);
+    pValue = HashMapRemove(&pStripe->HashMap, Key);
+    RwSpinlockReleaseExclusive(&pStripe->Lock, oldState);
+
+    return pValue;
+}
+
+BOOLEAN
+StripedHashMapExecuteForEach(
+    IN      PSTRIPED_HASH_MAP               HashMap,
+    IN      PFUNC_StripedHashMapFunction    Function,
+    IN_OPT  PVOID                           Context
+    )
+{
+    BOOLEAN bContinue;
+
+    ASSERT(HashMap != NULL);
+    ASSERT(Function != NULL);
+
+    bContinue = TRUE;
+
+    for (DWORD i = 0; i < STRIPED_HASH_MAP_NO_OF_STRIPES && bContinue; ++i)
+    {
+        HASH_MAP_ITERATOR it;
+        INTR_STATE oldState;
+        PVOID pValue;
+        QWORD key;
+
+        RwSpinlockAcquireShared(&HashMap->Stripes[i].Lock, &oldState);
+
+        HashMapIteratorInit(&HashMap->Stripes[i].HashMap, &it);
+        while (bContinue && (pValue = HashMapIteratorNext(&it, &key)) != NULL)
+        {
+            bContinue = Function(key, pValue, Context);
+        }
+
+        RwSpinlockReleaseShared(&HashMap->Stripes[i].Lock, oldState);
+    }
+
+    return bContinue;
+}
+
+#endif // _COMMONLIB_NO_LOCKS_
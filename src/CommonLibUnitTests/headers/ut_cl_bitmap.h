@@ -3,4 +3,9 @@
 BOOLEAN
 TcBitmapRun(
     void
-    );
\ No newline at end of file
+    );
+
+STATUS
+UtClBitmapScan(
+    void
+    );
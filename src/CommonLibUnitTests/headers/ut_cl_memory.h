@@ -0,0 +1,8 @@
+#pragma once
+
+// Returns the CL_MEMORY_FEATURE_* flags which can be used on this machine
+DWORD
+UtClMemoryGetHostFeatures();
+
+STATUS
+UtClMemory();
@@ -0,0 +1,6 @@
+#pragma once
+
+STATUS
+UtClStringScan(
+    void
+    );
@@ -7,6 +7,10 @@
 #include "ut_cl_string.h"
 #include "ut_cl_stack_dynamic.h"
 #include "ut_cl_hash_table.h"
+#include "ut_cl_memory.h"
+#include "ut_cl_string_scan.h"
+#include "ut_cl_lock_free.h"
+#include "ut_cl_bitmap.h"
 
 typedef struct _CL_UNIT_TEST
 {
@@ -27,6 +31,10 @@ const CL_UNIT_TEST CL_TESTS[] =
     {"Memory", TstStrings},
     {"DynamicStack", UtClStackDynamic},
     {"HashTable", UtClHashTable},
+    {"MemoryBenchmark", UtClMemory},
+    {"StringScan", UtClStringScan},
+    {"LockFree", UtClLockFree},
+    {"BitmapScan", UtClBitmapScan},
 };
 
 static constexpr auto NO_OF_CL_TESTS = ARRAYSIZE(CL_TESTS);
@@ -1,6 +1,30 @@
 #include "ut_base.h"
 #include "ut_cl_bitmap.h"
+#include "ut_cl_memory.h"
+#include "ut_cl_rng.h"
 #include "bitmap.h"
+#include <chrono>
+#include <vector>
+
+static constexpr DWORD UT_BITMAP_VALIDATION_ROUNDS = 20'000;
+static constexpr DWORD UT_BITMAP_MAX_VALIDATION_BITS = 2'000;
+
+// An allocation bitmap of a volume with 1M clusters
+static constexpr DWORD UT_BITMAP_BENCHMARK_BITS = 1024 * 1024;
+static constexpr DWORD UT_BITMAP_BENCHMARK_SCANS = 200;
+
+typedef struct _UT_BITMAP_FEATURE_SET
+{
+    const char*                 Name;
+    DWORD                       Features;
+} UT_BITMAP_FEATURE_SET;
+
+static const UT_BITMAP_FEATURE_SET FEATURE_SETS[] =
+{
+    {"none", 0},
+    {"sse2", CL_MEMORY_FEATURE_SSE2},
+    {"avx2", CL_MEMORY_FEATURE_AVX2 | CL_MEMORY_FEATURE_SSE2},
+};
 
 BOOLEAN
 TcBitmapRun(
@@ -14,4 +38,180 @@ TcBitmapRun(
     BitmapPreinit(&bmp, 10 );
 
     return TRUE;
-}
\ No newline at end of file
+}
+
+// The bit at a time implementation the scan used to have
+static
+DWORD
+_UtBitmapScanLegacy(
+    _In_        PBITMAP     Bitmap,
+    _In_        DWORD       Index,
+    _In_        DWORD       FirstInvalidBitIndex,
+    _In_        DWORD       ConsecutiveBits,
+    _In_        BOOLEAN     Set
+    )
+{
+    if (FirstInvalidBitIndex - Index < ConsecutiveBits)
+    {
+        return MAX_DWORD;
+    }
+
+    for (DWORD i = Index; i <= FirstInvalidBitIndex - ConsecutiveBits; ++i)
+    {
+        DWORD j;
+
+        for (j = 0; j < ConsecutiveBits; ++j)
+        {
+            if (Set != BitmapGetBitValue(Bitmap, i + j))
+            {
+                break;
+            }
+        }
+
+        if (j == ConsecutiveBits)
+        {
+            return i;
+        }
+    }
+
+    return MAX_DWORD;
+}
+
+// Each bit is set with a probability of Density / 256, runs of equal bits
+// are added so that long runs are also found
+static
+void
+_UtBitmapFillRandom(
+    _Inout_     PBITMAP     Bitmap,
+    _In_        DWORD       Density
+    )
+{
+    UtCl::RNG& rng = UtCl::RNG::GetInstance();
+    DWORD bitCount = BitmapGetMaxElementCount(Bitmap);
+
+    for (DWORD i = 0; i < bitCount; ++i)
+    {
+        BitmapSetBitValue(Bitmap, i, rng.GetNextRandom() % 256 < Density);
+    }
+
+    for (DWORD run = rng.GetNextRandom() % 4; run > 0; --run)
+    {
+        DWORD index = rng.GetNextRandom() % bitCount;
+        DWORD count = min(rng.GetNextRandom() % 200 + 1, bitCount - index);
+
+        BitmapSetBitsValue(Bitmap, index, count, rng.GetNextRandom() % 2 == 0);
+    }
+}
+
+static
+STATUS
+_UtBitmapValidate(
+    _In_        const UT_BITMAP_FEATURE_SET&    FeatureSet
+    )
+{
+    UtCl::RNG& rng = UtCl::RNG::GetInstance();
+    std::vector<BYTE> buffer;
+    BITMAP bitmap;
+
+    for (DWORD round = 0; round < UT_BITMAP_VALIDATION_ROUNDS; ++round)
+    {
+        DWORD bitCount = rng.GetNextRandom() % UT_BITMAP_MAX_VALIDATION_BITS + 1;
+        DWORD density = (round % 2 == 0) ? rng.GetNextRandom() % 257 : (rng.GetNextRandom() % 2) * 256;
+
+        buffer.resize(BitmapPreinit(&bitmap, bitCount));
+        BitmapInit(&bitmap, buffer.data());
+
+        _UtBitmapFillRandom(&bitmap, density);
+
+        DWORD index = rng.GetNextRandom() % (bitCount + 1);
+        DWORD firstInvalid = index + rng.GetNextRandom() % (bitCount - index + 1);
+        DWORD consecutiveBits = (rng.GetNextRandom() % 4 == 0) ? rng.GetNextRandom() % 100 + 1 : rng.GetNextRandom() % 8 + 1;
+        BOOLEAN set = rng.GetNextRandom() % 2 == 0;
+
+        DWORD result = BitmapScanFromTo(&bitmap, index, firstInvalid, consecutiveBits, set);
+        DWORD expected = _UtBitmapScanLegacy(&bitmap, index, firstInvalid, consecutiveBits, set);
+
+        if (result != expected)
+        {
+            LOG_ERROR("[%s] Scan for %u bits of %u in [%u, %u) of a %u bit bitmap returned %u instead of %u\n",
+                      FeatureSet.Name, consecutiveBits, set, index, firstInvalid, bitCount, result, expected);
+            return CL_STATUS_VALUE_MISMATCH;
+        }
+    }
+
+    return CL_STATUS_SUCCESS;
+}
+
+// Searches for the few free bits of an almost full allocation bitmap, every
+// scan starts from the beginning of the bitmap
+static
+void
+_UtBitmapBenchmark(
+    _In_        const char*         Name,
+    _In_        bool                Legacy
+    )
+{
+    UtCl::RNG& rng = UtCl::RNG::GetInstance();
+    std::vector<BYTE> buffer;
+    BITMAP bitmap;
+    volatile QWORD sink = 0;
+
+    buffer.resize(BitmapPreinit(&bitmap, UT_BITMAP_BENCHMARK_BITS));
+    BitmapInitEx(&bitmap, buffer.data(), TRUE);
+
+    for (DWORD i = 0; i < UT_BITMAP_BENCHMARK_BITS / 4096; ++i)
+    {
+        BitmapClearBits(&bitmap, rng.GetNextRandom() % (UT_BITMAP_BENCHMARK_BITS - 8), 8);
+    }
+
+    for (const DWORD consecutiveBits : { 1, 8, 16 })
+    {
+        auto start = std::chrono::high_resolution_clock::now();
+
+        for (DWORD i = 0; i < UT_BITMAP_BENCHMARK_SCANS; ++i)
+        {
+            DWORD index = i * (UT_BITMAP_BENCHMARK_BITS / UT_BITMAP_BENCHMARK_SCANS);
+
+            sink += Legacy
+                ? _UtBitmapScanLegacy(&bitmap, index, UT_BITMAP_BENCHMARK_BITS, consecutiveBits, FALSE)
+                : BitmapScanFrom(&bitmap, index, consecutiveBits, FALSE);
+        }
+
+        auto end = std::chrono::high_resolution_clock::now();
+
+        LOG("[%-6s] scan for %2u clear bits: %10.2f us\n", Name, consecutiveBits,
+            std::chrono::duration<double, std::micro>(end - start).count() / UT_BITMAP_BENCHMARK_SCANS);
+    }
+}
+
+STATUS
+UtClBitmapScan(
+    void
+    )
+{
+    STATUS status = CL_STATUS_SUCCESS;
+    DWORD hostFeatures = UtClMemoryGetHostFeatures();
+    DWORD previousFeatures = MemoryGetCpuFeatures();
+
+    _UtBitmapBenchmark("legacy", true);
+
+    for (const auto& featureSet : FEATURE_SETS)
+    {
+        if (!IsBooleanFlagOn(hostFeatures, featureSet.Features)) continue;
+
+        MemorySetCpuFeatures(featureSet.Features);
+
+        status = _UtBitmapValidate(featureSet);
+        if (!SUCCEEDED(status))
+        {
+            LOG_FUNC_ERROR("_UtBitmapValidate", status);
+            break;
+        }
+
+        _UtBitmapBenchmark(featureSet.Name, false);
+    }
+
+    MemorySetCpuFeatures(previousFeatures);
+
+    return status;
+}
@@ -1,8 +1,12 @@
 #include "ut_base.h"
 #include "ut_cl_hash_table.h"
 #include "hash_table.h"
+#include "hash_map.h"
 #include <unordered_map>
+#include <chrono>
+#include <vector>
 #include "ut_cl_rng.h"
+#include "ut_cl_memory.h"
 
 typedef struct _UT_HASH_ELEM
 {
@@ -504,6 +508,328 @@ cleanup:
     return status;
 }
 
+static constexpr DWORD HASH_MAP_VALIDATION_KEYS = 100'000;
+static constexpr DWORD HASH_MAP_VALIDATION_OPERATIONS = 2'000'000;
+
+static const DWORD HASH_MAP_BENCHMARK_KEYS[] =
+{
+    1'000'000, 4'000'000
+};
+
+static
+PVOID
+(__cdecl _HashMapAlloc)(
+    IN      DWORD       Size,
+    IN_OPT  PVOID       Context
+    )
+{
+    UNREFERENCED_PARAMETER(Context);
+
+    return new BYTE[Size];
+}
+
+static
+void
+(__cdecl _HashMapFree)(
+    IN      PVOID       Object,
+    IN_OPT  PVOID       Context
+    )
+{
+    UNREFERENCED_PARAMETER(Context);
+
+    delete[] (PBYTE)Object;
+}
+
+// The values stored in the map are derived from the keys so they are never NULL
+static
+PVOID
+_HashMapValueForKey(
+    _In_        QWORD       Key
+    )
+{
+    return (PVOID)((Key << 1) | 1);
+}
+
+static
+STATUS
+_HashMapValidate(
+    _In_        const char*     Name
+    )
+{
+    STATUS status;
+    HASH_MAP hashMap;
+    std::unordered_map<QWORD, PVOID> shadowHash;
+    UtCl::RNG& rng = UtCl::RNG::GetInstance();
+
+    status = HashMapInit(&hashMap, 0, _HashMapAlloc, _HashMapFree, nullptr);
+    if (!SUCCEEDED(status))
+    {
+        LOG_FUNC_ERROR("HashMapInit", status);
+        return status;
+    }
+
+    for (DWORD i = 0; i < HASH_MAP_VALIDATION_OPERATIONS && SUCCEEDED(status); ++i)
+    {
+        // the second half of the operations works on fewer keys so the map
+        // also shrinks while it is being resized
+        QWORD key = rng.GetNextRandom() % (i < HASH_MAP_VALIDATION_OPERATIONS / 2 ? HASH_MAP_VALIDATION_KEYS : HASH_MAP_VALIDATION_KEYS / 16);
+        DWORD operation = rng.GetNextRandom() % 8;
+        auto shadowIt = shadowHash.find(key);
+        PVOID expected = shadowIt != shadowHash.end() ? shadowIt->second : nullptr;
+
+        if (operation < 4)
+        {
+            PVOID previous;
+
+            status = HashMapInsert(&hashMap, key, _HashMapValueForKey(key), &previous);
+            if (!SUCCEEDED(status))
+            {
+                LOG_FUNC_ERROR("HashMapInsert", status);
+                break;
+            }
+
+            if (previous != expected)
+            {
+                LOG_ERROR("[%s] Insertion of key 0x%I64X returned previous value 0x%p instead of 0x%p\n",
+                          Name, key, previous, expected);
+                status = CL_STATUS_VALUE_MISMATCH;
+            }
+
+            shadowHash[key] = _HashMapValueForKey(key);
+        }
+        else if (operation < 6)
+        {
+            PVOID value = HashMapLookup(&hashMap, key);
+
+            if (value != expected)
+            {
+                LOG_ERROR("[%s] Lookup of key 0x%I64X returned 0x%p instead of 0x%p\n",
+                          Name, key, value, expected);
+                status = CL_STATUS_VALUE_MISMATCH;
+            }
+        }
+        else
+        {
+            PVOID value = HashMapRemove(&hashMap, key);
+
+            if (value != expected)
+            {
+                LOG_ERROR("[%s] Removal of key 0x%I64X returned 0x%p instead of 0x%p\n",
+                          Name, key, value, expected);
+                status = CL_STATUS_VALUE_MISMATCH;
+            }
+
+            shadowHash.erase(key);
+        }
+
+        if (SUCCEEDED(status) && HashMapSize(&hashMap) != shadowHash.size())
+        {
+            LOG_ERROR("[%s] Our reported hash size is %u, while the shadow hash size is %zu\n",
+                      Name, HashMapSize(&hashMap), shadowHash.size());
+            status = CL_STATUS_SIZE_INVALID;
+        }
+    }
+
+    if (SUCCEEDED(status))
+    {
+        HASH_MAP_ITERATOR it;
+        PVOID value;
+        QWORD key;
+        size_t elementsFound = 0;
+
+        // every other element is removed while iterating
+        HashMapIteratorInit(&hashMap, &it);
+        while ((value = HashMapIteratorNext(&it, &key)) != nullptr)
+        {
+            auto shadowIt = shadowHash.find(key);
+
+            if (shadowIt == shadowHash.end() || shadowIt->second != value)
+            {
+                LOG_ERROR("[%s] Iterator returned key 0x%I64X with value 0x%p which is not in the shadow hash\n",
+                          Name, key, value);
+                status = CL_STATUS_ELEMENT_FOUND;
+                break;
+            }
+
+            if (elementsFound++ % 2 == 0)
+            {
+                HashMapRemove(&hashMap, key);
+                shadowHash.erase(shadowIt);
+            }
+        }
+
+        if (SUCCEEDED(status) && (elementsFound - (elementsFound + 1) / 2 != shadowHash.size()
+                                  || HashMapSize(&hashMap) != shadowHash.size()))
+        {
+            LOG_ERROR("[%s] Iterator returned %zu elements, %zu remain in the shadow hash and %u in our hash\n",
+                      Name, elementsFound, shadowHash.size(), HashMapSize(&hashMap));
+            status = CL_STATUS_SIZE_INVALID;
+        }
+    }
+
+    if (SUCCEEDED(status))
+    {
+        HashMapClear(&hashMap, nullptr, nullptr);
+
+        if (HashMapSize(&hashMap) != 0 || HashMapLookup(&hashMap, 0) != nullptr)
+        {
+            LOG_ERROR("[%s] The hash map still has %u elements after being cleared\n",
+                      Name, HashMapSize(&hashMap));
+            status = CL_STATUS_SIZE_INVALID;
+        }
+    }
+
+    HashMapUninit(&hashMap);
+
+    return status;
+}
+
+template<typename Func>
+static
+double
+_HashMeasure(
+    _In_        DWORD               Operations,
+    _In_        Func                Operation
+    )
+{
+    auto start = std::chrono::high_resolution_clock::now();
+
+    Operation();
+
+    auto end = std::chrono::high_resolution_clock::now();
+
+    // millions of operations per second
+    return Operations / std::chrono::duration<double, std::micro>(end - start).count();
+}
+
+// Inserts, looks up (half of the keys are not present) and removes NumberOfKeys
+// random keys in each container and logs the throughput of each operation
+static
+void
+_HashBenchmark(
+    _In_        DWORD               NumberOfKeys,
+    _In_        bool                HashMapOnly
+    )
+{
+    std::vector<QWORD> keys(NumberOfKeys);
+    std::vector<QWORD> missingKeys(NumberOfKeys);
+    UtCl::RNG& rng = UtCl::RNG::GetInstance();
+    volatile QWORD sink = 0;
+
+    for (DWORD i = 0; i < NumberOfKeys; ++i)
+    {
+        // the MSB separates the keys which are inserted from the missing ones
+        keys[i] = ((QWORD)rng.GetNextRandom() << 32 | rng.GetNextRandom()) & ~(1ULL << 63);
+        missingKeys[i] = keys[i] | (1ULL << 63);
+    }
+
+    if (!HashMapOnly)
+    {
+        std::unordered_map<QWORD, PVOID> stdMap;
+
+        double insertRate = _HashMeasure(NumberOfKeys, [&]() {
+            for (const auto& key : keys) stdMap[key] = _HashMapValueForKey(key); });
+        double lookupRate = _HashMeasure(2 * NumberOfKeys, [&]() {
+            for (DWORD i = 0; i < NumberOfKeys; ++i)
+            {
+                sink += stdMap.count(keys[i]) + stdMap.count(missingKeys[i]);
+            } });
+        double removeRate = _HashMeasure(NumberOfKeys, [&]() {
+            for (const auto& key : keys) sink += stdMap.erase(key); });
+
+        LOG("[unordered_map] %8u keys: insert %7.2f lookup %7.2f remove %7.2f Mops/s\n",
+            NumberOfKeys, insertRate, lookupRate, removeRate);
+
+        // the HASH_TABLE has a fixed number of buckets, give it one for every
+        // four keys
+        HASH_TABLE hashTable;
+        PUT_HASH_ELEM pElems = new UT_HASH_ELEM[2 * NumberOfKeys];
+
+        if (SUCCEEDED(_HashTableCreate(NumberOfKeys / 4, sizeof(QWORD), HashFuncUniversal, &hashTable)))
+        {
+            for (DWORD i = 0; i < NumberOfKeys; ++i)
+            {
+                pElems[i].Value = keys[i];
+                pElems[NumberOfKeys + i].Value = missingKeys[i];
+            }
+
+            insertRate = _HashMeasure(NumberOfKeys, [&]() {
+                for (DWORD i = 0; i < NumberOfKeys; ++i) HashTableInsert(&hashTable, &pElems[i].HashEntry); });
+            lookupRate = _HashMeasure(2 * NumberOfKeys, [&]() {
+                for (DWORD i = 0; i < NumberOfKeys; ++i)
+                {
+                    sink += (QWORD)HashTableLookup(&hashTable, (PHASH_KEY)&pElems[i].Value);
+                    sink += (QWORD)HashTableLookup(&hashTable, (PHASH_KEY)&pElems[NumberOfKeys + i].Value);
+                } });
+            removeRate = _HashMeasure(NumberOfKeys, [&]() {
+                for (DWORD i = 0; i < NumberOfKeys; ++i) sink += (QWORD)HashTableRemove(&hashTable, (PHASH_KEY)&pElems[i].Value); });
+
+            LOG("[hash table   ] %8u keys: insert %7.2f lookup %7.2f remove %7.2f Mops/s\n",
+                NumberOfKeys, insertRate, lookupRate, removeRate);
+
+            delete[] (PBYTE)hashTable.TableData;
+        }
+
+        delete[] pElems;
+    }
+
+    HASH_MAP hashMap;
+
+    if (!SUCCEEDED(HashMapInit(&hashMap, 0, _HashMapAlloc, _HashMapFree, nullptr))) return;
+
+    double insertRate = _HashMeasure(NumberOfKeys, [&]() {
+        for (const auto& key : keys) HashMapInsert(&hashMap, key, _HashMapValueForKey(key), nullptr); });
+    double lookupRate = _HashMeasure(2 * NumberOfKeys, [&]() {
+        for (DWORD i = 0; i < NumberOfKeys; ++i)
+        {
+            sink += (QWORD)HashMapLookup(&hashMap, keys[i]);
+            sink += (QWORD)HashMapLookup(&hashMap, missingKeys[i]);
+        } });
+    double removeRate = _HashMeasure(NumberOfKeys, [&]() {
+        for (const auto& key : keys) sink += (QWORD)HashMapRemove(&hashMap, key); });
+
+    LOG("[hash map %-4s] %8u keys: insert %7.2f lookup %7.2f remove %7.2f Mops/s\n",
+        IsBooleanFlagOn(MemoryGetCpuFeatures(), CL_MEMORY_FEATURE_SSE2) ? "sse2" : "swar",
+        NumberOfKeys, insertRate, lookupRate, removeRate);
+
+    HashMapUninit(&hashMap);
+}
+
+static
+STATUS
+_UtClHashMap(
+    void
+    )
+{
+    STATUS status = CL_STATUS_SUCCESS;
+    DWORD hostFeatures = UtClMemoryGetHostFeatures();
+    DWORD previousFeatures = MemoryGetCpuFeatures();
+
+    // the groups are matched either with SSE2 or with 64 bit arithmetic
+    for (const DWORD features : { (DWORD)0, (DWORD)CL_MEMORY_FEATURE_SSE2 })
+    {
+        if (!IsBooleanFlagOn(hostFeatures, features)) continue;
+
+        MemorySetCpuFeatures(features);
+
+        status = _HashMapValidate(features != 0 ? "sse2" : "swar");
+        if (!SUCCEEDED(status))
+        {
+            LOG_FUNC_ERROR("_HashMapValidate", status);
+            break;
+        }
+
+        for (const auto& numberOfKeys : HASH_MAP_BENCHMARK_KEYS)
+        {
+            _HashBenchmark(numberOfKeys, features != 0);
+        }
+    }
+
+    MemorySetCpuFeatures(previousFeatures);
+
+    return status;
+}
+
 STATUS
 UtClHashTable()
 {
@@ -529,5 +855,14 @@ UtClHashTable()
         }
     }
 
+    if (SUCCEEDED(status))
+    {
+        status = _UtClHashMap();
+        if (!SUCCEEDED(status))
+        {
+            LOG_FUNC_ERROR("_UtClHashMap", status);
+        }
+    }
+
     return status;
 }
@@ -0,0 +1,322 @@
+#include "ut_base.h"
+#include "ut_cl_lock_free.h"
+#include "interlocked_slist.h"
+#include "mpsc_queue.h"
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+static constexpr DWORD UT_LOCK_FREE_ELEMS_PER_THREAD = 200'000;
+
+static const DWORD THREAD_COUNTS[] =
+{
+    1, 2, 4, 8
+};
+
+typedef struct _UT_LOCK_FREE_ELEM
+{
+    CL_SLIST_ENTRY              Entry;
+
+    DWORD                       Producer;
+    DWORD                       Index;
+} UT_LOCK_FREE_ELEM, *PUT_LOCK_FREE_ELEM;
+
+static
+std::vector<UT_LOCK_FREE_ELEM>
+_UtLockFreeCreateElems(
+    _In_        DWORD           NumberOfThreads
+    )
+{
+    std::vector<UT_LOCK_FREE_ELEM> elems(NumberOfThreads * UT_LOCK_FREE_ELEMS_PER_THREAD);
+
+    for (DWORD i = 0; i < elems.size(); ++i)
+    {
+        elems[i].Producer = i / UT_LOCK_FREE_ELEMS_PER_THREAD;
+        elems[i].Index = i % UT_LOCK_FREE_ELEMS_PER_THREAD;
+    }
+
+    return elems;
+}
+
+template<typename Func>
+static
+double
+_UtLockFreeMeasure(
+    _In_        DWORD           NumberOfThreads,
+    _In_        Func            ThreadFunction
+    )
+{
+    std::vector<std::thread> threads;
+
+    auto start = std::chrono::high_resolution_clock::now();
+
+    for (DWORD i = 0; i < NumberOfThreads; ++i)
+    {
+        threads.emplace_back(ThreadFunction, i);
+    }
+
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+
+    auto end = std::chrono::high_resolution_clock::now();
+
+    // ns per element
+    return std::chrono::duration<double, std::nano>(end - start).count() / ((QWORD)NumberOfThreads * UT_LOCK_FREE_ELEMS_PER_THREAD);
+}
+
+// Each thread pushes its elements and pops one element after each push, at
+// the end each element must have been popped exactly once
+static
+STATUS
+_UtSListValidate(
+    _In_        DWORD           NumberOfThreads
+    )
+{
+    std::vector<UT_LOCK_FREE_ELEM> elems = _UtLockFreeCreateElems(NumberOfThreads);
+    std::vector<std::atomic<DWORD>> timesPopped(elems.size());
+    CL_SLIST_HEADER head;
+    PCL_SLIST_HEADER pHead = &head;
+    PCL_SLIST_ENTRY pEntry;
+    DWORD depth;
+    DWORD flushed;
+
+    ClInitializeInterlockedSListHead(pHead);
+
+    for (auto& count : timesPopped) count = 0;
+
+    _UtLockFreeMeasure(NumberOfThreads, [&](DWORD Thread) {
+        for (DWORD i = 0; i < UT_LOCK_FREE_ELEMS_PER_THREAD; ++i)
+        {
+            ClInterlockedPushEntrySList(pHead, &elems[Thread * UT_LOCK_FREE_ELEMS_PER_THREAD + i].Entry);
+
+            // leave some elements in the list so the flush has work to do
+            if (i % 4 != 0)
+            {
+                PCL_SLIST_ENTRY pPopped = ClInterlockedPopEntrySList(pHead);
+                if (pPopped != nullptr)
+                {
+                    PUT_LOCK_FREE_ELEM pElem = CONTAINING_RECORD(pPopped, UT_LOCK_FREE_ELEM, Entry);
+
+                    timesPopped[pElem->Producer * UT_LOCK_FREE_ELEMS_PER_THREAD + pElem->Index]++;
+                }
+            }
+        } });
+
+    depth = ClQueryDepthSList(pHead);
+    flushed = 0;
+
+    for (pEntry = ClInterlockedFlushSList(pHead); pEntry != nullptr; pEntry = pEntry->Next)
+    {
+        PUT_LOCK_FREE_ELEM pElem = CONTAINING_RECORD(pEntry, UT_LOCK_FREE_ELEM, Entry);
+
+        timesPopped[pElem->Producer * UT_LOCK_FREE_ELEMS_PER_THREAD + pElem->Index]++;
+        flushed++;
+    }
+
+    if (depth != flushed)
+    {
+        LOG_ERROR("The list reported a depth of %u, however %u elements were flushed\n", depth, flushed);
+        return CL_STATUS_SIZE_INVALID;
+    }
+
+    for (DWORD i = 0; i < timesPopped.size(); ++i)
+    {
+        if (timesPopped[i] != 1)
+        {
+            LOG_ERROR("Element %u of thread %u was popped %u times\n",
+                      elems[i].Index, elems[i].Producer, (DWORD)timesPopped[i]);
+            return CL_STATUS_VALUE_MISMATCH;
+        }
+    }
+
+    return CL_STATUS_SUCCESS;
+}
+
+// The producers push their elements in order, the consumer must receive each
+// producer's elements in the same order
+static
+STATUS
+_UtMpscQueueValidate(
+    _In_        DWORD           NumberOfProducers
+    )
+{
+    std::vector<UT_LOCK_FREE_ELEM> elems = _UtLockFreeCreateElems(NumberOfProducers);
+    std::vector<DWORD> nextIndex(NumberOfProducers, 0);
+    std::vector<std::thread> producers;
+    MPSC_QUEUE queue;
+    QWORD elemsReceived;
+    STATUS status;
+
+    MpscQueueInit(&queue);
+    status = CL_STATUS_SUCCESS;
+
+    for (DWORD i = 0; i < NumberOfProducers; ++i)
+    {
+        producers.emplace_back([&](DWORD Producer) {
+            for (DWORD j = 0; j < UT_LOCK_FREE_ELEMS_PER_THREAD; ++j)
+            {
+                MpscQueuePush(&queue, &elems[Producer * UT_LOCK_FREE_ELEMS_PER_THREAD + j].Entry);
+            } }, i);
+    }
+
+    // the consumer must receive all the elements even if it fails
+    for (elemsReceived = 0; elemsReceived < elems.size(); )
+    {
+        PCL_SLIST_ENTRY pEntry = MpscQueuePop(&queue);
+        if (pEntry == nullptr) continue;
+
+        PUT_LOCK_FREE_ELEM pElem = CONTAINING_RECORD(pEntry, UT_LOCK_FREE_ELEM, Entry);
+
+        if (SUCCEEDED(status) && pElem->Index != nextIndex[pElem->Producer])
+        {
+            LOG_ERROR("Received element %u of producer %u while expecting element %u\n",
+                      pElem->Index, pElem->Producer, nextIndex[pElem->Producer]);
+            status = CL_STATUS_VALUE_MISMATCH;
+        }
+
+        nextIndex[pElem->Producer] = pElem->Index + 1;
+        elemsReceived++;
+    }
+
+    for (auto& producer : producers)
+    {
+        producer.join();
+    }
+
+    if (SUCCEEDED(status) && MpscQueuePop(&queue) != nullptr)
+    {
+        LOG_ERROR("The queue still has elements after all of them were received\n");
+        status = CL_STATUS_SIZE_INVALID;
+    }
+
+    return status;
+}
+
+static
+void
+_UtSListBenchmark(
+    _In_        DWORD           NumberOfThreads
+    )
+{
+    std::vector<UT_LOCK_FREE_ELEM> elems = _UtLockFreeCreateElems(NumberOfThreads);
+    CL_SLIST_HEADER head;
+    PCL_SLIST_HEADER pHead = &head;
+    std::vector<PUT_LOCK_FREE_ELEM> stack;
+    std::mutex stackLock;
+
+    ClInitializeInterlockedSListHead(pHead);
+
+    // a push followed by a pop for each element
+    double slistTime = _UtLockFreeMeasure(NumberOfThreads, [&](DWORD Thread) {
+        for (DWORD i = 0; i < UT_LOCK_FREE_ELEMS_PER_THREAD; ++i)
+        {
+            ClInterlockedPushEntrySList(pHead, &elems[Thread * UT_LOCK_FREE_ELEMS_PER_THREAD + i].Entry);
+            ClInterlockedPopEntrySList(pHead);
+        } });
+
+    double mutexTime = _UtLockFreeMeasure(NumberOfThreads, [&](DWORD Thread) {
+        for (DWORD i = 0; i < UT_LOCK_FREE_ELEMS_PER_THREAD; ++i)
+        {
+            {
+                std::lock_guard<std::mutex> guard(stackLock);
+                stack.push_back(&elems[Thread * UT_LOCK_FREE_ELEMS_PER_THREAD + i]);
+            }
+            {
+                std::lock_guard<std::mutex> guard(stackLock);
+                stack.pop_back();
+            }
+        } });
+
+    LOG("[slist] %u threads: interlocked %7.2f mutex %7.2f ns per push + pop\n",
+        NumberOfThreads, slistTime, mutexTime);
+}
+
+static
+void
+_UtMpscQueueBenchmark(
+    _In_        DWORD           NumberOfProducers
+    )
+{
+    std::vector<UT_LOCK_FREE_ELEM> elems = _UtLockFreeCreateElems(NumberOfProducers);
+    std::deque<PUT_LOCK_FREE_ELEM> deque;
+    std::mutex dequeLock;
+    MPSC_QUEUE queue;
+
+    MpscQueueInit(&queue);
+
+    // thread 0 is the consumer, the others are producers
+    double queueTime = _UtLockFreeMeasure(NumberOfProducers + 1, [&](DWORD Thread) {
+        if (Thread == 0)
+        {
+            for (QWORD received = 0; received < elems.size(); )
+            {
+                if (MpscQueuePop(&queue) != nullptr) received++;
+            }
+            return;
+        }
+
+        for (DWORD i = 0; i < UT_LOCK_FREE_ELEMS_PER_THREAD; ++i)
+        {
+            MpscQueuePush(&queue, &elems[(Thread - 1) * UT_LOCK_FREE_ELEMS_PER_THREAD + i].Entry);
+        } });
+
+    double mutexTime = _UtLockFreeMeasure(NumberOfProducers + 1, [&](DWORD Thread) {
+        if (Thread == 0)
+        {
+            for (QWORD received = 0; received < elems.size(); )
+            {
+                std::lock_guard<std::mutex> guard(dequeLock);
+
+                if (!deque.empty())
+                {
+                    deque.pop_front();
+                    received++;
+                }
+            }
+            return;
+        }
+
+        for (DWORD i = 0; i < UT_LOCK_FREE_ELEMS_PER_THREAD; ++i)
+        {
+            std::lock_guard<std::mutex> guard(dequeLock);
+            deque.push_back(&elems[(Thread - 1) * UT_LOCK_FREE_ELEMS_PER_THREAD + i]);
+        } });
+
+    LOG("[mpsc ] %u producers: queue %7.2f mutex %7.2f ns per element\n",
+        NumberOfProducers, queueTime, mutexTime);
+}
+
+STATUS
+UtClLockFree(
+    void
+    )
+{
+    STATUS status = CL_STATUS_SUCCESS;
+
+    for (const auto& numberOfThreads : THREAD_COUNTS)
+    {
+        status = _UtSListValidate(numberOfThreads);
+        if (!SUCCEEDED(status))
+        {
+            LOG_FUNC_ERROR("_UtSListValidate", status);
+            break;
+        }
+
+        status = _UtMpscQueueValidate(numberOfThreads);
+        if (!SUCCEEDED(status))
+        {
+            LOG_FUNC_ERROR("_UtMpscQueueValidate", status);
+            break;
+        }
+
+        _UtSListBenchmark(numberOfThreads);
+        _UtMpscQueueBenchmark(numberOfThreads);
+    }
+
+    return status;
+}
@@ -0,0 +1,456 @@
+#include "ut_base.h"
+#include "ut_cl_memory.h"
+#include "cl_memory.h"
+#include "ut_cl_rng.h"
+#include <intrin.h>
+#include <chrono>
+#include <vector>
+
+// Large enough for the biggest benchmarked block plus the offsets used to
+// misalign the buffers
+static constexpr DWORD UT_MEMORY_BUFFER_SIZE = 256 * 1024;
+static constexpr DWORD UT_MEMORY_MAX_OFFSET = 64;
+
+static constexpr DWORD UT_MEMORY_VALIDATION_ROUNDS = 10'000;
+static constexpr DWORD UT_MEMORY_MAX_VALIDATION_SIZE = 8 * 1024;
+
+// Each measurement processes roughly this many bytes
+static constexpr QWORD UT_MEMORY_BYTES_PER_MEASUREMENT = 256 * 1024 * 1024;
+
+static const DWORD BENCHMARK_SIZES[] =
+{
+    8, 16, 64, 256, 1024, 4096, 64 * 1024
+};
+
+// The last size is larger than the caches, bypassing them matters the most
+// when the working set of the running code is also competing for them
+static const DWORD BENCHMARK_PAGE_SIZES[] =
+{
+    PAGE_SIZE, 16 * PAGE_SIZE, 4096 * PAGE_SIZE
+};
+
+typedef struct _UT_MEMORY_FEATURE_SET
+{
+    const char*                 Name;
+    DWORD                       Features;
+} UT_MEMORY_FEATURE_SET;
+
+static const UT_MEMORY_FEATURE_SET FEATURE_SETS[] =
+{
+    {"none", 0},
+    {"erms", CL_MEMORY_FEATURE_ERMS},
+    {"sse2", CL_MEMORY_FEATURE_SSE2},
+    {"sse2+erms", CL_MEMORY_FEATURE_SSE2 | CL_MEMORY_FEATURE_ERMS},
+    {"avx2+erms", CL_MEMORY_FEATURE_AVX2 | CL_MEMORY_FEATURE_SSE2 | CL_MEMORY_FEATURE_ERMS},
+};
+
+// The byte at a time implementations the routines used to have, they are
+// the reference for both the validation and the benchmark
+static
+void
+_UtMemsetLegacy(
+    _Out_writes_bytes_all_(Size)    PVOID       Address,
+    _In_                            BYTE        Value,
+    _In_                            DWORD       Size
+    )
+{
+    for (DWORD i = 0; i < Size; ++i)
+    {
+        ((PBYTE)Address)[i] = Value;
+    }
+}
+
+static
+void
+_UtMemmoveLegacy(
+    _Out_writes_bytes_all_(Count)   PVOID       Destination,
+    _In_reads_bytes_(Count)         const void* Source,
+    _In_                            QWORD       Count
+    )
+{
+    for (QWORD i = 0; i < Count; ++i)
+    {
+        ((PBYTE)Destination)[i] = ((const BYTE*)Source)[i];
+    }
+}
+
+static
+int
+_UtMemcmpLegacy(
+    _In_reads_bytes_(Size)          const void* Ptr1,
+    _In_reads_bytes_(Size)          const void* Ptr2,
+    _In_                            DWORD       Size
+    )
+{
+    const BYTE* p1 = (const BYTE*)Ptr1;
+    const BYTE* p2 = (const BYTE*)Ptr2;
+
+    for (DWORD i = 0; i < Size; ++i)
+    {
+        if (p1[i] != p2[i])
+        {
+            return p1[i] - p2[i];
+        }
+    }
+
+    return 0;
+}
+
+static
+int
+_UtMemscanLegacy(
+    _In_reads_bytes_(Size)          const void* Buffer,
+    _In_                            DWORD       Size,
+    _In_                            BYTE        Value
+    )
+{
+    const BYTE* pData = (const BYTE*)Buffer;
+    DWORD i;
+
+    for (i = 0; i < Size; ++i)
+    {
+        if (pData[i] != Value)
+        {
+            return i;
+        }
+    }
+
+    return i;
+}
+
+DWORD
+UtClMemoryGetHostFeatures()
+{
+    int cpuInfo[4];
+    DWORD features = 0;
+
+    // structured extended features: EBX[5] = AVX2, EBX[9] = ERMS
+    __cpuidex(cpuInfo, 7, 0);
+
+    const DWORD extendedFeatures = (DWORD)cpuInfo[1];
+
+    if (IsBooleanFlagOn(extendedFeatures, (DWORD)1 << 9))
+    {
+        features |= CL_MEMORY_FEATURE_ERMS;
+    }
+
+    // x64 always has SSE2 and the host OS always saves the XMM state
+    features |= CL_MEMORY_FEATURE_SSE2;
+
+    // basic features: ECX[20] = SSE4.2
+    __cpuid(cpuInfo, 1);
+
+    if (IsBooleanFlagOn((DWORD)cpuInfo[2], (DWORD)1 << 20))
+    {
+        features |= CL_MEMORY_FEATURE_SSE42;
+    }
+
+    // the YMM state must be enabled by the OS: ECX[27] = OSXSAVE, XCR0[2:1]
+
+    if (IsBooleanFlagOn(extendedFeatures, (DWORD)1 << 5)
+        && IsBooleanFlagOn((DWORD)cpuInfo[2], (DWORD)1 << 27)
+        && IsBooleanFlagOn(_xgetbv(0), 0x6ULL))
+    {
+        features |= CL_MEMORY_FEATURE_AVX2;
+    }
+
+    return features;
+}
+
+static
+void
+_UtMemoryFillRandom(
+    _Out_writes_bytes_all_(Size)    PBYTE       Buffer,
+    _In_                            DWORD       Size
+    )
+{
+    UtCl::RNG& rng = UtCl::RNG::GetInstance();
+
+    for (DWORD i = 0; i < Size; ++i)
+    {
+        Buffer[i] = (BYTE)rng.GetNextRandom();
+    }
+}
+
+static
+STATUS
+_UtMemoryValidate(
+    _In_        const UT_MEMORY_FEATURE_SET&    FeatureSet
+    )
+{
+    UtCl::RNG& rng = UtCl::RNG::GetInstance();
+    std::vector<BYTE> actual(UT_MEMORY_BUFFER_SIZE);
+    std::vector<BYTE> expected(UT_MEMORY_BUFFER_SIZE);
+
+    for (DWORD round = 0; round < UT_MEMORY_VALIDATION_ROUNDS; ++round)
+    {
+        DWORD size = rng.GetNextRandom() % UT_MEMORY_MAX_VALIDATION_SIZE;
+        DWORD dstOffset = rng.GetNextRandom() % UT_MEMORY_MAX_OFFSET;
+        DWORD srcOffset = rng.GetNextRandom() % (2 * UT_MEMORY_MAX_VALIDATION_SIZE);
+        BYTE value = (BYTE)rng.GetNextRandom();
+        int result;
+        int expectedResult;
+
+        _UtMemoryFillRandom(actual.data(), UT_MEMORY_BUFFER_SIZE);
+        cl_memcpy(expected.data(), actual.data(), UT_MEMORY_BUFFER_SIZE);
+
+        PBYTE pActual = actual.data() + dstOffset;
+        PBYTE pExpected = expected.data() + dstOffset;
+
+        switch (round % 5)
+        {
+        case 0:
+            cl_memset(pActual, value, size);
+            _UtMemsetLegacy(pExpected, value, size);
+            break;
+        case 1:
+            // the destination may start inside or before the source
+            cl_memmove(pActual + srcOffset, pActual, size);
+            memmove(pExpected + srcOffset, pExpected, size);
+
+            cl_memmove(pActual, pActual + srcOffset / 2, size);
+            memmove(pExpected, pExpected + srcOffset / 2, size);
+            break;
+        case 2:
+            cl_memcpy(pActual, pActual + 2 * UT_MEMORY_MAX_VALIDATION_SIZE, size);
+            _UtMemmoveLegacy(pExpected, pExpected + 2 * UT_MEMORY_MAX_VALIDATION_SIZE, size);
+            break;
+        case 3:
+            cl_memcpy(pExpected, pActual, size);
+            if (size != 0 && (round & 1) != 0)
+            {
+                pExpected[rng.GetNextRandom() % size] ^= (BYTE)(1 + rng.GetNextRandom() % MAX_BYTE);
+            }
+
+            result = cl_memcmp(pActual, pExpected, size);
+            expectedResult = _UtMemcmpLegacy(pActual, pExpected, size);
+            if (result != expectedResult)
+            {
+                LOG_ERROR("[%s] memcmp of %u bytes returned %d instead of %d\n",
+                          FeatureSet.Name, size, result, expectedResult);
+                return CL_STATUS_VALUE_MISMATCH;
+            }
+
+            cl_memcpy(pExpected, pActual, size);
+            break;
+        default:
+            cl_memset(pActual, value, size);
+            if (size != 0 && (round & 1) != 0)
+            {
+                pActual[rng.GetNextRandom() % size] ^= 1;
+            }
+
+            result = cl_memscan(pActual, size, value);
+            expectedResult = _UtMemscanLegacy(pActual, size, value);
+            if (result != expectedResult)
+            {
+                LOG_ERROR("[%s] memscan of %u bytes returned %d instead of %d\n",
+                          FeatureSet.Name, size, result, expectedResult);
+                return CL_STATUS_VALUE_MISMATCH;
+            }
+
+            _UtMemmoveLegacy(pExpected, pActual, size);
+            break;
+        }
+
+        if (memcmp(actual.data(), expected.data(), UT_MEMORY_BUFFER_SIZE) != 0)
+        {
+            LOG_ERROR("[%s] operation %u on %u bytes produced different contents\n",
+                      FeatureSet.Name, round % 5, size);
+            return CL_STATUS_VALUE_MISMATCH;
+        }
+    }
+
+    return CL_STATUS_SUCCESS;
+}
+
+static
+PBYTE
+_UtMemoryPageAlign(
+    _In_        std::vector<BYTE>&  Buffer
+    )
+{
+    return (PBYTE)AlignAddressUpper(Buffer.data(), PAGE_SIZE);
+}
+
+static
+STATUS
+_UtMemoryValidatePages(
+    _In_        const UT_MEMORY_FEATURE_SET&    FeatureSet
+    )
+{
+    static constexpr DWORD NO_OF_PAGES = 8;
+
+    std::vector<BYTE> buffer((2 * NO_OF_PAGES + 1) * PAGE_SIZE);
+    std::vector<BYTE> expected(NO_OF_PAGES * PAGE_SIZE);
+    PBYTE pFirst = _UtMemoryPageAlign(buffer);
+    PBYTE pSecond = pFirst + NO_OF_PAGES * PAGE_SIZE;
+
+    for (DWORD noOfPages = 1; noOfPages <= NO_OF_PAGES; ++noOfPages)
+    {
+        DWORD size = noOfPages * PAGE_SIZE;
+
+        _UtMemoryFillRandom(pFirst, 2 * NO_OF_PAGES * PAGE_SIZE);
+        cl_memcpy(expected.data(), pSecond, NO_OF_PAGES * PAGE_SIZE);
+        _UtMemmoveLegacy(expected.data(), pFirst, size);
+
+        cl_pagecopy(pSecond, pFirst, size);
+        if (memcmp(pSecond, expected.data(), NO_OF_PAGES * PAGE_SIZE) != 0)
+        {
+            LOG_ERROR("[%s] pagecopy of %u pages produced different contents\n", FeatureSet.Name, noOfPages);
+            return CL_STATUS_VALUE_MISMATCH;
+        }
+
+        _UtMemsetLegacy(expected.data(), 0, size);
+
+        cl_pagezero(pSecond, size);
+        if (memcmp(pSecond, expected.data(), NO_OF_PAGES * PAGE_SIZE) != 0)
+        {
+            LOG_ERROR("[%s] pagezero of %u pages produced different contents\n", FeatureSet.Name, noOfPages);
+            return CL_STATUS_VALUE_MISMATCH;
+        }
+    }
+
+    return CL_STATUS_SUCCESS;
+}
+
+template<typename Func>
+static
+double
+_UtMemoryMeasure(
+    _In_        DWORD               Size,
+    _In_        Func                Operation
+    )
+{
+    QWORD iterations = UT_MEMORY_BYTES_PER_MEASUREMENT / Size;
+
+    auto start = std::chrono::high_resolution_clock::now();
+
+    for (QWORD i = 0; i < iterations; ++i)
+    {
+        Operation();
+    }
+
+    auto end = std::chrono::high_resolution_clock::now();
+
+    // GB/s
+    return (double)(iterations * Size) / std::chrono::duration<double, std::nano>(end - start).count();
+}
+
+static
+void
+_UtMemoryBenchmark(
+    _In_        const char*         Name
+    )
+{
+    std::vector<BYTE> buffer(UT_MEMORY_BUFFER_SIZE);
+    PBYTE pFirst = buffer.data() + 1;
+    PBYTE pSecond = buffer.data() + UT_MEMORY_BUFFER_SIZE / 2 + 3;
+    volatile int sink = 0;
+
+    for (const auto& size : BENCHMARK_SIZES)
+    {
+        double memsetRate = _UtMemoryMeasure(size, [&]() { cl_memset(pFirst, 0x5A, size); });
+        double memcpyRate = _UtMemoryMeasure(size, [&]() { cl_memcpy(pFirst, pSecond, size); });
+        double memmoveRate = _UtMemoryMeasure(size, [&]() { cl_memmove(pFirst + 8, pFirst, size); });
+
+        cl_memcpy(pSecond, pFirst, size);
+        double memcmpRate = _UtMemoryMeasure(size, [&]() { sink += cl_memcmp(pFirst, pSecond, size); });
+
+        cl_memset(pFirst, 0, size);
+        double memscanRate = _UtMemoryMeasure(size, [&]() { sink += cl_memscan(pFirst, size, 0); });
+
+        LOG("[%-10s] %6u bytes: memset %6.2f memcpy %6.2f memmove %6.2f memcmp %6.2f memscan %6.2f GB/s\n",
+            Name, size, memsetRate, memcpyRate, memmoveRate, memcmpRate, memscanRate);
+    }
+}
+
+// The rates of the non-temporal routines compared with memset and memcpy on
+// the same blocks, used to choose where the page routines are worth using
+static
+void
+_UtMemoryBenchmarkPages(
+    _In_        const char*         Name
+    )
+{
+    std::vector<BYTE> buffer((2 * BENCHMARK_PAGE_SIZES[ARRAYSIZE(BENCHMARK_PAGE_SIZES) - 1]) + PAGE_SIZE);
+    PBYTE pFirst = _UtMemoryPageAlign(buffer);
+    PBYTE pSecond = pFirst + BENCHMARK_PAGE_SIZES[ARRAYSIZE(BENCHMARK_PAGE_SIZES) - 1];
+
+    for (const auto& size : BENCHMARK_PAGE_SIZES)
+    {
+        double memsetRate = _UtMemoryMeasure(size, [&]() { cl_memset(pFirst, 0, size); });
+        double pagezeroRate = _UtMemoryMeasure(size, [&]() { cl_pagezero(pFirst, size); });
+        double memcpyRate = _UtMemoryMeasure(size, [&]() { cl_memcpy(pFirst, pSecond, size); });
+        double pagecopyRate = _UtMemoryMeasure(size, [&]() { cl_pagecopy(pFirst, pSecond, size); });
+
+        LOG("[%-10s] %8u bytes: memset %6.2f pagezero %6.2f memcpy %6.2f pagecopy %6.2f GB/s\n",
+            Name, size, memsetRate, pagezeroRate, memcpyRate, pagecopyRate);
+    }
+}
+
+static
+void
+_UtMemoryBenchmarkLegacy()
+{
+    std::vector<BYTE> buffer(UT_MEMORY_BUFFER_SIZE);
+    PBYTE pFirst = buffer.data() + 1;
+    PBYTE pSecond = buffer.data() + UT_MEMORY_BUFFER_SIZE / 2 + 3;
+    volatile int sink = 0;
+
+    for (const auto& size : BENCHMARK_SIZES)
+    {
+        double memsetRate = _UtMemoryMeasure(size, [&]() { _UtMemsetLegacy(pFirst, 0x5A, size); });
+        double memcpyRate = _UtMemoryMeasure(size, [&]() { _UtMemmoveLegacy(pFirst, pSecond, size); });
+        double memmoveRate = _UtMemoryMeasure(size, [&]() { _UtMemmoveLegacy(pFirst + 8, pFirst, size); });
+
+        _UtMemmoveLegacy(pSecond, pFirst, size);
+        double memcmpRate = _UtMemoryMeasure(size, [&]() { sink += _UtMemcmpLegacy(pFirst, pSecond, size); });
+
+        _UtMemsetLegacy(pFirst, 0, size);
+        double memscanRate = _UtMemoryMeasure(size, [&]() { sink += _UtMemscanLegacy(pFirst, size, 0); });
+
+        LOG("[%-10s] %6u bytes: memset %6.2f memcpy %6.2f memmove %6.2f memcmp %6.2f memscan %6.2f GB/s\n",
+            "legacy", size, memsetRate, memcpyRate, memmoveRate, memcmpRate, memscanRate);
+    }
+}
+
+STATUS
+UtClMemory()
+{
+    STATUS status = CL_STATUS_SUCCESS;
+    DWORD hostFeatures = UtClMemoryGetHostFeatures();
+    DWORD previousFeatures = MemoryGetCpuFeatures();
+
+    LOG("Host supports memory features 0x%x\n", hostFeatures);
+
+    _UtMemoryBenchmarkLegacy();
+
+    for (const auto& featureSet : FEATURE_SETS)
+    {
+        if (!IsBooleanFlagOn(hostFeatures, featureSet.Features)) continue;
+
+        MemorySetCpuFeatures(featureSet.Features);
+
+        status = _UtMemoryValidate(featureSet);
+        if (!SUCCEEDED(status))
+        {
+            LOG_FUNC_ERROR("_UtMemoryValidate", status);
+            break;
+        }
+
+        status = _UtMemoryValidatePages(featureSet);
+        if (!SUCCEEDED(status))
+        {
+            LOG_FUNC_ERROR("_UtMemoryValidatePages", status);
+            break;
+        }
+
+        _UtMemoryBenchmark(featureSet.Name);
+        _UtMemoryBenchmarkPages(featureSet.Name);
+    }
+
+    MemorySetCpuFeatures(previousFeatures);
+
+    return status;
+}
@@ -0,0 +1,299 @@
+#include "ut_base.h"
+#include "ut_cl_string_scan.h"
+#include "ut_cl_memory.h"
+#include "ut_cl_rng.h"
+#include "strutils.h"
+#include <chrono>
+#include <vector>
+
+// The strings are placed right before the end of a page so the validation
+// also covers the blocks loaded around the page boundary
+static constexpr DWORD UT_STRING_PAGES = 4;
+static constexpr DWORD UT_STRING_MAX_LENGTH = 300;
+
+static constexpr DWORD UT_STRING_VALIDATION_ROUNDS = 50'000;
+
+// Each measurement processes roughly this many characters
+static constexpr QWORD UT_STRING_CHARS_PER_MEASUREMENT = 64 * 1024 * 1024;
+
+static const DWORD BENCHMARK_LENGTHS[] =
+{
+    8, 32, 100, 260
+};
+
+// Few distinct characters so the compared strings have long common prefixes,
+// includes characters which differ only in case and bytes with the MSB set
+static const char STRING_ALPHABET[] = "aAzZ\\/. @`[{\x80\xFF";
+
+typedef struct _UT_STRING_FEATURE_SET
+{
+    const char*                 Name;
+    DWORD                       Features;
+} UT_STRING_FEATURE_SET;
+
+static const UT_STRING_FEATURE_SET FEATURE_SETS[] =
+{
+    {"none", 0},
+    {"sse2", CL_MEMORY_FEATURE_SSE2},
+    {"sse4.2", CL_MEMORY_FEATURE_SSE2 | CL_MEMORY_FEATURE_SSE42},
+};
+
+// The byte at a time implementations the routines used to have
+static
+int
+_UtStringCompareLegacy(
+    _In_z_      const char*     String1,
+    _In_z_      const char*     String2,
+    _In_        bool            IgnoreCase
+    )
+{
+    DWORD i = 0;
+
+    while ('\0' != String1[i] && '\0' != String2[i])
+    {
+        char c1 = IgnoreCase ? tolower(String1[i]) : String1[i];
+        char c2 = IgnoreCase ? tolower(String2[i]) : String2[i];
+
+        if (c1 != c2)
+        {
+            return c1 > c2 ? 1 : -1;
+        }
+
+        ++i;
+    }
+
+    if ('\0' != String1[i])
+    {
+        return 1;
+    }
+
+    return '\0' != String2[i] ? -1 : 0;
+}
+
+static
+const char*
+_UtStringFindLegacy(
+    _In_z_      const char*     String,
+    _In_        char            Value,
+    _In_        bool            Last
+    )
+{
+    const char* pResult = String;
+
+    for (DWORD i = 0; '\0' != String[i]; ++i)
+    {
+        if (String[i] == Value)
+        {
+            if (!Last)
+            {
+                return String + i;
+            }
+
+            pResult = String + i;
+        }
+    }
+
+    return pResult;
+}
+
+static
+DWORD
+_UtStringLengthLegacy(
+    _In_z_      const char*     String
+    )
+{
+    DWORD i = 0;
+
+    while ('\0' != String[i])
+    {
+        ++i;
+    }
+
+    return i;
+}
+
+static
+void
+_UtStringFillRandom(
+    _Out_writes_z_(Length + 1)  char*       String,
+    _In_                        DWORD       Length
+    )
+{
+    UtCl::RNG& rng = UtCl::RNG::GetInstance();
+
+    for (DWORD i = 0; i < Length; ++i)
+    {
+        String[i] = STRING_ALPHABET[rng.GetNextRandom() % (ARRAYSIZE(STRING_ALPHABET) - 1)];
+    }
+
+    String[Length] = '\0';
+}
+
+static
+char*
+_UtStringPageEnd(
+    _In_        std::vector<char>&  Buffer,
+    _In_        DWORD               Page
+    )
+{
+    return (char*)AlignAddressUpper(Buffer.data(), PAGE_SIZE) + (Page + 1) * PAGE_SIZE;
+}
+
+static
+STATUS
+_UtStringValidate(
+    _In_        const UT_STRING_FEATURE_SET&    FeatureSet
+    )
+{
+    UtCl::RNG& rng = UtCl::RNG::GetInstance();
+    std::vector<char> buffer((UT_STRING_PAGES + 1) * PAGE_SIZE);
+
+    for (DWORD round = 0; round < UT_STRING_VALIDATION_ROUNDS; ++round)
+    {
+        DWORD length1 = rng.GetNextRandom() % UT_STRING_MAX_LENGTH;
+        DWORD length2 = rng.GetNextRandom() % UT_STRING_MAX_LENGTH;
+
+        // the first string ends exactly at the end of a page or a few bytes
+        // before it, the second one starts anywhere in another page
+        char* str1 = _UtStringPageEnd(buffer, 0) - length1 - 1 - rng.GetNextRandom() % 3;
+        char* str2 = _UtStringPageEnd(buffer, 2) - length2 - 1 - rng.GetNextRandom() % PAGE_SIZE;
+        char value = STRING_ALPHABET[rng.GetNextRandom() % (ARRAYSIZE(STRING_ALPHABET) - 1)];
+
+        _UtStringFillRandom(str1, length1);
+        _UtStringFillRandom(str2, length2);
+
+        // most of the times the second string starts with the first one
+        if (rng.GetNextRandom() % 4 != 0)
+        {
+            DWORD common = rng.GetNextRandom() % (min(length1, length2) + 1);
+
+            cl_memcpy(str2, str1, common);
+        }
+
+        for (const bool ignoreCase : { false, true })
+        {
+            int result = ignoreCase ? cl_stricmp(str1, str2) : cl_strcmp(str1, str2);
+            int expected = _UtStringCompareLegacy(str1, str2, ignoreCase);
+
+            if (result != expected)
+            {
+                LOG_ERROR("[%s] %s of strings of %u and %u characters returned %d instead of %d\n",
+                          FeatureSet.Name, ignoreCase ? "stricmp" : "strcmp", length1, length2, result, expected);
+                return CL_STATUS_VALUE_MISMATCH;
+            }
+        }
+
+        if (cl_strlen(str1) != _UtStringLengthLegacy(str1))
+        {
+            LOG_ERROR("[%s] strlen returned %u instead of %u\n",
+                      FeatureSet.Name, cl_strlen(str1), _UtStringLengthLegacy(str1));
+            return CL_STATUS_VALUE_MISMATCH;
+        }
+
+        if (cl_strchr(str1, value) != _UtStringFindLegacy(str1, value, false)
+            || cl_strrchr(str1, value) != _UtStringFindLegacy(str1, value, true))
+        {
+            LOG_ERROR("[%s] strchr/strrchr of 0x%02x in a string of %u characters returned a different result\n",
+                      FeatureSet.Name, (BYTE)value, length1);
+            return CL_STATUS_VALUE_MISMATCH;
+        }
+    }
+
+    return CL_STATUS_SUCCESS;
+}
+
+template<typename Func>
+static
+double
+_UtStringMeasure(
+    _In_        DWORD               Length,
+    _In_        Func                Operation
+    )
+{
+    QWORD iterations = UT_STRING_CHARS_PER_MEASUREMENT / Length;
+
+    auto start = std::chrono::high_resolution_clock::now();
+
+    for (QWORD i = 0; i < iterations; ++i)
+    {
+        Operation();
+    }
+
+    auto end = std::chrono::high_resolution_clock::now();
+
+    // ns per call
+    return std::chrono::duration<double, std::nano>(end - start).count() / iterations;
+}
+
+static
+void
+_UtStringBenchmark(
+    _In_        const char*         Name,
+    _In_        bool                Legacy
+    )
+{
+    std::vector<char> buffer(2 * (UT_STRING_MAX_LENGTH + 1) + 1);
+
+    // paths usually do not start at an aligned address
+    char* str1 = buffer.data() + 1;
+    char* str2 = str1 + UT_STRING_MAX_LENGTH + 1;
+    volatile QWORD sink = 0;
+
+    for (const auto& length : BENCHMARK_LENGTHS)
+    {
+        // a path which has a backslash every 8 characters, the second string
+        // only differs in case
+        for (DWORD i = 0; i < length; ++i)
+        {
+            str1[i] = (i % 8 == 7) ? '\\' : (char)('a' + i % 26);
+            str2[i] = (i % 8 == 7) ? '\\' : (char)('A' + i % 26);
+        }
+        str1[length] = str2[length] = '\0';
+
+        double strlenTime = _UtStringMeasure(length, [&]() {
+            sink += Legacy ? _UtStringLengthLegacy(str1) : cl_strlen(str1); });
+        double strchrTime = _UtStringMeasure(length, [&]() {
+            sink += (QWORD)(Legacy ? _UtStringFindLegacy(str1, '.', false) : cl_strchr(str1, '.')); });
+        double strrchrTime = _UtStringMeasure(length, [&]() {
+            sink += (QWORD)(Legacy ? _UtStringFindLegacy(str1, '\\', true) : cl_strrchr(str1, '\\')); });
+        double strcmpTime = _UtStringMeasure(length, [&]() {
+            sink += Legacy ? _UtStringCompareLegacy(str1, str1, false) : cl_strcmp(str1, str1); });
+        double stricmpTime = _UtStringMeasure(length, [&]() {
+            sink += Legacy ? _UtStringCompareLegacy(str1, str2, true) : cl_stricmp(str1, str2); });
+
+        LOG("[%-6s] %3u chars: strlen %7.2f strchr %7.2f strrchr %7.2f strcmp %7.2f stricmp %7.2f ns\n",
+            Name, length, strlenTime, strchrTime, strrchrTime, strcmpTime, stricmpTime);
+    }
+}
+
+STATUS
+UtClStringScan(
+    void
+    )
+{
+    STATUS status = CL_STATUS_SUCCESS;
+    DWORD hostFeatures = UtClMemoryGetHostFeatures();
+    DWORD previousFeatures = MemoryGetCpuFeatures();
+
+    _UtStringBenchmark("legacy", true);
+
+    for (const auto& featureSet : FEATURE_SETS)
+    {
+        if (!IsBooleanFlagOn(hostFeatures, featureSet.Features)) continue;
+
+        MemorySetCpuFeatures(featureSet.Features);
+
+        status = _UtStringValidate(featureSet);
+        if (!SUCCEEDED(status))
+        {
+            LOG_FUNC_ERROR("_UtStringValidate", status);
+            break;
+        }
+
+        _UtStringBenchmark(featureSet.Name, false);
+    }
+
+    MemorySetCpuFeatures(previousFeatures);
+
+    return status;
+}
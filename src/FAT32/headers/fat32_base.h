@@ -4,4 +4,6 @@
 #include "io.h"
 #include "log.h"
 #include "fat_structures.h"
+#include "fat_cache.h"
+#include "fat_extent_map.h"
 #include "ex.h"
\ No newline at end of file
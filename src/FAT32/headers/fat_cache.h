@@ -0,0 +1,106 @@
+#pragma once
+
+#include "bitmap.h"
+
+// Maximum number of sectors read or written with a single request when the
+// FAT is loaded or flushed
+#define FAT_CACHE_MAX_SECTORS_PER_TRANSFER      128
+
+// In-memory copy of the active FAT, loaded when the volume is mounted.
+// Modified entries only mark their FAT sector as dirty, the dirty sectors
+// are written back to the disk (to all the FAT copies if mirroring is enabled)
+// by FatCacheFlush. A bitmap of the free clusters is kept up to date with the
+// entries, so free clusters are found without walking the FAT.
+typedef struct _FAT_CACHE
+{
+    PDEVICE_OBJECT      VolumeDevice;
+
+    // the entries of the whole FAT, indexed by cluster number
+    FAT32_ENTRY*        Entries;
+
+    // number of entries which describe actual clusters, including the
+    // 2 reserved ones
+    DWORD               NumberOfEntries;
+
+    DWORD               BytesPerSector;
+
+    DWORD               FirstFatSector;             // Sector where the first FAT starts
+    DWORD               SectorsPerFat;
+
+    DWORD               NumberOfFats;
+    DWORD               ActiveFat;                  // FAT from which the cache was loaded
+
+    // if FALSE the sectors are written back only to the active FAT
+    BOOLEAN             Mirroring;
+
+    // a bit for each sector of the FAT
+    BITMAP              DirtySectors;
+
+    // a bit for each entry, set if the cluster is free
+    BITMAP              FreeClusters;
+    DWORD               FreeClusterCount;
+
+    // cluster from which the search for free clusters starts
+    DWORD               NextFreeCluster;
+
+    // 0 if the volume has no valid FSInfo sector
+    DWORD               FsInfoSector;
+
+    // the free count and next free cluster are written back on flush
+    FSINFO              FsInfo;
+    BOOLEAN             FsInfoDirty;
+} FAT_CACHE, *PFAT_CACHE;
+
+STATUS
+FatCacheInit(
+    OUT     PFAT_CACHE      FatCache,
+    IN      PDEVICE_OBJECT  VolumeDevice,
+    IN      PFAT_BPB        Bpb,
+    IN      DWORD           CountOfClusters
+    );
+
+void
+FatCacheUninit(
+    INOUT   PFAT_CACHE      FatCache
+    );
+
+// Returns the value of the FAT entry of Cluster, without the 4 reserved bits
+DWORD
+FatCacheGetEntry(
+    IN      PFAT_CACHE      FatCache,
+    IN      QWORD           Cluster
+    );
+
+// Changes the value of the FAT entry of Cluster, the 4 reserved bits of the
+// entry are preserved
+void
+FatCacheSetEntry(
+    INOUT   PFAT_CACHE      FatCache,
+    IN      QWORD           Cluster,
+    IN      DWORD           Value
+    );
+
+// Returns the number of free clusters on the volume
+DWORD
+FatCacheGetFreeClusterCount(
+    IN      PFAT_CACHE      FatCache
+    );
+
+// Reserves Count consecutive free clusters, the search starts at
+// PreferredCluster or at the next free cluster hint if PreferredCluster is 0
+// and wraps around the end of the FAT. The reserved clusters are linked
+// together and the last one is marked as the end of the chain.
+// Returns STATUS_DISK_FULL if there is no such run of free clusters.
+STATUS
+FatCacheAllocateClusterRun(
+    INOUT   PFAT_CACHE      FatCache,
+    IN      QWORD           PreferredCluster,
+    IN      DWORD           Count,
+    OUT     QWORD*          FirstCluster
+    );
+
+// Writes all the dirty sectors and the FSInfo sector back to the disk
+STATUS
+FatCacheFlush(
+    INOUT   PFAT_CACHE      FatCache
+    );
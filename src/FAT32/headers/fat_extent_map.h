@@ -0,0 +1,64 @@
+#pragma once
+
+// Number of extents for which space is allocated when the first extent is added
+#define FAT_EXTENT_MAP_MIN_CAPACITY             8
+
+// Run of clusters of a file which are also contiguous on the volume
+typedef struct _FAT_EXTENT
+{
+    // index of the first cluster of the run in the file
+    DWORD               FileCluster;
+
+    // volume cluster where the run starts
+    DWORD               FirstCluster;
+
+    DWORD               ClusterCount;
+} FAT_EXTENT, *PFAT_EXTENT;
+
+// Cluster chain of an open file, described as a sorted array of extents.
+// The chain is walked only once: the extents are built while the file is
+// accessed and each walk continues from the last cluster already mapped,
+// so clusters appended to the chain are mapped the next time they are needed.
+// A file cluster is then found with a binary search over the extents.
+typedef struct _FAT_EXTENT_MAP
+{
+    // first cluster of the file
+    DWORD               FirstCluster;
+
+    PFAT_EXTENT         Extents;
+    DWORD               NumberOfExtents;
+    DWORD               Capacity;
+} FAT_EXTENT_MAP, *PFAT_EXTENT_MAP;
+
+void
+FatExtentMapInit(
+    OUT     PFAT_EXTENT_MAP ExtentMap,
+    IN      QWORD           FirstCluster
+    );
+
+void
+FatExtentMapUninit(
+    INOUT   PFAT_EXTENT_MAP ExtentMap
+    );
+
+// Returns in Cluster the volume cluster holding the FileCluster-th cluster of
+// the file or 0 if the cluster chain is shorter than that. ContiguousClusters
+// receives the number of clusters, starting with Cluster, which follow each
+// other on the volume, as far as the chain has been mapped.
+STATUS
+FatExtentMapLookup(
+    INOUT   PFAT_EXTENT_MAP ExtentMap,
+    INOUT   PFAT_CACHE      FatCache,
+    IN      DWORD           FileCluster,
+    OUT     QWORD*          Cluster,
+    OUT_OPT DWORD*          ContiguousClusters
+    );
+
+// Returns the last cluster of the chain and the number of clusters in it
+STATUS
+FatExtentMapGetLastCluster(
+    INOUT   PFAT_EXTENT_MAP ExtentMap,
+    INOUT   PFAT_CACHE      FatCache,
+    OUT     QWORD*          LastCluster,
+    OUT     DWORD*          NumberOfClusters
+    );
@@ -1,5 +1,14 @@
 #pragma once
 
+// Maximum number of sectors read or written with a single request by
+// FatReadFile and FatWriteFile, the ATA driver fails larger requests
+#define FAT_MAX_SECTORS_PER_TRANSFER            MAX_WORD
+
+// Maximum number of bytes transferred with a single asynchronous request,
+// the ATA driver describes a DMA transfer with at most a page of PRD entries
+// and a buffer of this size needs at most half of them
+#define FAT_MAX_BYTES_PER_ASYNC_TRANSFER        (1 * MB_SIZE)
+
 // Structure containing information about the
 // FAT32 partition
 typedef struct _FAT_DATA
@@ -19,12 +28,15 @@ typedef struct _FAT_DATA
     DWORD               EntriesPerSector;           // Directory entries / sector
 
     DWORD               AllocationSize;
+
+    FAT_CACHE           FatCache;
 } FAT_DATA, *PFAT_DATA;
 
  typedef
 STATUS
 (__cdecl FUNC_FatReadWriteFile)(
     IN      PFAT_DATA   FatData,
+    INOUT   PFAT_EXTENT_MAP ExtentMap,
     IN      QWORD       BaseFileSector,
     IN      QWORD       SectorOffset,
     IN      QWORD       DirEntrySector,
@@ -65,6 +77,7 @@ FatSearchDirectoryEntry(
 STATUS
 FatReadFile(
     IN      PFAT_DATA   FatData,
+    INOUT   PFAT_EXTENT_MAP ExtentMap,
     IN      QWORD       BaseFileSector,
     IN      QWORD       SectorOffset,
     IN      QWORD       DirEntrySector,
@@ -77,6 +90,7 @@ FatReadFile(
 STATUS
 FatWriteFile(
     IN      PFAT_DATA   FatData,
+    INOUT   PFAT_EXTENT_MAP ExtentMap,
     IN      QWORD       BaseFileSector,
     IN      QWORD       SectorOffset,
     IN      QWORD       DirEntrySector,
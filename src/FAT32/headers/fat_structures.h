@@ -95,6 +95,17 @@
 
 #define        FAT32_UNKNOWN                0xFFFFFFFF
 
+// FSInfo signatures
+#define        FSI_LEAD_SIGNATURE           0x41615252
+#define        FSI_STRUC_SIGNATURE          0x61417272
+#define        FSI_TRAIL_SIGNATURE          0xAA550000
+
+// BPB_ExtFlags: number of the active FAT, only valid if mirroring is disabled
+#define        FAT32_EXT_FLAGS_ACTIVE_FAT_MASK  0x000F
+
+// BPB_ExtFlags: if set only the active FAT is updated
+#define        FAT32_EXT_FLAGS_NO_MIRRORING     0x0080
+
 // Maximum number of clusters per FAT type
 #define        FAT12_MAX_CLUSTERS           4085
 #define        FAT16_MAX_CLUSTERS           65525
@@ -199,6 +210,7 @@ typedef struct _FSINFO
     BYTE            FSI_Reserved2[12];
     DWORD           FSI_TrailSig;
 } FSINFO, *PFSINFO;
+STATIC_ASSERT(sizeof(FSINFO) == SECTOR_SIZE);
 
 // Found in sector 0 of the partition
 typedef struct _FAT_BPB
@@ -5,7 +5,7 @@ NextSectorInClusterChain(
     IN      PFAT_DATA       FatData,
     IN      QWORD           CurrentSector,
     OUT     QWORD*          NextSector,
-    IN      BOOLEAN         ExtendChain
+    IN      DWORD           ExtendChainClusters     // 0 if the chain must not be extended
 );
 
 STATUS
@@ -15,6 +15,16 @@ NextClusterInChain(
     OUT     QWORD*          Result
 );
 
+// Reserves a chain of ClusterCount clusters, contiguous if possible,
+// starting the search from PreferredCluster
+STATUS
+AllocateClusterChain(
+    IN      PFAT_DATA       FatData,
+    IN      QWORD           PreferredCluster,
+    IN      DWORD           ClusterCount,
+    OUT     QWORD*          FirstCluster
+);
+
 STATUS
 FirstSectorOfCluster(
     IN      PFAT_DATA   FatData,
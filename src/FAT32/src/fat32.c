@@ -1,6 +1,7 @@
 #include "fat32_base.h"
 #include "fat32.h"
 #include "fat_operations.h"
+#include "fat_utils.h"
 
 FUNC_DriverDispatch     _FatDispatchCreate;
 FUNC_DriverDispatch     _FatDispatchClose;
@@ -16,6 +17,9 @@ typedef struct _FCB
     QWORD               ParentOffsetInVolume;
 
     FILE_INFORMATION    FileInformation;
+
+    // runs of contiguous clusters of the file, built as the file is accessed
+    FAT_EXTENT_MAP      ExtentMap;
 } FCB, *PFCB;
 
 STATUS
@@ -186,6 +190,7 @@ STATUS
     BOOLEAN createOperation;
     PFCB pFcb;
     QWORD parentSector;
+    QWORD fileCluster;
 
     LOG_FUNC_START;
 
@@ -201,6 +206,7 @@ STATUS
     createOperation = FALSE;
     pFcb = NULL;
     parentSector = 0;
+    fileCluster = 0;
 
     pStackLocation = IoGetCurrentIrpStackLocation(Irp);
     ASSERT(IRP_MJ_CREATE == pStackLocation->MajorFunction);
@@ -241,6 +247,13 @@ STATUS
             __leave;
         }
 
+        status = ClusterOfSector(pFatData, fileSector, &fileCluster);
+        if (!SUCCEEDED(status))
+        {
+            LOG_FUNC_ERROR("ClusterOfSector", status);
+            __leave;
+        }
+
         // create FCB
         pFcb = ExAllocatePoolWithTag(PoolAllocateZeroMemory, sizeof(FCB), HEAP_FS_TAG, 0);
         if (NULL == pFcb)
@@ -252,6 +265,7 @@ STATUS
         pFcb->FileOffsetInVolume = fileSector;
         pFcb->ParentOffsetInVolume = parentSector;
         memcpy(&pFcb->FileInformation, &fileInformation, sizeof(FILE_INFORMATION));
+        FatExtentMapInit(&pFcb->ExtentMap, fileCluster);
 
         pStackLocation->FileObject->FileSize = fileInformation.FileSize;
         pStackLocation->FileObject->FsContext2 = pFcb;
@@ -278,6 +292,7 @@ STATUS
     STATUS status;
     PIO_STACK_LOCATION pStackLocation;
     PFCB pFcb;
+    PFAT_DATA pFatData;
 
     LOG_FUNC_START;
 
@@ -291,12 +306,24 @@ STATUS
 
     ASSERT(IRP_MJ_CLOSE == pStackLocation->MajorFunction);
 
+    pFatData = IoGetDeviceExtension(DeviceObject);
+    ASSERT(NULL != pFatData);
+
+    // the FAT sectors modified while the file was used are written back to the
+    // disk only when a file is closed, there is no unmount operation
+    status = FatCacheFlush(&pFatData->FatCache);
+    if (!SUCCEEDED(status))
+    {
+        LOG_FUNC_ERROR("FatCacheFlush", status);
+    }
+
     ASSERT(NULL != pStackLocation->FileObject);
     pFcb = pStackLocation->FileObject->FsContext2;
 
     ASSERT(NULL != pFcb);
 
     // as part of the close we need to free the FCB
+    FatExtentMapUninit(&pFcb->ExtentMap);
     ExFreePoolWithTag(pFcb, HEAP_FS_TAG);
     pFcb = NULL;
     pStackLocation->FileObject->FsContext2 = NULL;
@@ -364,6 +391,7 @@ STATUS
 
         status = FatReadWriteFunc(
             pFatData,
+            &pFcb->ExtentMap,
             (DWORD)pFcb->FileOffsetInVolume,
             (DWORD)(pStackLocation->Parameters.ReadWrite.Offset / pFatData->BytesPerSector),
             pFcb->ParentOffsetInVolume,
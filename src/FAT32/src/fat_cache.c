@@ -0,0 +1,458 @@
+#include "fat32_base.h"
+#include "fat_cache.h"
+
+static
+STATUS
+_FatCacheReadFsInfo(
+    INOUT   PFAT_CACHE      FatCache,
+    IN      DWORD           FsInfoSector
+    );
+
+STATUS
+FatCacheInit(
+    OUT     PFAT_CACHE      FatCache,
+    IN      PDEVICE_OBJECT  VolumeDevice,
+    IN      PFAT_BPB        Bpb,
+    IN      DWORD           CountOfClusters
+    )
+{
+    STATUS status;
+    QWORD fatSizeInBytes;
+    DWORD bitmapSize;
+    PBYTE pBitmapBuffer;
+    QWORD firstSectorToRead;
+    DWORD sectorsToRead;
+    QWORD bytesToRead;
+    DWORD i;
+
+    ASSERT(NULL != FatCache);
+    ASSERT(NULL != VolumeDevice);
+    ASSERT(NULL != Bpb);
+
+    memzero(FatCache, sizeof(FAT_CACHE));
+
+    status = STATUS_SUCCESS;
+    pBitmapBuffer = NULL;
+
+    FatCache->VolumeDevice = VolumeDevice;
+    FatCache->BytesPerSector = Bpb->BPB_BytsPerSec;
+    FatCache->FirstFatSector = Bpb->BPB_RsvdSecCnt;
+    FatCache->SectorsPerFat = Bpb->DiffOffset.FAT32_BPB.BPB_FATSz32;
+    FatCache->NumberOfFats = Bpb->BPB_NumFATs;
+    FatCache->Mirroring = !IsBooleanFlagOn(Bpb->DiffOffset.FAT32_BPB.BPB_ExtFlags, FAT32_EXT_FLAGS_NO_MIRRORING);
+
+    // fatgen103.pdf: the active FAT is relevant only if mirroring is disabled
+    FatCache->ActiveFat = FatCache->Mirroring ? 0 : (Bpb->DiffOffset.FAT32_BPB.BPB_ExtFlags & FAT32_EXT_FLAGS_ACTIVE_FAT_MASK);
+
+    LOG_TRACE_FILESYSTEM("Sectors per FAT: 0x%X\n", FatCache->SectorsPerFat);
+    LOG_TRACE_FILESYSTEM("Active FAT: %u, mirroring: %u\n", FatCache->ActiveFat, FatCache->Mirroring);
+
+    if (0 == FatCache->SectorsPerFat || FatCache->ActiveFat >= FatCache->NumberOfFats)
+    {
+        LOG_ERROR("Invalid FAT layout\n");
+        return STATUS_DEVICE_FILESYSTEM_UNSUPPORTED;
+    }
+
+    fatSizeInBytes = (QWORD)FatCache->SectorsPerFat * FatCache->BytesPerSector;
+    if (fatSizeInBytes > MAX_DWORD)
+    {
+        LOG_ERROR("FAT size 0x%X is too large to be cached\n", fatSizeInBytes);
+        return STATUS_DEVICE_FILESYSTEM_UNSUPPORTED;
+    }
+
+    // the sectors at the end of the FAT may not describe any cluster
+    FatCache->NumberOfEntries = (DWORD)min(CountOfClusters + 2, fatSizeInBytes / sizeof(FAT32_ENTRY));
+    FatCache->NextFreeCluster = 2;
+
+    __try
+    {
+        FatCache->Entries = ExAllocatePoolWithTag(0, (DWORD)fatSizeInBytes, HEAP_FS_TAG, 0);
+        if (NULL == FatCache->Entries)
+        {
+            status = STATUS_HEAP_NO_MORE_MEMORY;
+            LOG_FUNC_ERROR_ALLOC("ExAllocatePoolWithTag", fatSizeInBytes);
+            __leave;
+        }
+
+        bitmapSize = BitmapPreinit(&FatCache->DirtySectors, FatCache->SectorsPerFat);
+
+        pBitmapBuffer = ExAllocatePoolWithTag(0, bitmapSize, HEAP_FS_TAG, 0);
+        if (NULL == pBitmapBuffer)
+        {
+            status = STATUS_HEAP_NO_MORE_MEMORY;
+            LOG_FUNC_ERROR_ALLOC("ExAllocatePoolWithTag", bitmapSize);
+            __leave;
+        }
+
+        BitmapInit(&FatCache->DirtySectors, pBitmapBuffer);
+        pBitmapBuffer = NULL;
+
+        firstSectorToRead = FatCache->FirstFatSector + (QWORD)FatCache->ActiveFat * FatCache->SectorsPerFat;
+
+        for (i = 0; i < FatCache->SectorsPerFat; i += sectorsToRead)
+        {
+            sectorsToRead = min(FatCache->SectorsPerFat - i, FAT_CACHE_MAX_SECTORS_PER_TRANSFER);
+            bytesToRead = (QWORD)sectorsToRead * FatCache->BytesPerSector;
+
+            status = IoReadDevice(
+                VolumeDevice,
+                (PBYTE)FatCache->Entries + (QWORD)i * FatCache->BytesPerSector,
+                &bytesToRead,
+                (firstSectorToRead + i) * FatCache->BytesPerSector
+            );
+            if (!SUCCEEDED(status))
+            {
+                LOG_FUNC_ERROR("IoReadDevice", status);
+                __leave;
+            }
+            ASSERT(bytesToRead == (QWORD)sectorsToRead * FatCache->BytesPerSector);
+        }
+
+        bitmapSize = BitmapPreinit(&FatCache->FreeClusters, FatCache->NumberOfEntries);
+
+        pBitmapBuffer = ExAllocatePoolWithTag(0, bitmapSize, HEAP_FS_TAG, 0);
+        if (NULL == pBitmapBuffer)
+        {
+            status = STATUS_HEAP_NO_MORE_MEMORY;
+            LOG_FUNC_ERROR_ALLOC("ExAllocatePoolWithTag", bitmapSize);
+            __leave;
+        }
+
+        BitmapInit(&FatCache->FreeClusters, pBitmapBuffer);
+        pBitmapBuffer = NULL;
+
+        // the first 2 entries are reserved, they never describe a free cluster
+        for (i = 2; i < FatCache->NumberOfEntries; ++i)
+        {
+            if (0 == (FatCache->Entries[i] & FAT32_CLUSTER_MASK))
+            {
+                BitmapSetBit(&FatCache->FreeClusters, i);
+                FatCache->FreeClusterCount++;
+            }
+        }
+
+        LOG_TRACE_FILESYSTEM("Free clusters: %u\n", FatCache->FreeClusterCount);
+
+        status = _FatCacheReadFsInfo(FatCache, Bpb->DiffOffset.FAT32_BPB.BPB_FSInfo);
+        if (!SUCCEEDED(status))
+        {
+            LOG_FUNC_ERROR("_FatCacheReadFsInfo", status);
+            __leave;
+        }
+    }
+    __finally
+    {
+        if (!SUCCEEDED(status))
+        {
+            FatCacheUninit(FatCache);
+        }
+    }
+
+    return status;
+}
+
+void
+FatCacheUninit(
+    INOUT   PFAT_CACHE      FatCache
+    )
+{
+    ASSERT(NULL != FatCache);
+
+    if (NULL != FatCache->DirtySectors.BitmapBuffer)
+    {
+        ExFreePoolWithTag(FatCache->DirtySectors.BitmapBuffer, HEAP_FS_TAG);
+        BitmapUninit(&FatCache->DirtySectors);
+    }
+
+    if (NULL != FatCache->FreeClusters.BitmapBuffer)
+    {
+        ExFreePoolWithTag(FatCache->FreeClusters.BitmapBuffer, HEAP_FS_TAG);
+        BitmapUninit(&FatCache->FreeClusters);
+    }
+
+    if (NULL != FatCache->Entries)
+    {
+        ExFreePoolWithTag(FatCache->Entries, HEAP_FS_TAG);
+        FatCache->Entries = NULL;
+    }
+}
+
+DWORD
+FatCacheGetEntry(
+    IN      PFAT_CACHE      FatCache,
+    IN      QWORD           Cluster
+    )
+{
+    ASSERT(NULL != FatCache);
+    ASSERT(Cluster < FatCache->NumberOfEntries);
+
+    return FatCache->Entries[Cluster] & FAT32_CLUSTER_MASK;
+}
+
+void
+FatCacheSetEntry(
+    INOUT   PFAT_CACHE      FatCache,
+    IN      QWORD           Cluster,
+    IN      DWORD           Value
+    )
+{
+    BOOLEAN wasFree;
+
+    ASSERT(NULL != FatCache);
+    ASSERT(2 <= Cluster && Cluster < FatCache->NumberOfEntries);
+    ASSERT(0 == (Value & ~FAT32_CLUSTER_MASK));
+
+    wasFree = 0 == (FatCache->Entries[Cluster] & FAT32_CLUSTER_MASK);
+
+    FatCache->Entries[Cluster] &= ~FAT32_CLUSTER_MASK;    // we need to preserve the 4 reserved bits
+    FatCache->Entries[Cluster] |= Value;
+
+    BitmapSetBit(&FatCache->DirtySectors, (DWORD)(Cluster * sizeof(FAT32_ENTRY) / FatCache->BytesPerSector));
+
+    if (wasFree != (0 == Value))
+    {
+        BitmapSetBitValue(&FatCache->FreeClusters, (DWORD)Cluster, 0 == Value);
+
+        if (wasFree)
+        {
+            ASSERT(0 != FatCache->FreeClusterCount);
+            FatCache->FreeClusterCount--;
+        }
+        else
+        {
+            FatCache->FreeClusterCount++;
+        }
+
+        FatCache->FsInfo.FSI_Free_Count = FatCache->FreeClusterCount;
+        FatCache->FsInfoDirty = TRUE;
+    }
+}
+
+DWORD
+FatCacheGetFreeClusterCount(
+    IN      PFAT_CACHE      FatCache
+    )
+{
+    ASSERT(NULL != FatCache);
+
+    return FatCache->FreeClusterCount;
+}
+
+STATUS
+FatCacheAllocateClusterRun(
+    INOUT   PFAT_CACHE      FatCache,
+    IN      QWORD           PreferredCluster,
+    IN      DWORD           Count,
+    OUT     QWORD*          FirstCluster
+    )
+{
+    DWORD startCluster;
+    DWORD firstCluster;
+    DWORD lastCluster;
+    DWORD i;
+
+    ASSERT(NULL != FatCache);
+    ASSERT(0 != Count);
+    ASSERT(NULL != FirstCluster);
+
+    *FirstCluster = 0;
+
+    if (Count > FatCache->FreeClusterCount)
+    {
+        return STATUS_DISK_FULL;
+    }
+
+    startCluster = (2 <= PreferredCluster && PreferredCluster < FatCache->NumberOfEntries)
+        ? (DWORD)PreferredCluster
+        : FatCache->NextFreeCluster;
+    ASSERT(2 <= startCluster && startCluster < FatCache->NumberOfEntries);
+
+    firstCluster = BitmapScanFrom(&FatCache->FreeClusters, startCluster, Count, TRUE);
+    if (MAX_DWORD == firstCluster)
+    {
+        // wrap around, the run may end right before the cluster from which
+        // the first search started
+        firstCluster = BitmapScanFromTo(&FatCache->FreeClusters,
+                                        2,
+                                        min(startCluster + Count - 1, FatCache->NumberOfEntries),
+                                        Count,
+                                        TRUE);
+        if (MAX_DWORD == firstCluster)
+        {
+            return STATUS_DISK_FULL;
+        }
+    }
+
+    lastCluster = firstCluster + Count - 1;
+
+    LOG_TRACE_FILESYSTEM("Allocated clusters [0x%x, 0x%x]\n", firstCluster, lastCluster);
+
+    for (i = firstCluster; i < lastCluster; ++i)
+    {
+        FatCacheSetEntry(FatCache, i, i + 1);
+    }
+    FatCacheSetEntry(FatCache, lastCluster, FAT32_EOC_MARK);
+
+    FatCache->NextFreeCluster = (lastCluster + 1 < FatCache->NumberOfEntries) ? lastCluster + 1 : 2;
+
+    // fatgen103.pdf:
+    // Typically this value is set to the last cluster number that the driver allocated.
+    FatCache->FsInfo.FSI_Nxt_Free = lastCluster;
+    FatCache->FsInfoDirty = TRUE;
+
+    *FirstCluster = firstCluster;
+
+    return STATUS_SUCCESS;
+}
+
+STATUS
+FatCacheFlush(
+    INOUT   PFAT_CACHE      FatCache
+    )
+{
+    STATUS status;
+    DWORD sector;
+    DWORD sectorCount;
+    DWORD fat;
+    QWORD bytesToWrite;
+
+    ASSERT(NULL != FatCache);
+
+    status = STATUS_SUCCESS;
+    sector = 0;
+
+    while (sector < FatCache->SectorsPerFat)
+    {
+        sector = BitmapScanFrom(&FatCache->DirtySectors, sector, 1, TRUE);
+        if (MAX_DWORD == sector)
+        {
+            // no more dirty sectors
+            break;
+        }
+
+        // consecutive dirty sectors are written with a single request
+        sectorCount = 1;
+        while (sector + sectorCount < FatCache->SectorsPerFat &&
+               sectorCount < FAT_CACHE_MAX_SECTORS_PER_TRANSFER &&
+               BitmapGetBitValue(&FatCache->DirtySectors, sector + sectorCount))
+        {
+            sectorCount++;
+        }
+
+        LOG_TRACE_FILESYSTEM("Will flush [0x%x] FAT sectors starting from [0x%x]\n", sectorCount, sector);
+
+        for (fat = 0; fat < FatCache->NumberOfFats; ++fat)
+        {
+            if (!FatCache->Mirroring && fat != FatCache->ActiveFat)
+            {
+                continue;
+            }
+
+            bytesToWrite = (QWORD)sectorCount * FatCache->BytesPerSector;
+
+            status = IoWriteDevice(
+                FatCache->VolumeDevice,
+                (PBYTE)FatCache->Entries + (QWORD)sector * FatCache->BytesPerSector,
+                &bytesToWrite,
+                (FatCache->FirstFatSector + (QWORD)fat * FatCache->SectorsPerFat + sector) * FatCache->BytesPerSector
+            );
+            if (!SUCCEEDED(status))
+            {
+                // the sectors remain dirty and will be written by the next flush
+                LOG_FUNC_ERROR("IoWriteDevice", status);
+                return status;
+            }
+            ASSERT(bytesToWrite == (QWORD)sectorCount * FatCache->BytesPerSector);
+        }
+
+        BitmapClearBits(&FatCache->DirtySectors, sector, sectorCount);
+
+        sector = sector + sectorCount;
+    }
+
+    if (FatCache->FsInfoDirty && 0 != FatCache->FsInfoSector)
+    {
+        bytesToWrite = sizeof(FSINFO);
+
+        status = IoWriteDevice(
+            FatCache->VolumeDevice,
+            &FatCache->FsInfo,
+            &bytesToWrite,
+            (QWORD)FatCache->FsInfoSector * FatCache->BytesPerSector
+        );
+        if (!SUCCEEDED(status))
+        {
+            LOG_FUNC_ERROR("IoWriteDevice", status);
+            return status;
+        }
+        ASSERT(bytesToWrite == sizeof(FSINFO));
+
+        FatCache->FsInfoDirty = FALSE;
+    }
+
+    return status;
+}
+
+static
+STATUS
+_FatCacheReadFsInfo(
+    INOUT   PFAT_CACHE      FatCache,
+    IN      DWORD           FsInfoSector
+    )
+{
+    STATUS status;
+    QWORD bytesToRead;
+
+    ASSERT(NULL != FatCache);
+
+    // the FSInfo structure is placed in the reserved region
+    if (0 == FsInfoSector || FsInfoSector >= FatCache->FirstFatSector)
+    {
+        LOG_WARNING("Volume has no FSInfo sector\n");
+        return STATUS_SUCCESS;
+    }
+
+    bytesToRead = sizeof(FSINFO);
+
+    status = IoReadDevice(
+        FatCache->VolumeDevice,
+        &FatCache->FsInfo,
+        &bytesToRead,
+        (QWORD)FsInfoSector * FatCache->BytesPerSector
+    );
+    if (!SUCCEEDED(status))
+    {
+        LOG_FUNC_ERROR("IoReadDevice", status);
+        return status;
+    }
+    ASSERT(bytesToRead == sizeof(FSINFO));
+
+    if (FSI_LEAD_SIGNATURE != FatCache->FsInfo.FSI_LeadSig ||
+        FSI_STRUC_SIGNATURE != FatCache->FsInfo.FSI_StrucSig ||
+        FSI_TRAIL_SIGNATURE != FatCache->FsInfo.FSI_TrailSig)
+    {
+        LOG_WARNING("FSInfo sector 0x%x is not valid\n", FsInfoSector);
+        return STATUS_SUCCESS;
+    }
+
+    FatCache->FsInfoSector = FsInfoSector;
+
+    // the count computed from the FAT is always right, the one stored may be
+    // FAT32_UNKNOWN or stale if the volume was not unmounted cleanly
+    if (FatCache->FsInfo.FSI_Free_Count != FatCache->FreeClusterCount)
+    {
+        LOG_TRACE_FILESYSTEM("FSI_Free_Count 0x%x updated to 0x%x\n",
+                             FatCache->FsInfo.FSI_Free_Count, FatCache->FreeClusterCount);
+
+        FatCache->FsInfo.FSI_Free_Count = FatCache->FreeClusterCount;
+        FatCache->FsInfoDirty = TRUE;
+    }
+
+    // FSI_Nxt_Free is only a hint, FAT32_UNKNOWN means it is not available
+    if (2 <= FatCache->FsInfo.FSI_Nxt_Free && FatCache->FsInfo.FSI_Nxt_Free < FatCache->NumberOfEntries)
+    {
+        FatCache->NextFreeCluster = FatCache->FsInfo.FSI_Nxt_Free;
+    }
+
+    return STATUS_SUCCESS;
+}
@@ -0,0 +1,286 @@
+#include "fat32_base.h"
+#include "fat_extent_map.h"
+
+static
+STATUS
+_FatExtentMapAddCluster(
+    INOUT   PFAT_EXTENT_MAP ExtentMap,
+    IN      DWORD           Cluster
+    );
+
+static
+STATUS
+_FatExtentMapWalk(
+    INOUT   PFAT_EXTENT_MAP ExtentMap,
+    INOUT   PFAT_CACHE      FatCache,
+    IN      DWORD           FileCluster
+    );
+
+void
+FatExtentMapInit(
+    OUT     PFAT_EXTENT_MAP ExtentMap,
+    IN      QWORD           FirstCluster
+    )
+{
+    ASSERT(NULL != ExtentMap);
+    ASSERT(FirstCluster <= MAX_DWORD);
+
+    memzero(ExtentMap, sizeof(FAT_EXTENT_MAP));
+
+    ExtentMap->FirstCluster = (DWORD)FirstCluster;
+}
+
+void
+FatExtentMapUninit(
+    INOUT   PFAT_EXTENT_MAP ExtentMap
+    )
+{
+    ASSERT(NULL != ExtentMap);
+
+    if (NULL != ExtentMap->Extents)
+    {
+        ExFreePoolWithTag(ExtentMap->Extents, HEAP_FS_TAG);
+        ExtentMap->Extents = NULL;
+    }
+
+    ExtentMap->NumberOfExtents = 0;
+    ExtentMap->Capacity = 0;
+}
+
+STATUS
+FatExtentMapLookup(
+    INOUT   PFAT_EXTENT_MAP ExtentMap,
+    INOUT   PFAT_CACHE      FatCache,
+    IN      DWORD           FileCluster,
+    OUT     QWORD*          Cluster,
+    OUT_OPT DWORD*          ContiguousClusters
+    )
+{
+    STATUS status;
+    PFAT_EXTENT pExtent;
+    DWORD left;
+    DWORD right;
+    DWORD middle;
+
+    ASSERT(NULL != ExtentMap);
+    ASSERT(NULL != FatCache);
+    ASSERT(NULL != Cluster);
+
+    *Cluster = 0;
+    if (NULL != ContiguousClusters)
+    {
+        *ContiguousClusters = 0;
+    }
+
+    status = _FatExtentMapWalk(ExtentMap, FatCache, FileCluster);
+    if (!SUCCEEDED(status))
+    {
+        LOG_FUNC_ERROR("_FatExtentMapWalk", status);
+        return status;
+    }
+
+    pExtent = &ExtentMap->Extents[ExtentMap->NumberOfExtents - 1];
+    if (FileCluster >= pExtent->FileCluster + pExtent->ClusterCount)
+    {
+        // the cluster chain ends before FileCluster
+        return STATUS_SUCCESS;
+    }
+
+    // search for the last extent which starts at or before FileCluster
+    left = 0;
+    right = ExtentMap->NumberOfExtents - 1;
+
+    while (left < right)
+    {
+        middle = left + (right - left + 1) / 2;
+
+        if (ExtentMap->Extents[middle].FileCluster <= FileCluster)
+        {
+            left = middle;
+        }
+        else
+        {
+            right = middle - 1;
+        }
+    }
+
+    pExtent = &ExtentMap->Extents[left];
+    ASSERT(pExtent->FileCluster <= FileCluster && FileCluster < pExtent->FileCluster + pExtent->ClusterCount);
+
+    *Cluster = pExtent->FirstCluster + (FileCluster - pExtent->FileCluster);
+
+    if (NULL != ContiguousClusters)
+    {
+        *ContiguousClusters = pExtent->FileCluster + pExtent->ClusterCount - FileCluster;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+STATUS
+FatExtentMapGetLastCluster(
+    INOUT   PFAT_EXTENT_MAP ExtentMap,
+    INOUT   PFAT_CACHE      FatCache,
+    OUT     QWORD*          LastCluster,
+    OUT     DWORD*          NumberOfClusters
+    )
+{
+    STATUS status;
+    PFAT_EXTENT pExtent;
+
+    ASSERT(NULL != ExtentMap);
+    ASSERT(NULL != FatCache);
+    ASSERT(NULL != LastCluster);
+    ASSERT(NULL != NumberOfClusters);
+
+    // no file can have MAX_DWORD clusters, the whole chain is walked
+    status = _FatExtentMapWalk(ExtentMap, FatCache, MAX_DWORD);
+    if (!SUCCEEDED(status))
+    {
+        LOG_FUNC_ERROR("_FatExtentMapWalk", status);
+        return status;
+    }
+
+    pExtent = &ExtentMap->Extents[ExtentMap->NumberOfExtents - 1];
+
+    *LastCluster = pExtent->FirstCluster + pExtent->ClusterCount - 1;
+    *NumberOfClusters = pExtent->FileCluster + pExtent->ClusterCount;
+
+    return STATUS_SUCCESS;
+}
+
+static
+STATUS
+_FatExtentMapAddCluster(
+    INOUT   PFAT_EXTENT_MAP ExtentMap,
+    IN      DWORD           Cluster
+    )
+{
+    PFAT_EXTENT pLastExtent;
+    PFAT_EXTENT pNewExtents;
+    DWORD newCapacity;
+    DWORD fileCluster;
+
+    ASSERT(NULL != ExtentMap);
+
+    pLastExtent = (0 != ExtentMap->NumberOfExtents) ? &ExtentMap->Extents[ExtentMap->NumberOfExtents - 1] : NULL;
+
+    if (NULL != pLastExtent && pLastExtent->FirstCluster + pLastExtent->ClusterCount == Cluster)
+    {
+        // the cluster continues the last run
+        pLastExtent->ClusterCount++;
+        return STATUS_SUCCESS;
+    }
+
+    fileCluster = (NULL != pLastExtent) ? pLastExtent->FileCluster + pLastExtent->ClusterCount : 0;
+
+    if (ExtentMap->NumberOfExtents == ExtentMap->Capacity)
+    {
+        newCapacity = (0 == ExtentMap->Capacity) ? FAT_EXTENT_MAP_MIN_CAPACITY : ExtentMap->Capacity * 2;
+
+        pNewExtents = ExAllocatePoolWithTag(0, sizeof(FAT_EXTENT) * newCapacity, HEAP_FS_TAG, 0);
+        if (NULL == pNewExtents)
+        {
+            LOG_FUNC_ERROR_ALLOC("ExAllocatePoolWithTag", sizeof(FAT_EXTENT) * newCapacity);
+            return STATUS_HEAP_NO_MORE_MEMORY;
+        }
+
+        if (NULL != ExtentMap->Extents)
+        {
+            memcpy(pNewExtents, ExtentMap->Extents, sizeof(FAT_EXTENT) * ExtentMap->NumberOfExtents);
+            ExFreePoolWithTag(ExtentMap->Extents, HEAP_FS_TAG);
+        }
+
+        ExtentMap->Extents = pNewExtents;
+        ExtentMap->Capacity = newCapacity;
+    }
+
+    ExtentMap->Extents[ExtentMap->NumberOfExtents].FileCluster = fileCluster;
+    ExtentMap->Extents[ExtentMap->NumberOfExtents].FirstCluster = Cluster;
+    ExtentMap->Extents[ExtentMap->NumberOfExtents].ClusterCount = 1;
+    ExtentMap->NumberOfExtents++;
+
+    return STATUS_SUCCESS;
+}
+
+// Follows the cluster chain from the last mapped cluster until FileCluster is
+// mapped or the end of the chain is reached
+static
+STATUS
+_FatExtentMapWalk(
+    INOUT   PFAT_EXTENT_MAP ExtentMap,
+    INOUT   PFAT_CACHE      FatCache,
+    IN      DWORD           FileCluster
+    )
+{
+    STATUS status;
+    PFAT_EXTENT pLastExtent;
+    DWORD lastCluster;
+    DWORD nextCluster;
+
+    ASSERT(NULL != ExtentMap);
+    ASSERT(NULL != FatCache);
+
+    status = STATUS_SUCCESS;
+
+    if (0 == ExtentMap->NumberOfExtents)
+    {
+        if (ExtentMap->FirstCluster < 2 || ExtentMap->FirstCluster >= FatCache->NumberOfEntries)
+        {
+            LOG_ERROR("Invalid first cluster 0x%x\n", ExtentMap->FirstCluster);
+            return STATUS_DEVICE_CLUSTER_INVALID;
+        }
+
+        status = _FatExtentMapAddCluster(ExtentMap, ExtentMap->FirstCluster);
+        if (!SUCCEEDED(status))
+        {
+            LOG_FUNC_ERROR("_FatExtentMapAddCluster", status);
+            return status;
+        }
+    }
+
+    for (;;)
+    {
+        pLastExtent = &ExtentMap->Extents[ExtentMap->NumberOfExtents - 1];
+        if (FileCluster < pLastExtent->FileCluster + pLastExtent->ClusterCount)
+        {
+            break;
+        }
+
+        lastCluster = pLastExtent->FirstCluster + pLastExtent->ClusterCount - 1;
+        nextCluster = FatCacheGetEntry(FatCache, lastCluster);
+
+        if (0 == nextCluster)
+        {
+            LOG_TRACE_FILESYSTEM("Found zero in cluster chain\n");
+
+            // has to be treated as EOC marker and written back, such that the
+            // cluster is not treated as a free one
+            FatCacheSetEntry(FatCache, lastCluster, FAT32_EOC_MARK);
+            break;
+        }
+
+        if (FAT32_BAD_CLUSTER <= nextCluster)
+        {
+            // end of chain, a bad cluster is never followed
+            break;
+        }
+
+        // a chain longer than the volume must contain a loop
+        if (nextCluster < 2 || nextCluster >= FatCache->NumberOfEntries ||
+            pLastExtent->FileCluster + pLastExtent->ClusterCount >= FatCache->NumberOfEntries)
+        {
+            LOG_ERROR("Invalid cluster 0x%x follows cluster 0x%x\n", nextCluster, lastCluster);
+            return STATUS_DEVICE_CLUSTER_INVALID;
+        }
+
+        status = _FatExtentMapAddCluster(ExtentMap, nextCluster);
+        if (!SUCCEEDED(status))
+        {
+            LOG_FUNC_ERROR("_FatExtentMapAddCluster", status);
+            return status;
+        }
+    }
+
+    return status;
+}
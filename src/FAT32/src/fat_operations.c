@@ -138,6 +138,15 @@ FatInitVolume(
     ASSERT_INFO(FatData->AllocationSize >= pVolumeDevice->DeviceAlignment,
         "The FAT driver does not handle issues caused by greater device alignment needed by volume devices");
 
+    // the whole FAT is kept in memory => cluster chains are followed without
+    // any disk access
+    status = FatCacheInit(&FatData->FatCache, pVolumeDevice, &bpb, FatData->CountOfClusters);
+    if (!SUCCEEDED(status))
+    {
+        LOG_FUNC_ERROR("FatCacheInit", status);
+        return status;
+    }
+
     return status;
 }
 
@@ -276,6 +285,7 @@ FatSearch(
 STATUS
 FatReadFile(
     IN      PFAT_DATA   FatData,
+    INOUT   PFAT_EXTENT_MAP ExtentMap,
     IN      QWORD       BaseFileSector,
     IN      QWORD       SectorOffset,
     IN      QWORD       DirEntrySector,
@@ -287,12 +297,16 @@ FatReadFile(
 {
     STATUS status;
     QWORD currentSector;                // the sector in which the file is
-    QWORD nextSector;
+    QWORD currentCluster;
+    QWORD fileCluster;                  // index of the current cluster in the file
+    DWORD contiguousClusters;           // clusters left in the current run
+    QWORD sectorsInRun;                 // sectors left in the current run
+    QWORD lastFileCluster;              // index of the last cluster read
     QWORD sectorsRemaining;             // how much of the file we have parsed so far
     QWORD sectorsToRead;
     QWORD bytesToRead;
+    QWORD maxSectorsPerTransfer;
     PBYTE pData;
-    QWORD sectorsTraversed;
 
     DIR_ENTRY  dirEntry = { 0 };
     QWORD dirEntryIndex = 0;
@@ -303,17 +317,22 @@ FatReadFile(
     LOG_FUNC_START;
 
     ASSERT(NULL != FatData);
+    ASSERT(NULL != ExtentMap);
     ASSERT(NULL != Buffer);
 
     ASSERT(IsAddressAligned(BaseFileSector, FatData->SectorsPerCluster));
 
     status = STATUS_SUCCESS;
-    currentSector = BaseFileSector;
-    nextSector = 0;
+    currentSector = 0;
+    currentCluster = 0;
+    fileCluster = SectorOffset / FatData->SectorsPerCluster;
+    contiguousClusters = 0;
+    sectorsInRun = 0;
+    lastFileCluster = (SectorOffset + SectorsToRead - 1) / FatData->SectorsPerCluster;
     sectorsRemaining = SectorsToRead;
-    sectorsTraversed = 0;
     sectorsToRead = 0;
     bytesToRead = 0;
+    maxSectorsPerTransfer = Asynchronous ? FAT_MAX_BYTES_PER_ASYNC_TRANSFER / FatData->BytesPerSector : FAT_MAX_SECTORS_PER_TRANSFER;
     pData = (PBYTE)Buffer;
 
     LOG_TRACE_FILESYSTEM("Base file sector: [0x%x]\n", BaseFileSector);
@@ -325,32 +344,52 @@ FatReadFile(
         return STATUS_SUCCESS;
     }
 
-    while (sectorsTraversed + FatData->SectorsPerCluster <= SectorOffset)
+    // the chain is first mapped up to the last cluster needed, so the runs
+    // found in the extent map are not cut short at the end of the mapped chain
+    status = FatExtentMapLookup(ExtentMap, &FatData->FatCache, (DWORD)lastFileCluster, &currentCluster, NULL);
+    if (!SUCCEEDED(status))
     {
-        ASSERT(SectorOffset >= FatData->SectorsPerCluster);
+        LOG_FUNC_ERROR("FatExtentMapLookup", status);
+        return status;
+    }
 
-        status = NextSectorInClusterChain(FatData, currentSector, &nextSector, FALSE);
-        if (!SUCCEEDED(status))
-        {
-            LOG_FUNC_ERROR("NextSectorInClusterChain", status);
-            return status;
-        }
+    // the cluster in which the read starts is found in the extent map,
+    // the cluster chain is not walked from the beginning of the file
+    status = FatExtentMapLookup(ExtentMap, &FatData->FatCache, (DWORD)fileCluster, &currentCluster, &contiguousClusters);
+    if (!SUCCEEDED(status))
+    {
+        LOG_FUNC_ERROR("FatExtentMapLookup", status);
+        return status;
+    }
 
-        currentSector = nextSector;
-        sectorsTraversed = sectorsTraversed + FatData->SectorsPerCluster;
+    if (0 == currentCluster)
+    {
+        // the offset is past the end of the cluster chain
+        *SectorsRead = 0;
+        return STATUS_SUCCESS;
+    }
+
+    status = FirstSectorOfCluster(FatData, currentCluster, &currentSector);
+    if (!SUCCEEDED(status))
+    {
+        LOG_FUNC_ERROR("FirstSectorOfCluster", status);
+        return status;
     }
-    ASSERT(0 != currentSector);
 
     // we modify current sector to sectorToReach because
     // we do not need to read the whole cluster
     currentSector = currentSector + (SectorOffset % FatData->SectorsPerCluster);
 
     // it is possible that the first sector to read is in the middle of a cluster
-    sectorsToRead = min(sectorsRemaining, FatData->SectorsPerCluster - (SectorOffset % FatData->SectorsPerCluster));
-    bytesToRead = sectorsToRead * FatData->BytesPerSector;
+    sectorsInRun = (QWORD)contiguousClusters * FatData->SectorsPerCluster - (SectorOffset % FatData->SectorsPerCluster);
 
     for (;;)
     {
+        // the clusters of a run are contiguous on the volume, so the whole run
+        // is read with a single request if the device allows it
+        sectorsToRead = min(min(sectorsRemaining, sectorsInRun), maxSectorsPerTransfer);
+        bytesToRead = sectorsToRead * FatData->BytesPerSector;
+
         LOG_TRACE_FILESYSTEM("Will read [0x%x] sectors starting from sector [0x%x]\n", sectorsToRead, currentSector);
 
         status = IoReadDeviceEx(
@@ -370,30 +409,44 @@ FatReadFile(
         pData = pData + bytesToRead;
 
         sectorsRemaining = sectorsRemaining - sectorsToRead;
+        sectorsInRun = sectorsInRun - sectorsToRead;
+        currentSector = currentSector + sectorsToRead;
 
         if (0 == sectorsRemaining)
         {
             break;
         }
 
-        // find next sector
-        status = NextSectorInClusterChain(FatData, currentSector, &nextSector, FALSE);
+        if (0 != sectorsInRun)
+        {
+            // the run is larger than the maximum transfer size
+            continue;
+        }
+
+        // find next run
+        fileCluster = (SectorOffset + SectorsToRead - sectorsRemaining) / FatData->SectorsPerCluster;
+
+        status = FatExtentMapLookup(ExtentMap, &FatData->FatCache, (DWORD)fileCluster, &currentCluster, &contiguousClusters);
         if (!SUCCEEDED(status))
         {
-            LOG_FUNC_ERROR("NextSectorInClusterChain", status);
+            LOG_FUNC_ERROR("FatExtentMapLookup", status);
             return status;
         }
 
-        if (0 == nextSector)
+        if (0 == currentCluster)
         {
             // reached EOC marker
             break;
         }
 
-        currentSector = nextSector;
+        status = FirstSectorOfCluster(FatData, currentCluster, &currentSector);
+        if (!SUCCEEDED(status))
+        {
+            LOG_FUNC_ERROR("FirstSectorOfCluster", status);
+            return status;
+        }
 
-        sectorsToRead = min(FatData->SectorsPerCluster, sectorsRemaining);
-        bytesToRead = sectorsToRead * FatData->BytesPerSector;
+        sectorsInRun = (QWORD)contiguousClusters * FatData->SectorsPerCluster;
     }
 
     status = GetDirEntryFromSector(FatData, DirEntrySector, BaseFileSector, &dirEntryIndex, &dirEntry);
@@ -424,6 +477,7 @@ FatReadFile(
 STATUS
 FatWriteFile(
     IN      PFAT_DATA   FatData,
+    INOUT   PFAT_EXTENT_MAP ExtentMap,
     IN      QWORD       BaseFileSector,
     IN      QWORD       SectorOffset,
     IN      QWORD       DirEntrySector,
@@ -436,11 +490,18 @@ FatWriteFile(
     STATUS status;
     QWORD currentSector;                // the sector in which the file is
     QWORD nextSector;
+    QWORD currentCluster;
+    QWORD fileCluster;                  // index of the current cluster in the file
+    DWORD contiguousClusters;           // clusters left in the current run
+    QWORD sectorsInRun;                 // sectors left in the current run
+    QWORD lastFileCluster;              // index of the last cluster written
+    QWORD lastCluster;
+    DWORD numberOfClusters;
     QWORD sectorsRemaining;             // how much of the file we have parsed so far
     QWORD sectorsToWrite;
     QWORD bytesToWrite;
+    QWORD maxSectorsPerTransfer;
     PBYTE pData;
-    QWORD sectorsTraversed;
     DIR_ENTRY  dirEntry = { 0 };
     QWORD dirEntryIndex = 0;
     DATETIME currentDateTime = { 0 };
@@ -451,17 +512,25 @@ FatWriteFile(
     LOG_FUNC_START;
 
     ASSERT(NULL != FatData);
+    ASSERT(NULL != ExtentMap);
     ASSERT(NULL != Buffer);
 
     ASSERT(IsAddressAligned(BaseFileSector, FatData->SectorsPerCluster));
 
     status = STATUS_SUCCESS;
-    currentSector = BaseFileSector;
+    currentSector = 0;
     nextSector = 0;
+    currentCluster = 0;
+    fileCluster = SectorOffset / FatData->SectorsPerCluster;
+    contiguousClusters = 0;
+    sectorsInRun = 0;
+    lastFileCluster = (SectorOffset + SectorsToWrite - 1) / FatData->SectorsPerCluster;
+    lastCluster = 0;
+    numberOfClusters = 0;
     sectorsRemaining = SectorsToWrite;
-    sectorsTraversed = 0;
     sectorsToWrite = 0;
     bytesToWrite = 0;
+    maxSectorsPerTransfer = Asynchronous ? FAT_MAX_BYTES_PER_ASYNC_TRANSFER / FatData->BytesPerSector : FAT_MAX_SECTORS_PER_TRANSFER;
     pData = (PBYTE)Buffer;
 
     LOG_TRACE_FILESYSTEM("Base file sector: [0x%x]\n", BaseFileSector);
@@ -473,32 +542,81 @@ FatWriteFile(
         return STATUS_SUCCESS;
     }
 
-    while (sectorsTraversed + FatData->SectorsPerCluster <= SectorOffset)
+    status = FatExtentMapLookup(ExtentMap, &FatData->FatCache, (DWORD)lastFileCluster, &currentCluster, NULL);
+    if (!SUCCEEDED(status))
+    {
+        LOG_FUNC_ERROR("FatExtentMapLookup", status);
+        return status;
+    }
+
+    if (0 == currentCluster)
     {
-        ASSERT(SectorOffset >= FatData->SectorsPerCluster);
+        // the write goes past the end of the cluster chain, all the clusters
+        // needed are added to the chain at once, so they may be contiguous
+        status = FatExtentMapGetLastCluster(ExtentMap, &FatData->FatCache, &lastCluster, &numberOfClusters);
+        if (!SUCCEEDED(status))
+        {
+            LOG_FUNC_ERROR("FatExtentMapGetLastCluster", status);
+            return status;
+        }
+        ASSERT(lastFileCluster >= numberOfClusters);
+
+        status = FirstSectorOfCluster(FatData, lastCluster, &currentSector);
+        if (!SUCCEEDED(status))
+        {
+            LOG_FUNC_ERROR("FirstSectorOfCluster", status);
+            return status;
+        }
 
-        status = NextSectorInClusterChain(FatData, currentSector, &nextSector, TRUE);
+        status = NextSectorInClusterChain(FatData,
+                                          currentSector,
+                                          &nextSector,
+                                          (DWORD)(lastFileCluster + 1 - numberOfClusters));
         if (!SUCCEEDED(status))
         {
             LOG_FUNC_ERROR("NextSectorInClusterChain", status);
             return status;
         }
 
-        currentSector = nextSector;
-        sectorsTraversed = sectorsTraversed + FatData->SectorsPerCluster;
+        // map the new clusters, so the runs found in the extent map include them
+        status = FatExtentMapLookup(ExtentMap, &FatData->FatCache, (DWORD)lastFileCluster, &currentCluster, NULL);
+        if (!SUCCEEDED(status))
+        {
+            LOG_FUNC_ERROR("FatExtentMapLookup", status);
+            return status;
+        }
+        ASSERT(0 != currentCluster);
+    }
+
+    status = FatExtentMapLookup(ExtentMap, &FatData->FatCache, (DWORD)fileCluster, &currentCluster, &contiguousClusters);
+    if (!SUCCEEDED(status))
+    {
+        LOG_FUNC_ERROR("FatExtentMapLookup", status);
+        return status;
+    }
+    ASSERT(0 != currentCluster);
+
+    status = FirstSectorOfCluster(FatData, currentCluster, &currentSector);
+    if (!SUCCEEDED(status))
+    {
+        LOG_FUNC_ERROR("FirstSectorOfCluster", status);
+        return status;
     }
-    ASSERT(0 != currentSector);
 
     // we modify current sector to sectorToReach because
     // we do not need to write to the whole cluster
     currentSector = currentSector + (SectorOffset % FatData->SectorsPerCluster);
 
     // it is possible that the first sector to write to is in the middle of a cluster
-    sectorsToWrite = min(sectorsRemaining, FatData->SectorsPerCluster - (SectorOffset % FatData->SectorsPerCluster));
-    bytesToWrite = sectorsToWrite * FatData->BytesPerSector;
+    sectorsInRun = (QWORD)contiguousClusters * FatData->SectorsPerCluster - (SectorOffset % FatData->SectorsPerCluster);
 
     for (;;)
     {
+        // the clusters of a run are contiguous on the volume, so the whole run
+        // is written with a single request if the device allows it
+        sectorsToWrite = min(min(sectorsRemaining, sectorsInRun), maxSectorsPerTransfer);
+        bytesToWrite = sectorsToWrite * FatData->BytesPerSector;
+
         LOG_TRACE_FILESYSTEM("Will write [0x%x] sectors starting from sector [0x%x]\n", sectorsToWrite, currentSector);
 
         status = IoWriteDeviceEx(
@@ -518,24 +636,39 @@ FatWriteFile(
         pData = pData + bytesToWrite;
 
         sectorsRemaining = sectorsRemaining - sectorsToWrite;
+        sectorsInRun = sectorsInRun - sectorsToWrite;
+        currentSector = currentSector + sectorsToWrite;
 
         if (0 == sectorsRemaining)
         {
             break;
         }
 
-        // find next sector, extend chain if necessary
-        status = NextSectorInClusterChain(FatData, currentSector, &nextSector, TRUE);
+        if (0 != sectorsInRun)
+        {
+            // the run is larger than the maximum transfer size
+            continue;
+        }
+
+        // find next run, the chain was already extended
+        fileCluster = (SectorOffset + SectorsToWrite - sectorsRemaining) / FatData->SectorsPerCluster;
+
+        status = FatExtentMapLookup(ExtentMap, &FatData->FatCache, (DWORD)fileCluster, &currentCluster, &contiguousClusters);
         if (!SUCCEEDED(status))
         {
-            LOG_FUNC_ERROR("NextSectorInClusterChain", status);
+            LOG_FUNC_ERROR("FatExtentMapLookup", status);
             return status;
         }
+        ASSERT(0 != currentCluster);
 
-        currentSector = nextSector;
+        status = FirstSectorOfCluster(FatData, currentCluster, &currentSector);
+        if (!SUCCEEDED(status))
+        {
+            LOG_FUNC_ERROR("FirstSectorOfCluster", status);
+            return status;
+        }
 
-        sectorsToWrite = min(FatData->SectorsPerCluster, sectorsRemaining);
-        bytesToWrite = sectorsToWrite * FatData->BytesPerSector;
+        sectorsInRun = (QWORD)contiguousClusters * FatData->SectorsPerCluster;
     }
 
     status = GetDirEntryFromSector(FatData, DirEntrySector, BaseFileSector, &dirEntryIndex, &dirEntry);
@@ -629,7 +762,7 @@ FatSearchDirectoryEntry(
                     pEntry = NULL;
 
                     // we go to the next sector we need to parse
-                    status = NextSectorInClusterChain(FatData, sectorToParse, &sectorToParse, FALSE);
+                    status = NextSectorInClusterChain(FatData, sectorToParse, &sectorToParse, 0);
                     if (!SUCCEEDED(status))
                     {
                         // something bad happened :(
@@ -828,15 +961,11 @@ FatCreateDirectoryEntry(
     QWORD sectorAllocated;
     DWORD index = 0;                // index of the DIR_ENTRY in the current cluster
     DIR_ENTRY* pEntry = NULL;        // pointer to DIR_ENTRY vector
-    FSINFO* pFSinfo = NULL;            // pointer to FSInfo
     BOOLEAN found;                    // found = 1 if we find free space in last cluster in chain
-    BYTE* pFAT = NULL;                // pointer to FAT
     DATETIME crtDateTime;            // date time read from CMOS
     FATTIME fatTime;                    // time converted for FAT representation
     FATDATE fatDate;                    // date converted for FAT representation
 
-    QWORD fatEntrySector;            // used for calculating the sector to read for the FAT entry
-    DWORD fatEntryOffset;            // offset in the FAT sector read
     QWORD parentDirEntrySector;
     QWORD bytesToRead;
 
@@ -1009,51 +1138,18 @@ FatCreateDirectoryEntry(
         // use memcpy because we don't want NULL terminator afterwards
         memcpy((char*)pEntry[index].DIR_Name, newEntryName, SHORT_NAME_CHARS);
 
-        // we search for the cluster we can use to allocate for the new entry
-        if (NULL == pFSinfo)
-        {
-            bytesToRead = FatData->BytesPerSector;
-
-            ASSERT(bytesToRead <= MAX_DWORD);
-
-            pFSinfo = (FSINFO*)ExAllocatePoolWithTag(PoolAllocateZeroMemory, (DWORD)bytesToRead, HEAP_TEMP_TAG, 0);
-            if (NULL == pFSinfo)
-            {
-                status = STATUS_HEAP_NO_MORE_MEMORY;
-                LOG_FUNC_ERROR_ALLOC("HeapAllocatePoolWithTag", bytesToRead);
-                __leave;
-            }
-
-            status = IoReadDevice(FatData->VolumeDevice,
-                pFSinfo,
-                &bytesToRead,
-                1 * FatData->BytesPerSector
-            );
-            if (!SUCCEEDED(status))
-            {
-                LOG_FUNC_ERROR("IoReadDevice", status);
-                __leave;
-            }
-            ASSERT(bytesToRead == FatData->BytesPerSector);
-        }
-
-        if (0 == pFSinfo->FSI_Free_Count)
+        // we reserve the cluster where the directory entry's data will be placed,
+        // the FSInfo free count and next free cluster are updated by the FAT cache
+        status = AllocateClusterChain(FatData, 0, 1, &currentClusterInChain);
+        if (!SUCCEEDED(status))
         {
-            // if there are no more free clusters we fail
-            status = STATUS_DISK_FULL;
+            LOG_FUNC_ERROR("AllocateClusterChain", status);
             __leave;
         }
-        // HERE we should check the FSI_Free_Count for 0xFFFFFFFF and if so we should recompute the
-        // free count and recheck it for 0
-
-        // we set the directory cluster (should check against 0xFFFFFFFF) and if so we should
-        // start looking for clusters starting form cluster 2
 
         // we set the cluster where the directory entry's data will be placed
-        pEntry[index].DIR_FstClusHI = DWORD_HIGH(pFSinfo->FSI_Nxt_Free);
-        pEntry[index].DIR_FstClusLO = DWORD_LOW(pFSinfo->FSI_Nxt_Free);
-
-        currentClusterInChain = pFSinfo->FSI_Nxt_Free;
+        pEntry[index].DIR_FstClusHI = DWORD_HIGH(currentClusterInChain);
+        pEntry[index].DIR_FstClusLO = DWORD_LOW(currentClusterInChain);
 
         // set the new file attributes
         pEntry[index].DIR_Attr = FileAttributes;
@@ -1076,28 +1172,7 @@ FatCreateDirectoryEntry(
         pEntry[index].DIR_WrtTime = fatTime;
 
 
-        // Step 9. Update FSI information FreeCount and NextFree
-
-        // decrement free count
-        pFSinfo->FSI_Free_Count--;
-
-        // update next free cluster(should check if cluster is actually free)
-        pFSinfo->FSI_Nxt_Free++;
-
-        // we write the changes made to pFSinfo and to the parent cluster of the new entry
-        bytesToRead = FatData->BytesPerSector;
-        status = IoWriteDevice(FatData->VolumeDevice,
-            pFSinfo,
-            &bytesToRead,
-            1 * FatData->BytesPerSector
-        );
-        if (!SUCCEEDED(status))
-        {
-            LOG_FUNC_ERROR("IoWriteDevice", status);
-            __leave;
-        }
-        ASSERT(bytesToRead == FatData->BytesPerSector);
-
+        // Step 9. Write the parent cluster of the new entry
         bytesToRead = FatData->BytesPerSector * FatData->SectorsPerCluster;
         status = IoWriteDevice(FatData->VolumeDevice,
             pEntry,
@@ -1193,67 +1268,9 @@ FatCreateDirectoryEntry(
             __leave;
         }
         ASSERT(bytesToRead == FatData->BytesPerSector * FatData->SectorsPerCluster);
-
-        // Step 12. Add EOC for new cluster used
-
-        // we allocate space for the FAT
-        bytesToRead = FatData->BytesPerSector;
-        pFAT = (BYTE*)ExAllocatePoolWithTag(PoolAllocateZeroMemory, (DWORD)bytesToRead, HEAP_TEMP_TAG, 0);
-        if (NULL == pFAT)
-        {
-            status = STATUS_HEAP_NO_MORE_MEMORY;
-            LOG_FUNC_ERROR_ALLOC("HeapAllocatePoolWithTag", bytesToRead);
-            __leave;
-        }
-
-        // we find the sector and the offset of the FAT
-        fatEntrySector = FatData->ReservedSectors + (currentClusterInChain * sizeof(DWORD)) / FatData->BytesPerSector;
-        fatEntryOffset = (currentClusterInChain * sizeof(DWORD)) % FatData->BytesPerSector;
-
-
-        status = IoReadDevice(FatData->VolumeDevice,
-            pFAT,
-            &bytesToRead,
-            fatEntrySector * FatData->BytesPerSector
-        );
-        if (!SUCCEEDED(status))
-        {
-            LOG_FUNC_ERROR("IoReadDevice", status);
-            __leave;
-        }
-        ASSERT(bytesToRead == FatData->BytesPerSector);
-
-
-        *((DWORD*)&(pFAT[fatEntryOffset])) = *((DWORD*)&(pFAT[fatEntryOffset])) & (~FAT32_CLUSTER_MASK);    // we need to preserve the 4 reserved bits
-        *((DWORD*)&(pFAT[fatEntryOffset])) = *((DWORD*)&(pFAT[fatEntryOffset])) | FAT32_EOC_MARK;            // we add the EOC mark
-
-
-        status = IoWriteDevice(FatData->VolumeDevice,
-            pFAT,
-            &bytesToRead,
-            fatEntrySector * FatData->BytesPerSector
-        );
-        if (!SUCCEEDED(status))
-        {
-            LOG_FUNC_ERROR("IoWriteDevice", status);
-            __leave;
-        }
-        ASSERT(bytesToRead == FatData->BytesPerSector);
     }
     __finally
     {
-        if (NULL != pFAT)
-        {
-            ExFreePoolWithTag(pFAT, HEAP_TEMP_TAG);
-            pFAT = NULL;
-        }
-
-        if (NULL != pFSinfo)
-        {
-            ExFreePoolWithTag(pFSinfo, HEAP_TEMP_TAG);
-            pFSinfo = NULL;
-        }
-
         if (NULL != pEntry)
         {
             ExFreePoolWithTag(pEntry, HEAP_TEMP_TAG);
@@ -1324,7 +1341,7 @@ FatQueryDirectory(
                     pEntry = NULL;
 
                     // we go to the next sector by following the cluster chain
-                    status = NextSectorInClusterChain(FatData, sectorToParse, &sectorToParse, FALSE);
+                    status = NextSectorInClusterChain(FatData, sectorToParse, &sectorToParse, 0);
                     if (!SUCCEEDED(status))
                     {
                         LOG_FUNC_ERROR("NextSectorInClusterChain", status);
@@ -35,6 +35,7 @@ STATUS
 _AddNewClusterToChain(
     IN      PFAT_DATA       FatData,
     IN      QWORD           LastClusterFromChain,
+    IN      DWORD           ClusterCount,
     OUT     QWORD*          ReservedCluster
 );
 
@@ -43,7 +44,7 @@ NextSectorInClusterChain(
     IN      PFAT_DATA       FatData,
     IN      QWORD           CurrentSector,
     OUT     QWORD*          NextSector,
-    IN      BOOLEAN         ExtendChain
+    IN      DWORD           ExtendChainClusters
     )
 {
     STATUS status;
@@ -76,14 +77,14 @@ NextSectorInClusterChain(
     // we check if we reached the end of chain
     if (FAT32_EOC(nextCluster))
     {
-        if (!ExtendChain)
+        if (0 == ExtendChainClusters)
         {
-        // arrived to the end of the cluster chain
-        *NextSector = 0;
-        return status;
-    }
+            // arrived to the end of the cluster chain
+            *NextSector = 0;
+            return status;
+        }
 
-        status = _AddNewClusterToChain(FatData, currentCluster, &nextCluster);
+        status = _AddNewClusterToChain(FatData, currentCluster, ExtendChainClusters, &nextCluster);
         if (!SUCCEEDED(status))
         {
             LOG_FUNC_ERROR("AddNewClusterToChain", status);
@@ -109,219 +110,103 @@ NextClusterInChain(
     OUT     QWORD*          NextCluster
     )
 {
-    STATUS status;
-    FAT32_ENTRY* pFat32Entries;        // pointer to a FAT table
-    QWORD sectorNumber;
-    QWORD indexInSector;
-    QWORD bytesToReadWrite;
-    QWORD offset;
     QWORD nextCluster;
 
     ASSERT(NULL != FatData);
     ASSERT(NULL != NextCluster);
 
-    status = STATUS_UNSUCCESSFUL;
-    pFat32Entries = NULL;
-    nextCluster = 0;
-
-    sectorNumber = FatData->ReservedSectors + (CurrentCluster * (sizeof(FAT32_ENTRY)) / FatData->BytesPerSector);
-    indexInSector = CurrentCluster % (FatData->BytesPerSector / sizeof(FAT32_ENTRY));
-    bytesToReadWrite = FatData->BytesPerSector;
-    offset = sectorNumber * FatData->BytesPerSector;
-
-    __try
-    {
-        pFat32Entries = (FAT32_ENTRY*)ExAllocatePoolWithTag(PoolAllocateZeroMemory, FatData->BytesPerSector, HEAP_TEMP_TAG, 0);
-    if (NULL == pFat32Entries)
+    if ((CurrentCluster > FatData->CountOfClusters + 1) || (CurrentCluster < 2))
     {
-            status = STATUS_HEAP_NO_MORE_MEMORY;
-        // could not allocate memory for a FAT32 sector
-            LOG_FUNC_ERROR_ALLOC("ExAllocatePoolWithTag", FatData->BytesPerSector);
-            __leave;
+        return STATUS_DEVICE_CLUSTER_INVALID;
     }
 
-    // We read the sector
-        status = IoReadDevice(
-            FatData->VolumeDevice,
-                          pFat32Entries,
-            &bytesToReadWrite,
-                          offset
-                          );
-    if (!SUCCEEDED(status))
-    {
-        LOG_FUNC_ERROR("IoReadDevice", status);
-            __leave;
-        }
-        ASSERT(bytesToReadWrite == FatData->BytesPerSector);
-
-        nextCluster = pFat32Entries[indexInSector] & FAT32_CLUSTER_MASK;
+    nextCluster = FatCacheGetEntry(&FatData->FatCache, CurrentCluster);
 
-        if (0 == nextCluster)
-        {
-            LOG_TRACE_FILESYSTEM("Found zero in cluster chain");
-            // has to be treated as EOC marker
-            nextCluster = FAT32_EOC_MARK;
-
-            // write EOC marker back to disk, such that the cluster is not treated as a free one
-            pFat32Entries[indexInSector] &= ~FAT32_CLUSTER_MASK;    // we need to preserve the 4 reserved bits
-            pFat32Entries[indexInSector] |= FAT32_EOC_MARK;            // we add the EOC mark
-
-            status = IoWriteDevice(
-                FatData->VolumeDevice,
-                pFat32Entries,
-                &bytesToReadWrite,
-                offset
-            );
-            if (!SUCCEEDED(status))
-            {
-                LOG_FUNC_ERROR("IoWriteDevice", status);
-                __leave;
-            }
-            ASSERT(bytesToReadWrite == FatData->BytesPerSector);
-        }
-        else if (FAT32_BAD_CLUSTER == nextCluster)
-        {
-            // maybe we should cut off the cluster chain, so it doesn't reach the bad cluster
-            nextCluster = FAT32_EOC_MARK;
-        }
+    if (0 == nextCluster)
+    {
+        LOG_TRACE_FILESYSTEM("Found zero in cluster chain");
+        // has to be treated as EOC marker
+        nextCluster = FAT32_EOC_MARK;
 
-        status = STATUS_SUCCESS;
+        // write EOC marker back, such that the cluster is not treated as a free one
+        FatCacheSetEntry(&FatData->FatCache, CurrentCluster, FAT32_EOC_MARK);
     }
-    __finally
+    else if (FAT32_BAD_CLUSTER == nextCluster)
     {
-        *NextCluster = nextCluster;
-
-        // We free the memory allocated
-        if (NULL != pFat32Entries)
-        {
-            ExFreePoolWithTag(pFat32Entries, HEAP_TEMP_TAG);
-            pFat32Entries = NULL;
-        }
+        // maybe we should cut off the cluster chain, so it doesn't reach the bad cluster
+        nextCluster = FAT32_EOC_MARK;
     }
 
-        return status;
-    }
+    *NextCluster = nextCluster;
+
+    return STATUS_SUCCESS;
+}
 
-static
 STATUS
-_FirstFreeCluster(
+AllocateClusterChain(
     IN      PFAT_DATA       FatData,
-    IN      QWORD           FirstCheckedCluster,
-    IN      BOOLEAN         MarkReserved,
-    OUT     QWORD*          FreeCluster
-)
+    IN      QWORD           PreferredCluster,
+    IN      DWORD           ClusterCount,
+    OUT     QWORD*          FirstCluster
+    )
 {
-    STATUS status = STATUS_UNSUCCESSFUL;
-    FAT32_ENTRY* pFat32Entries = NULL;        // pointer to a FAT table
-    QWORD firstCheckedCluster = FirstCheckedCluster;
-    QWORD entriesPerFat = 0;
-    QWORD sectorsPerFat = 0;
-    QWORD firstFatSector = 0;
-    QWORD currentSector = 0;
-    QWORD bytesToReadWrite = 0;
-    QWORD indexInSector = 0;
-    QWORD clusterIndex = 0;
+    STATUS status;
+    QWORD firstCluster;
+    QWORD lastCluster;
+    QWORD cluster;
+    DWORD i;
 
-    __try
+    ASSERT(NULL != FatData);
+    ASSERT(0 != ClusterCount);
+    ASSERT(NULL != FirstCluster);
+
+    // contiguous clusters are preferred, they can be transferred with a single request
+    status = FatCacheAllocateClusterRun(&FatData->FatCache, PreferredCluster, ClusterCount, FirstCluster);
+    if (STATUS_DISK_FULL != status)
     {
-        pFat32Entries = (FAT32_ENTRY*)ExAllocatePoolWithTag(PoolAllocateZeroMemory, FatData->BytesPerSector, HEAP_TEMP_TAG, 0);
-        if (NULL == pFat32Entries)
-        {
-            status = STATUS_HEAP_NO_MORE_MEMORY;
-            // could not allocate memory for a FAT32 sector
-            LOG_FUNC_ERROR_ALLOC("ExAllocatePoolWithTag", FatData->BytesPerSector);
-            __leave;
-        }
+        return status;
+    }
 
-        bytesToReadWrite = FatData->BytesPerSector; // read the FAT sector by sector
+    if (FatCacheGetFreeClusterCount(&FatData->FatCache) < ClusterCount)
+    {
+        LOG_TRACE_FILESYSTEM("Only 0x%x free clusters, 0x%x needed\n",
+                             FatCacheGetFreeClusterCount(&FatData->FatCache), ClusterCount);
+        return STATUS_DISK_FULL;
+    }
 
-        firstFatSector = FatData->ReservedSectors;
-        entriesPerFat = FatData->CountOfClusters + 2;
-        sectorsPerFat = entriesPerFat * sizeof(FAT32_ENTRY) / FatData->BytesPerSector;
+    // the free space is fragmented, the chain is built one cluster at a time
+    firstCluster = 0;
+    lastCluster = 0;
 
-        // if search should begin after the last cluster
-        if (entriesPerFat <= firstCheckedCluster)
+    for (i = 0; i < ClusterCount; ++i)
+    {
+        status = FatCacheAllocateClusterRun(&FatData->FatCache,
+                                            (0 == lastCluster) ? PreferredCluster : lastCluster + 1,
+                                            1,
+                                            &cluster);
+        if (!SUCCEEDED(status))
         {
-            status = STATUS_SUCCESS;
-            __leave;
+            // we checked there are enough free clusters
+            ASSERT(FALSE);
+            LOG_FUNC_ERROR("FatCacheAllocateClusterRun", status);
+            return status;
         }
 
-        if (FAT32_UNKNOWN == firstCheckedCluster)
+        if (0 == lastCluster)
         {
-            firstCheckedCluster = 2;
+            firstCluster = cluster;
         }
-
-        currentSector = firstFatSector + (firstCheckedCluster * sizeof(FAT32_ENTRY) / FatData->BytesPerSector);
-        indexInSector = firstCheckedCluster % (FatData->BytesPerSector / sizeof(FAT32_ENTRY));
-        // for each sector of the FAT
-        for (; currentSector < sectorsPerFat; currentSector++)
+        else
         {
-            // We read the sector
-            status = IoReadDevice(
-                FatData->VolumeDevice,
-                pFat32Entries,
-                &bytesToReadWrite,
-                currentSector * FatData->BytesPerSector
-            );
-            if (!SUCCEEDED(status))
-            {
-                LOG_FUNC_ERROR("IoReadDevice", status);
-                __leave;
-            }
-            ASSERT(bytesToReadWrite == FatData->BytesPerSector);
-
-            // check all the entries in the current sector of the FAT
-            for (; indexInSector < FatData->BytesPerSector / sizeof(FAT32_ENTRY); indexInSector++)
-            {
-                if (0 == (pFat32Entries[indexInSector] & FAT32_CLUSTER_MASK)) // found free cluster
-                {
-                    if (MarkReserved)
-                    {
-                        // write EOC marker back to disk, such that the cluster is reserved
-                        pFat32Entries[indexInSector] &= ~FAT32_CLUSTER_MASK;    // we need to preserve the 4 reserved bits
-                        pFat32Entries[indexInSector] |= FAT32_EOC_MARK;         // we add the EOC mark
-
-                        status = IoWriteDevice(
-                            FatData->VolumeDevice,
-                            pFat32Entries,
-                            &bytesToReadWrite,
-                            currentSector * FatData->BytesPerSector
-                        );
-                        if (!SUCCEEDED(status))
-                        {
-                            LOG_FUNC_ERROR("IoWriteDevice", status);
-                            __leave;
-                        }
-                        ASSERT(bytesToReadWrite == FatData->BytesPerSector);
-                    }
-
-                    // clusterIndex = Index of sector inside FAT * Nr of FAT entryies per sector + FAT entry index in current sector
-                    clusterIndex = (currentSector - firstFatSector) * (FatData->BytesPerSector / sizeof(FAT32_ENTRY)) + indexInSector;
-
-                    ASSERT(2 <= clusterIndex && clusterIndex < entriesPerFat);
-                    ASSERT(FAT32_UNKNOWN != clusterIndex);
-
-                    currentSector = sectorsPerFat; // break outer for loop
-                    break;
-                }
-            }
-            // reset entry index
-            indexInSector = 0;
+            FatCacheSetEntry(&FatData->FatCache, lastCluster, (DWORD)cluster);
         }
-    }
-    __finally
-    {
-        *FreeCluster = clusterIndex;
 
-    // We free the memory allocated
-        if (NULL != pFat32Entries)
-        {
-    ExFreePoolWithTag(pFat32Entries, HEAP_TEMP_TAG);
-            pFat32Entries = NULL;
-        }
+        lastCluster = cluster;
     }
 
-    return status;
+    *FirstCluster = firstCluster;
+
+    return STATUS_SUCCESS;
 }
 
 static
@@ -329,189 +214,32 @@ STATUS
 _AddNewClusterToChain(
     IN      PFAT_DATA       FatData,
     IN      QWORD           LastClusterFromChain,
+    IN      DWORD           ClusterCount,
     OUT     QWORD*          ReservedCluster
 )
 {
+    STATUS status;
+    QWORD reservedCluster;
+
     ASSERT(FatData != NULL);
     ASSERT(ReservedCluster != NULL);
 
     ASSERT(!FAT32_EOC(LastClusterFromChain));
 
-    STATUS status = STATUS_UNSUCCESSFUL;
-    FSINFO* pFsInfo = NULL;            // pointer to FSInfo
-    FAT32_ENTRY* pFat32Entries = NULL;        // pointer to a FAT table
-    QWORD bytesToReadWrite = 0;
-    QWORD freeCluster = 0;
-    QWORD reservedCluster = 0;
-    QWORD sectorFromFat = 0;
-    QWORD indexInSector = 0;
+    reservedCluster = 0;
 
-    __try
+    // try to continue the chain right after its last cluster
+    status = AllocateClusterChain(FatData, LastClusterFromChain + 1, ClusterCount, &reservedCluster);
+    if (!SUCCEEDED(status))
     {
-        pFsInfo = (FSINFO*)ExAllocatePoolWithTag(PoolAllocateZeroMemory, sizeof(FSINFO), HEAP_TEMP_TAG, 0);
-        if (NULL == pFsInfo)
-        {
-            status = STATUS_HEAP_NO_MORE_MEMORY;
-            LOG_FUNC_ERROR_ALLOC("ExAllocatePoolWithTag", sizeof(FSINFO));
-            __leave;
-        }
-
-        bytesToReadWrite = sizeof(FSINFO);
-        status = IoReadDevice(
-            FatData->VolumeDevice,
-            pFsInfo,
-            &bytesToReadWrite,
-            1 * FatData->BytesPerSector
-        );
-        if (!SUCCEEDED(status))
-        {
-            LOG_FUNC_ERROR("IoReadDevice", status);
-            __leave;
-        }
-        ASSERT(bytesToReadWrite == FatData->BytesPerSector);
-
-        // if there are no more free clusters we fail
-        if (0 == pFsInfo->FSI_Free_Count)
-        {
-            pFsInfo->FSI_Nxt_Free = FAT32_UNKNOWN;
-
-            status = STATUS_DISK_FULL;
-            __leave;
-        }
-
-        status = _FirstFreeCluster(FatData, pFsInfo->FSI_Nxt_Free, TRUE, &reservedCluster);
-        if (!SUCCEEDED(status))
-        {
-            LOG_FUNC_ERROR("FirstFreeCluster", status);
-            __leave;
-        }
-
-        if (0 == reservedCluster) // no free cluster found
-        {
-            // FSI_Free_Count was not zero, but there was no free cluster
-            ASSERT(FAT32_UNKNOWN == pFsInfo->FSI_Free_Count);
-
-            pFsInfo->FSI_Free_Count = 0;
-            pFsInfo->FSI_Nxt_Free = FAT32_UNKNOWN;
-
-            status = STATUS_DISK_FULL;
-            __leave;
-        }
-
-        // a free cluster was reserved
-        // write it to the end of the cluster chain
-        pFat32Entries = (FAT32_ENTRY*)ExAllocatePoolWithTag(PoolAllocateZeroMemory, FatData->BytesPerSector, HEAP_TEMP_TAG, 0);
-        if (NULL == pFat32Entries)
-        {
-            status = STATUS_HEAP_NO_MORE_MEMORY;
-            // could not allocate memory for a FAT32 sector
-            LOG_FUNC_ERROR_ALLOC("ExAllocatePoolWithTag", FatData->BytesPerSector);
-            __leave;
-        }
-
-        sectorFromFat = FatData->ReservedSectors + (LastClusterFromChain * sizeof(FAT32_ENTRY) / FatData->BytesPerSector);
-        indexInSector = LastClusterFromChain % (FatData->BytesPerSector / sizeof(FAT32_ENTRY));
-
-        bytesToReadWrite = FatData->BytesPerSector;
-        // We read the sector
-        status = IoReadDevice(
-            FatData->VolumeDevice,
-            pFat32Entries,
-            &bytesToReadWrite,
-            sectorFromFat * FatData->BytesPerSector
-        );
-        if (!SUCCEEDED(status))
-        {
-            LOG_FUNC_ERROR("IoReadDevice", status);
-            __leave;
-        }
-        ASSERT(bytesToReadWrite == FatData->BytesPerSector);
-
-        pFat32Entries[indexInSector] &= ~FAT32_CLUSTER_MASK;    // we need to preserve the 4 reserved bits
-        pFat32Entries[indexInSector] |= (DWORD)reservedCluster;
-
-        status = IoWriteDevice(
-            FatData->VolumeDevice,
-            pFat32Entries,
-            &bytesToReadWrite,
-            sectorFromFat * FatData->BytesPerSector
-        );
-        if (!SUCCEEDED(status))
-        {
-            LOG_FUNC_ERROR("IoWriteDevice", status);
-            __leave;
-        }
-        ASSERT(bytesToReadWrite == FatData->BytesPerSector);
-
-        // Update the FSI_Nxt_Free and FSI_Free_Count
-
-        // fatgen103.pdf:
-        // Typically this value is set to the last cluster number that the driver allocated.
-        pFsInfo->FSI_Nxt_Free = (DWORD)reservedCluster;
-
-        if (FAT32_UNKNOWN == pFsInfo->FSI_Free_Count)
-        {
-            // calculate remaining free clusters
-            pFsInfo->FSI_Free_Count = 0;
-
-            freeCluster = reservedCluster;
-
-            for(;;)
-            {
-                status = _FirstFreeCluster(FatData, freeCluster + 1, FALSE, &freeCluster);
-                if (!SUCCEEDED(status))
-                {
-                    LOG_FUNC_ERROR("FirstFreeCluster", status);
-                    __leave;
-                }
-
-                if (0 == freeCluster)
-                {
-                    break;
-                }
-
-                pFsInfo->FSI_Free_Count++;
-            }
-        }
-        else // FSI_Free_Count != FAT32_UNKNOWN or 0
-        {
-            pFsInfo->FSI_Free_Count--;
-        }
-
+        LOG_FUNC_ERROR("AllocateClusterChain", status);
+        return status;
     }
-    __finally
-    {
-        *ReservedCluster = reservedCluster;
-
-        // Write the FsInfo back to the disk
-        // (placed here in case of __leave when disk is full)
-        bytesToReadWrite = sizeof(FSINFO);
-        status = IoWriteDevice(
-            FatData->VolumeDevice,
-            pFsInfo,
-            &bytesToReadWrite,
-            1 * FatData->BytesPerSector
-        );
-        if (!SUCCEEDED(status))
-        {
-            LOG_FUNC_ERROR("IoWriteDevice", status);
-        }
-        ASSERT(bytesToReadWrite == FatData->BytesPerSector);
 
-        // We free the memory allocated
-        if (NULL != pFsInfo)
-        {
-            ExFreePoolWithTag(pFsInfo, HEAP_TEMP_TAG);
-            pFsInfo = NULL;
-        }
+    // write the new clusters to the end of the cluster chain
+    FatCacheSetEntry(&FatData->FatCache, LastClusterFromChain, (DWORD)reservedCluster);
 
-        // We free the memory allocated
-        if (NULL != pFat32Entries)
-        {
-            ExFreePoolWithTag(pFat32Entries, HEAP_TEMP_TAG);
-            pFat32Entries = NULL;
-        }
-    }
+    *ReservedCluster = reservedCluster;
 
     return status;
 }
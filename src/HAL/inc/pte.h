@@ -22,6 +22,8 @@
 #define PAGE_4MB_OFFSET                             ((QWORD)(1<<22)-1)
 #define PAGE_1GB_OFFSET                             ((QWORD)(1<<30)-1)
 
+#define PAGE_2MB_SIZE                               (PAGE_2MB_OFFSET + 1)
+
 #define PCID_NO_OF_BITS                             12
 #define PCID_TOTAL_NO_OF_VALUES                     (1<<PCID_NO_OF_BITS)
 #define PCID_FIRST_VALID_VALUE                      1
@@ -337,7 +339,11 @@ typedef struct _PTE_MAP_FLAGS
     WORD            PagingStructure      :    1;
     WORD            UserAccess           :    1;
     WORD            GlobalPage           :    1;
-    WORD            __Reserved0          :    7;
+
+    // Valid only for PD entries, maps a 2-MByte page instead of referencing
+    // a page table
+    WORD            LargePage            :    1;
+    WORD            __Reserved0          :    6;
 } PTE_MAP_FLAGS, *PPTE_MAP_FLAGS;
 STATIC_ASSERT(sizeof(PTE_MAP_FLAGS) == sizeof(WORD));
 #pragma warning(pop)
@@ -365,6 +371,11 @@ PteLargePageGetPhysicalAddress(
     IN          PVOID           PageTable
     );
 
+BOOLEAN
+PteIsLargePage(
+    IN          PVOID           PageTable
+    );
+
 BOOLEAN
 PteIsPresent(
     IN          PVOID           PageTable
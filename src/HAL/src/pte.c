@@ -15,6 +15,33 @@ PteMap(
     pTablePointer = PageTable;
     memzero(pTablePointer, sizeof(PVOID));
 
+    if (Flags.LargePage)
+    {
+        PPD_ENTRY_2MB pLargeEntry;
+
+        ASSERT(!Flags.PagingStructure);
+        ASSERT(IsAddressAligned(PhysicalAddress, PAGE_2MB_SIZE));
+
+        pLargeEntry = PageTable;
+
+        pLargeEntry->PhysicalAddress = (QWORD) PhysicalAddress >> SHIFT_FOR_LARGE_PAGE;
+        pLargeEntry->Present = 1;
+        pLargeEntry->PageSize = 1;
+
+        pLargeEntry->ReadWrite = Flags.Writable;
+        pLargeEntry->XD = !Flags.Executable;
+        pLargeEntry->UserSupervisor = Flags.UserAccess;
+
+        // for large pages the PAT bit is bit 12, bit 7 is the PS flag
+        pLargeEntry->PAT = (Flags.PatIndex >> 2) & 1;
+        pLargeEntry->PCD = (Flags.PatIndex >> 1) & 1;
+        pLargeEntry->PWT = (Flags.PatIndex >> 0) & 1;
+
+        pLargeEntry->Global = Flags.GlobalPage;
+
+        return;
+    }
+
     pTablePointer->PhysicalAddress = (QWORD) PhysicalAddress >> SHIFT_FOR_PHYSICAL_ADDR;
     pTablePointer->Present = 1;
 
@@ -74,6 +101,20 @@ PteLargePageGetPhysicalAddress(
 
 }
 
+BOOLEAN
+PteIsLargePage(
+    IN          PVOID           PageTable
+    )
+{
+    PPD_ENTRY_2MB pEntry;
+
+    ASSERT(NULL != PageTable);
+
+    pEntry = (PPD_ENTRY_2MB)PageTable;
+
+    return (1 == pEntry->Present) && (1 == pEntry->PageSize);
+}
+
 BOOLEAN
 PteIsPresent(
     IN          PVOID           PageTable
@@ -4,6 +4,11 @@
 #include "acpi.h"
 #pragma warning(pop)
 
+#define AcpiSratCpuProximityDomain(Entry)   ((DWORD)(Entry)->ProximityDomainLo              \
+                                            | ((DWORD)(Entry)->ProximityDomainHi[0] << 8)   \
+                                            | ((DWORD)(Entry)->ProximityDomainHi[1] << 16)  \
+                                            | ((DWORD)(Entry)->ProximityDomainHi[2] << 24))
+
 void
 AcpiInterfacePreinit(
     void
@@ -54,4 +59,26 @@ AcpiRetrieveNextPrtEntry(
     OUT_PTR ACPI_PCI_ROUTING_TABLE**    AcpiEntry,
     OUT     BYTE*                       BusNumber,
     OUT     WORD*                       SegmentNumber
+    );
+
+// The CPU and memory affinity entries are only available if the firmware
+// provides a SRAT, x2APIC entries are returned in the xAPIC format
+STATUS
+AcpiRetrieveNextCpuAffinity(
+    IN      BOOLEAN                     RestartSearch,
+    OUT_PTR ACPI_SRAT_CPU_AFFINITY**    AcpiEntry
+    );
+
+STATUS
+AcpiRetrieveNextMemoryAffinity(
+    IN      BOOLEAN                     RestartSearch,
+    OUT_PTR ACPI_SRAT_MEM_AFFINITY**    AcpiEntry
+    );
+
+// Returns STATUS_DEVICE_DOES_NOT_EXIST if the firmware provides no SLIT
+STATUS
+AcpiRetrieveLocalityDistance(
+    IN      DWORD                       FromProximityDomain,
+    IN      DWORD                       ToProximityDomain,
+    OUT     BYTE*                       Distance
     );
\ No newline at end of file
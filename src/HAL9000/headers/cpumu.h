@@ -123,6 +123,19 @@ CpuMuActivateFpuFeatures(
     void
     );
 
+//******************************************************************************
+// Function:     CpuMuSelectMemoryRoutines
+// Description:  Selects the implementations of the CommonLib memory and
+//               string routines based on the features of the BSP and on the
+//               register state enabled by CpuMuActivateFpuFeatures.
+// Returns:      void
+// NOTE:         Must be called before the APs are started.
+//******************************************************************************
+void
+CpuMuSelectMemoryRoutines(
+    void
+    );
+
 __forceinline
 IRQL
 CpuMuRaiseIrql(
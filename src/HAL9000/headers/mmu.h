@@ -5,6 +5,24 @@
 
 typedef struct _PROCESS* PPROCESS;
 typedef struct _PE_NT_HEADER_INFO *PPE_NT_HEADER_INFO;
+typedef struct _PROCESS_MEMORY_STATISTICS* PPROCESS_MEMORY_STATISTICS;
+
+// Updated with interlocked operations, the fault service times are kept in
+// TSC ticks and converted only when the statistics are retrieved
+typedef struct _PAGING_STATISTICS
+{
+    volatile QWORD          ResidentPages;
+    volatile QWORD          PeakResidentPages;
+
+    volatile QWORD          DemandZeroFaults;
+    volatile QWORD          FileBackedFaults;
+    volatile QWORD          SwapInFaults;
+    volatile QWORD          CopyOnWriteFaults;
+    volatile QWORD          ProtectionFaults;
+
+    volatile QWORD          FaultServiceTicks;
+    volatile QWORD          MaxFaultServiceTicks;
+} PAGING_STATISTICS, *PPAGING_STATISTICS;
 
 /// TODO: Move BasePhysicalAddress and KernelSpace outside protected region
 typedef struct _PAGING_DATA
@@ -18,6 +36,22 @@ typedef struct _PAGING_DATA
     DWORD                   CurrentIndex;
 
     BOOLEAN                 KernelSpace;
+
+    // These are not protected by the paging lock: each CPU sets its own bit
+    // when it loads the paging tables and clears it once it no longer caches
+    // translations of the address space
+    volatile BYTE           ActiveCpus;
+
+    // Never reused => identifies the address space in the per-CPU PCID caches
+    QWORD                   ContextId;
+
+    // Incremented on each shootdown, a CPU which cached translations of an
+    // older generation flushes its PCID when it loads the paging tables
+    volatile QWORD          TlbGeneration;
+
+    // Not protected by the paging lock either, the resident pages are
+    // accounted when the leaf entries are mapped and unmapped
+    PAGING_STATISTICS       Statistics;
 } PAGING_DATA, *PPAGING_DATA;
 
 typedef struct _PAGING_LOCK_DATA
@@ -74,8 +108,9 @@ MmuDiscardIdentityMappings(
 
 //******************************************************************************
 // Function:     MmuInitThreadingSystem
-// Description:  Creates the worker thread responsible for zero-ing physical
-//               frames after they have been released.
+// Description:  Creates the worker threads responsible for zero-ing physical
+//               frames after they have been released and for tearing down
+//               the address spaces of destroyed processes.
 // Returns:      STATUS
 //******************************************************************************
 STATUS
@@ -83,6 +118,17 @@ MmuInitThreadingSystem(
     void
     );
 
+//******************************************************************************
+// Function:     MmuInitSwapSystem
+// Description:  Makes the system swap file available for evicting user pages.
+//               Must be called after the IOMU determined the swap file.
+// Returns:      STATUS
+//******************************************************************************
+STATUS
+MmuInitSwapSystem(
+    void
+    );
+
 //******************************************************************************
 // Function:     MmuGetTotalSystemMemory
 // Description:  Returns the number of bytes of physical memory available in the
@@ -131,8 +177,10 @@ MmuMapMemoryEx(
     IN_OPT  PPAGING_LOCK_DATA       PagingData
     );
 
+#define MmuMapMemoryInternal(...)   MmuMapMemoryInternalEx(__VA_ARGS__, FALSE)
+
 //******************************************************************************
-// Function:     MmuMapMemoryInternal
+// Function:     MmuMapMemoryInternalEx
 // Description:  Maps a physical address range into the specified virtual
 //               address space.
 // Returns:      void
@@ -142,17 +190,20 @@ MmuMapMemoryEx(
 // Parameter:    IN PVOID VirtualAddress
 // Parameter:    IN BOOLEAN Invalidate
 // Parameter:    IN BOOLEAN Uncacheable
+// Parameter:    IN BOOLEAN LargePages - if TRUE the range may be mapped using
+//               2MB pages wherever both the VA and PA are 2MB aligned.
 /// NOTE:        This should only be used by ap_tramp, vmm and no other modules.
 //******************************************************************************
 void
-MmuMapMemoryInternal(
+MmuMapMemoryInternalEx(
     IN      PHYSICAL_ADDRESS        PhysicalAddress,
     IN      QWORD                   Size,
     IN      PAGE_RIGHTS             PageRights,
     IN      PVOID                   VirtualAddress,
     IN      BOOLEAN                 Invalidate,
     IN      BOOLEAN                 Uncacheable,
-    IN_OPT  PPAGING_LOCK_DATA       PagingData
+    IN_OPT  PPAGING_LOCK_DATA       PagingData,
+    IN      BOOLEAN                 LargePages
     );
 
 //******************************************************************************
@@ -160,7 +211,7 @@ MmuMapMemoryInternal(
 // Description:  Unmaps a previously mapped memory region.
 // Returns:      void
 // Parameter:    IN PVOID VirtualAddress
-// Parameter:    IN DWORD Size
+// Parameter:    IN QWORD Size
 //******************************************************************************
 void
 MmuUnmapMemoryEx(
@@ -314,7 +365,10 @@ MmuCreateAddressSpaceForProcess(
 
 //******************************************************************************
 // Function:     MmuDestroyAddressSpaceForProcess
-// Description:  Destroys a previously created address space.
+// Description:  Destroys a previously created address space. Once the
+//               teardown worker runs the VA space and the paging tables are
+//               only detached from the process and queued, their frames are
+//               released in the background.
 // Returns:      void
 // Parameter:    INOUT PPROCESS Process
 //******************************************************************************
@@ -409,6 +463,36 @@ MmuIsBufferValid(
     IN          PPROCESS            Process
     );
 
+//******************************************************************************
+// Function:     MmuRetrieveProcessMemoryStatistics
+// Description:  Retrieves the resident and committed memory of Process and the
+//               page faults taken in its address space.
+// Returns:      STATUS
+// Parameter:    IN PPROCESS Process
+// Parameter:    OUT PPROCESS_MEMORY_STATISTICS Statistics
+//******************************************************************************
+STATUS
+MmuRetrieveProcessMemoryStatistics(
+    IN          PPROCESS                        Process,
+    OUT         PPROCESS_MEMORY_STATISTICS      Statistics
+    );
+
+//******************************************************************************
+// Function:     MmuFlushFileMapping
+// Description:  Writes back to their files the modified pages of the shared
+//               file mappings of Process found in [Address, Address + Size).
+// Returns:      STATUS
+// Parameter:    IN PVOID Address
+// Parameter:    IN QWORD Size
+// Parameter:    IN PPROCESS Process
+//******************************************************************************
+STATUS
+MmuFlushFileMapping(
+    IN          PVOID               Address,
+    IN          QWORD               Size,
+    IN          PPROCESS            Process
+    );
+
 //******************************************************************************
 // Function:     MmuGetSystemVirtualAddressForUserBuffer
 // Description:  Maps the physical memory which backs UserAddress from the
@@ -19,9 +19,28 @@ PmmInitSystem(
     OUT         DWORD*                  SizeReserved
     );
 
+//******************************************************************************
+// Function:     PmmInitNumaNodes
+// Description:  Splits the physical memory in nodes using the SRAT and orders
+//               the nodes by their SLIT distance. From now on the frames
+//               requested without a minimum address are taken from the node
+//               closest to the current CPU, the other nodes are used only if
+//               the closest one cannot satisfy the request.
+// Returns:      STATUS
+// Parameter:    void
+// NOTE:         Must be called after the ACPI tables were parsed.
+//******************************************************************************
+_No_competing_thread_
+STATUS
+PmmInitNumaNodes(
+    void
+    );
+
 //******************************************************************************
 // Function:     PmmRequestMemoryEx
 // Description:  Reserves the first free frames available after MinPhysAddr.
+//               If MinPhysAddr is NULL the frames are preferably taken from
+//               the node of the current CPU.
 // Returns:      PHYSICAL_ADDRESS - start address of physical address reserved
 // Parameter:    IN DWORD NoOfFrames - frames to reserved.
 // Parameter:    IN_OPT PHYSICAL_ADDRESS MinPhysAddr - physical address from
@@ -34,6 +53,23 @@ PmmReserveMemoryEx(
     IN_OPT      PHYSICAL_ADDRESS        MinPhysAddr
     );
 
+//******************************************************************************
+// Function:     PmmReserveAlignedMemory
+// Description:  Reserves the first free frames available whose starting
+//               physical address is aligned to Alignment bytes, preferably
+//               from the node of the current CPU.
+// Returns:      PHYSICAL_ADDRESS - start address of physical address reserved
+// Parameter:    IN DWORD NoOfFrames - frames to reserved.
+// Parameter:    IN QWORD Alignment - must be a power of 2 multiple of
+//               PAGE_SIZE.
+//******************************************************************************
+PTR_SUCCESS
+PHYSICAL_ADDRESS
+PmmReserveAlignedMemory(
+    IN          DWORD                   NoOfFrames,
+    IN          QWORD                   Alignment
+    );
+
 //******************************************************************************
 // Function:     PmmReleaseMemory
 // Description:  Releases previously reserved memory
@@ -47,6 +83,19 @@ PmmReleaseMemory(
     IN          DWORD                   NoOfFrames
     );
 
+//******************************************************************************
+// Function:     PmmGetNumberOfFreeFrames
+// Description:  Returns the number of frames which are not reserved. Frames
+//               released through MmuReleaseMemory are counted only after they
+//               were zeroed.
+// Returns:      QWORD
+// Parameter:    void
+//******************************************************************************
+QWORD
+PmmGetNumberOfFreeFrames(
+    void
+    );
+
 //******************************************************************************
 // Function:     PmmGetTotalSystemMemory
 // Description:
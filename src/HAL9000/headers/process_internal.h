@@ -13,7 +13,7 @@ typedef struct _PROCESS
 {
     REF_COUNT                       RefCnt;
 
-    // The PIDs will also be used for the CR3 PCID
+    // The PCIDs are assigned by each CPU, they are not related to the PID
     PID                             Id;
 
     char*                           ProcessName;
@@ -96,6 +96,20 @@ ProcessRetrieveSystemProcess(
     void
     );
 
+//******************************************************************************
+// Function:     ProcessRetrieveById
+// Description:  Searches for the process with the given PID.
+// Returns:      PPROCESS - The process referenced, it must be closed with
+//               ProcessCloseHandle. NULL if there is no process with this PID
+//               or if it is being destroyed.
+// Parameter:    IN PID ProcessId
+//******************************************************************************
+PTR_SUCCESS
+PPROCESS
+ProcessRetrieveById(
+    IN      PID                 ProcessId
+    );
+
 //******************************************************************************
 // Function:     ProcessInsertThreadInList
 // Description:  Inserts the Thread in the Process thread list.
@@ -150,16 +164,12 @@ ProcessExecuteForEachProcessEntry(
 
 //******************************************************************************
 // Function:     ProcessActivatePagingTables
-// Description:  Performs a switch to the Process paging tables.
+// Description:  Performs a switch to the Process paging tables. The TLB is
+//               flushed only if it may hold stale translations of the process.
 // Returns:      void
 // Parameter:    IN PPROCESS Process
-// Parameter:    IN BOOLEAN InvalidateAddressSpace - if TRUE all the cached
-//               translations for the Process PCID will be flushed. This option
-//               is useful when a process terminates and its PCID will be
-//               later used by another process.
 //******************************************************************************
 void
 ProcessActivatePagingTables(
-    IN      PPROCESS            Process,
-    IN      BOOLEAN             InvalidateAddressSpace
+    IN      PPROCESS            Process
     );
@@ -21,3 +21,8 @@ void
 TestAllProcessFunctionalities(
     void
     );
+
+void
+TestProcessExitPerformance(
+    void
+    );
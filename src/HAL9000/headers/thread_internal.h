@@ -252,6 +252,20 @@ ThreadExecuteForEachThreadEntry(
     IN_OPT  PVOID               Context
     );
 
+//******************************************************************************
+// Function:     ThreadRetrieveById
+// Description:  Searches for the thread with the given TID.
+// Returns:      PTHREAD - The thread referenced, it must be closed with
+//               ThreadCloseHandle. NULL if there is no thread with this TID or
+//               if it is being destroyed.
+// Parameter:    IN TID ThreadId
+//******************************************************************************
+PTR_SUCCESS
+PTHREAD
+ThreadRetrieveById(
+    IN      TID                 ThreadId
+    );
+
 
 //******************************************************************************O
 // Function:     GetCurrentThread
@@ -0,0 +1,112 @@
+#pragma once
+
+#include "vmm.h"
+
+//******************************************************************************
+// Shared file mappings
+//
+// Regions allocated with VMM_ALLOC_TYPE_SHARED_FILE are written back to their
+// backing file. The pages are faulted in clean, the CPU sets the dirty bit on
+// the first write. The writeback clears the dirty bits of a group of pages
+// under the paging lock, shoots down their translations and only then writes
+// their contents => a write racing with the writeback sets the dirty bit again
+// and is never lost.
+//
+// Dirty pages are written back periodically by a worker thread, when the
+// mapping is (partially) unmapped, when the address space is destroyed and
+// on demand through VmFileMapFlush.
+//******************************************************************************
+
+_No_competing_thread_
+void
+VmFileMapPreinit(
+    void
+    );
+
+//******************************************************************************
+// Function:     VmFileMapInit
+// Description:  Creates the thread which periodically writes back the dirty
+//               pages of the shared file mappings.
+// Returns:      STATUS
+//******************************************************************************
+STATUS
+VmFileMapInit(
+    void
+    );
+
+//******************************************************************************
+// Function:     VmFileMapRegister
+// Description:  Starts tracking a shared file mapping, its dirty pages will be
+//               written back to File until it is unmapped.
+// Returns:      STATUS
+// Parameter:    IN PVMM_RESERVATION_SPACE VaSpace
+// Parameter:    IN PPAGING_LOCK_DATA PagingData - paging tables of the user
+//               address space in which the file is mapped.
+// Parameter:    IN PVOID BaseAddress - the VA to which offset 0 of the file is
+//               mapped.
+// Parameter:    IN QWORD Size
+// Parameter:    IN PFILE_OBJECT File
+//******************************************************************************
+STATUS
+VmFileMapRegister(
+    IN      PVMM_RESERVATION_SPACE  VaSpace,
+    IN      PPAGING_LOCK_DATA       PagingData,
+    IN      PVOID                   BaseAddress,
+    IN      QWORD                   Size,
+    IN      PFILE_OBJECT            File
+    );
+
+//******************************************************************************
+// Function:     VmFileMapFlush
+// Description:  Writes back the dirty pages of the shared file mappings found
+//               in [Address, Address + Size).
+// Returns:      STATUS - STATUS_SUCCESS even if no shared mapping is found in
+//               the range.
+// Parameter:    IN PVMM_RESERVATION_SPACE VaSpace
+// Parameter:    IN PVOID Address
+// Parameter:    IN QWORD Size
+//******************************************************************************
+STATUS
+VmFileMapFlush(
+    IN      PVMM_RESERVATION_SPACE  VaSpace,
+    IN      PVOID                   Address,
+    IN      QWORD                   Size
+    );
+
+//******************************************************************************
+// Function:     VmFileMapBeginUnmap
+// Description:  Writes back the dirty pages of a range which is about to be
+//               freed, a released mapping is no longer tracked. Until
+//               VmFileMapEndUnmap is called no writeback may run => the frames
+//               can be unmapped and released safely.
+// Returns:      BOOLEAN - TRUE if VmFileMapEndUnmap must be called.
+// Parameter:    IN PVMM_RESERVATION_SPACE VaSpace
+// Parameter:    IN PVOID Address
+// Parameter:    IN QWORD Size - ignored for VMM_FREE_TYPE_RELEASE
+// Parameter:    IN VMM_FREE_TYPE FreeType
+//******************************************************************************
+BOOLEAN
+VmFileMapBeginUnmap(
+    IN      PVMM_RESERVATION_SPACE  VaSpace,
+    IN      PVOID                   Address,
+    IN      QWORD                   Size,
+    IN      VMM_FREE_TYPE           FreeType
+    );
+
+void
+VmFileMapEndUnmap(
+    void
+    );
+
+//******************************************************************************
+// Function:     VmFileMapUnregisterAddressSpace
+// Description:  Writes back and forgets all the shared file mappings of an
+//               address space, must be called before the reservations are
+//               freed (this closes the backing files).
+// Returns:      void
+// Parameter:    IN PVMM_RESERVATION_SPACE VaSpace
+//******************************************************************************
+void
+VmFileMapUnregisterAddressSpace(
+    IN      PVMM_RESERVATION_SPACE  VaSpace
+    );
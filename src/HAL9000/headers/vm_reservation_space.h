@@ -27,6 +27,29 @@ typedef struct _VMM_RESERVATION_SPACE
 
     _Guarded_by_(ReservationLock)
     struct _VMM_RESERVATION*    ReservationList;
+
+    // The used reservations are kept in a balanced interval tree ordered by
+    // their start address => the reservation describing an address is found
+    // in O(log n) no matter how many reservations exist
+    _Guarded_by_(ReservationLock)
+    struct _VMM_RESERVATION*    ReservationTreeRoot;
+
+    // Entries released are reused before touching new entries of the list
+    _Guarded_by_(ReservationLock)
+    struct _VMM_RESERVATION*    FreeReservationList;
+
+    // First entry of ReservationList which was never used
+    _Guarded_by_(ReservationLock)
+    struct _VMM_RESERVATION*    NextUnusedReservation;
+
+    // Leaves of sparse commit bitmaps which no longer describe any committed
+    // page, the first QWORD of each leaf points to the next one
+    _Guarded_by_(ReservationLock)
+    PBYTE                       FreeCommitLeafList;
+
+    // Number of pages committed by all the reservations
+    _Guarded_by_(ReservationLock)
+    QWORD                       CommittedPages;
 } VMM_RESERVATION_SPACE, *PVMM_RESERVATION_SPACE;
 
 //******************************************************************************
@@ -70,6 +93,35 @@ VmReservationSpaceDetermineNextFreeVirtualAddress(
     return (PVOID) _InterlockedExchangeAdd64(&ReservationSpace->FreeVirtualAddressPointer, Size);
 }
 
+// Same as VmReservationSpaceDetermineNextFreeVirtualAddress except the returned
+// address is aligned to Alignment bytes (used so large regions can be mapped
+// with large pages)
+__forceinline
+RET_NOT_NULL
+PVOID
+VmReservationSpaceDetermineNextFreeAlignedVirtualAddress(
+    INOUT                   PVMM_RESERVATION_SPACE  ReservationSpace,
+    IN                      QWORD                   Size,
+    IN                      QWORD                   Alignment
+    )
+{
+    PVOID pCurrent;
+    PVOID pAligned;
+
+    ASSERT(ReservationSpace != NULL);
+    ASSERT(Alignment != 0 && IsAddressAligned(Alignment, Alignment));
+
+    do
+    {
+        pCurrent = ReservationSpace->FreeVirtualAddressPointer;
+        pAligned = (PVOID) AlignAddressUpper(pCurrent, Alignment);
+    } while (_InterlockedCompareExchange64((volatile __int64*)&ReservationSpace->FreeVirtualAddressPointer,
+                                           (__int64) PtrOffset(pAligned, Size),
+                                           (__int64) pCurrent) != (__int64) pCurrent);
+
+    return pAligned;
+}
+
 //******************************************************************************
 // Function:     VmReservationCanAddressBeAccessed
 // Description:  Checks if an Address belonging to a VA reservation space is
@@ -85,6 +137,8 @@ VmReservationSpaceDetermineNextFreeVirtualAddress(
 // Parameter:    OUT BOOLEAN * Uncacheable
 // Parameter:    OUT_PTR_MAYBE_NULL PFILE_OBJECT * BackingFile
 // Parameter:    OUT QWORD * FileOffset
+// Parameter:    OUT BOOLEAN * SharedFile - TRUE if the modified pages must be
+//               written back to BackingFile.
 //******************************************************************************
 BOOLEAN
 VmReservationCanAddressBeAccessed(
@@ -94,7 +148,8 @@ VmReservationCanAddressBeAccessed(
     OUT                     PAGE_RIGHTS*            MemoryRights,
     OUT                     BOOLEAN*                Uncacheable,
     OUT_PTR_MAYBE_NULL      PFILE_OBJECT*           BackingFile,
-    OUT                     QWORD*                  FileOffset
+    OUT                     QWORD*                  FileOffset,
+    OUT                     BOOLEAN*                SharedFile
     );
 
 STATUS
@@ -129,3 +184,33 @@ VmReservationReturnRightsForAddress(
     IN                      QWORD                   Size,
     OUT                     PAGE_RIGHTS*            Rights
     );
+
+//******************************************************************************
+// Function:     VmReservationSpaceGetCommittedSize
+// Description:  Returns the number of bytes committed in the reservation space.
+// Returns:      QWORD
+// Parameter:    IN PVMM_RESERVATION_SPACE ReservationSpace
+//******************************************************************************
+QWORD
+VmReservationSpaceGetCommittedSize(
+    IN                      PVMM_RESERVATION_SPACE  ReservationSpace
+    );
+
+//******************************************************************************
+// Function:     VmReservationSpaceGetNextReservation
+// Description:  Retrieves the reservation with the lowest start address which
+//               is greater than or equal to Address.
+// Returns:      STATUS - STATUS_ELEMENT_NOT_FOUND if there is no such
+//               reservation.
+// Parameter:    IN PVMM_RESERVATION_SPACE ReservationSpace
+// Parameter:    IN_OPT PVOID Address
+// Parameter:    OUT PVOID* StartVa
+// Parameter:    OUT QWORD* Size
+//******************************************************************************
+STATUS
+VmReservationSpaceGetNextReservation(
+    IN                      PVMM_RESERVATION_SPACE  ReservationSpace,
+    IN_OPT                  PVOID                   Address,
+    OUT                     PVOID*                  StartVa,
+    OUT                     QWORD*                  Size
+    );
@@ -0,0 +1,115 @@
+#pragma once
+
+#include "mmu.h"
+
+typedef struct _FILE_OBJECT *PFILE_OBJECT;
+
+_No_competing_thread_
+void
+VmSwapPreinit(
+    void
+    );
+
+//******************************************************************************
+// Function:     VmSwapInit
+// Description:  Splits the swap file into page sized slots and enables the
+//               eviction of user pages.
+// Returns:      STATUS
+// Parameter:    IN PFILE_OBJECT SwapFile
+//******************************************************************************
+STATUS
+VmSwapInit(
+    IN      PFILE_OBJECT            SwapFile
+    );
+
+//******************************************************************************
+// Function:     VmSwapTrackResidentPage
+// Description:  Adds a user page to the set of pages which may be evicted
+//               when the system runs out of physical frames.
+// Returns:      void
+// Parameter:    IN PPAGING_LOCK_DATA PagingData - paging tables of the
+//               process owning the page
+// Parameter:    IN PVOID VirtualAddress
+// Parameter:    IN PHYSICAL_ADDRESS PhysicalAddress
+// Parameter:    IN BOOLEAN AlwaysWriteBack - if TRUE the page will be written
+//               to swap on eviction even if it is not dirty (its contents are
+//               found nowhere else, i.e. it was just read from swap).
+//******************************************************************************
+void
+VmSwapTrackResidentPage(
+    IN      PPAGING_LOCK_DATA       PagingData,
+    IN      PVOID                   VirtualAddress,
+    IN      PHYSICAL_ADDRESS        PhysicalAddress,
+    IN      BOOLEAN                 AlwaysWriteBack
+    );
+
+//******************************************************************************
+// Function:     VmSwapUntrackAddressSpace
+// Description:  Forgets all the resident pages belonging to an address space,
+//               must be called before the paging tables are destroyed.
+// Returns:      void
+// Parameter:    IN PPAGING_LOCK_DATA PagingData
+//******************************************************************************
+void
+VmSwapUntrackAddressSpace(
+    IN      PPAGING_LOCK_DATA       PagingData
+    );
+
+//******************************************************************************
+// Function:     VmSwapEvictPage
+// Description:  Runs the clock (second-chance) algorithm over the resident
+//               user pages and evicts a batch of pages which were not accessed
+//               since the previous pass of the clock hand. Dirty pages are
+//               written to a cluster of consecutive swap slots with a single
+//               transfer, clean pages are simply dropped.
+// Returns:      PHYSICAL_ADDRESS - one of the frames which were freed, the
+//               caller owns it and must overwrite its contents. The other
+//               frames are released to the PMM. NULL if no page could be
+//               evicted.
+// NOTE:         Blocks while the pages are written, must not be called with a
+//               spinlock held.
+//******************************************************************************
+PTR_SUCCESS
+PHYSICAL_ADDRESS
+VmSwapEvictPage(
+    void
+    );
+
+//******************************************************************************
+// Function:     VmSwapReadPage
+// Description:  Reads the contents of a swap slot into a physical frame.
+// Returns:      STATUS
+// Parameter:    IN QWORD SwapSlot
+// Parameter:    IN PHYSICAL_ADDRESS PhysicalAddress
+// NOTE:         May block on the swap file, must not be called with a
+//               spinlock held.
+//******************************************************************************
+STATUS
+VmSwapReadPage(
+    IN      QWORD                   SwapSlot,
+    IN      PHYSICAL_ADDRESS        PhysicalAddress
+    );
+
+//******************************************************************************
+// Function:     VmSwapDuplicateSlot
+// Description:  Takes an additional reference to a swap slot, used when a
+//               swapped out page becomes shared by multiple PTEs.
+// Returns:      void
+// Parameter:    IN QWORD SwapSlot
+//******************************************************************************
+void
+VmSwapDuplicateSlot(
+    IN      QWORD                   SwapSlot
+    );
+
+//******************************************************************************
+// Function:     VmSwapFreeSlot
+// Description:  Drops a reference to a swap slot, when the last reference is
+//               gone the slot is marked as unused.
+// Returns:      void
+// Parameter:    IN QWORD SwapSlot
+//******************************************************************************
+void
+VmSwapFreeSlot(
+    IN      QWORD                   SwapSlot
+    );
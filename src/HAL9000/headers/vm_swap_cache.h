@@ -0,0 +1,91 @@
+#pragma once
+
+//******************************************************************************
+// Compressed swap cache
+//
+// Pages evicted to swap are first compressed into a bounded pool of physical
+// memory. Only when the pool is full are the oldest compressed pages written
+// to the swap file, through the write back function given on initialization.
+// Pages filled with zeroes take no room at all in the pool, only the slot is
+// marked as zeroed.
+//
+// All the functions work on slots obtained by the caller from the swap file,
+// the cache only decides where the contents of a slot are kept.
+//******************************************************************************
+
+typedef
+STATUS
+(__cdecl FUNC_SwapCacheWriteBack)(
+    IN      QWORD                   SwapSlot,
+    IN_READS_BYTES(PAGE_SIZE)
+            PVOID                   Page
+    );
+
+typedef FUNC_SwapCacheWriteBack*    PFUNC_SwapCacheWriteBack;
+
+_No_competing_thread_
+void
+VmSwapCachePreinit(
+    void
+    );
+
+//******************************************************************************
+// Function:     VmSwapCacheInit
+// Description:  Reserves the memory pool used for holding compressed pages.
+// Returns:      STATUS
+// Parameter:    IN DWORD NumberOfSlots - number of slots in the swap file
+// Parameter:    IN PFUNC_SwapCacheWriteBack WriteBackFunction - called to
+//               write a page to its slot when the pool is full
+//******************************************************************************
+STATUS
+VmSwapCacheInit(
+    IN      DWORD                       NumberOfSlots,
+    IN      PFUNC_SwapCacheWriteBack    WriteBackFunction
+    );
+
+//******************************************************************************
+// Function:     VmSwapCacheInsertPage
+// Description:  Stores the contents of a page for SwapSlot in the cache.
+// Returns:      BOOLEAN - TRUE if the page was cached, FALSE if the caller must
+//               write the page to the swap file itself (the page could not be
+//               compressed well enough or the pool is full).
+// Parameter:    IN QWORD SwapSlot
+// Parameter:    IN PVOID Page
+//******************************************************************************
+BOOLEAN
+VmSwapCacheInsertPage(
+    IN      QWORD                   SwapSlot,
+    IN_READS_BYTES(PAGE_SIZE)
+            PVOID                   Page
+    );
+
+//******************************************************************************
+// Function:     VmSwapCacheRetrievePage
+// Description:  Restores the contents of SwapSlot if they are cached.
+// Returns:      BOOLEAN - TRUE if the page was found in the cache, FALSE if it
+//               must be read from the swap file.
+// Parameter:    IN QWORD SwapSlot
+// Parameter:    OUT PVOID Page
+// Parameter:    IN BOOLEAN Discard - if TRUE the cached copy is dropped, this
+//               is the case when the last reference to the slot becomes
+//               resident.
+//******************************************************************************
+BOOLEAN
+VmSwapCacheRetrievePage(
+    IN      QWORD                   SwapSlot,
+    OUT_WRITES_BYTES(PAGE_SIZE)
+            PVOID                   Page,
+    IN      BOOLEAN                 Discard
+    );
+
+//******************************************************************************
+// Function:     VmSwapCacheDiscardPage
+// Description:  Drops the cached contents of SwapSlot (if any), called when
+//               the slot is freed.
+// Returns:      void
+// Parameter:    IN QWORD SwapSlot
+//******************************************************************************
+void
+VmSwapCacheDiscardPage(
+    IN      QWORD                   SwapSlot
+    );
@@ -0,0 +1,170 @@
+#pragma once
+
+#include "mmu.h"
+
+//******************************************************************************
+// TLB shootdown
+//
+// The invalidations required after modifying the paging tables of a user
+// address space are gathered in a batch while the paging lock is held. Once
+// the lock is released the batch is flushed: the local TLB is invalidated and
+// a single IPI is sent to the other CPUs which ran the address space since
+// they last flushed it, the caller waits until all of them are done.
+//
+// Kernel VAs are handed out by a bump allocator and are never mapped again
+// after being unmapped => for the kernel address space only the local TLB is
+// invalidated, this is the same reasoning behind lazy kernel TLB flushing.
+//
+// PCIDs are not tied to processes: each CPU tags the address spaces it runs
+// with PCIDs from a small private cache. Each shootdown increments the
+// generation of the address space, the CPUs which are not running it only
+// forget about it and flush the PCID when they load the paging tables again.
+// Switching to an address space whose cached generation is still current
+// doesn't flush anything.
+//******************************************************************************
+
+// Batches invalidating more pages than this flush the whole address space
+#define VM_TLB_BATCH_MAX_PAGES          32
+
+// Maximum number of runs of contiguous frames whose release is deferred
+// until the batch is flushed
+#define VM_TLB_BATCH_MAX_FRAME_RUNS     32
+
+typedef struct _VM_TLB_FRAME_RUN
+{
+    PHYSICAL_ADDRESS                PhysicalAddress;
+    DWORD                           NumberOfFrames;
+} VM_TLB_FRAME_RUN, *PVM_TLB_FRAME_RUN;
+
+typedef struct _VM_TLB_BATCH
+{
+    PPAGING_DATA                    PagingData;
+
+    // Set when more than VM_TLB_BATCH_MAX_PAGES pages were added
+    BOOLEAN                         FlushAll;
+
+    DWORD                           NumberOfPages;
+    PVOID                           Pages[VM_TLB_BATCH_MAX_PAGES];
+
+    // Frames unmapped from the address space, they may still be reached
+    // through the stale TLB entries of other CPUs until the batch is flushed
+    DWORD                           NumberOfFrameRuns;
+    VM_TLB_FRAME_RUN                FrameRuns[VM_TLB_BATCH_MAX_FRAME_RUNS];
+} VM_TLB_BATCH, *PVM_TLB_BATCH;
+
+//******************************************************************************
+// Function:     VmTlbInitAddressSpace
+// Description:  Assigns a new context ID to the address space, must be called
+//               before its paging tables are first loaded.
+// Returns:      void
+// Parameter:    OUT PPAGING_DATA PagingData
+//******************************************************************************
+void
+VmTlbInitAddressSpace(
+    OUT     PPAGING_DATA            PagingData
+    );
+
+//******************************************************************************
+// Function:     VmTlbBatchInit
+// Description:  Prepares an empty batch for the address space described by
+//               PagingData.
+// Returns:      void
+// Parameter:    OUT PVM_TLB_BATCH Batch
+// Parameter:    IN PPAGING_DATA PagingData
+//******************************************************************************
+void
+VmTlbBatchInit(
+    OUT     PVM_TLB_BATCH           Batch,
+    IN      PPAGING_DATA            PagingData
+    );
+
+//******************************************************************************
+// Function:     VmTlbBatchAddPage
+// Description:  Records a page whose translation was changed or removed. For
+//               the kernel address space the page is invalidated on the spot.
+//               If the page was mapped through a large page any address inside
+//               it can be given.
+// Returns:      void
+// Parameter:    INOUT PVM_TLB_BATCH Batch
+// Parameter:    IN PVOID VirtualAddress
+//******************************************************************************
+void
+VmTlbBatchAddPage(
+    INOUT   PVM_TLB_BATCH           Batch,
+    IN      PVOID                   VirtualAddress
+    );
+
+//******************************************************************************
+// Function:     VmTlbBatchReleaseFrames
+// Description:  Defers the release of frames which were unmapped from the
+//               address space until the batch is flushed. Contiguous frames
+//               are released together.
+// Returns:      void
+// Parameter:    INOUT PVM_TLB_BATCH Batch
+// Parameter:    IN PHYSICAL_ADDRESS PhysicalAddress
+// Parameter:    IN DWORD NumberOfFrames
+// NOTE:         The caller must check with VmTlbBatchIsFull that there is
+//               room left in the batch.
+//******************************************************************************
+void
+VmTlbBatchReleaseFrames(
+    INOUT   PVM_TLB_BATCH           Batch,
+    IN      PHYSICAL_ADDRESS        PhysicalAddress,
+    IN      DWORD                   NumberOfFrames
+    );
+
+//******************************************************************************
+// Function:     VmTlbBatchIsFull
+// Description:  Checks if the batch can still hold frames to release.
+// Returns:      BOOLEAN - TRUE if the batch must be flushed before any other
+//               frames are unmapped.
+// Parameter:    IN PVM_TLB_BATCH Batch
+//******************************************************************************
+BOOLEAN
+VmTlbBatchIsFull(
+    IN      PVM_TLB_BATCH           Batch
+    );
+
+//******************************************************************************
+// Function:     VmTlbBatchFlush
+// Description:  Invalidates the pages recorded in the batch on all the CPUs
+//               which may cache translations of the address space, releases
+//               the deferred frames and empties the batch.
+// Returns:      void
+// Parameter:    INOUT PVM_TLB_BATCH Batch
+// NOTE:         Unless the batch is empty no spinlock may be held by the
+//               caller (and especially no paging lock): the other CPUs may be
+//               spinning on it with interrupts disabled and would never
+//               acknowledge the IPI.
+//******************************************************************************
+void
+VmTlbBatchFlush(
+    INOUT   PVM_TLB_BATCH           Batch
+    );
+
+//******************************************************************************
+// Function:     VmTlbActivateAddressSpace
+// Description:  Loads the paging tables of the address space on the current
+//               CPU using the PCID the CPU assigned to it. The translations
+//               tagged with the PCID are flushed only if the PCID was taken
+//               from another address space or if the address space was shot
+//               down since the CPU last ran it.
+// Returns:      void
+// Parameter:    INOUT PPAGING_DATA PagingData
+//******************************************************************************
+void
+VmTlbActivateAddressSpace(
+    INOUT   PPAGING_DATA            PagingData
+    );
+
+//******************************************************************************
+// Function:     VmTlbServiceRequests
+// Description:  Performs the invalidations other CPUs are waiting for, must be
+//               called by code spinning with interrupts disabled for a resource
+//               whose owner may be flushing a batch.
+// Returns:      void
+//******************************************************************************
+void
+VmTlbServiceRequests(
+    void
+    );
@@ -2,6 +2,7 @@
 
 #include "mmu.h"
 #include "pte.h"
+#include "vm_tlb.h"
 
 typedef struct _FILE_OBJECT* PFILE_OBJECT;
 
@@ -9,6 +10,9 @@ typedef struct _VMM_RESERVATION_SPACE* PVMM_RESERVATION_SPACE;
 
 typedef struct _MDL *PMDL;
 
+// Slot value used when no swap slot is available
+#define VMM_INVALID_SWAP_SLOT           MAX_QWORD
+
 _No_competing_thread_
 void
 VmmPreinit(
@@ -43,38 +47,55 @@ VmmMapMemoryEx(
     IN      BOOLEAN                 Uncacheable
     );
 
+#define VmmMapMemoryInternal(...)   VmmMapMemoryInternalEx(__VA_ARGS__, FALSE, NULL)
+
 //******************************************************************************
-// Function:     VmmMapMemoryInternal
+// Function:     VmmMapMemoryInternalEx
 // Description:  Same as VmmMapMemoryEx except it maps the address to an
-//               explicit virtual address.
+//               explicit virtual address. If LargePages is set each 2MB
+//               aligned chunk of the range whose physical address is also
+//               2MB aligned is mapped using a single PDE. The mappings which
+//               replace present entries are recorded in Batch, if Batch is
+//               NULL only the local TLB is invalidated (the paging tables are
+//               not in use on other CPUs).
 /// NOTE:        This should be used used only in the vmm and mmu files
 //******************************************************************************
 void
-VmmMapMemoryInternal(
+VmmMapMemoryInternalEx(
     IN      PPAGING_DATA            PagingData,
     IN      PHYSICAL_ADDRESS        PhysicalAddress,
     IN      QWORD                   Size,
     IN      PVOID                   BaseAddress,
     IN      PAGE_RIGHTS             PageRights,
     IN      BOOLEAN                 Invalidate,
-    IN      BOOLEAN                 Uncacheable
+    IN      BOOLEAN                 Uncacheable,
+    IN      BOOLEAN                 LargePages,
+    IN_OPT  PVM_TLB_BATCH           Batch
     );
 
 //******************************************************************************
 // Function:     VmmUnmapMemoryEx
 // Description:  Unmaps a previously mapped VA with VmmMapMemoryEx or
-//               VmmMapMemoryInternal
-// Returns:      void
-// Parameter:    IN PML4 Cr3 - paging tables
+//               VmmMapMemoryInternal. Large pages only partially covered by
+//               the range are first split into 4KB pages.
+// Returns:      QWORD - number of bytes unmapped, less than Size if Batch
+//               cannot hold any more frames to release. The caller must flush
+//               the batch and unmap the rest of the range.
+// Parameter:    IN PPAGING_DATA PagingData - paging tables, the paging
+//               structure frames are needed in case a large page is split
 // Parameter:    IN PVOID VirtualAddress
 // Parameter:    IN DWORD Size - PAGE_SIZE aligned number of bytes to unmap
+// Parameter:    IN BOOLEAN ReleaseMemory
+// Parameter:    INOUT PVM_TLB_BATCH Batch - receives the pages to invalidate
+//               and the frames to release once no CPU can reach them
 //******************************************************************************
-void
+QWORD
 VmmUnmapMemoryEx(
-    IN      PML4                    Cr3,
+    IN      PPAGING_DATA            PagingData,
     IN      PVOID                   VirtualAddress,
     IN      QWORD                   Size,
-    IN      BOOLEAN                 ReleaseMemory
+    IN      BOOLEAN                 ReleaseMemory,
+    INOUT   PVM_TLB_BATCH           Batch
     );
 
 #define VmmGetPhysicalAddress(Cr3,Va)   VmmGetPhysicalAddressEx((Cr3),(Va),NULL,NULL)
@@ -101,6 +122,115 @@ VmmGetPhysicalAddressEx(
     OUT_OPT BOOLEAN*                Dirty
     );
 
+//******************************************************************************
+// Function:     VmmBeginPageEviction
+// Description:  Marks the 4KB PTE of VirtualAddress not present while keeping
+//               the frame it maps, a fault on the page simply maps it back.
+//               The TLBs of all the CPUs must be flushed before the eviction
+//               is completed with VmmSwapOutPage.
+// Returns:      PHYSICAL_ADDRESS - the frame which is mapped, NULL if the
+//               address is not mapped through a present 4KB PTE.
+// Parameter:    IN PPAGING_DATA PagingData
+// Parameter:    IN PVOID VirtualAddress
+// NOTE:         The caller must hold the paging data lock exclusively.
+//******************************************************************************
+PTR_SUCCESS
+PHYSICAL_ADDRESS
+VmmBeginPageEviction(
+    IN      PPAGING_DATA            PagingData,
+    IN      PVOID                   VirtualAddress
+    );
+
+//******************************************************************************
+// Function:     VmmSwapOutPage
+// Description:  Completes the eviction started by VmmBeginPageEviction. If
+//               the page must be written back (it is dirty or AlwaysWriteBack
+//               is set) the PTE is replaced with a not present entry
+//               describing SwapSlot, else the PTE is simply cleared.
+// Returns:      BOOLEAN - TRUE if the frame is no longer mapped, FALSE if the
+//               page is mapped again: it was accessed in the meantime or it
+//               must be written back and SwapSlot is VMM_INVALID_SWAP_SLOT.
+// Parameter:    IN PPAGING_DATA PagingData
+// Parameter:    IN PVOID VirtualAddress
+// Parameter:    IN PHYSICAL_ADDRESS PhysicalAddress - the frame returned by
+//               VmmBeginPageEviction
+// Parameter:    IN QWORD SwapSlot
+// Parameter:    IN BOOLEAN AlwaysWriteBack
+// Parameter:    OUT BOOLEAN* WriteBack - TRUE if the page contents must be
+//               written to SwapSlot.
+// Parameter:    OUT_OPT QWORD* PreviousEntry - the PTE value before the page
+//               was swapped out, can be used with VmmRestorePageEntry.
+// NOTE:         The caller must hold the paging data lock exclusively.
+//******************************************************************************
+BOOLEAN
+VmmSwapOutPage(
+    IN      PPAGING_DATA            PagingData,
+    IN      PVOID                   VirtualAddress,
+    IN      PHYSICAL_ADDRESS        PhysicalAddress,
+    IN      QWORD                   SwapSlot,
+    IN      BOOLEAN                 AlwaysWriteBack,
+    OUT     BOOLEAN*                WriteBack,
+    OUT_OPT QWORD*                  PreviousEntry
+    );
+
+//******************************************************************************
+// Function:     VmmRestorePageEntry
+// Description:  Restores a PTE previously modified by VmmSwapOutPage, used
+//               when the page could not be written to swap. The PTE is
+//               restored only if it still describes SwapSlot.
+// Returns:      BOOLEAN - TRUE if the PTE was restored, FALSE if the page was
+//               already brought back or unmapped in the meantime.
+// Parameter:    IN PPAGING_DATA PagingData
+// Parameter:    IN PVOID VirtualAddress
+// Parameter:    IN QWORD SwapSlot
+// Parameter:    IN QWORD PreviousEntry
+//******************************************************************************
+BOOLEAN
+VmmRestorePageEntry(
+    IN      PPAGING_DATA            PagingData,
+    IN      PVOID                   VirtualAddress,
+    IN      QWORD                   SwapSlot,
+    IN      QWORD                   PreviousEntry
+    );
+
+//******************************************************************************
+// Function:     VmmCleanPage
+// Description:  Clears the dirty bit of the 4KB PTE of VirtualAddress and adds
+//               the page to Batch. The page contents may be written back only
+//               after the batch is flushed, later writes set the bit again.
+// Returns:      PHYSICAL_ADDRESS - the frame mapped, NULL if the page is not
+//               mapped through a present 4KB PTE or if it is not dirty.
+// Parameter:    IN PPAGING_DATA PagingData
+// Parameter:    IN PVOID VirtualAddress
+// Parameter:    INOUT PVM_TLB_BATCH Batch
+// NOTE:         The caller must hold the paging data lock exclusively.
+//******************************************************************************
+PTR_SUCCESS
+PHYSICAL_ADDRESS
+VmmCleanPage(
+    IN      PPAGING_DATA            PagingData,
+    IN      PVOID                   VirtualAddress,
+    INOUT   PVM_TLB_BATCH           Batch
+    );
+
+//******************************************************************************
+// Function:     VmmMarkPageDirty
+// Description:  Sets the dirty bit of a page cleaned with VmmCleanPage whose
+//               contents could not be written back. Nothing is done if the
+//               page no longer maps PhysicalAddress.
+// Returns:      void
+// Parameter:    IN PPAGING_DATA PagingData
+// Parameter:    IN PVOID VirtualAddress
+// Parameter:    IN PHYSICAL_ADDRESS PhysicalAddress
+// NOTE:         The caller must hold the paging data lock exclusively.
+//******************************************************************************
+void
+VmmMarkPageDirty(
+    IN      PPAGING_DATA            PagingData,
+    IN      PVOID                   VirtualAddress,
+    IN      PHYSICAL_ADDRESS        PhysicalAddress
+    );
+
 //******************************************************************************
 // Function:     VmmPreparePagingData
 // Description:  Retrieves the PAT indices required for mapping uncacheable and
@@ -159,6 +289,36 @@ VmmInitReservationSystem(
     void
     );
 
+//******************************************************************************
+// Function:     VmmInitZeroFrame
+// Description:  Allocates the frame filled with zeroes which is shared by all
+//               the anonymous user pages until they are first written. Without
+//               it each page fault allocates a private frame.
+// Returns:      STATUS
+//******************************************************************************
+_No_competing_thread_
+STATUS
+VmmInitZeroFrame(
+    void
+    );
+
+//******************************************************************************
+// Function:     VmmBreakCopyOnWrite
+// Description:  Gives a private frame to each page in the range which is
+//               currently shared copy-on-write, must be called before the
+//               physical frames of a user buffer are written directly.
+// Returns:      STATUS
+// Parameter:    IN PVOID VirtualAddress
+// Parameter:    IN QWORD Size
+// Parameter:    IN PPAGING_LOCK_DATA PagingData
+//******************************************************************************
+STATUS
+VmmBreakCopyOnWrite(
+    IN      PVOID                   VirtualAddress,
+    IN      QWORD                   Size,
+    IN      PPAGING_LOCK_DATA       PagingData
+    );
+
 #define VmmAllocRegion(Addr,Size,Type,Rights)       VmmAllocRegionEx((Addr),(Size),(Type),(Rights),FALSE, NULL, NULL, NULL, NULL)
 
 //******************************************************************************
@@ -278,13 +438,18 @@ VmmCreateVirtualAddressSpace(
 //******************************************************************************
 // Function:     VmmDestroyVirtualAddressSpace
 // Description:  Destroys a previously created VAS by VmmCreateVirtualAddressSpace
+//               and releases the frames mapped in each of its reservations.
 // Returns:      void
 // Parameter:    PVMM_RESERVATION_SPACE ReservationSpace
+// Parameter:    IN_OPT PPAGING_LOCK_DATA PagingData - the paging tables the
+//               reservations were mapped in, if NULL no frames are released.
+// NOTE:         The pages must no longer be tracked for eviction.
 //******************************************************************************
 void
 VmmDestroyVirtualAddressSpace(
     _Pre_valid_ _Post_ptr_invalid_
-            PVMM_RESERVATION_SPACE          ReservationSpace
+            PVMM_RESERVATION_SPACE          ReservationSpace,
+    IN_OPT  PPAGING_LOCK_DATA               PagingData
     );
 
 //******************************************************************************
@@ -307,3 +472,19 @@ VmmIsBufferValid(
     IN          PVMM_RESERVATION_SPACE              ReservationSpace,
     IN          BOOLEAN                             KernelAccess
     );
+
+//******************************************************************************
+// Function:     VmmRetrieveStatistics
+// Description:  Retrieves the memory statistics of an address space.
+// Returns:      void
+// Parameter:    IN PPAGING_LOCK_DATA PagingData
+// Parameter:    IN_OPT PVMM_RESERVATION_SPACE ReservationSpace - if NULL the
+//               committed memory of the system process is retrieved.
+// Parameter:    OUT PPROCESS_MEMORY_STATISTICS Statistics
+//******************************************************************************
+void
+VmmRetrieveStatistics(
+    IN          PPAGING_LOCK_DATA                   PagingData,
+    IN_OPT      PVMM_RESERVATION_SPACE              ReservationSpace,
+    OUT         PPROCESS_MEMORY_STATISTICS          Statistics
+    );
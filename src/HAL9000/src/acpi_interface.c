@@ -48,6 +48,18 @@ typedef struct _ACPI_PRT_ENTRY
     LIST_ENTRY                  ListEntry;
 } ACPI_PRT_ENTRY, *PACPI_PRT_ENTRY;
 
+typedef struct _ACPI_CPU_AFFINITY_ENTRY
+{
+    ACPI_SRAT_CPU_AFFINITY      Data;
+    LIST_ENTRY                  ListEntry;
+} ACPI_CPU_AFFINITY_ENTRY, *PACPI_CPU_AFFINITY_ENTRY;
+
+typedef struct _ACPI_MEMORY_AFFINITY_ENTRY
+{
+    ACPI_SRAT_MEM_AFFINITY      Data;
+    LIST_ENTRY                  ListEntry;
+} ACPI_MEMORY_AFFINITY_ENTRY, *PACPI_MEMORY_AFFINITY_ENTRY;
+
 typedef struct _ACPI_INTERFACE_DATA
 {
     LIST_ENTRY                  CpuList;
@@ -55,6 +67,13 @@ typedef struct _ACPI_INTERFACE_DATA
     LIST_ENTRY                  IntOverrideList;
     LIST_ENTRY                  McfgList;
     LIST_ENTRY                  PrtList;
+    LIST_ENTRY                  CpuAffinityList;
+    LIST_ENTRY                  MemoryAffinityList;
+
+    // LocalityCount x LocalityCount matrix copied from the SLIT, NULL if the
+    // firmware doesn't describe the distances between proximity domains
+    QWORD                       LocalityCount;
+    PBYTE                       LocalityDistances;
 } ACPI_INTERFACE_DATA, *PACPI_INTERFACE_DATA;
 
 static ACPI_INTERFACE_DATA      m_acpiData;
@@ -71,6 +90,18 @@ _AcpiInterfaceParseMcfg(
     void
     );
 
+static
+STATUS
+_AcpiInterfaceParseSrat(
+    void
+    );
+
+static
+STATUS
+_AcpiInterfaceParseSlit(
+    void
+    );
+
 static
 STATUS
 _AcpiInterfaceParsePrts(
@@ -105,6 +136,8 @@ AcpiInterfacePreinit(
     InitializeListHead(&m_acpiData.IntOverrideList);
     InitializeListHead(&m_acpiData.McfgList);
     InitializeListHead(&m_acpiData.PrtList);
+    InitializeListHead(&m_acpiData.CpuAffinityList);
+    InitializeListHead(&m_acpiData.MemoryAffinityList);
 }
 
 STATUS
@@ -153,6 +186,39 @@ AcpiInterfaceInit(
         LOGL("Successfully parsed MCFG\n");
     }
 
+    // if there is no SRAT the system is treated as having a single node
+    status = _AcpiInterfaceParseSrat();
+    if (!SUCCEEDED(status))
+    {
+        LOG_FUNC_ERROR("_AcpiInterfaceParseSrat", status);
+        if (status != STATUS_DEVICE_DOES_NOT_EXIST)
+        {
+            return status;
+        }
+
+        status = STATUS_SUCCESS;
+    }
+    else
+    {
+        LOGL("Successfully parsed SRAT\n");
+
+        status = _AcpiInterfaceParseSlit();
+        if (!SUCCEEDED(status))
+        {
+            LOG_FUNC_ERROR("_AcpiInterfaceParseSlit", status);
+            if (status != STATUS_DEVICE_DOES_NOT_EXIST)
+            {
+                return status;
+            }
+
+            status = STATUS_SUCCESS;
+        }
+        else
+        {
+            LOGL("Successfully parsed SLIT\n");
+        }
+    }
+
 
     LOG_FUNC_END;
 
@@ -409,6 +475,104 @@ AcpiRetrieveNextPrtEntry(
     return STATUS_SUCCESS;
 }
 
+STATUS
+AcpiRetrieveNextCpuAffinity(
+    IN      BOOLEAN                     RestartSearch,
+    OUT_PTR ACPI_SRAT_CPU_AFFINITY**    AcpiEntry
+    )
+{
+    PACPI_CPU_AFFINITY_ENTRY pEntry;
+
+    static PLIST_ENTRY __pCurEntry = NULL;
+
+    if (NULL == AcpiEntry)
+    {
+        return STATUS_INVALID_PARAMETER2;
+    }
+
+    if (RestartSearch)
+    {
+        __pCurEntry = m_acpiData.CpuAffinityList.Flink;
+    }
+
+    if (__pCurEntry == &m_acpiData.CpuAffinityList)
+    {
+        return STATUS_NO_MORE_OBJECTS;
+    }
+
+    pEntry = CONTAINING_RECORD(__pCurEntry, ACPI_CPU_AFFINITY_ENTRY, ListEntry);
+    __pCurEntry = __pCurEntry->Flink;
+
+    *AcpiEntry = &pEntry->Data;
+
+    return STATUS_SUCCESS;
+}
+
+STATUS
+AcpiRetrieveNextMemoryAffinity(
+    IN      BOOLEAN                     RestartSearch,
+    OUT_PTR ACPI_SRAT_MEM_AFFINITY**    AcpiEntry
+    )
+{
+    PACPI_MEMORY_AFFINITY_ENTRY pEntry;
+
+    static PLIST_ENTRY __pCurEntry = NULL;
+
+    if (NULL == AcpiEntry)
+    {
+        return STATUS_INVALID_PARAMETER2;
+    }
+
+    if (RestartSearch)
+    {
+        __pCurEntry = m_acpiData.MemoryAffinityList.Flink;
+    }
+
+    if (__pCurEntry == &m_acpiData.MemoryAffinityList)
+    {
+        return STATUS_NO_MORE_OBJECTS;
+    }
+
+    pEntry = CONTAINING_RECORD(__pCurEntry, ACPI_MEMORY_AFFINITY_ENTRY, ListEntry);
+    __pCurEntry = __pCurEntry->Flink;
+
+    *AcpiEntry = &pEntry->Data;
+
+    return STATUS_SUCCESS;
+}
+
+STATUS
+AcpiRetrieveLocalityDistance(
+    IN      DWORD                       FromProximityDomain,
+    IN      DWORD                       ToProximityDomain,
+    OUT     BYTE*                       Distance
+    )
+{
+    if (NULL == Distance)
+    {
+        return STATUS_INVALID_PARAMETER3;
+    }
+
+    if (NULL == m_acpiData.LocalityDistances)
+    {
+        return STATUS_DEVICE_DOES_NOT_EXIST;
+    }
+
+    if (FromProximityDomain >= m_acpiData.LocalityCount)
+    {
+        return STATUS_INVALID_PARAMETER1;
+    }
+
+    if (ToProximityDomain >= m_acpiData.LocalityCount)
+    {
+        return STATUS_INVALID_PARAMETER2;
+    }
+
+    *Distance = m_acpiData.LocalityDistances[FromProximityDomain * m_acpiData.LocalityCount + ToProximityDomain];
+
+    return STATUS_SUCCESS;
+}
+
 static
 STATUS
 _AcpiInterfaceParseMadt(
@@ -559,6 +723,164 @@ _AcpiInterfaceParseMcfg(
     return STATUS_SUCCESS;
 }
 
+static
+STATUS
+_AcpiInterfaceParseSrat(
+    void
+    )
+{
+    ACPI_TABLE_HEADER* table;
+    ACPI_STATUS acpiStatus;
+    DWORD actualTableLength;
+    DWORD offsetInTable;
+    ACPI_SUBTABLE_HEADER* pHeader;
+    PBYTE pData;
+
+    acpiStatus = AcpiGetTable(ACPI_SIG_SRAT, 1, &table);
+    if (AE_OK != acpiStatus)
+    {
+        LOG_FUNC_ERROR("AcpiGetTable", acpiStatus);
+        return acpiStatus == AE_NOT_FOUND ? STATUS_DEVICE_DOES_NOT_EXIST : STATUS_UNSUCCESSFUL;
+    }
+
+    offsetInTable = 0;
+    actualTableLength = table->Length - sizeof(ACPI_TABLE_SRAT);
+    pData = (BYTE*)table + sizeof(ACPI_TABLE_SRAT);
+    while (offsetInTable < actualTableLength)
+    {
+        pHeader = (ACPI_SUBTABLE_HEADER*)&(pData[offsetInTable]);
+        if (0 == pHeader->Length)
+        {
+            LOG_ERROR("SRAT entry at offset 0x%x has a zero length\n", offsetInTable);
+            return STATUS_UNSUCCESSFUL;
+        }
+
+        if (ACPI_SRAT_TYPE_CPU_AFFINITY == pHeader->Type
+            || ACPI_SRAT_TYPE_X2APIC_CPU_AFFINITY == pHeader->Type)
+        {
+            ACPI_SRAT_CPU_AFFINITY cpuAffinity;
+
+            memzero(&cpuAffinity, sizeof(ACPI_SRAT_CPU_AFFINITY));
+
+            if (ACPI_SRAT_TYPE_CPU_AFFINITY == pHeader->Type)
+            {
+                memcpy(&cpuAffinity, pHeader, sizeof(ACPI_SRAT_CPU_AFFINITY));
+            }
+            else
+            {
+                ACPI_SRAT_X2APIC_CPU_AFFINITY* pX2Apic = (ACPI_SRAT_X2APIC_CPU_AFFINITY*)pHeader;
+
+                // we only use xAPIC mode => CPUs with larger IDs are not used
+                if (pX2Apic->ApicId > MAX_BYTE)
+                {
+                    offsetInTable = offsetInTable + pHeader->Length;
+                    continue;
+                }
+
+                // store it in the same format as the xAPIC entries
+                cpuAffinity.Header = pX2Apic->Header;
+                cpuAffinity.ApicId = (BYTE) pX2Apic->ApicId;
+                cpuAffinity.Flags = pX2Apic->Flags;
+                cpuAffinity.ProximityDomainLo = (BYTE) pX2Apic->ProximityDomain;
+                cpuAffinity.ProximityDomainHi[0] = (BYTE) (pX2Apic->ProximityDomain >> 8);
+                cpuAffinity.ProximityDomainHi[1] = (BYTE) (pX2Apic->ProximityDomain >> 16);
+                cpuAffinity.ProximityDomainHi[2] = (BYTE) (pX2Apic->ProximityDomain >> 24);
+            }
+
+            if (IsBooleanFlagOn(cpuAffinity.Flags, ACPI_SRAT_CPU_ENABLED))
+            {
+                PACPI_CPU_AFFINITY_ENTRY pEntry = ExAllocatePoolWithTag(PoolAllocateZeroMemory, sizeof(ACPI_CPU_AFFINITY_ENTRY), HEAP_ACPIIF_TAG, 0);
+                if (NULL == pEntry)
+                {
+                    LOG_FUNC_ERROR_ALLOC("HeapAllocatePoolWithTag", sizeof(ACPI_CPU_AFFINITY_ENTRY));
+                    return STATUS_HEAP_NO_MORE_MEMORY;
+                }
+
+                LOG("CPU with APIC ID 0x%x is in proximity domain %u\n",
+                    cpuAffinity.ApicId, AcpiSratCpuProximityDomain(&cpuAffinity));
+
+                memcpy(&pEntry->Data, &cpuAffinity, sizeof(ACPI_SRAT_CPU_AFFINITY));
+
+                InsertTailList(&m_acpiData.CpuAffinityList, &pEntry->ListEntry);
+            }
+        }
+        else if (ACPI_SRAT_TYPE_MEMORY_AFFINITY == pHeader->Type)
+        {
+            ACPI_SRAT_MEM_AFFINITY* pMemory = (ACPI_SRAT_MEM_AFFINITY*)pHeader;
+
+            if (IsBooleanFlagOn(pMemory->Flags, ACPI_SRAT_MEM_ENABLED))
+            {
+                PACPI_MEMORY_AFFINITY_ENTRY pEntry = ExAllocatePoolWithTag(PoolAllocateZeroMemory, sizeof(ACPI_MEMORY_AFFINITY_ENTRY), HEAP_ACPIIF_TAG, 0);
+                if (NULL == pEntry)
+                {
+                    LOG_FUNC_ERROR_ALLOC("HeapAllocatePoolWithTag", sizeof(ACPI_MEMORY_AFFINITY_ENTRY));
+                    return STATUS_HEAP_NO_MORE_MEMORY;
+                }
+
+                LOG("Memory [0x%X, 0x%X) is in proximity domain %u\n",
+                    pMemory->BaseAddress, pMemory->BaseAddress + pMemory->Length, pMemory->ProximityDomain);
+
+                memcpy(&pEntry->Data, pMemory, sizeof(ACPI_SRAT_MEM_AFFINITY));
+
+                InsertTailList(&m_acpiData.MemoryAffinityList, &pEntry->ListEntry);
+            }
+        }
+        else
+        {
+            LOG("SRAT entry type: 0x%x\n", pHeader->Type);
+        }
+
+        offsetInTable = offsetInTable + pHeader->Length;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static
+STATUS
+_AcpiInterfaceParseSlit(
+    void
+    )
+{
+    ACPI_TABLE_HEADER* table;
+    ACPI_TABLE_SLIT* pSlit;
+    ACPI_STATUS acpiStatus;
+    QWORD noOfEntries;
+
+    acpiStatus = AcpiGetTable(ACPI_SIG_SLIT, 1, &table);
+    if (AE_OK != acpiStatus)
+    {
+        LOG_FUNC_ERROR("AcpiGetTable", acpiStatus);
+        return acpiStatus == AE_NOT_FOUND ? STATUS_DEVICE_DOES_NOT_EXIST : STATUS_UNSUCCESSFUL;
+    }
+
+    pSlit = (ACPI_TABLE_SLIT*)table;
+
+    noOfEntries = pSlit->LocalityCount * pSlit->LocalityCount;
+    if (0 == pSlit->LocalityCount
+        || noOfEntries > table->Length - FIELD_OFFSET(ACPI_TABLE_SLIT, Entry))
+    {
+        LOG_ERROR("SLIT describes %U localities but it is only 0x%x bytes long\n",
+                  pSlit->LocalityCount, table->Length);
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    // the table may be unmapped by ACPICA => keep a copy of the distances
+    m_acpiData.LocalityDistances = ExAllocatePoolWithTag(0, (DWORD) noOfEntries, HEAP_ACPIIF_TAG, 0);
+    if (NULL == m_acpiData.LocalityDistances)
+    {
+        LOG_FUNC_ERROR_ALLOC("HeapAllocatePoolWithTag", (DWORD) noOfEntries);
+        return STATUS_HEAP_NO_MORE_MEMORY;
+    }
+
+    memcpy(m_acpiData.LocalityDistances, pSlit->Entry, (DWORD) noOfEntries);
+    m_acpiData.LocalityCount = pSlit->LocalityCount;
+
+    LOG("SLIT describes %U localities\n", m_acpiData.LocalityCount);
+
+    return STATUS_SUCCESS;
+}
+
 static
 STATUS
 _AcpiInterfaceParsePrts(
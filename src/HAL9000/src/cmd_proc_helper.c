@@ -7,12 +7,7 @@
 #include "dmp_process.h"
 #include "strutils.h"
 #include "test_process.h"
-
-typedef struct _PROC_STAT_CTX
-{
-    PID             ProcessPid;
-    BOOLEAN         FoundProcess;
-} PROC_STAT_CTX, *PPROC_STAT_CTX;
+#include "mmu.h"
 
 #pragma warning(push)
 
@@ -39,6 +34,12 @@ _CmdHelperPrintProcessFunctions(
 
 static FUNC_ListFunction _CmdProcessPrint;
 
+static
+void
+_CmdProcessPrintMemoryStatistics(
+    IN      PPROCESS        Process
+    );
+
 void
 (__cdecl CmdListProcesses)(
     IN      QWORD       NumberOfParameters
@@ -64,22 +65,23 @@ void
     IN      char*       PidString
     )
 {
-    PROC_STAT_CTX statCtx = { 0 };
-    STATUS status;
+    PPROCESS pProcess;
     PID pid;
 
     ASSERT(NumberOfParameters == 1);
     atoi64(&pid, PidString, BASE_HEXA);
 
-    statCtx.ProcessPid = pid;
-
-    status = ProcessExecuteForEachProcessEntry(_CmdProcessPrint, &statCtx);
-    ASSERT(SUCCEEDED(status));
-
-    if (!statCtx.FoundProcess)
+    pProcess = ProcessRetrieveById(pid);
+    if (NULL == pProcess)
     {
-        pwarn("Process with PID 0x%X does not exist!\n", statCtx.ProcessPid);
+        pwarn("Process with PID 0x%X does not exist!\n", pid);
+        return;
     }
+
+    DumpProcess(pProcess);
+    _CmdProcessPrintMemoryStatistics(pProcess);
+
+    ProcessCloseHandle(pProcess);
 }
 
 void
@@ -115,35 +117,59 @@ STATUS
     )
 {
     PPROCESS pProcess;
+    DWORD cmdLineLength;
 
     ASSERT(NULL != ListEntry);
+    ASSERT(NULL == FunctionContext);
 
     pProcess = CONTAINING_RECORD(ListEntry, PROCESS, NextProcess);
 
-    if (FunctionContext == NULL)
-    {
-        DWORD cmdLineLength = strlen(pProcess->FullCommandLine);
-        ASSERT(cmdLineLength != INVALID_STRING_SIZE);
-
-        printf("%9x%c", pProcess->Id, '|');
-        printf("%9u%c", pProcess->NumberOfArguments, '|');
-        printf(cmdLineLength > 38 ? "%35S...%c" : "%38S%c", pProcess->FullCommandLine, '|');
-        printf("%8U%c", pProcess->NumberOfThreads, '|');
-        printf("%11U%c", pProcess->RefCnt.ReferenceCount, '|');
-    }
-    else
-    {
-        PPROC_STAT_CTX pCtx = (PPROC_STAT_CTX) FunctionContext;
+    cmdLineLength = strlen(pProcess->FullCommandLine);
+    ASSERT(cmdLineLength != INVALID_STRING_SIZE);
 
-        if (pCtx->ProcessPid == pProcess->Id)
-        {
-            pCtx->FoundProcess = TRUE;
+    printf("%9x%c", pProcess->Id, '|');
+    printf("%9u%c", pProcess->NumberOfArguments, '|');
+    printf(cmdLineLength > 38 ? "%35S...%c" : "%38S%c", pProcess->FullCommandLine, '|');
+    printf("%8U%c", pProcess->NumberOfThreads, '|');
+    printf("%11U%c", pProcess->RefCnt.ReferenceCount, '|');
 
-            DumpProcess(pProcess);
-        }
+    return STATUS_SUCCESS;
+}
+
+static
+void
+_CmdProcessPrintMemoryStatistics(
+    IN      PPROCESS        Process
+    )
+{
+    PROCESS_MEMORY_STATISTICS stats;
+    QWORD noOfFaults;
+    STATUS status;
+
+    ASSERT(Process != NULL);
+
+    status = MmuRetrieveProcessMemoryStatistics(Process, &stats);
+    if (!SUCCEEDED(status))
+    {
+        perror("MmuRetrieveProcessMemoryStatistics failed with status 0x%x\n", status);
+        return;
     }
 
-    return STATUS_SUCCESS;
+    noOfFaults = stats.DemandZeroFaults + stats.FileBackedFaults + stats.SwapInFaults
+                 + stats.CopyOnWriteFaults + stats.ProtectionFaults;
+
+    printf("Resident memory: %U KB (peak %U KB)\n", stats.ResidentBytes / KB_SIZE, stats.PeakResidentBytes / KB_SIZE);
+    printf("Committed memory: %U KB\n", stats.CommittedBytes / KB_SIZE);
+    printf("Page faults: %U\n", noOfFaults);
+    printf("    Demand zero: %U\n", stats.DemandZeroFaults);
+    printf("    File backed: %U\n", stats.FileBackedFaults);
+    printf("    Swap in: %U\n", stats.SwapInFaults);
+    printf("    Copy on write: %U\n", stats.CopyOnWriteFaults);
+    printf("    Protection: %U\n", stats.ProtectionFaults);
+    printf("Fault service time: %U us (mean %U us, max %U us)\n",
+           stats.FaultServiceTimeUs,
+           (noOfFaults != 0) ? stats.FaultServiceTimeUs / noOfFaults : 0,
+           stats.MaxFaultServiceTimeUs);
 }
 
 #include "test_common.h"
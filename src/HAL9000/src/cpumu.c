@@ -417,6 +417,47 @@ CpuMuActivateFpuFeatures(
     return HalSetActiveFpuFeatures(HAL9000_USED_XCR0_FEATURES);
 }
 
+void
+CpuMuSelectMemoryRoutines(
+    void
+    )
+{
+    DWORD features;
+    QWORD cr4;
+
+    features = 0;
+    cr4 = __readcr4();
+
+    // fast strings do not depend on the FPU state
+    if (m_cpuMuData.StructuredExtendedFeatures.ebx.EnhancedRepMovsb)
+    {
+        features |= CL_MEMORY_FEATURE_ERMS;
+    }
+
+    // the vector registers can be used only if their state is enabled,
+    // otherwise any SSE instruction causes a #UD
+    if (IsBooleanFlagOn(cr4, CR4_OSFXSR) && m_cpuMuData.FeatureInformation.edx.SSE2)
+    {
+        features |= CL_MEMORY_FEATURE_SSE2;
+
+        if (m_cpuMuData.FeatureInformation.ecx.SSE4_2)
+        {
+            features |= CL_MEMORY_FEATURE_SSE42;
+        }
+
+        if (m_cpuMuData.StructuredExtendedFeatures.ebx.AVX2
+            && IsBooleanFlagOn(cr4, CR4_OSXSAVE)
+            && IsBooleanFlagOn(HalGetActiveFpuFeatures(NULL, NULL), XCR0_SAVED_STATE_SSE | XCR0_SAVED_STATE_AVX))
+        {
+            features |= CL_MEMORY_FEATURE_AVX2;
+        }
+    }
+
+    LOGL("Memory and string routines will use features 0x%x\n", features);
+
+    MemorySetCpuFeatures(features);
+}
+
 static
 void
 _CpuValidateCurrentCpu(
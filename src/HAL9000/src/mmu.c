@@ -15,6 +15,11 @@
 #include "thread_internal.h"
 #include "io.h"
 #include "mdl.h"
+#include "iomu.h"
+#include "vm_swap.h"
+#include "vm_tlb.h"
+#include "vm_file_map.h"
+#include "mpsc_queue.h"
 
 #define PAGING_STRUCTURES_BASE_MEMORY                           (128*KB_SIZE)
 
@@ -69,7 +74,7 @@ STATIC_ASSERT( sizeof(PAGE_FAULT_ERR_CODE) == sizeof(DWORD));
 
 typedef struct _MMU_ZERO_WORKER_ITEM
 {
-    LIST_ENTRY                      ListEntry;
+    CL_SLIST_ENTRY                  QueueEntry;
 
     PHYSICAL_ADDRESS                PhysicalAddress;
     DWORD                           NumberOfFrames;
@@ -79,8 +84,7 @@ typedef struct _MMU_ZERO_WORKER_THREAD_CTX
 {
     PEX_EVENT                       NewPagesEvent;
 
-    PLOCK                           PagesLock;
-    PLIST_ENTRY                     PagesToZeroList;
+    PMPSC_QUEUE                     PagesToZeroQueue;
 } MMU_ZERO_WORKER_THREAD_CTX, *PMMU_ZERO_WORKER_THREAD_CTX;
 
 typedef struct _MMU_ZERO_THREAD_DATA
@@ -88,10 +92,37 @@ typedef struct _MMU_ZERO_THREAD_DATA
     PTHREAD                         WorkerThread;
 
     EX_EVENT                        NewPagesEvent;
-    LOCK                            PagesLock;
-    LIST_ENTRY                      PagesToZeroList;
+    // Any CPU may release memory, only the worker thread removes the items
+    MPSC_QUEUE                      PagesToZeroQueue;
 } MMU_ZERO_THREAD_DATA, *PMMU_ZERO_THREAD_DATA;
 
+// An address space whose process was destroyed, its frames are released by
+// the teardown worker
+typedef struct _MMU_TEARDOWN_ITEM
+{
+    LIST_ENTRY                      ListEntry;
+
+    PVMM_RESERVATION_SPACE          VaSpace;
+    PPAGING_LOCK_DATA               PagingData;
+
+    // The image is mapped outside of the reservations
+    PVOID                           ImageBase;
+    QWORD                           ImageSize;
+} MMU_TEARDOWN_ITEM, *PMMU_TEARDOWN_ITEM;
+
+typedef struct _MMU_TEARDOWN_THREAD_DATA
+{
+    // NULL until MmuInitThreadingSystem runs, until then address spaces are
+    // destroyed synchronously
+    PTHREAD                         WorkerThread;
+
+    EX_EVENT                        NewItemsEvent;
+    LOCK                            ItemsLock;
+
+    _Guarded_by_(ItemsLock)
+    LIST_ENTRY                      ItemsList;
+} MMU_TEARDOWN_THREAD_DATA, *PMMU_TEARDOWN_THREAD_DATA;
+
 typedef struct _MMU_HEAP_DATA
 {
     _Guarded_by_(HeapLock)
@@ -117,6 +148,8 @@ typedef struct _MMU_DATA
 
     MMU_ZERO_THREAD_DATA            ZeroThreadData;
 
+    MMU_TEARDOWN_THREAD_DATA        TeardownThreadData;
+
     MMU_HEAP_DATA                   Heaps[MmuHeapIndexReserved];
 } MMU_DATA, *PMMU_DATA;
 
@@ -222,6 +255,17 @@ _MmuDestroyPagingTables(
 
 static FUNC_ThreadStart                 _MmuZeroWorkerThreadFunction;
 
+static FUNC_ThreadStart                 _MmuTeardownWorkerThreadFunction;
+
+static
+void
+_MmuDestroyAddressSpace(
+    IN_OPT  PVMM_RESERVATION_SPACE  VaSpace,
+    IN_OPT  PPAGING_LOCK_DATA       PagingData,
+    IN_OPT  PVOID                   ImageBase,
+    IN      QWORD                   ImageSize
+    );
+
 __forceinline
 static
 DWORD
@@ -249,8 +293,10 @@ MmuPreinitSystem(
 
     RecRwSpinlockInit(0, &m_mmuData.PagingData.Lock);
 
-    InitializeListHead(&m_mmuData.ZeroThreadData.PagesToZeroList);
-    LockInit(&m_mmuData.ZeroThreadData.PagesLock);
+    MpscQueueInit(&m_mmuData.ZeroThreadData.PagesToZeroQueue);
+
+    InitializeListHead(&m_mmuData.TeardownThreadData.ItemsList);
+    LockInit(&m_mmuData.TeardownThreadData.ItemsLock);
 
     m_mmuData.PcidSupportAvailable = CpuMuIsPcidFeaturePresent();
 
@@ -319,6 +365,16 @@ MmuInitSystem(
     }
     LOGL("ExEventInit succeeded\n");
 
+    status = ExEventInit(&m_mmuData.TeardownThreadData.NewItemsEvent,
+                         ExEventTypeNotification,
+                         FALSE
+                         );
+    if (!SUCCEEDED(status))
+    {
+        LOG_FUNC_ERROR("ExEventInit", status );
+        return status;
+    }
+
     status = _MmuRetrieveKernelInfoAndValidate(KernelBaseAddress,
                                                KernelSize,
                                                &m_mmuData.KernelInfo
@@ -471,6 +527,14 @@ MmuInitSystem(
     }
     LOG("_MmuInitializeHeap succeeded for special heap\n");
 
+    // not fatal, without the zero frame each untouched page gets its own frame
+    status = VmmInitZeroFrame();
+    if (!SUCCEEDED(status))
+    {
+        LOG_FUNC_ERROR("VmmInitZeroFrame", status);
+        status = STATUS_SUCCESS;
+    }
+
     return status;
 }
 
@@ -515,8 +579,7 @@ MmuInitThreadingSystem(
         return STATUS_HEAP_INSUFFICIENT_RESOURCES;
     }
     pCtx->NewPagesEvent = &m_mmuData.ZeroThreadData.NewPagesEvent;
-    pCtx->PagesToZeroList = &m_mmuData.ZeroThreadData.PagesToZeroList;
-    pCtx->PagesLock = &m_mmuData.ZeroThreadData.PagesLock;
+    pCtx->PagesToZeroQueue = &m_mmuData.ZeroThreadData.PagesToZeroQueue;
 
     __try
     {
@@ -534,6 +597,27 @@ MmuInitThreadingSystem(
 
         pCtx = NULL;
         m_mmuData.ZeroThreadData.WorkerThread = pThread;
+
+        status = ThreadCreate("Address Space Teardown Thread",
+                              ThreadPriorityLowest,
+                              _MmuTeardownWorkerThreadFunction,
+                              NULL,
+                              &pThread
+        );
+        if (!SUCCEEDED(status))
+        {
+            LOG_FUNC_ERROR("ThreadCreate", status);
+            __leave;
+        }
+
+        m_mmuData.TeardownThreadData.WorkerThread = pThread;
+
+        status = VmFileMapInit();
+        if (!SUCCEEDED(status))
+        {
+            LOG_FUNC_ERROR("VmFileMapInit", status);
+            __leave;
+        }
     }
     __finally
     {
@@ -549,6 +633,22 @@ MmuInitThreadingSystem(
     return status;
 }
 
+STATUS
+MmuInitSwapSystem(
+    void
+    )
+{
+    PFILE_OBJECT pSwapFile;
+
+    pSwapFile = IomuGetSwapFile();
+    if (NULL == pSwapFile)
+    {
+        return STATUS_FILE_NOT_FOUND;
+    }
+
+    return VmSwapInit(pSwapFile);
+}
+
 QWORD
 MmuGetTotalSystemMemory(
     void
@@ -623,18 +723,20 @@ MmuMapMemoryEx(
 }
 
 void
-MmuMapMemoryInternal(
+MmuMapMemoryInternalEx(
     IN      PHYSICAL_ADDRESS        PhysicalAddress,
     IN      QWORD                   Size,
     IN      PAGE_RIGHTS             PageRights,
     IN      PVOID                   VirtualAddress,
     IN      BOOLEAN                 Invalidate,
     IN      BOOLEAN                 Uncacheable,
-    IN_OPT  PPAGING_LOCK_DATA       PagingData
+    IN_OPT  PPAGING_LOCK_DATA       PagingData,
+    IN      BOOLEAN                 LargePages
     )
 {
     INTR_STATE oldState;
     PPAGING_LOCK_DATA pPagingData;
+    VM_TLB_BATCH batch;
 
     ASSERT( 0 != Size );
     ASSERT( IsAddressAligned(Size, PAGE_SIZE));
@@ -644,16 +746,24 @@ MmuMapMemoryInternal(
 
     pPagingData = (PagingData == NULL) ? &m_mmuData.PagingData : PagingData;
 
+    VmTlbBatchInit(&batch, &pPagingData->Data);
+
     RecRwSpinlockAcquireExclusive(&pPagingData->Lock, &oldState );
-    VmmMapMemoryInternal(&pPagingData->Data,
-                         PhysicalAddress,
-                         Size,
-                         VirtualAddress,
-                         PageRights,
-                         Invalidate,
-                         Uncacheable
-                         );
+    VmmMapMemoryInternalEx(&pPagingData->Data,
+                           PhysicalAddress,
+                           Size,
+                           VirtualAddress,
+                           PageRights,
+                           Invalidate,
+                           Uncacheable,
+                           LargePages,
+                           &batch
+                           );
     RecRwSpinlockReleaseExclusive(&pPagingData->Lock, oldState);
+
+    // empty unless present mappings were replaced, which never happens when
+    // the caller still holds the paging lock
+    VmTlbBatchFlush(&batch);
 }
 
 void
@@ -666,10 +776,11 @@ MmuUnmapMemoryEx(
 {
     QWORD alignedVirtualAddress;
     DWORD alignmentDifferences;
-    DWORD alignedSize;
-    PML4 cr3;
+    QWORD alignedSize;
+    QWORD bytesUnmapped;
     INTR_STATE oldState;
     PPAGING_LOCK_DATA pPagingData;
+    VM_TLB_BATCH batch;
 
     ASSERT(VirtualAddress != NULL);
     ASSERT(Size != 0);
@@ -680,14 +791,28 @@ MmuUnmapMemoryEx(
     alignmentDifferences = (DWORD)((QWORD)VirtualAddress - alignedVirtualAddress);
     alignedSize = AlignAddressUpper(Size + alignmentDifferences, PAGE_SIZE);
 
-    RecRwSpinlockAcquireExclusive(&pPagingData->Lock, &oldState);
-    cr3.Raw = (QWORD) pPagingData->Data.BasePhysicalAddress;
-    VmmUnmapMemoryEx(cr3,
-                    (PVOID) alignedVirtualAddress,
-                     alignedSize,
-                     ReleaseMemory
-                    );
-    RecRwSpinlockReleaseExclusive(&pPagingData->Lock, oldState);
+    VmTlbBatchInit(&batch, &pPagingData->Data);
+
+    do
+    {
+        RecRwSpinlockAcquireExclusive(&pPagingData->Lock, &oldState);
+        bytesUnmapped = VmmUnmapMemoryEx(&pPagingData->Data,
+                                         (PVOID) alignedVirtualAddress,
+                                         alignedSize,
+                                         ReleaseMemory,
+                                         &batch
+                                         );
+        RecRwSpinlockReleaseExclusive(&pPagingData->Lock, oldState);
+
+        // the frames are released only after no CPU can reach them through
+        // its TLB
+        VmTlbBatchFlush(&batch);
+
+        ASSERT(bytesUnmapped != 0 && bytesUnmapped <= alignedSize);
+
+        alignedVirtualAddress = alignedVirtualAddress + bytesUnmapped;
+        alignedSize = alignedSize - bytesUnmapped;
+    } while (alignedSize != 0);
 }
 
 void
@@ -697,7 +822,6 @@ MmuReleaseMemory(
     )
 {
     BOOLEAN bListEmpty;
-    INTR_STATE oldState;
     PMMU_ZERO_WORKER_ITEM pItem;
 
     LOG_FUNC_START_CPU;
@@ -719,9 +843,7 @@ MmuReleaseMemory(
     pItem->PhysicalAddress = PhysicalAddr;
     pItem->NumberOfFrames = NoOfFrames;
 
-    LockAcquire(&m_mmuData.ZeroThreadData.PagesLock, &oldState );
-    InsertTailList(&m_mmuData.ZeroThreadData.PagesToZeroList, &pItem->ListEntry );
-    LockRelease(&m_mmuData.ZeroThreadData.PagesLock, oldState);
+    MpscQueuePush(&m_mmuData.ZeroThreadData.PagesToZeroQueue, &pItem->QueueEntry);
     pItem = NULL;
 
     LOG_TRACE_MMU("About to signal worker thread\n");
@@ -850,6 +972,7 @@ MmuSolvePageFault(
 {
     PAGE_RIGHTS rightsRequested;
     PAGE_FAULT_ERR_CODE pfErrCode;
+    BOOLEAN bUserAddressSpace;
 
     ASSERT( INTR_OFF == CpuIntrGetState() );
 
@@ -859,9 +982,16 @@ MmuSolvePageFault(
     rightsRequested |= ( pfErrCode.Write ? PAGE_RIGHTS_WRITE : 0 );
     rightsRequested |= ( pfErrCode.Execution ? PAGE_RIGHTS_EXECUTE : 0 );
 
+    // kernel code writing through a user pointer to a page which is still
+    // shared copy-on-write must be solved in the address space of the process
+    bUserAddressSpace = pfErrCode.Usermode
+                        || (pfErrCode.Present && pfErrCode.Write
+                            && !IsBooleanFlagOn((QWORD)FaultingAddress, (QWORD)1 << VA_HIGHEST_VALID_BIT)
+                            && !ProcessIsSystem(NULL));
+
     return VmmSolvePageFault(FaultingAddress,
                              rightsRequested,
-                             pfErrCode.Usermode ? GetCurrentThread()->Process->PagingData : &m_mmuData.PagingData
+                             bUserAddressSpace ? GetCurrentThread()->Process->PagingData : &m_mmuData.PagingData
                              );
 }
 
@@ -953,33 +1083,49 @@ MmuDestroyAddressSpaceForProcess(
     INOUT   PPROCESS                Process
     )
 {
+    PMMU_TEARDOWN_ITEM pItem;
+    INTR_STATE oldState;
+    PVOID pImageBase;
+    QWORD imageSize;
+
     ASSERT(Process != NULL);
     ASSERT(!ProcessIsSystem(Process));
 
-    if (Process->VaSpace != NULL)
+    if (Process->VaSpace == NULL && Process->PagingData == NULL)
     {
-        VmmDestroyVirtualAddressSpace(Process->VaSpace);
-        Process->VaSpace = NULL;
+        return;
     }
 
-    if (Process->PagingData != NULL)
+    pItem = NULL;
+    pImageBase = (Process->HeaderInfo != NULL) ? Process->HeaderInfo->Preferred.ImageBase : NULL;
+    imageSize = (Process->HeaderInfo != NULL) ? AlignAddressUpper(Process->HeaderInfo->Size, PAGE_SIZE) : 0;
+
+    if (m_mmuData.TeardownThreadData.WorkerThread != NULL)
     {
-        // NOTE: from what I've realized nothing bad can happen if an interrupt
-        // occurs while we change our paging tables to those of another process
-        // this change does not modify the current's thread owner process or its
-        // paging structures so the original paging structures will be used in the
-        // interrupt handlers
+        pItem = ExAllocatePoolWithTag(0, sizeof(MMU_TEARDOWN_ITEM), HEAP_MMU_TAG, 0);
+    }
 
-        // invalidate all PCID mappings => new processes can reuse
-        // PCID
-        ProcessActivatePagingTables(Process, TRUE);
+    if (pItem == NULL)
+    {
+        // no worker to hand the address space to
+        _MmuDestroyAddressSpace(Process->VaSpace, Process->PagingData, pImageBase, imageSize);
+    }
+    else
+    {
+        pItem->VaSpace = Process->VaSpace;
+        pItem->PagingData = Process->PagingData;
+        pItem->ImageBase = pImageBase;
+        pItem->ImageSize = imageSize;
 
-        // restore previous paging table
-        ProcessActivatePagingTables(GetCurrentThread()->Process, !m_mmuData.PcidSupportAvailable);
+        LockAcquire(&m_mmuData.TeardownThreadData.ItemsLock, &oldState);
+        InsertTailList(&m_mmuData.TeardownThreadData.ItemsList, &pItem->ListEntry);
+        LockRelease(&m_mmuData.TeardownThreadData.ItemsLock, oldState);
 
-        _MmuDestroyPagingTables(Process->PagingData);
-        Process->PagingData = NULL;
+        ExEventSignal(&m_mmuData.TeardownThreadData.NewItemsEvent);
     }
+
+    Process->VaSpace = NULL;
+    Process->PagingData = NULL;
 }
 
 _No_competing_thread_
@@ -1036,7 +1182,7 @@ MmuChangeProcessSpace(
 {
     ASSERT(Process != NULL);
 
-    ProcessActivatePagingTables(Process, !m_mmuData.PcidSupportAvailable);
+    ProcessActivatePagingTables(Process);
 }
 
 PTR_SUCCESS
@@ -1177,6 +1323,52 @@ MmuIsBufferValid(
                             Process->PagingData->Data.KernelSpace);
 }
 
+STATUS
+MmuRetrieveProcessMemoryStatistics(
+    IN          PPROCESS                        Process,
+    OUT         PPROCESS_MEMORY_STATISTICS      Statistics
+    )
+{
+    if (Process == NULL)
+    {
+        return STATUS_INVALID_PARAMETER1;
+    }
+
+    if (Statistics == NULL)
+    {
+        return STATUS_INVALID_PARAMETER2;
+    }
+
+    VmmRetrieveStatistics(Process->PagingData, Process->VaSpace, Statistics);
+
+    return STATUS_SUCCESS;
+}
+
+STATUS
+MmuFlushFileMapping(
+    IN          PVOID               Address,
+    IN          QWORD               Size,
+    IN          PPROCESS            Process
+    )
+{
+    if (Address == NULL)
+    {
+        return STATUS_INVALID_PARAMETER1;
+    }
+
+    if (Size == 0)
+    {
+        return STATUS_INVALID_PARAMETER2;
+    }
+
+    if (Process == NULL || Process->VaSpace == NULL)
+    {
+        return STATUS_INVALID_PARAMETER3;
+    }
+
+    return VmFileMapFlush(Process->VaSpace, Address, Size);
+}
+
 STATUS
 MmuGetSystemVirtualAddressForUserBuffer(
     IN          PVOID               UserAddress,
@@ -1218,6 +1410,18 @@ MmuGetSystemVirtualAddressForUserBuffer(
 
     __try
     {
+        // the kernel will write through its own mapping => the pages cannot
+        // remain shared with other virtual addresses
+        if (IsBooleanFlagOn(PageRights, PAGE_RIGHTS_WRITE))
+        {
+            status = VmmBreakCopyOnWrite(UserAddress, Size, Process->PagingData);
+            if (!SUCCEEDED(status))
+            {
+                LOG_FUNC_ERROR("VmmBreakCopyOnWrite", status);
+                __leave;
+            }
+        }
+
         pMdl = MdlAllocateEx(UserAddress,
                              (DWORD)Size,
                              NULL,
@@ -1993,12 +2197,11 @@ _MmuZeroWorkerThreadFunction(
     IN_OPT      PVOID           Context
     )
 {
-    PLIST_ENTRY pListHead;
+    PMPSC_QUEUE pQueue;
     STATUS status;
     PMMU_ZERO_WORKER_THREAD_CTX pCtx;
     PEX_EVENT pEvent;
-    PLIST_ENTRY pCurrentEntry;
-    PLOCK pLock;
+    PCL_SLIST_ENTRY pCurrentEntry;
 
     LOG_FUNC_START;
 
@@ -2008,15 +2211,12 @@ _MmuZeroWorkerThreadFunction(
     pCtx = (PMMU_ZERO_WORKER_THREAD_CTX) Context;
     pCurrentEntry = NULL;
 
-    pListHead = pCtx->PagesToZeroList;
-    ASSERT( NULL != pListHead );
+    pQueue = pCtx->PagesToZeroQueue;
+    ASSERT( NULL != pQueue );
 
     pEvent = pCtx->NewPagesEvent;
     ASSERT( NULL != pEvent );
 
-    pLock = pCtx->PagesLock;
-    ASSERT( NULL != pLock );
-
     ExFreePoolWithTag(pCtx, HEAP_MMU_TAG);
     pCtx = NULL;
 
@@ -2025,7 +2225,6 @@ _MmuZeroWorkerThreadFunction(
     while (TRUE)
     {
         PMMU_ZERO_WORKER_ITEM pItem;
-        INTR_STATE oldState;
         DWORD noOfBytes;
         PVOID pAddr;
 
@@ -2036,20 +2235,23 @@ _MmuZeroWorkerThreadFunction(
         // may use executive timer in the future
         ExEventWaitForSignal(pEvent);
 
-        LockAcquire(pLock, &oldState);
-        pCurrentEntry = RemoveHeadList(pListHead);
-        LockRelease(pLock, oldState);
-
-        if (pCurrentEntry == pListHead)
+        pCurrentEntry = MpscQueuePop(pQueue);
+        if (NULL == pCurrentEntry)
         {
-            // list is empty :(
+            // queue is empty :(
             ExEventClearSignal(pEvent);
 
-            // wait for another signal
-            continue;
+            // an item may have been pushed before the signal was cleared, it
+            // must not wait for the next release
+            pCurrentEntry = MpscQueuePop(pQueue);
+            if (NULL == pCurrentEntry)
+            {
+                // wait for another signal
+                continue;
+            }
         }
 
-        pItem = CONTAINING_RECORD(pCurrentEntry, MMU_ZERO_WORKER_ITEM, ListEntry);
+        pItem = CONTAINING_RECORD(pCurrentEntry, MMU_ZERO_WORKER_ITEM, QueueEntry);
 
         noOfBytes = pItem->NumberOfFrames * PAGE_SIZE;
         pAddr = MmuMapMemoryEx(pItem->PhysicalAddress,
@@ -2062,7 +2264,8 @@ _MmuZeroWorkerThreadFunction(
         ASSERT( NULL != pAddr );
 
         // zero the memory, that's our job :)
-        memzero(pAddr, noOfBytes);
+        // nobody will read these frames soon => bypass the caches
+        pagezero(pAddr, noOfBytes);
 
         // truly release physical addresses
         PmmReleaseMemory(pItem->PhysicalAddress, pItem->NumberOfFrames );
@@ -2079,4 +2282,98 @@ _MmuZeroWorkerThreadFunction(
     NOT_REACHED;
 
     return status;
+}
+
+static
+STATUS
+_MmuTeardownWorkerThreadFunction(
+    IN_OPT      PVOID           Context
+    )
+{
+    PMMU_TEARDOWN_THREAD_DATA pData;
+
+    ASSERT(NULL == Context);
+
+    pData = &m_mmuData.TeardownThreadData;
+
+    // warning C4127: conditional expression is constant
+#pragma warning(suppress:4127)
+    while (TRUE)
+    {
+        PMMU_TEARDOWN_ITEM pItem;
+        PLIST_ENTRY pEntry;
+        INTR_STATE oldState;
+
+        ExEventWaitForSignal(&pData->NewItemsEvent);
+
+        LockAcquire(&pData->ItemsLock, &oldState);
+        pEntry = RemoveHeadList(&pData->ItemsList);
+        if (pEntry == &pData->ItemsList)
+        {
+            // cleared while holding the lock => an item inserted after this
+            // point signals the event again
+            ExEventClearSignal(&pData->NewItemsEvent);
+        }
+        LockRelease(&pData->ItemsLock, oldState);
+
+        if (pEntry == &pData->ItemsList)
+        {
+            continue;
+        }
+
+        pItem = CONTAINING_RECORD(pEntry, MMU_TEARDOWN_ITEM, ListEntry);
+
+        _MmuDestroyAddressSpace(pItem->VaSpace, pItem->PagingData, pItem->ImageBase, pItem->ImageSize);
+
+        ExFreePoolWithTag(pItem, HEAP_MMU_TAG);
+    }
+
+    NOT_REACHED;
+
+    return STATUS_SUCCESS;
+}
+
+static
+void
+_MmuDestroyAddressSpace(
+    IN_OPT  PVMM_RESERVATION_SPACE  VaSpace,
+    IN_OPT  PPAGING_LOCK_DATA       PagingData,
+    IN_OPT  PVOID                   ImageBase,
+    IN      QWORD                   ImageSize
+    )
+{
+    if (VaSpace != NULL)
+    {
+        // the paging tables are still intact => the dirty pages of the shared
+        // file mappings can be written back before their files are closed
+        VmFileMapUnregisterAddressSpace(VaSpace);
+    }
+
+    if (PagingData != NULL)
+    {
+        // the pages of the process must not be evicted while their frames
+        // are released
+        VmSwapUntrackAddressSpace(PagingData);
+
+        // the image frames were taken over from the kernel buffer the
+        // executable was read into, nobody else maps them
+        if (ImageBase != NULL && ImageSize != 0)
+        {
+            MmuUnmapMemoryEx(ImageBase, ImageSize, TRUE, PagingData);
+        }
+    }
+
+    if (VaSpace != NULL)
+    {
+        VmmDestroyVirtualAddressSpace(VaSpace, PagingData);
+    }
+
+    if (PagingData != NULL)
+    {
+        // nothing to invalidate: the context ID of the address space is never
+        // reused and a CPU flushes a PCID before tagging another address space
+        // with it
+
+        _MmuDestroyPagingTables(PagingData);
+    }
 }
\ No newline at end of file
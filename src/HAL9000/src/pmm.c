@@ -3,6 +3,16 @@
 #include "int15.h"
 #include "bitmap.h"
 #include "synch.h"
+#include "acpi_interface.h"
+#include "cpumu.h"
+
+#define PMM_MAX_NODES                   8
+#define PMM_MAX_RANGES_PER_NODE         8
+
+// distances assumed when the firmware provides no SLIT, same as the values
+// the SLIT uses for the local and the closest remote node
+#define PMM_LOCAL_NODE_DISTANCE         10
+#define PMM_REMOTE_NODE_DISTANCE        20
 
 typedef struct _MEMORY_REGION_LIST
 {
@@ -10,6 +20,26 @@ typedef struct _MEMORY_REGION_LIST
     DWORD               NumberOfEntries;
 } MEMORY_REGION_LIST, *PMEMORY_REGION_LIST;
 
+typedef struct _PMM_FRAME_RANGE
+{
+    DWORD               StartFrame;
+    DWORD               EndFrame;
+} PMM_FRAME_RANGE, *PPMM_FRAME_RANGE;
+
+typedef struct _PMM_NODE
+{
+    DWORD               ProximityDomain;
+
+    QWORD               NumberOfFrames;
+
+    DWORD               NumberOfRanges;
+    PMM_FRAME_RANGE     Ranges[PMM_MAX_RANGES_PER_NODE];
+
+    // Indexes of all the nodes sorted by their distance from this one, the
+    // first one is always the node itself
+    BYTE                FallbackOrder[PMM_MAX_NODES];
+} PMM_NODE, *PPMM_NODE;
+
 typedef struct _PMM_DATA
 {
     // Both of the highest physical address values are setup on initialization and
@@ -36,6 +66,18 @@ typedef struct _PMM_DATA
 
     _Guarded_by_(AllocationLock)
     BITMAP              AllocationBitmap;
+
+    // Number of bits cleared in AllocationBitmap
+    _Guarded_by_(AllocationLock)
+    QWORD               NumberOfFreeFrames;
+
+    // Setup by PmmInitNumaNodes, while there are less than 2 nodes the frames
+    // are allocated without taking their location into account
+    DWORD               NumberOfNodes;
+    PMM_NODE            Nodes[PMM_MAX_NODES];
+
+    // Node from which the frames requested by each CPU are first taken
+    BYTE                CpuNodes[MAX_BYTE + 1];
 } PMM_DATA, *PPMM_DATA;
 
 static PMM_DATA m_pmmData;
@@ -62,6 +104,45 @@ _PmmInitializeAllocationBitmap(
     OUT                         DWORD*                      SizeReserved
     );
 
+static
+DWORD
+_PmmGetNodeIndex(
+    IN                          DWORD                       ProximityDomain
+    );
+
+static
+BYTE
+_PmmGetDistance(
+    IN                          DWORD                       FromProximityDomain,
+    IN                          DWORD                       ToProximityDomain
+    );
+
+static
+void
+_PmmAddNodeRange(
+    IN                          DWORD                       ProximityDomain,
+    IN                          QWORD                       BaseAddress,
+    IN                          QWORD                       Length
+    );
+
+REQUIRES_EXCL_LOCK(m_pmmData.AllocationLock)
+static
+DWORD
+_PmmReserveFrames(
+    IN                          DWORD                       StartIndex,
+    IN                          DWORD                       FirstInvalidIndex,
+    IN                          DWORD                       NoOfFrames,
+    IN                          DWORD                       FramesAlignment
+    );
+
+REQUIRES_EXCL_LOCK(m_pmmData.AllocationLock)
+static
+DWORD
+_PmmReserveFramesFromNodes(
+    IN                          DWORD                       NoOfFrames,
+    IN                          DWORD                       FramesAlignment
+    );
+
 _No_competing_thread_
 void
 PmmPreinitSystem(
@@ -142,6 +223,101 @@ PmmInitSystem(
     return STATUS_SUCCESS;
 }
 
+_No_competing_thread_
+STATUS
+PmmInitNumaNodes(
+    void
+    )
+{
+    STATUS status;
+    ACPI_SRAT_MEM_AFFINITY* pMemory;
+    ACPI_SRAT_CPU_AFFINITY* pCpu;
+    BOOLEAN bRestartSearch;
+    DWORD i;
+    DWORD j;
+
+    LOG_FUNC_START;
+
+    ASSERT(0 == m_pmmData.NumberOfNodes);
+
+    bRestartSearch = TRUE;
+    while (SUCCEEDED(status = AcpiRetrieveNextMemoryAffinity(bRestartSearch, &pMemory)))
+    {
+        bRestartSearch = FALSE;
+
+        _PmmAddNodeRange(pMemory->ProximityDomain, pMemory->BaseAddress, pMemory->Length);
+    }
+    ASSERT(STATUS_NO_MORE_OBJECTS == status);
+
+    if (m_pmmData.NumberOfNodes <= 1)
+    {
+        LOGL("The system has %u NUMA nodes, frames will be allocated without taking their location into account\n",
+             m_pmmData.NumberOfNodes);
+        memzero(m_pmmData.Nodes, sizeof(m_pmmData.Nodes));
+        m_pmmData.NumberOfNodes = 0;
+        return STATUS_SUCCESS;
+    }
+
+    // sort the nodes by distance for each node, the node itself will always
+    // be the first one because the local distance is the smallest one
+    for (i = 0; i < m_pmmData.NumberOfNodes; ++i)
+    {
+        PPMM_NODE pNode = &m_pmmData.Nodes[i];
+
+        for (j = 0; j < m_pmmData.NumberOfNodes; ++j)
+        {
+            BYTE distance = _PmmGetDistance(pNode->ProximityDomain, m_pmmData.Nodes[j].ProximityDomain);
+            DWORD k;
+
+            for (k = j;
+                 k > 0 && _PmmGetDistance(pNode->ProximityDomain, m_pmmData.Nodes[pNode->FallbackOrder[k - 1]].ProximityDomain) > distance;
+                 --k)
+            {
+                pNode->FallbackOrder[k] = pNode->FallbackOrder[k - 1];
+            }
+
+            pNode->FallbackOrder[k] = (BYTE) j;
+        }
+
+        LOGL("Node %u has proximity domain %u and 0x%X frames in %u ranges\n",
+             i, pNode->ProximityDomain, pNode->NumberOfFrames, pNode->NumberOfRanges);
+    }
+
+    // CPUs which aren't described in the SRAT take their frames from the first
+    // node, CPUs in proximity domains without memory use the closest node
+    bRestartSearch = TRUE;
+    while (SUCCEEDED(status = AcpiRetrieveNextCpuAffinity(bRestartSearch, &pCpu)))
+    {
+        DWORD domain = AcpiSratCpuProximityDomain(pCpu);
+        DWORD nodeIndex;
+
+        bRestartSearch = FALSE;
+
+        nodeIndex = _PmmGetNodeIndex(domain);
+        if (MAX_DWORD == nodeIndex)
+        {
+            nodeIndex = 0;
+            for (i = 1; i < m_pmmData.NumberOfNodes; ++i)
+            {
+                if (_PmmGetDistance(domain, m_pmmData.Nodes[i].ProximityDomain)
+                    < _PmmGetDistance(domain, m_pmmData.Nodes[nodeIndex].ProximityDomain))
+                {
+                    nodeIndex = i;
+                }
+            }
+        }
+
+        m_pmmData.CpuNodes[pCpu->ApicId] = (BYTE) nodeIndex;
+
+        LOGL("CPU with APIC ID 0x%02x allocates from node %u\n", pCpu->ApicId, nodeIndex);
+    }
+    ASSERT(STATUS_NO_MORE_OBJECTS == status);
+
+    LOG_FUNC_END;
+
+    return STATUS_SUCCESS;
+}
+
 PTR_SUCCESS
 PHYSICAL_ADDRESS
 PmmReserveMemoryEx(
@@ -171,15 +347,82 @@ PmmReserveMemoryEx(
     }
 
     LockAcquire( &m_pmmData.AllocationLock, &oldState);
-    idx = BitmapScanFromAndFlip(&m_pmmData.AllocationBitmap, (DWORD) startIdx, NoOfFrames, FALSE );
+    if (0 == startIdx && 0 != m_pmmData.NumberOfNodes)
+    {
+        // callers which don't care where the frames are get them from the
+        // node closest to the current CPU
+        idx = _PmmReserveFramesFromNodes(NoOfFrames, 1);
+    }
+    else
+    {
+        idx = BitmapScanFromAndFlip(&m_pmmData.AllocationBitmap, (DWORD) startIdx, NoOfFrames, FALSE );
+    }
     if (MAX_DWORD == idx)
     {
         LockRelease( &m_pmmData.AllocationLock, oldState);
         return NULL;
     }
 
+    ASSERT(m_pmmData.NumberOfFreeFrames >= NoOfFrames);
+    m_pmmData.NumberOfFreeFrames = m_pmmData.NumberOfFreeFrames - NoOfFrames;
+
+    LockRelease( &m_pmmData.AllocationLock, oldState);
+
+    return (PHYSICAL_ADDRESS) ( (QWORD) idx * PAGE_SIZE );
+}
+
+PTR_SUCCESS
+PHYSICAL_ADDRESS
+PmmReserveAlignedMemory(
+    IN          DWORD                   NoOfFrames,
+    IN          QWORD                   Alignment
+    )
+{
+    DWORD idx;
+    QWORD framesAlignment;
+
+    INTR_STATE oldState;
+
+    if (0 == NoOfFrames)
+    {
+        return NULL;
+    }
+
+    if (0 == Alignment || !IsAddressAligned(Alignment, PAGE_SIZE) || !IsAddressAligned(Alignment, Alignment))
+    {
+        return NULL;
+    }
+
+    framesAlignment = Alignment / PAGE_SIZE;
+    if (framesAlignment > MAX_DWORD)
+    {
+        return NULL;
+    }
+
+    LockAcquire( &m_pmmData.AllocationLock, &oldState);
+    if (0 != m_pmmData.NumberOfNodes)
+    {
+        idx = _PmmReserveFramesFromNodes(NoOfFrames, (DWORD) framesAlignment);
+    }
+    else
+    {
+        idx = _PmmReserveFrames(0,
+                                BitmapGetMaxElementCount(&m_pmmData.AllocationBitmap),
+                                NoOfFrames,
+                                (DWORD) framesAlignment);
+    }
+    if (MAX_DWORD != idx)
+    {
+        ASSERT(m_pmmData.NumberOfFreeFrames >= NoOfFrames);
+        m_pmmData.NumberOfFreeFrames = m_pmmData.NumberOfFreeFrames - NoOfFrames;
+    }
     LockRelease( &m_pmmData.AllocationLock, oldState);
 
+    if (MAX_DWORD == idx)
+    {
+        return NULL;
+    }
+
     return (PHYSICAL_ADDRESS) ( (QWORD) idx * PAGE_SIZE );
 }
 
@@ -200,7 +443,23 @@ PmmReleaseMemory(
 
     LockAcquire( &m_pmmData.AllocationLock, &oldState);
     BitmapClearBits(&m_pmmData.AllocationBitmap, (DWORD) index, NoOfFrames);
+    m_pmmData.NumberOfFreeFrames = m_pmmData.NumberOfFreeFrames + NoOfFrames;
+    LockRelease( &m_pmmData.AllocationLock, oldState);
+}
+
+QWORD
+PmmGetNumberOfFreeFrames(
+    void
+    )
+{
+    QWORD noOfFreeFrames;
+    INTR_STATE oldState;
+
+    LockAcquire( &m_pmmData.AllocationLock, &oldState);
+    noOfFreeFrames = m_pmmData.NumberOfFreeFrames;
     LockRelease( &m_pmmData.AllocationLock, oldState);
+
+    return noOfFreeFrames;
 }
 
 QWORD
@@ -320,6 +579,9 @@ _PmmInitializeAllocationBitmap(
     bitmapSize = BitmapPreinit(Bitmap, (DWORD) noOfPhysicalFrames);
     BitmapInit(Bitmap, CurrentVirtualAddress );
 
+    // all the frames start out free
+    m_pmmData.NumberOfFreeFrames = BitmapGetMaxElementCount(Bitmap);
+
     LOG("Bitmap size: %u B\n", bitmapSize );
 
     *SizeReserved = bitmapSize;
@@ -367,4 +629,192 @@ _PmmInitializeAllocationBitmap(
     }
 
     LOG_FUNC_END;
+}
+
+static
+DWORD
+_PmmGetNodeIndex(
+    IN                          DWORD                       ProximityDomain
+    )
+{
+    DWORD i;
+
+    for (i = 0; i < m_pmmData.NumberOfNodes; ++i)
+    {
+        if (m_pmmData.Nodes[i].ProximityDomain == ProximityDomain)
+        {
+            return i;
+        }
+    }
+
+    return MAX_DWORD;
+}
+
+static
+BYTE
+_PmmGetDistance(
+    IN                          DWORD                       FromProximityDomain,
+    IN                          DWORD                       ToProximityDomain
+    )
+{
+    BYTE distance;
+
+    if (SUCCEEDED(AcpiRetrieveLocalityDistance(FromProximityDomain, ToProximityDomain, &distance)))
+    {
+        return distance;
+    }
+
+    return (FromProximityDomain == ToProximityDomain) ? PMM_LOCAL_NODE_DISTANCE : PMM_REMOTE_NODE_DISTANCE;
+}
+
+static
+void
+_PmmAddNodeRange(
+    IN                          DWORD                       ProximityDomain,
+    IN                          QWORD                       BaseAddress,
+    IN                          QWORD                       Length
+    )
+{
+    DWORD nodeIndex;
+    PPMM_NODE pNode;
+    QWORD startFrame;
+    QWORD endFrame;
+
+    // only the frames tracked by the allocation bitmap matter, the bitmap
+    // already keeps the reserved frames (and the ones under 1MB) from being
+    // allocated
+    startFrame = AlignAddressUpper(BaseAddress, PAGE_SIZE) / PAGE_SIZE;
+    endFrame = min(AlignAddressLower(BaseAddress + Length, PAGE_SIZE) / PAGE_SIZE,
+                   BitmapGetMaxElementCount(&m_pmmData.AllocationBitmap));
+    if (startFrame >= endFrame)
+    {
+        return;
+    }
+
+    nodeIndex = _PmmGetNodeIndex(ProximityDomain);
+    if (MAX_DWORD == nodeIndex)
+    {
+        if (PMM_MAX_NODES == m_pmmData.NumberOfNodes)
+        {
+            LOG_WARNING("Cannot track more than %u nodes, memory from proximity domain %u will be treated as remote\n",
+                        PMM_MAX_NODES, ProximityDomain);
+            return;
+        }
+
+        nodeIndex = m_pmmData.NumberOfNodes++;
+        m_pmmData.Nodes[nodeIndex].ProximityDomain = ProximityDomain;
+    }
+
+    pNode = &m_pmmData.Nodes[nodeIndex];
+    if (PMM_MAX_RANGES_PER_NODE == pNode->NumberOfRanges)
+    {
+        LOG_WARNING("Cannot track more than %u ranges for node %u, memory at 0x%X will be treated as remote\n",
+                    PMM_MAX_RANGES_PER_NODE, nodeIndex, BaseAddress);
+        return;
+    }
+
+    pNode->Ranges[pNode->NumberOfRanges].StartFrame = (DWORD) startFrame;
+    pNode->Ranges[pNode->NumberOfRanges].EndFrame = (DWORD) endFrame;
+    pNode->NumberOfRanges++;
+    pNode->NumberOfFrames = pNode->NumberOfFrames + (endFrame - startFrame);
+}
+
+REQUIRES_EXCL_LOCK(m_pmmData.AllocationLock)
+static
+DWORD
+_PmmReserveFrames(
+    IN                          DWORD                       StartIndex,
+    IN                          DWORD                       FirstInvalidIndex,
+    IN                          DWORD                       NoOfFrames,
+    IN                          DWORD                       FramesAlignment
+    )
+{
+    DWORD idx;
+    DWORD startIdx;
+
+    ASSERT(LockIsOwner(&m_pmmData.AllocationLock));
+    ASSERT(0 != FramesAlignment);
+
+    if (1 == FramesAlignment)
+    {
+        return BitmapScanFromToAndFlip(&m_pmmData.AllocationBitmap, StartIndex, FirstInvalidIndex, NoOfFrames, FALSE);
+    }
+
+    startIdx = (DWORD) AlignAddressUpper(StartIndex, FramesAlignment);
+    for(;;)
+    {
+        if (startIdx >= FirstInvalidIndex)
+        {
+            return MAX_DWORD;
+        }
+
+        // find the first free run and if it doesn't start at an aligned frame
+        // restart the search from the next aligned frame index
+        idx = BitmapScanFromTo(&m_pmmData.AllocationBitmap, startIdx, FirstInvalidIndex, NoOfFrames, FALSE);
+        if (MAX_DWORD == idx)
+        {
+            return MAX_DWORD;
+        }
+
+        if (IsAddressAligned(idx, FramesAlignment))
+        {
+            BitmapSetBits(&m_pmmData.AllocationBitmap, idx, NoOfFrames);
+            return idx;
+        }
+
+        if (AlignAddressUpper(idx, FramesAlignment) >= FirstInvalidIndex)
+        {
+            return MAX_DWORD;
+        }
+
+        startIdx = (DWORD) AlignAddressUpper(idx, FramesAlignment);
+    }
+}
+
+REQUIRES_EXCL_LOCK(m_pmmData.AllocationLock)
+static
+DWORD
+_PmmReserveFramesFromNodes(
+    IN                          DWORD                       NoOfFrames,
+    IN                          DWORD                       FramesAlignment
+    )
+{
+    PPCPU pCpu;
+    PPMM_NODE pLocalNode;
+    PPMM_NODE pNode;
+    DWORD idx;
+    DWORD i;
+    DWORD j;
+
+    ASSERT(LockIsOwner(&m_pmmData.AllocationLock));
+    ASSERT(0 != m_pmmData.NumberOfNodes);
+
+    // the lock disabled interrupts so we cannot be moved to another CPU, the
+    // PCPU is not yet setup on the BSP while the system initializes
+    pCpu = GetCurrentPcpu();
+    pLocalNode = &m_pmmData.Nodes[(pCpu != NULL) ? m_pmmData.CpuNodes[pCpu->ApicId] : 0];
+
+    for (i = 0; i < m_pmmData.NumberOfNodes; ++i)
+    {
+        pNode = &m_pmmData.Nodes[pLocalNode->FallbackOrder[i]];
+
+        for (j = 0; j < pNode->NumberOfRanges; ++j)
+        {
+            idx = _PmmReserveFrames(pNode->Ranges[j].StartFrame,
+                                    pNode->Ranges[j].EndFrame,
+                                    NoOfFrames,
+                                    FramesAlignment);
+            if (MAX_DWORD != idx)
+            {
+                return idx;
+            }
+        }
+    }
+
+    // the request may only be satisfied by frames spanning multiple nodes or
+    // by frames which are not described in the SRAT
+    return _PmmReserveFrames(0,
+                             BitmapGetMaxElementCount(&m_pmmData.AllocationBitmap),
+                             NoOfFrames,
+                             FramesAlignment);
 }
\ No newline at end of file
@@ -3,10 +3,15 @@
 #include "thread_internal.h"
 #include "process_internal.h"
 #include "vmm.h"
+#include "vm_tlb.h"
 #include "um_application.h"
 #include "bitmap.h"
-#include "pte.h"
 #include "pe_exports.h"
+#include "striped_hash_map.h"
+
+// PIDs are not used as PCIDs => the number of processes is not limited by
+// the number of PCIDs
+#define PROCESS_MAX_NO_OF_PIDS      (1 << 16)
 
 typedef struct _PROCESS_SYSTEM_DATA
 {
@@ -14,12 +19,16 @@ typedef struct _PROCESS_SYSTEM_DATA
 
     _Guarded_by_(PidBitmapLock)
     BITMAP          PidBitmap;
-    BYTE            PidBitmapBuffer[PCID_TOTAL_NO_OF_VALUES/BITS_PER_BYTE];
+    BYTE            PidBitmapBuffer[PROCESS_MAX_NO_OF_PIDS/BITS_PER_BYTE];
 
     PPROCESS        SystemProcess;
 
     LIST_ENTRY      ProcessList;
     MUTEX           ProcessListLock;
+
+    // Maps PIDs to processes, used for lookups by ID so they do not need to
+    // walk ProcessList while holding its lock
+    STRIPED_HASH_MAP    ProcessIdMap;
 } PROCESS_SYSTEM_DATA, *PPROCESS_SYSTEM_DATA;
 
 static PROCESS_SYSTEM_DATA m_processData;
@@ -37,7 +46,7 @@ _ProcessSystemRetrieveNextPid(
     idx = BitmapScanAndFlip(&m_processData.PidBitmap, 1, FALSE);
     MutexRelease(&m_processData.PidBitmapLock);
 
-    ASSERT(PCID_IS_VALID(idx));
+    ASSERT_INFO(idx != MAX_DWORD, "All the %u PIDs are in use!\n", PROCESS_MAX_NO_OF_PIDS);
 
     return idx;
 }
@@ -49,7 +58,7 @@ _ProcessSystemFreePid(
     IN      PID             ProcessId
     )
 {
-    ASSERT(PCID_IS_VALID(ProcessId));
+    ASSERT(ProcessId != 0 && ProcessId < PROCESS_MAX_NO_OF_PIDS);
 
     MutexAcquire(&m_processData.PidBitmapLock);
     ASSERT_INFO(BitmapGetBitValue(&m_processData.PidBitmap, (DWORD) ProcessId),
@@ -101,6 +110,10 @@ _ProcessParseCommandLine(
 // Called when the reference count reaches zero
 static FUNC_FreeFunction            _ProcessDestroy;
 
+static FUNC_HashMapAlloc            _ProcessIdMapAlloc;
+static FUNC_FreeFunction            _ProcessIdMapFree;
+static FUNC_StripedHashMapFunction  _ProcessReferenceFromMap;
+
 _No_competing_thread_
 void
 ProcessSystemPreinit(
@@ -109,17 +122,20 @@ ProcessSystemPreinit(
 {
     memzero(&m_processData, sizeof(PROCESS_SYSTEM_DATA));
 
-    ASSERT(ARRAYSIZE(m_processData.PidBitmapBuffer) == BitmapPreinit(&m_processData.PidBitmap, PCID_TOTAL_NO_OF_VALUES));
+    ASSERT(ARRAYSIZE(m_processData.PidBitmapBuffer) == BitmapPreinit(&m_processData.PidBitmap, PROCESS_MAX_NO_OF_PIDS));
 
     BitmapInit(&m_processData.PidBitmap, m_processData.PidBitmapBuffer);
 
-    // the value zero cannot be used when CR4.PCIDE == 1, i.e. when PCID are used
+    // zero is never handed out as a PID
     BitmapSetBit(&m_processData.PidBitmap, 0);
 
     MutexInit(&m_processData.PidBitmapLock, FALSE);
 
     MutexInit(&m_processData.ProcessListLock, FALSE);
     InitializeListHead(&m_processData.ProcessList);
+
+    // nothing is allocated until the first process is inserted
+    StripedHashMapInit(&m_processData.ProcessIdMap, _ProcessIdMapAlloc, _ProcessIdMapFree, NULL);
 }
 
 _No_competing_thread_
@@ -161,6 +177,18 @@ ProcessRetrieveSystemProcess(
     return m_processData.SystemProcess;
 }
 
+PTR_SUCCESS
+PPROCESS
+ProcessRetrieveById(
+    IN      PID                 ProcessId
+    )
+{
+    return StripedHashMapLookup(&m_processData.ProcessIdMap,
+                                ProcessId,
+                                _ProcessReferenceFromMap,
+                                NULL);
+}
+
 STATUS
 ProcessExecuteForEachProcessEntry(
     IN      PFUNC_ListFunction  Function,
@@ -195,17 +223,12 @@ ProcessExecuteForEachProcessEntry(
 
 void
 ProcessActivatePagingTables(
-    IN      PPROCESS            Process,
-    IN      BOOLEAN             InvalidateAddressSpace
+    IN      PPROCESS            Process
     )
 {
     ASSERT(Process != NULL);
 
-    ASSERT(PCID_IS_VALID(Process->Id));
-
-    VmmChangeCr3(Process->PagingData->Data.BasePhysicalAddress,
-                 (PCID)Process->Id,
-                 InvalidateAddressSpace);
+    VmTlbActivateAddressSpace(&Process->PagingData->Data);
 }
 #pragma warning(pop)
 
@@ -516,6 +539,13 @@ _ProcessInit(
         InsertTailList(&m_processData.ProcessList, &pProcess->NextProcess);
         MutexRelease(&m_processData.ProcessListLock);
 
+        status = StripedHashMapInsert(&m_processData.ProcessIdMap, pProcess->Id, pProcess, NULL);
+        if (!SUCCEEDED(status))
+        {
+            LOG_FUNC_ERROR("StripedHashMapInsert", status);
+            __leave;
+        }
+
         LOG_TRACE_PROCESS("Process with PID 0x%X created\n", pProcess->Id);
     }
     __finally
@@ -730,6 +760,12 @@ _ProcessDestroy(
     RemoveEntryList(&Process->NextProcess);
     MutexRelease(&m_processData.ProcessListLock);
 
+    // PID 0 is never handed out => the process was never inserted in the map
+    if (Process->Id != 0)
+    {
+        StripedHashMapRemove(&m_processData.ProcessIdMap, Process->Id);
+    }
+
     if (NULL != Process->FullCommandLine)
     {
         ExFreePoolWithTag(Process->FullCommandLine, HEAP_PROCESS_TAG);
@@ -742,23 +778,67 @@ _ProcessDestroy(
         Process->ProcessName = NULL;
     }
 
+    // Because the system process will never be destroyed it is ok to free
+    // these memory addresses unconditionally
+    MmuDestroyAddressSpaceForProcess(Process);
+
+    // the header info is needed to find where the image was mapped
     if (NULL != Process->HeaderInfo)
     {
         ExFreePoolWithTag(Process->HeaderInfo, HEAP_PROCESS_TAG);
         Process->HeaderInfo = NULL;
     }
 
-    // Because the system process will never be destroyed it is ok to free
-    // these memory addresses unconditionally
-    MmuDestroyAddressSpaceForProcess(Process);
-
     if (Process->Id != 0)
     {
-        // This should be done only after MmuDestroyVirtualSpaceForProcess, that
-        // function is also responsible for destroying all cached translations for
-        // this process ID
+        // PIDs are not used to tag translations => the PID can be reused even
+        // if the address space is still being torn down
         _ProcessSystemFreePid(Process->Id);
     }
 
     ExFreePoolWithTag(Process, HEAP_PROCESS_TAG);
 }
+
+static
+PVOID
+(__cdecl _ProcessIdMapAlloc)(
+    IN      DWORD                   Size,
+    IN_OPT  PVOID                   Context
+    )
+{
+    ASSERT(NULL == Context);
+
+    return ExAllocatePoolWithTag(0, Size, HEAP_PROCESS_TAG, 0);
+}
+
+static
+void
+(__cdecl _ProcessIdMapFree)(
+    IN      PVOID                   Object,
+    IN_OPT  PVOID                   Context
+    )
+{
+    ASSERT(NULL == Context);
+
+    ExFreePoolWithTag(Object, HEAP_PROCESS_TAG);
+}
+
+// Called with the lock of the map stripe held => the process cannot be
+// destroyed while we reference it, a process whose reference count already
+// reached 0 is about to be removed from the map
+static
+BOOLEAN
+(__cdecl _ProcessReferenceFromMap)(
+    IN      QWORD                   Key,
+    IN      PVOID                   Value,
+    IN_OPT  PVOID                   Context
+    )
+{
+    PPROCESS pProcess = (PPROCESS) Value;
+
+    ASSERT(NULL != pProcess);
+    ASSERT(pProcess->Id == Key);
+    ASSERT(NULL == Context);
+
+    return RfcTryReference(&pProcess->RefCnt);
+}
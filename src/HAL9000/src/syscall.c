@@ -67,6 +67,10 @@ SyscallHandler(
         case SyscallIdIdentifyVersion:
             status = SyscallValidateInterface((SYSCALL_IF_VERSION)*pSyscallParameters);
             break;
+        case SyscallIdProcessGetMemoryStatistics:
+            status = SyscallProcessGetMemoryStatistics((UM_HANDLE)pSyscallParameters[0],
+                                                       (PROCESS_MEMORY_STATISTICS*)pSyscallParameters[1]);
+            break;
         // STUDENT TODO: implement the rest of the syscalls
         default:
             LOG_ERROR("Unimplemented syscall called from User-space!\n");
@@ -169,4 +173,39 @@ SyscallValidateInterface(
     return STATUS_SUCCESS;
 }
 
+// SyscallIdProcessGetMemoryStatistics
+STATUS
+SyscallProcessGetMemoryStatistics(
+    IN_OPT  UM_HANDLE                   ProcessHandle,
+    OUT     PROCESS_MEMORY_STATISTICS*  Statistics
+    )
+{
+    PROCESS_MEMORY_STATISTICS statistics;
+    STATUS status;
+
+    // there is no handle table yet => only the calling process can be queried
+    if (ProcessHandle != UM_INVALID_HANDLE_VALUE)
+    {
+        return STATUS_INVALID_PARAMETER1;
+    }
+
+    status = MmuIsBufferValid(Statistics, sizeof(PROCESS_MEMORY_STATISTICS), PAGE_RIGHTS_WRITE, GetCurrentProcess());
+    if (!SUCCEEDED(status))
+    {
+        LOG_FUNC_ERROR("MmuIsBufferValid", status);
+        return STATUS_INVALID_PARAMETER2;
+    }
+
+    status = MmuRetrieveProcessMemoryStatistics(GetCurrentProcess(), &statistics);
+    if (!SUCCEEDED(status))
+    {
+        LOG_FUNC_ERROR("MmuRetrieveProcessMemoryStatistics", status);
+        return status;
+    }
+
+    memcpy(Statistics, &statistics, sizeof(PROCESS_MEMORY_STATISTICS));
+
+    return STATUS_SUCCESS;
+}
+
 // STUDENT TODO: implement the rest of the syscalls
\ No newline at end of file
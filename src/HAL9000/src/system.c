@@ -9,6 +9,7 @@
 #include "print.h"
 #include "synch.h"
 #include "mmu.h"
+#include "pmm.h"
 #include "thread_internal.h"
 #include "gdtmu.h"
 #include "lapic_system.h"
@@ -121,6 +122,8 @@ SystemInit(
 
     LOGL("CpuMuActivateFpuFeatures succeeded\n");
 
+    CpuMuSelectMemoryRoutines();
+
     // IDT handlers need to be initialized before
     // MmuInitSystem is called because the VMM
     // needs page fault handling to allocate memory
@@ -174,6 +177,14 @@ SystemInit(
     }
     LOGL("AcpiInterfaceInit suceeded\n");
 
+    status = PmmInitNumaNodes();
+    if (!SUCCEEDED(status))
+    {
+        LOG_FUNC_ERROR("PmmInitNumaNodes", status);
+        return status;
+    }
+    LOGL("PmmInitNumaNodes suceeded\n");
+
     status = LapicSystemInit();
     if (!SUCCEEDED(status))
     {
@@ -304,6 +315,19 @@ SystemInit(
 
     LOGL("IOMU late initialization successfully completed\n");
 
+    // the system can run without swap, user pages which are not backed by a file
+    // will simply not be evicted
+    status = MmuInitSwapSystem();
+    if (!SUCCEEDED(status))
+    {
+        LOG_FUNC_ERROR("MmuInitSwapSystem", status);
+        status = STATUS_SUCCESS;
+    }
+    else
+    {
+        LOGL("Swap system successfully initialized\n");
+    }
+
     status = NetworkStackInit(FALSE);
     if (!SUCCEEDED(status))
     {
@@ -5,6 +5,7 @@
 #include "test_file_io.h"
 #include "test_dma.h"
 #include "test_thread.h"
+#include "test_process.h"
 #include "smp.h"
 
 #define TEST_HEAP_ALLOCATION_SIZE           0x100
@@ -28,4 +29,5 @@ TestRunAllPerformance(
 {
     TestFileReadPerformance();
     TestDmaPerformance();
+    TestProcessExitPerformance();
 }
\ No newline at end of file
@@ -11,7 +11,8 @@ static const char FILES_TO_READ[][MAX_PATH] = { "C:\\WINLOA~1.RAR",
                                                 };
 static const DWORD NO_OF_FILES = ARRAYSIZE(FILES_TO_READ);
 
-static const DWORD READ_CHUNK_SIZES[] = { PAGE_SIZE, 4 * PAGE_SIZE, 8 * PAGE_SIZE, 32 * PAGE_SIZE, 63 * PAGE_SIZE };
+// the last chunk is larger than the 1MB limit of an asynchronous FAT transfer
+static const DWORD READ_CHUNK_SIZES[] = { PAGE_SIZE, 4 * PAGE_SIZE, 8 * PAGE_SIZE, 32 * PAGE_SIZE, 63 * PAGE_SIZE, 300 * PAGE_SIZE };
 static const DWORD NO_OF_CHUNK_SIZES = ARRAYSIZE(READ_CHUNK_SIZES);
 static const char* STAT_NAMES[2] = { "SYNCHRONOUS", "ASYNCHRONOUS" };
 
@@ -121,13 +122,13 @@ TestFileRead(
                 __leave;
             }
 
-            fileOffset = 0;
-            bytesRemaining = fileInformation.FileSize;
-
             for (j = 0; j < NO_OF_CHUNK_SIZES; ++j)
             {
                 DWORD allocationSize = READ_CHUNK_SIZES[j];
 
+                fileOffset = 0;
+                bytesRemaining = fileInformation.FileSize;
+
                 LOGL("Running on file [%s] with chunk size 0x%x bytes\n", FILES_TO_READ[i], allocationSize);
 
                 if (NULL != pSyncBuffer)
@@ -138,7 +139,7 @@ TestFileRead(
 
                 if (NULL != pAsyncBuffer)
                 {
-                    ExFreePoolWithTag(pAsyncBuffer, HEAP_TEST_TAG);
+                    IoFreeContinuousMemory(pAsyncBuffer);
                     pAsyncBuffer = NULL;
                 }
 
@@ -150,10 +151,13 @@ TestFileRead(
                     __leave;
                 }
 
-                pAsyncBuffer = ExAllocatePoolWithTag(PoolAllocateZeroMemory, allocationSize, HEAP_TEST_TAG, 0);
+                // the asynchronous buffer is physically contiguous, such that
+                // the DMA transfers of the large chunks are described by
+                // translations longer than a 64KB PRD entry
+                pAsyncBuffer = IoAllocateContinuousMemory(allocationSize);
                 if (NULL == pAsyncBuffer)
                 {
-                    LOG_FUNC_ERROR_ALLOC("HeapAllocatePoolWithTag", allocationSize);
+                    LOG_FUNC_ERROR_ALLOC("IoAllocateContinuousMemory", allocationSize);
                     status = STATUS_HEAP_INSUFFICIENT_RESOURCES;
                     __leave;
                 }
@@ -197,6 +201,8 @@ TestFileRead(
                     if (0 != memcmp(pAsyncBuffer, pSyncBuffer, (DWORD)bytesRead))
                     {
                         LOG_ERROR("Async buffers differs from sync buffer at file offset 0x%X\n", fileOffset);
+                        status = STATUS_UNSUCCESSFUL;
+                        __leave;
                     }
 
                     bytesRemaining = bytesRemaining - bytesRead;
@@ -238,7 +244,7 @@ TestFileRead(
 
         if (NULL != pAsyncBuffer)
         {
-            ExFreePoolWithTag(pAsyncBuffer, HEAP_TEST_TAG);
+            IoFreeContinuousMemory(pAsyncBuffer);
             pAsyncBuffer = NULL;
         }
     }
@@ -1,10 +1,23 @@
 #include "test_common.h"
 #include "test_process.h"
 #include "process.h"
+#include "thread.h"
 #include "iomu.h"
+#include "pmm.h"
+#include "perf_framework.h"
+#include "rtc.h"
 
 #define MAX_PROCESSES_TO_SPAWN          16
 
+#define PROCESS_EXIT_PERFORMANCE_NO_OF_ITERATIONS   8
+
+// The frames of an exiting process are zeroed by a worker before they are
+// freed, we give it this long to catch up
+#define PROCESS_EXIT_FRAMES_RELEASE_TIMEOUT_US      (5 * SEC_IN_US)
+
+// processes which leave large address spaces behind when they exit
+static const char* PROCESS_EXIT_PERFORMANCE_APPS[] = { "VirtualAllocHugeEager", "SwapLinear" };
+
 const PROCESS_TEST PROCESS_TESTS[] =
 {
     // Project 2: Userprog
@@ -128,6 +141,12 @@ const PROCESS_TEST PROCESS_TESTS[] =
 
 const DWORD PROCESS_TOTAL_NO_OF_TESTS = ARRAYSIZE(PROCESS_TESTS);
 
+static
+QWORD
+_TestProcessWaitForFreeFrames(
+    IN      QWORD                       NumberOfFreeFrames
+    );
+
 
 void
 TestProcessFunctionality(
@@ -197,3 +216,104 @@ TestAllProcessFunctionalities(
         TestProcessFunctionality(&PROCESS_TESTS[i]);
     }
 }
+
+void
+TestProcessExitPerformance(
+    void
+    )
+{
+    STATUS status;
+    STATUS terminationStatus;
+    PPROCESS pProcess;
+    char fullPath[MAX_PATH];
+    const char* pSystemPartition;
+    QWORD startTime;
+    QWORD elapsedTime;
+    QWORD totalTime;
+    QWORD freeFramesBefore;
+    QWORD freeFramesAfter;
+    PERFORMANCE_STATS perfStats[ARRAYSIZE(PROCESS_EXIT_PERFORMANCE_APPS)];
+
+    pSystemPartition = IomuGetSystemPartitionPath();
+    if (pSystemPartition == NULL)
+    {
+        LOG_ERROR("Cannot run user tests without knowing the system partition!\n");
+        return;
+    }
+
+    memzero(perfStats, sizeof(perfStats));
+
+    for (DWORD i = 0; i < ARRAYSIZE(PROCESS_EXIT_PERFORMANCE_APPS); ++i)
+    {
+        snprintf(fullPath, MAX_PATH,
+                 "%s%s\\%s.exe", pSystemPartition, "APPLICATIONS",
+                 PROCESS_EXIT_PERFORMANCE_APPS[i]);
+
+        totalTime = 0;
+        perfStats[i].Min = MAX_QWORD;
+
+        for (DWORD j = 0; j < PROCESS_EXIT_PERFORMANCE_NO_OF_ITERATIONS; ++j)
+        {
+            freeFramesBefore = PmmGetNumberOfFreeFrames();
+
+            status = ProcessCreate(fullPath,
+                                   NULL,
+                                   &pProcess);
+            if (!SUCCEEDED(status))
+            {
+                LOG_FUNC_ERROR("ProcessCreate", status);
+                return;
+            }
+
+            ProcessWaitForTermination(pProcess, &terminationStatus);
+
+            // closing the last handle is what destroys the address space, we
+            // only measure how long the parent is held up by it
+            startTime = RtcGetTickCount();
+            ProcessCloseHandle(pProcess);
+            elapsedTime = RtcGetTickCount() - startTime;
+            pProcess = NULL;
+
+            // the first spawn may grow the kernel pools, from then on every
+            // frame used by the process must be given back
+            freeFramesAfter = _TestProcessWaitForFreeFrames(freeFramesBefore);
+            if (j != 0 && freeFramesAfter < freeFramesBefore)
+            {
+                LOG_ERROR("Process [%s] leaked %U frames\n",
+                          PROCESS_EXIT_PERFORMANCE_APPS[i], freeFramesBefore - freeFramesAfter);
+            }
+
+            perfStats[i].Min = min(perfStats[i].Min, elapsedTime);
+            perfStats[i].Max = max(perfStats[i].Max, elapsedTime);
+            totalTime = totalTime + elapsedTime;
+        }
+
+        perfStats[i].Min = IomuTickCountToUs(perfStats[i].Min);
+        perfStats[i].Max = IomuTickCountToUs(perfStats[i].Max);
+        perfStats[i].Mean = IomuTickCountToUs(totalTime / PROCESS_EXIT_PERFORMANCE_NO_OF_ITERATIONS);
+    }
+
+    LOGL("Process exit latency [us]\n");
+    DisplayPerformanceStats(perfStats, ARRAYSIZE(PROCESS_EXIT_PERFORMANCE_APPS), PROCESS_EXIT_PERFORMANCE_APPS);
+}
+
+static
+QWORD
+_TestProcessWaitForFreeFrames(
+    IN      QWORD                       NumberOfFreeFrames
+    )
+{
+    QWORD deadline;
+    QWORD freeFrames;
+
+    deadline = IomuGetSystemTimeUs() + PROCESS_EXIT_FRAMES_RELEASE_TIMEOUT_US;
+
+    for (freeFrames = PmmGetNumberOfFreeFrames();
+         freeFrames < NumberOfFreeFrames && IomuGetSystemTimeUs() < deadline;
+         freeFrames = PmmGetNumberOfFreeFrames())
+    {
+        ThreadYield();
+    }
+
+    return freeFrames;
+}
@@ -14,6 +14,9 @@ static const DWORD TST_VMM_ALLOCATION_SIZES[] =
 };
 static const DWORD TST_VMM_NO_OF_SIZES = ARRAYSIZE(TST_VMM_ALLOCATION_SIZES);
 
+// larger than 4GB, such that any 32 bit truncation of the size is noticed
+#define TST_VMM_HUGE_ALLOCATION_SIZE                (5 * GB_SIZE)
+
 static
 STATUS
 _TstVmmAllocationAndDeallocation(
@@ -21,6 +24,12 @@ _TstVmmAllocationAndDeallocation(
     IN          BOOLEAN     SpecifyBase
     );
 
+static
+STATUS
+_TstVmmHugeAllocationAndDeallocation(
+    void
+    );
+
 void
 TestVmmAllocAndFreeFunctions(
     void
@@ -39,6 +48,10 @@ TestVmmAllocAndFreeFunctions(
             LOGL("_TstVmmAllocationAndDeallocation finished with status: 0x%x\n", status );
         }
     }
+
+    LOGL("Will call _TstVmmHugeAllocationAndDeallocation for size: %U B\n", TST_VMM_HUGE_ALLOCATION_SIZE);
+    status = _TstVmmHugeAllocationAndDeallocation();
+    LOGL("_TstVmmHugeAllocationAndDeallocation finished with status: 0x%x\n", status);
 }
 
 static
@@ -130,4 +143,62 @@ _TstVmmAllocationAndDeallocation(
                   );
 
     return status;
-}
\ No newline at end of file
+}
+
+static
+STATUS
+_TstVmmHugeAllocationAndDeallocation(
+    void
+    )
+{
+    PBYTE pBaseAddress;
+    PBYTE pPagesToTouch[3];
+    DWORD i;
+
+    LOGL("About to reserve and commit region of %U bytes\n", TST_VMM_HUGE_ALLOCATION_SIZE);
+    pBaseAddress = VmmAllocRegion(NULL,
+                                  TST_VMM_HUGE_ALLOCATION_SIZE,
+                                  VMM_ALLOC_TYPE_RESERVE | VMM_ALLOC_TYPE_COMMIT,
+                                  PAGE_RIGHTS_READWRITE
+                                  );
+    if (NULL == pBaseAddress)
+    {
+        LOG_ERROR("VmmAllocRegion failed reserve and commit: %U bytes of memory\n", TST_VMM_HUGE_ALLOCATION_SIZE);
+        return STATUS_MEMORY_CANNOT_BE_COMMITED;
+    }
+
+    // the commit is lazy, only the touched pages are backed by frames
+    pPagesToTouch[0] = pBaseAddress;
+    pPagesToTouch[1] = pBaseAddress + 4 * GB_SIZE + PAGE_SIZE;
+    pPagesToTouch[2] = pBaseAddress + TST_VMM_HUGE_ALLOCATION_SIZE - PAGE_SIZE;
+
+    for (i = 0; i < ARRAYSIZE(pPagesToTouch); ++i)
+    {
+        LOGL("About to write to committed region at address 0x%X\n", pPagesToTouch[i]);
+        *pPagesToTouch[i] = TST_VMM_MAGIC_VALUE_TO_WRITE;
+        if (TST_VMM_MAGIC_VALUE_TO_WRITE != *pPagesToTouch[i])
+        {
+            LOG_ERROR("Value written does not correspond to value read\n");
+            VmmFreeRegion(pBaseAddress, 0, VMM_FREE_TYPE_RELEASE);
+            return STATUS_UNSUCCESSFUL;
+        }
+    }
+
+    LOGL("About to release region of %U bytes\n", TST_VMM_HUGE_ALLOCATION_SIZE);
+    VmmFreeRegion(pBaseAddress,
+                  0,
+                  VMM_FREE_TYPE_RELEASE
+                  );
+
+    // a release which stopped at 4GB would leave the pages above it mapped
+    for (i = 0; i < ARRAYSIZE(pPagesToTouch); ++i)
+    {
+        if (NULL != MmuGetPhysicalAddress(pPagesToTouch[i]))
+        {
+            LOG_ERROR("Page at 0x%X is still mapped after the region was released\n", pPagesToTouch[i]);
+            return STATUS_UNSUCCESSFUL;
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
@@ -9,6 +9,7 @@
 #include "isr.h"
 #include "gdtmu.h"
 #include "pe_exports.h"
+#include "striped_hash_map.h"
 
 #define TID_INCREMENT               4
 
@@ -32,6 +33,10 @@ typedef struct _THREAD_SYSTEM_DATA
     _Guarded_by_(AllThreadsLock)
     LIST_ENTRY          AllThreadsList;
 
+    // Maps TIDs to threads, used for lookups by ID so they do not need to
+    // walk AllThreadsList while holding its lock
+    STRIPED_HASH_MAP    ThreadIdMap;
+
     LOCK                ReadyThreadsLock;
 
     _Guarded_by_(ReadyThreadsLock)
@@ -123,6 +128,10 @@ _ThreadDereference(
 
 static FUNC_FreeFunction            _ThreadDestroy;
 
+static FUNC_HashMapAlloc            _ThreadIdMapAlloc;
+static FUNC_FreeFunction            _ThreadIdMapFree;
+static FUNC_StripedHashMapFunction  _ThreadReferenceFromMap;
+
 static
 void
 _ThreadKernelFunction(
@@ -143,6 +152,9 @@ ThreadSystemPreinit(
     InitializeListHead(&m_threadSystemData.AllThreadsList);
     LockInit(&m_threadSystemData.AllThreadsLock);
 
+    // nothing is allocated until the first thread is inserted
+    StripedHashMapInit(&m_threadSystemData.ThreadIdMap, _ThreadIdMapAlloc, _ThreadIdMapFree, NULL);
+
     InitializeListHead(&m_threadSystemData.ReadyThreadsList);
     LockInit(&m_threadSystemData.ReadyThreadsLock);
 }
@@ -690,6 +702,18 @@ ThreadExecuteForEachThreadEntry(
     return status;
 }
 
+PTR_SUCCESS
+PTHREAD
+ThreadRetrieveById(
+    IN      TID                 ThreadId
+    )
+{
+    return StripedHashMapLookup(&m_threadSystemData.ThreadIdMap,
+                                ThreadId,
+                                _ThreadReferenceFromMap,
+                                NULL);
+}
+
 void
 SetCurrentThread(
     IN      PTHREAD     Thread
@@ -799,6 +823,13 @@ _ThreadInit(
         LockAcquire(&m_threadSystemData.AllThreadsLock, &oldIntrState);
         InsertTailList(&m_threadSystemData.AllThreadsList, &pThread->AllList);
         LockRelease(&m_threadSystemData.AllThreadsLock, oldIntrState);
+
+        status = StripedHashMapInsert(&m_threadSystemData.ThreadIdMap, pThread->Id, pThread, NULL);
+        if (!SUCCEEDED(status))
+        {
+            LOG_FUNC_ERROR("StripedHashMapInsert", status);
+            __leave;
+        }
     }
     __finally
     {
@@ -1191,6 +1222,8 @@ _ThreadDestroy(
     RemoveEntryList(&pThread->AllList);
     LockRelease(&m_threadSystemData.AllThreadsLock, oldState);
 
+    StripedHashMapRemove(&m_threadSystemData.ThreadIdMap, pThread->Id);
+
     // This must be done before removing the thread from the process list, else
     // this may be the last thread and the process VAS will be freed by the time
     // ProcessRemoveThreadFromList - this function also dereferences the process
@@ -1238,4 +1271,47 @@ _ThreadKernelFunction(
 
     ThreadExit(exitStatus);
     NOT_REACHED;
+}
+
+static
+PVOID
+(__cdecl _ThreadIdMapAlloc)(
+    IN      DWORD                   Size,
+    IN_OPT  PVOID                   Context
+    )
+{
+    ASSERT(NULL == Context);
+
+    return ExAllocatePoolWithTag(0, Size, HEAP_THREAD_TAG, 0);
+}
+
+static
+void
+(__cdecl _ThreadIdMapFree)(
+    IN      PVOID                   Object,
+    IN_OPT  PVOID                   Context
+    )
+{
+    ASSERT(NULL == Context);
+
+    ExFreePoolWithTag(Object, HEAP_THREAD_TAG);
+}
+
+// Called with the lock of the map stripe held => the thread cannot be
+// destroyed while we reference it
+static
+BOOLEAN
+(__cdecl _ThreadReferenceFromMap)(
+    IN      QWORD                   Key,
+    IN      PVOID                   Value,
+    IN_OPT  PVOID                   Context
+    )
+{
+    PTHREAD pThread = (PTHREAD) Value;
+
+    ASSERT(NULL != pThread);
+    ASSERT(pThread->Id == Key);
+    ASSERT(NULL == Context);
+
+    return RfcTryReference(&pThread->RefCnt);
 }
\ No newline at end of file
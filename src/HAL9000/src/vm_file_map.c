@@ -0,0 +1,552 @@
+#include "HAL9000.h"
+#include "vm_file_map.h"
+#include "vmm.h"
+#include "vm_tlb.h"
+#include "thread.h"
+#include "mutex.h"
+#include "ex_timer.h"
+#include "io.h"
+
+// Interval at which the worker thread writes back the dirty pages
+#define VM_FILE_MAP_WRITEBACK_PERIOD_US         (5 * SEC_IN_US)
+
+// Number of pages whose dirty bits are cleared with a single acquisition of
+// the paging lock, their translations are invalidated with a single batch
+#define VM_FILE_MAP_WRITEBACK_CHUNK_PAGES       VM_TLB_BATCH_MAX_PAGES
+
+typedef struct _VM_FILE_MAPPING
+{
+    LIST_ENTRY                      ListEntry;
+
+    PVMM_RESERVATION_SPACE          VaSpace;
+    PPAGING_LOCK_DATA               PagingData;
+
+    PVOID                           StartVa;
+    QWORD                           Size;
+
+    PFILE_OBJECT                    File;
+
+    // The pages past the end of the file are never written back => the
+    // file is never extended through a mapping
+    QWORD                           FileSize;
+} VM_FILE_MAPPING, *PVM_FILE_MAPPING;
+
+typedef struct _VM_FILE_MAP_DATA
+{
+    // Held across the file writes: while it is held the frames of the
+    // mappings cannot be released => the physical addresses gathered by the
+    // writeback remain valid
+    MUTEX                           MappingsLock;
+
+    _Guarded_by_(MappingsLock)
+    LIST_ENTRY                      MappingsList;
+
+    // Checked without the lock to avoid taking the mutex on unmaps if no
+    // shared file mappings exist
+    volatile DWORD                  NumberOfMappings;
+
+    PTHREAD                         WritebackThread;
+} VM_FILE_MAP_DATA, *PVM_FILE_MAP_DATA;
+
+static VM_FILE_MAP_DATA m_fileMapData;
+
+static FUNC_ThreadStart             _VmFileMapWritebackThreadFunction;
+
+REQUIRES_EXCL_LOCK(m_fileMapData.MappingsLock)
+static
+STATUS
+_VmFileMapWriteBackRange(
+    IN      PVM_FILE_MAPPING        Mapping,
+    IN      PVOID                   Address,
+    IN      QWORD                   Size
+    );
+
+REQUIRES_EXCL_LOCK(m_fileMapData.MappingsLock)
+static
+STATUS
+_VmFileMapWriteBackIntersection(
+    IN      PVMM_RESERVATION_SPACE  VaSpace,
+    IN      PVOID                   Address,
+    IN      QWORD                   Size,
+    IN      BOOLEAN                 Unregister
+    );
+
+REQUIRES_EXCL_LOCK(m_fileMapData.MappingsLock)
+static
+STATUS
+_VmFileMapWritePage(
+    IN      PVM_FILE_MAPPING        Mapping,
+    IN      PVOID                   VirtualAddress,
+    IN      PHYSICAL_ADDRESS        PhysicalAddress
+    );
+
+REQUIRES_EXCL_LOCK(m_fileMapData.MappingsLock)
+static
+void
+_VmFileMapRemoveMapping(
+    INOUT   PVM_FILE_MAPPING        Mapping
+    );
+
+_No_competing_thread_
+void
+VmFileMapPreinit(
+    void
+    )
+{
+    memzero(&m_fileMapData, sizeof(VM_FILE_MAP_DATA));
+
+    MutexInit(&m_fileMapData.MappingsLock, FALSE);
+    InitializeListHead(&m_fileMapData.MappingsList);
+}
+
+STATUS
+VmFileMapInit(
+    void
+    )
+{
+    STATUS status;
+    PTHREAD pThread;
+
+    pThread = NULL;
+
+    status = ThreadCreate("File Mapping Writeback Thread",
+                          ThreadPriorityLowest,
+                          _VmFileMapWritebackThreadFunction,
+                          NULL,
+                          &pThread
+                          );
+    if (!SUCCEEDED(status))
+    {
+        LOG_FUNC_ERROR("ThreadCreate", status);
+        return status;
+    }
+
+    m_fileMapData.WritebackThread = pThread;
+
+    return status;
+}
+
+STATUS
+VmFileMapRegister(
+    IN      PVMM_RESERVATION_SPACE  VaSpace,
+    IN      PPAGING_LOCK_DATA       PagingData,
+    IN      PVOID                   BaseAddress,
+    IN      QWORD                   Size,
+    IN      PFILE_OBJECT            File
+    )
+{
+    PVM_FILE_MAPPING pMapping;
+    STATUS status;
+
+    ASSERT(VaSpace != NULL);
+    ASSERT(PagingData != NULL && !PagingData->Data.KernelSpace);
+    ASSERT(IsAddressAligned(BaseAddress, PAGE_SIZE));
+    ASSERT(File != NULL);
+
+    pMapping = ExAllocatePoolWithTag(PoolAllocateZeroMemory, sizeof(VM_FILE_MAPPING), HEAP_MMU_TAG, 0);
+    if (pMapping == NULL)
+    {
+        LOG_FUNC_ERROR_ALLOC("ExAllocatePoolWithTag", sizeof(VM_FILE_MAPPING));
+        return STATUS_HEAP_INSUFFICIENT_RESOURCES;
+    }
+
+    status = IoGetFileSize(File, &pMapping->FileSize);
+    if (!SUCCEEDED(status))
+    {
+        LOG_FUNC_ERROR("IoGetFileSize", status);
+        ExFreePoolWithTag(pMapping, HEAP_MMU_TAG);
+        return status;
+    }
+
+    pMapping->VaSpace = VaSpace;
+    pMapping->PagingData = PagingData;
+    pMapping->StartVa = BaseAddress;
+    pMapping->Size = AlignAddressUpper(Size, PAGE_SIZE);
+    pMapping->File = File;
+
+    MutexAcquire(&m_fileMapData.MappingsLock);
+    InsertTailList(&m_fileMapData.MappingsList, &pMapping->ListEntry);
+    _InterlockedIncrement(&m_fileMapData.NumberOfMappings);
+    MutexRelease(&m_fileMapData.MappingsLock);
+
+    return STATUS_SUCCESS;
+}
+
+STATUS
+VmFileMapFlush(
+    IN      PVMM_RESERVATION_SPACE  VaSpace,
+    IN      PVOID                   Address,
+    IN      QWORD                   Size
+    )
+{
+    STATUS status;
+
+    ASSERT(VaSpace != NULL);
+    ASSERT(Size != 0);
+
+    if (m_fileMapData.NumberOfMappings == 0)
+    {
+        return STATUS_SUCCESS;
+    }
+
+    MutexAcquire(&m_fileMapData.MappingsLock);
+    status = _VmFileMapWriteBackIntersection(VaSpace, Address, Size, FALSE);
+    MutexRelease(&m_fileMapData.MappingsLock);
+
+    return status;
+}
+
+BOOLEAN
+VmFileMapBeginUnmap(
+    IN      PVMM_RESERVATION_SPACE  VaSpace,
+    IN      PVOID                   Address,
+    IN      QWORD                   Size,
+    IN      VMM_FREE_TYPE           FreeType
+    )
+{
+    STATUS status;
+    BOOLEAN bRelease;
+
+    ASSERT(VaSpace != NULL);
+
+    if (m_fileMapData.NumberOfMappings == 0)
+    {
+        return FALSE;
+    }
+
+    bRelease = IsBooleanFlagOn(FreeType, VMM_FREE_TYPE_RELEASE);
+
+    MutexAcquire(&m_fileMapData.MappingsLock);
+
+    // a released region is identified by its base address => a single
+    // byte is enough to find the mapping
+    status = _VmFileMapWriteBackIntersection(VaSpace,
+                                             Address,
+                                             bRelease ? 1 : Size,
+                                             bRelease);
+    if (!SUCCEEDED(status))
+    {
+        // the region is freed anyway, there is no one left to report it to
+        LOG_FUNC_ERROR("_VmFileMapWriteBackIntersection", status);
+    }
+
+    return TRUE;
+}
+
+void
+VmFileMapEndUnmap(
+    void
+    )
+{
+    MutexRelease(&m_fileMapData.MappingsLock);
+}
+
+void
+VmFileMapUnregisterAddressSpace(
+    IN      PVMM_RESERVATION_SPACE  VaSpace
+    )
+{
+    PLIST_ENTRY pEntry;
+    PLIST_ENTRY pNextEntry;
+    STATUS status;
+
+    ASSERT(VaSpace != NULL);
+
+    if (m_fileMapData.NumberOfMappings == 0)
+    {
+        return;
+    }
+
+    MutexAcquire(&m_fileMapData.MappingsLock);
+
+    for (pEntry = m_fileMapData.MappingsList.Flink;
+         pEntry != &m_fileMapData.MappingsList;
+         pEntry = pNextEntry)
+    {
+        PVM_FILE_MAPPING pMapping = CONTAINING_RECORD(pEntry, VM_FILE_MAPPING, ListEntry);
+
+        pNextEntry = pEntry->Flink;
+
+        if (pMapping->VaSpace != VaSpace)
+        {
+            continue;
+        }
+
+        status = _VmFileMapWriteBackRange(pMapping, pMapping->StartVa, pMapping->Size);
+        if (!SUCCEEDED(status))
+        {
+            LOG_FUNC_ERROR("_VmFileMapWriteBackRange", status);
+        }
+
+        _VmFileMapRemoveMapping(pMapping);
+    }
+
+    MutexRelease(&m_fileMapData.MappingsLock);
+}
+
+static
+STATUS
+_VmFileMapWritebackThreadFunction(
+    IN_OPT      PVOID           Context
+    )
+{
+    EX_TIMER timer;
+    STATUS status;
+    PLIST_ENTRY pEntry;
+
+    ASSERT(Context == NULL);
+
+    // warning C4127: conditional expression is constant
+#pragma warning(suppress:4127)
+    while (TRUE)
+    {
+        status = ExTimerInit(&timer, ExTimerTypeRelativeOnce, VM_FILE_MAP_WRITEBACK_PERIOD_US);
+        if (!SUCCEEDED(status))
+        {
+            LOG_FUNC_ERROR("ExTimerInit", status);
+            return status;
+        }
+
+        ExTimerStart(&timer);
+        ExTimerWait(&timer);
+        ExTimerUninit(&timer);
+
+        if (m_fileMapData.NumberOfMappings == 0)
+        {
+            continue;
+        }
+
+        MutexAcquire(&m_fileMapData.MappingsLock);
+
+        for (pEntry = m_fileMapData.MappingsList.Flink;
+             pEntry != &m_fileMapData.MappingsList;
+             pEntry = pEntry->Flink)
+        {
+            PVM_FILE_MAPPING pMapping = CONTAINING_RECORD(pEntry, VM_FILE_MAPPING, ListEntry);
+
+            // the pages whose writes failed remain dirty and are retried on
+            // the next period
+            status = _VmFileMapWriteBackRange(pMapping, pMapping->StartVa, pMapping->Size);
+            if (!SUCCEEDED(status))
+            {
+                LOG_FUNC_ERROR("_VmFileMapWriteBackRange", status);
+            }
+        }
+
+        MutexRelease(&m_fileMapData.MappingsLock);
+    }
+
+    NOT_REACHED;
+
+    return STATUS_SUCCESS;
+}
+
+REQUIRES_EXCL_LOCK(m_fileMapData.MappingsLock)
+static
+STATUS
+_VmFileMapWriteBackRange(
+    IN      PVM_FILE_MAPPING        Mapping,
+    IN      PVOID                   Address,
+    IN      QWORD                   Size
+    )
+{
+    PHYSICAL_ADDRESS pages[VM_FILE_MAP_WRITEBACK_CHUNK_PAGES];
+    VM_TLB_BATCH batch;
+    INTR_STATE oldState;
+    PVOID pCurrentVa;
+    PVOID pEndVa;
+    STATUS status;
+
+    ASSERT(Mapping != NULL);
+    ASSERT(IsAddressAligned(Address, PAGE_SIZE));
+
+    status = STATUS_SUCCESS;
+
+    // pages past the end of the file are never written back
+    pEndVa = PtrOffset(Mapping->StartVa, min(Mapping->Size, AlignAddressUpper(Mapping->FileSize, PAGE_SIZE)));
+    pEndVa = min(pEndVa, PtrOffset(Address, Size));
+
+    for (pCurrentVa = Address; pCurrentVa < pEndVa; pCurrentVa = PtrOffset(pCurrentVa, VM_FILE_MAP_WRITEBACK_CHUNK_PAGES * PAGE_SIZE))
+    {
+        DWORD noOfPages;
+        DWORD i;
+
+        noOfPages = (DWORD) min(VM_FILE_MAP_WRITEBACK_CHUNK_PAGES, PtrDiff(pEndVa, pCurrentVa) / PAGE_SIZE);
+
+        // 1. Clear the dirty bits, from now on any write to these pages will
+        // set them again once the translations are invalidated
+        VmTlbBatchInit(&batch, &Mapping->PagingData->Data);
+
+        RecRwSpinlockAcquireExclusive(&Mapping->PagingData->Lock, &oldState);
+        for (i = 0; i < noOfPages; ++i)
+        {
+            pages[i] = VmmCleanPage(&Mapping->PagingData->Data,
+                                    PtrOffset(pCurrentVa, (QWORD) i * PAGE_SIZE),
+                                    &batch);
+        }
+        RecRwSpinlockReleaseExclusive(&Mapping->PagingData->Lock, oldState);
+
+        VmTlbBatchFlush(&batch);
+
+        // 2. Write the contents of the pages which were dirty
+        for (i = 0; i < noOfPages; ++i)
+        {
+            if (pages[i] == NULL)
+            {
+                continue;
+            }
+
+            if (SUCCEEDED(status))
+            {
+                status = _VmFileMapWritePage(Mapping, PtrOffset(pCurrentVa, (QWORD) i * PAGE_SIZE), pages[i]);
+                if (SUCCEEDED(status))
+                {
+                    continue;
+                }
+                LOG_FUNC_ERROR("_VmFileMapWritePage", status);
+            }
+
+            // the contents of this page and of all the following ones were
+            // not written => they must remain dirty
+            RecRwSpinlockAcquireExclusive(&Mapping->PagingData->Lock, &oldState);
+            VmmMarkPageDirty(&Mapping->PagingData->Data, PtrOffset(pCurrentVa, (QWORD) i * PAGE_SIZE), pages[i]);
+            RecRwSpinlockReleaseExclusive(&Mapping->PagingData->Lock, oldState);
+        }
+
+        if (!SUCCEEDED(status))
+        {
+            break;
+        }
+    }
+
+    return status;
+}
+
+REQUIRES_EXCL_LOCK(m_fileMapData.MappingsLock)
+static
+STATUS
+_VmFileMapWriteBackIntersection(
+    IN      PVMM_RESERVATION_SPACE  VaSpace,
+    IN      PVOID                   Address,
+    IN      QWORD                   Size,
+    IN      BOOLEAN                 Unregister
+    )
+{
+    PLIST_ENTRY pEntry;
+    PLIST_ENTRY pNextEntry;
+    STATUS status;
+    STATUS firstError;
+    PVOID pStart;
+    PVOID pEnd;
+
+    ASSERT(VaSpace != NULL);
+    ASSERT(Size != 0);
+
+    firstError = STATUS_SUCCESS;
+
+    for (pEntry = m_fileMapData.MappingsList.Flink;
+         pEntry != &m_fileMapData.MappingsList;
+         pEntry = pNextEntry)
+    {
+        PVM_FILE_MAPPING pMapping = CONTAINING_RECORD(pEntry, VM_FILE_MAPPING, ListEntry);
+
+        pNextEntry = pEntry->Flink;
+
+        if (pMapping->VaSpace != VaSpace)
+        {
+            continue;
+        }
+
+        pStart = max(Address, pMapping->StartVa);
+        pEnd = min(PtrOffset(Address, Size), PtrOffset(pMapping->StartVa, pMapping->Size));
+        if (pStart >= pEnd)
+        {
+            continue;
+        }
+
+        if (Unregister)
+        {
+            // a released mapping is written back entirely
+            pStart = pMapping->StartVa;
+            pEnd = PtrOffset(pMapping->StartVa, pMapping->Size);
+        }
+
+        pStart = (PVOID) AlignAddressLower(pStart, PAGE_SIZE);
+
+        status = _VmFileMapWriteBackRange(pMapping, pStart, PtrDiff(pEnd, pStart));
+        if (!SUCCEEDED(status) && SUCCEEDED(firstError))
+        {
+            firstError = status;
+        }
+
+        if (Unregister)
+        {
+            _VmFileMapRemoveMapping(pMapping);
+        }
+    }
+
+    return firstError;
+}
+
+REQUIRES_EXCL_LOCK(m_fileMapData.MappingsLock)
+static
+STATUS
+_VmFileMapWritePage(
+    IN      PVM_FILE_MAPPING        Mapping,
+    IN      PVOID                   VirtualAddress,
+    IN      PHYSICAL_ADDRESS        PhysicalAddress
+    )
+{
+    PVOID pMapping;
+    QWORD fileOffset;
+    QWORD bytesToWrite;
+    QWORD bytesWritten;
+    STATUS status;
+
+    ASSERT(Mapping != NULL);
+    ASSERT(PhysicalAddress != NULL);
+
+    fileOffset = PtrDiff(VirtualAddress, Mapping->StartVa);
+    ASSERT(fileOffset < Mapping->FileSize);
+
+    bytesToWrite = min(PAGE_SIZE, Mapping->FileSize - fileOffset);
+    bytesWritten = 0;
+
+    // the page is written through a mapping of the system process, the
+    // writeback thread does not run in the address space of the mapping
+    pMapping = MmuMapSystemMemory(PhysicalAddress, PAGE_SIZE);
+    if (pMapping == NULL)
+    {
+        LOG_FUNC_ERROR("MmuMapSystemMemory", STATUS_MEMORY_CANNOT_BE_MAPPED);
+        return STATUS_MEMORY_CANNOT_BE_MAPPED;
+    }
+
+    status = IoWriteFile(Mapping->File,
+                         bytesToWrite,
+                         &fileOffset,
+                         pMapping,
+                         &bytesWritten);
+    if (SUCCEEDED(status) && bytesWritten != bytesToWrite)
+    {
+        status = STATUS_UNSUCCESSFUL;
+    }
+
+    MmuUnmapSystemMemory(pMapping, PAGE_SIZE);
+
+    return status;
+}
+
+REQUIRES_EXCL_LOCK(m_fileMapData.MappingsLock)
+static
+void
+_VmFileMapRemoveMapping(
+    INOUT   PVM_FILE_MAPPING        Mapping
+    )
+{
+    ASSERT(Mapping != NULL);
+
+    RemoveEntryList(&Mapping->ListEntry);
+    _InterlockedDecrement(&m_fileMapData.NumberOfMappings);
+
+    ExFreePoolWithTag(Mapping, HEAP_MMU_TAG);
+}
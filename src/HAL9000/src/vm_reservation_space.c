@@ -9,9 +9,31 @@ typedef enum _VMM_RESERVATION_STATE
 {
     VmmReservationStateFree     = 0x0,
     VmmReservationStateUsed     = 0x1,
-    VmmReservationStateLast     = 0x2,
 } VMM_RESERVATION_STATE;
 
+// Describes how the commit bitmap of a reservation is stored, this is
+// chosen by the size of the reservation so that the metadata needed does not
+// grow with the size of huge and sparsely committed reservations
+typedef enum _VMM_COMMIT_TRACKING
+{
+    // The bitmap lives inside the VMM_RESERVATION structure
+    VmmCommitTrackingInline     = 0x0,
+
+    // The bitmap is a single buffer allocated from the bitmap area
+    VmmCommitTrackingDense,
+
+    // Two-level bitmap: a directory of pointers to page sized leaves, each
+    // leaf is allocated only when one of the pages it describes is committed
+    VmmCommitTrackingSparse,
+} VMM_COMMIT_TRACKING;
+
+// Reservations of at most this many pages use VmmCommitTrackingInline
+#define VMM_RESERVATION_INLINE_COMMIT_PAGES         BITS_FOR_STRUCTURE(QWORD)
+
+// Number of pages described by a leaf of a sparse commit bitmap, reservations
+// larger than this use VmmCommitTrackingSparse
+#define VMM_RESERVATION_PAGES_PER_LEAF              (PAGE_SIZE * BITS_PER_BYTE)
+
 // A reservation is allocated each time a process reserves an area of
 // virtual memory. The commit bitmap is used to distinguish between the
 // reserved memory and the committed memory.
@@ -26,10 +48,21 @@ typedef struct _VMM_RESERVATION
     // The rights with which the memory was allocated
     PAGE_RIGHTS             PageRights;
 
-    // The state of the this structure, this is used for finding the
-    // next free slot
+    // The state of the this structure
     VMM_RESERVATION_STATE   State;
 
+    // Links in the reservation tree, for free entries Right links the next
+    // free entry
+    struct _VMM_RESERVATION*    Left;
+    struct _VMM_RESERVATION*    Right;
+
+    // Highest end address of all the reservations in the subtree rooted at
+    // this entry, allows finding overlapping reservations in O(log n)
+    PVOID                   MaxEndVa;
+
+    // Height of the subtree rooted at this entry, used for balancing (AVL)
+    DWORD                   Height;
+
     // If TRUE memory will be set as strong uncacheable (UC)
     // If FALSE the memory will be set as write back (WB)
     BOOLEAN                 Uncacheable;
@@ -38,9 +71,26 @@ typedef struct _VMM_RESERVATION
     // Indicates the file which holds the data
     PFILE_OBJECT            BackingFile;
 
+    // If TRUE the modified pages are written back to BackingFile, else the
+    // file is only used to fill the pages
+    BOOLEAN                 SharedFile;
+
     // Describes which pages of the virtual memory reserved are actually
     // committed, i.e. which are valid when a #PF occurs
+    VMM_COMMIT_TRACKING     CommitTracking;
+
+    // Used for VmmCommitTrackingInline and VmmCommitTrackingDense
     BITMAP                  CommitBitmap;
+    QWORD                   InlineCommitBits;
+
+    // Used for VmmCommitTrackingSparse, a NULL leaf means none of the pages
+    // it describes are committed
+    PBYTE*                  CommitLeaves;
+    QWORD                   NumberOfCommitLeaves;
+
+    // Number of pages whose commit bits are set, subtracted from the
+    // reservation space when the reservation is released
+    QWORD                   CommittedPages;
 } VMM_RESERVATION, *PVMM_RESERVATION;
 
 // 20% Will go for the list of reservations
@@ -48,20 +98,69 @@ typedef struct _VMM_RESERVATION
 #define RESERVATION_LIST_PERCENTAGE_IN_HUNDREDS     (20 * 100)
 
 //******************************************************************************
-// Function:     _VmFindFirstFreeReservation
-// Description:  Returns the first free reservation entry or NULL if the whole
-//               region was exhausted.
+// Function:     _VmRetrieveFreeReservation
+// Description:  Returns a free reservation entry, previously released entries
+//               are reused first. NULL if the whole region was exhausted.
 // Returns:      PVMM_RESERVATION
-// Parameter:    void
+// Parameter:    INOUT PVMM_RESERVATION_SPACE ReservationSpace
 //******************************************************************************
-REQUIRES_SHARED_LOCK(ReservationSpace->ReservationLock)
+REQUIRES_EXCL_LOCK(ReservationSpace->ReservationLock)
 static
 PTR_SUCCESS
 PVMM_RESERVATION
-_VmFindFirstFreeReservation(
+_VmRetrieveFreeReservation(
     INOUT    PVMM_RESERVATION_SPACE  ReservationSpace
     );
 
+//******************************************************************************
+// Function:     _VmReleaseReservation
+// Description:  Removes a reservation from the reservation tree and makes its
+//               entry available for future reservations.
+// Returns:      void
+// Parameter:    INOUT PVMM_RESERVATION_SPACE ReservationSpace
+// Parameter:    INOUT PVMM_RESERVATION Reservation
+//******************************************************************************
+REQUIRES_EXCL_LOCK(ReservationSpace->ReservationLock)
+static
+void
+_VmReleaseReservation(
+    INOUT    PVMM_RESERVATION_SPACE  ReservationSpace,
+    INOUT    PVMM_RESERVATION        Reservation
+    );
+
+//******************************************************************************
+// Function:     _VmFindOverlappingReservation
+// Description:  Searches the reservation tree for a reservation intersecting
+//               the address range received as input.
+// Returns:      PVMM_RESERVATION - NULL if no reservation intersects the range
+// Parameter:    IN PVMM_RESERVATION_SPACE ReservationSpace
+// Parameter:    IN PVOID Address
+// Parameter:    IN QWORD Size
+//******************************************************************************
+REQUIRES_SHARED_LOCK(ReservationSpace->ReservationLock)
+static
+PTR_SUCCESS
+PVMM_RESERVATION
+_VmFindOverlappingReservation(
+    IN      PVMM_RESERVATION_SPACE  ReservationSpace,
+    IN      PVOID                   Address,
+    IN      QWORD                   Size
+    );
+
+static
+PVMM_RESERVATION
+_VmReservationTreeInsert(
+    IN_OPT  PVMM_RESERVATION        Root,
+    INOUT   PVMM_RESERVATION        Reservation
+    );
+
+static
+PVMM_RESERVATION
+_VmReservationTreeRemove(
+    INOUT   PVMM_RESERVATION        Root,
+    IN      PVMM_RESERVATION        Reservation
+    );
+
 //******************************************************************************
 // Function:     VmFindReservation
 // Description:  Checks if there is a reservation made for the address range
@@ -103,6 +202,7 @@ _VmInitializeReservation(
     IN      PAGE_RIGHTS             PageRights,
     IN      BOOLEAN                 Uncacheable,
     IN_OPT  PFILE_OBJECT            FileObject,
+    IN      BOOLEAN                 SharedFile,
     OUT     PVMM_RESERVATION        VmmReservation
     );
 
@@ -126,7 +226,8 @@ _VmChangeVaReservationState(
     IN      VMM_ALLOC_TYPE          AllocationType,
     IN      PAGE_RIGHTS             PageRights,
     IN      BOOLEAN                 Uncacheable,
-    IN_OPT  PFILE_OBJECT            FileObject
+    IN_OPT  PFILE_OBJECT            FileObject,
+    IN      BOOLEAN                 SharedFile
     );
 
 // This function should be called only on a copy of the reservation to be uninitialized
@@ -152,6 +253,7 @@ _VmUninitializeReservation(
 static
 void
 _VmCommitReservation(
+    INOUT   PVMM_RESERVATION_SPACE  ReservationSpace,
     IN      PVOID                   Address,
     IN      QWORD                   Size,
     INOUT   PVMM_RESERVATION        VmmReservation
@@ -161,11 +263,93 @@ _VmCommitReservation(
 static
 void
 _VmDecommitReservation(
+    INOUT   PVMM_RESERVATION_SPACE  ReservationSpace,
     IN      PVOID                   Address,
     IN      QWORD                   Size,
     INOUT   PVMM_RESERVATION        VmmReservation
     );
 
+//******************************************************************************
+// Function:     _VmSetCommitBits
+// Description:  Marks a range of pages of a reservation as committed or not
+//               committed. For sparse reservations leaves are allocated on
+//               the first commit and recycled once all their pages are
+//               decommitted.
+// Returns:      void
+// Parameter:    INOUT PVMM_RESERVATION_SPACE ReservationSpace
+// Parameter:    INOUT PVMM_RESERVATION VmmReservation
+// Parameter:    IN QWORD FirstPage - index of the first page in the reservation
+// Parameter:    IN QWORD NumberOfPages
+// Parameter:    IN BOOLEAN Commit
+//******************************************************************************
+REQUIRES_EXCL_LOCK(ReservationSpace->ReservationLock)
+static
+void
+_VmSetCommitBits(
+    INOUT   PVMM_RESERVATION_SPACE  ReservationSpace,
+    INOUT   PVMM_RESERVATION        VmmReservation,
+    IN      QWORD                   FirstPage,
+    IN      QWORD                   NumberOfPages,
+    IN      BOOLEAN                 Commit
+    );
+
+//******************************************************************************
+// Function:     _VmAccountCommitChange
+// Description:  Updates the number of committed pages of the reservation and
+//               of the reservation space after the commit bits of a range of
+//               NumberOfPages pages were changed.
+// Returns:      void
+// Parameter:    INOUT PVMM_RESERVATION_SPACE ReservationSpace
+// Parameter:    INOUT PVMM_RESERVATION VmmReservation
+// Parameter:    IN QWORD NumberOfPages
+// Parameter:    IN QWORD PagesPreviouslyCommitted - pages of the range which
+//               were committed before the change.
+// Parameter:    IN BOOLEAN Commit
+//******************************************************************************
+REQUIRES_EXCL_LOCK(ReservationSpace->ReservationLock)
+static
+void
+_VmAccountCommitChange(
+    INOUT   PVMM_RESERVATION_SPACE  ReservationSpace,
+    INOUT   PVMM_RESERVATION        VmmReservation,
+    IN      QWORD                   NumberOfPages,
+    IN      QWORD                   PagesPreviouslyCommitted,
+    IN      BOOLEAN                 Commit
+    );
+
+//******************************************************************************
+// Function:     _VmCountSetBits
+// Description:  Counts the set bits in [Index, Index + NumberOfBits), each run
+//               of set bits is skipped with a single scan.
+// Returns:      DWORD
+// Parameter:    IN PBITMAP Bitmap
+// Parameter:    IN DWORD Index
+// Parameter:    IN DWORD NumberOfBits
+//******************************************************************************
+static
+DWORD
+_VmCountSetBits(
+    IN      PBITMAP                 Bitmap,
+    IN      DWORD                   Index,
+    IN      DWORD                   NumberOfBits
+    );
+
+//******************************************************************************
+// Function:     _VmAllocateBitmapBuffer
+// Description:  Allocates a page aligned buffer from the bitmap area, the
+//               physical memory is allocated on the first access.
+// Returns:      PBYTE
+// Parameter:    INOUT PVMM_RESERVATION_SPACE ReservationSpace
+// Parameter:    IN QWORD Size
+//******************************************************************************
+REQUIRES_EXCL_LOCK(ReservationSpace->ReservationLock)
+static
+PBYTE
+_VmAllocateBitmapBuffer(
+    INOUT   PVMM_RESERVATION_SPACE  ReservationSpace,
+    IN      QWORD                   Size
+    );
+
 //******************************************************************************
 // Function:     _VmIsVaCommited
 // Description:  Checks if a virtual address from within a reservation is
@@ -240,7 +424,10 @@ VmReservationSpaceFinishInit(
 {
     ASSERT(ReservationSpace != NULL);
 
-    ReservationSpace->ReservationList[0].State = VmmReservationStateLast;
+    ReservationSpace->ReservationTreeRoot = NULL;
+    ReservationSpace->FreeReservationList = NULL;
+    ReservationSpace->NextUnusedReservation = ReservationSpace->ReservationList;
+    ReservationSpace->FreeCommitLeafList = NULL;
 }
 
 REQUIRES_SHARED_LOCK(ReservationSpace->ReservationLock)
@@ -263,26 +450,12 @@ _VmFindReservation(
     ASSERT(Reservation != NULL);
 
     status = STATUS_SUCCESS;
-    bFound = FALSE;
 
-    for(pCurrentReservation = ReservationSpace->ReservationList;
-            VmmReservationStateLast != pCurrentReservation->State &&
-            (PVOID) pCurrentReservation < ReservationSpace->BitmapAddressStart;
-        pCurrentReservation = pCurrentReservation + 1
-        )
-    {
-        if (VmmReservationStateFree == pCurrentReservation->State)
-        {
-            // skip free entries
-            continue;
-        }
-
-        if (CHECK_BOUNDS(Address, Size, pCurrentReservation->StartVa, pCurrentReservation->Size))
-        {
-            bFound = TRUE;
-            break;
-        }
-    }
+    // reservations never overlap => the only candidate is the reservation
+    // containing the first address
+    pCurrentReservation = _VmFindOverlappingReservation(ReservationSpace, Address, 1);
+    bFound = (pCurrentReservation != NULL)
+             && CHECK_BOUNDS(Address, Size, pCurrentReservation->StartVa, pCurrentReservation->Size);
 
     if (!bFound)
     {
@@ -310,6 +483,7 @@ _VmInitializeReservation(
     IN      PAGE_RIGHTS             PageRights,
     IN      BOOLEAN                 Uncacheable,
     IN_OPT  PFILE_OBJECT            FileObject,
+    IN      BOOLEAN                 SharedFile,
     OUT     PVMM_RESERVATION        VmmReservation
     )
 {
@@ -332,36 +506,75 @@ _VmInitializeReservation(
     VmmReservation->PageRights = PageRights;
     VmmReservation->Uncacheable = Uncacheable;
     VmmReservation->BackingFile = FileObject;
+    VmmReservation->SharedFile = SharedFile;
 
     LOG_TRACE_VMM("StartVa: 0x%X\n", Address );
     LOG_TRACE_VMM("Size: 0x%X\n", Size );
 
-    ASSERT( noOfPages <= MAX_DWORD);
+    LOG_TRACE_VMM("NoOfPages: 0x%X\n", noOfPages );
+
+    if (noOfPages > VMM_RESERVATION_PAGES_PER_LEAF)
+    {
+        // Huge reservations are usually committed sparsely, only the directory
+        // is allocated now, the leaves are allocated on commit
+        VmmReservation->CommitTracking = VmmCommitTrackingSparse;
+        VmmReservation->NumberOfCommitLeaves = (noOfPages + VMM_RESERVATION_PAGES_PER_LEAF - 1) / VMM_RESERVATION_PAGES_PER_LEAF;
+
+        bitmapSize = VmmReservation->NumberOfCommitLeaves * sizeof(PBYTE);
+        VmmReservation->CommitLeaves = (PBYTE*) _VmAllocateBitmapBuffer(ReservationSpace, bitmapSize);
+        memzero(VmmReservation->CommitLeaves, (DWORD) bitmapSize);
+
+        LOG_TRACE_VMM("Number of leaves: 0x%X\n", VmmReservation->NumberOfCommitLeaves );
+        return;
+    }
 
     bitmapSize = BitmapPreinit( &VmmReservation->CommitBitmap, (DWORD) noOfPages );
     ASSERT( 0 != bitmapSize );
 
     LOG_TRACE_VMM("BitmapSize: 0x%X\n", bitmapSize );
-    LOG_TRACE_VMM("NoOfPages: 0x%X\n", noOfPages );
     LOG_TRACE_VMM("Bitmap->BitCount: 0x%x\n", BitmapGetMaxElementCount(&VmmReservation->CommitBitmap) );
 
-    /// TODO: Check if there's a reason in which we advance the bitmap buffers from page to page - it seems rather
-    /// wasteful (most reservations will probably be under 8 pages - this could be described by a BYTE, not a PAGE)
-    /// One reason may be because at uninit the whole physical frame of memory will be released => there can't be two
-    /// bitmap buffers in the same PAGE - we need to analyze what is more wasteful (never being able to free some physical
-    /// frames or allocating a physical frame to described the buffer for each reservation)
-    /// Another suggestion would be for each VMM_RESERVATION structure to also have a QWORD which can be used as the
-    /// bitmap if the pages described fit in the buffer (i.e. 64 pages or 256KB which will cover 99,99% cases)
-    ASSERT( IsAddressAligned(ReservationSpace->FreeBitmapAddress, PAGE_SIZE ));
-    BitmapInit(&VmmReservation->CommitBitmap, ReservationSpace->FreeBitmapAddress );
+    if (noOfPages <= VMM_RESERVATION_INLINE_COMMIT_PAGES)
+    {
+        // Most reservations are small, there is no reason to waste a whole
+        // page of the bitmap area for them
+        VmmReservation->CommitTracking = VmmCommitTrackingInline;
+        BitmapInit(&VmmReservation->CommitBitmap, (PBYTE) &VmmReservation->InlineCommitBits);
+    }
+    else
+    {
+        // Each buffer starts on its own page so that its physical frames can
+        // be released when the reservation is freed
+        VmmReservation->CommitTracking = VmmCommitTrackingDense;
+        BitmapInit(&VmmReservation->CommitBitmap, _VmAllocateBitmapBuffer(ReservationSpace, bitmapSize));
+    }
+}
+
+REQUIRES_EXCL_LOCK(ReservationSpace->ReservationLock)
+static
+PBYTE
+_VmAllocateBitmapBuffer(
+    INOUT   PVMM_RESERVATION_SPACE  ReservationSpace,
+    IN      QWORD                   Size
+    )
+{
+    PBYTE pBuffer;
+
+    ASSERT(ReservationSpace != NULL);
+    ASSERT(Size != 0);
+
+    pBuffer = ReservationSpace->FreeBitmapAddress;
+    ASSERT( IsAddressAligned(pBuffer, PAGE_SIZE ));
 
     // Make sure we're not exceeding our bitmap buffers VA space
-    ASSERT(CHECK_BOUNDS(ReservationSpace->FreeBitmapAddress,
-                        AlignAddressUpper(bitmapSize, PAGE_SIZE),
+    ASSERT(CHECK_BOUNDS(pBuffer,
+                        AlignAddressUpper(Size, PAGE_SIZE),
                         ReservationSpace->ReservationList,
                         ReservationSpace->ReservedAreaSize));
 
-    ReservationSpace->FreeBitmapAddress = ReservationSpace->FreeBitmapAddress + AlignAddressUpper( bitmapSize, PAGE_SIZE );
+    ReservationSpace->FreeBitmapAddress = pBuffer + AlignAddressUpper(Size, PAGE_SIZE);
+
+    return pBuffer;
 }
 
 REQUIRES_EXCL_LOCK(ReservationSpace->ReservationLock)
@@ -374,7 +587,8 @@ _VmChangeVaReservationState(
     IN      VMM_ALLOC_TYPE          AllocationType,
     IN      PAGE_RIGHTS             PageRights,
     IN      BOOLEAN                 Uncacheable,
-    IN_OPT  PFILE_OBJECT            FileObject
+    IN_OPT  PFILE_OBJECT            FileObject,
+    IN      BOOLEAN                 SharedFile
     )
 {
     PVMM_RESERVATION pReservation;
@@ -393,40 +607,45 @@ _VmChangeVaReservationState(
     status = STATUS_SUCCESS;
     pReservation = NULL;
 
-    status = _VmFindReservation(ReservationSpace,
-                                Address,
-                                Size,
-                                &pReservation
-                                );
-    if (STATUS_ELEMENT_NOT_FOUND == status)
+    if (VMM_ALLOC_TYPE_RESERVE == AllocationType)
     {
-        if (VMM_ALLOC_TYPE_RESERVE != AllocationType)
+        // the range must not intersect any other reservation, not even partially
+        pReservation = _VmFindOverlappingReservation(ReservationSpace, Address, Size);
+        if (pReservation != NULL)
         {
-            LOG_ERROR("There is no reservation found for address 0x%X\n", Address);
-            return STATUS_MEMORY_IS_NOT_RESERVED;
+            LOG_ERROR("Cannot reserve an already reserved virtual address 0x%X\n", Address);
+            return STATUS_MEMORY_ALREADY_RESERVED;
         }
-        status = STATUS_SUCCESS;
     }
-    else if (SUCCEEDED(status))
+    else
     {
-        if (VMM_ALLOC_TYPE_RESERVE == AllocationType)
+        status = _VmFindReservation(ReservationSpace,
+                                    Address,
+                                    Size,
+                                    &pReservation
+                                    );
+        if (STATUS_ELEMENT_NOT_FOUND == status)
         {
-            LOG_ERROR("Cannot reserve an already reserved virtual address 0x%X\n", Address);
-            return STATUS_MEMORY_ALREADY_RESERVED;
+            LOG_ERROR("There is no reservation found for address 0x%X\n", Address);
+            return STATUS_MEMORY_IS_NOT_RESERVED;
         }
-    }
 
-    if (!SUCCEEDED(status))
-    {
-        LOG_FUNC_ERROR("_VmFindReservation", status );
-        return status;
+        if (!SUCCEEDED(status))
+        {
+            LOG_FUNC_ERROR("_VmFindReservation", status );
+            return status;
+        }
     }
 
     switch (AllocationType)
     {
     case VMM_ALLOC_TYPE_RESERVE:
-        pReservation = _VmFindFirstFreeReservation(ReservationSpace);
-        ASSERT( NULL != pReservation );
+        pReservation = _VmRetrieveFreeReservation(ReservationSpace);
+        if (NULL == pReservation)
+        {
+            LOG_ERROR("There are no more reservation entries available\n");
+            return STATUS_MEMORY_CANNOT_BE_RESERVED;
+        }
 
         // _VmChangeVaReservationState is called with the lock taken exclusively and no function to release
         // the lock is called
@@ -439,8 +658,12 @@ _VmChangeVaReservationState(
                                 PageRights,
                                 Uncacheable,
                                 FileObject,
+                                SharedFile,
                                 pReservation
                                 );
+
+        ReservationSpace->ReservationTreeRoot = _VmReservationTreeInsert(ReservationSpace->ReservationTreeRoot,
+                                                                         pReservation);
         break;
     case VMM_ALLOC_TYPE_COMMIT:
         ASSERT( NULL != pReservation );
@@ -462,7 +685,8 @@ _VmChangeVaReservationState(
         // warning C26110: Caller failing to hold lock 'm_vmmData.ReservationLock' before calling function
         // '_VmCommitReservation'
 #pragma warning(suppress: 26110)
-        _VmCommitReservation(Address,
+        _VmCommitReservation(ReservationSpace,
+                             Address,
                              Size,
                              pReservation
                              );
@@ -474,11 +698,11 @@ _VmChangeVaReservationState(
     return status;
 }
 
-REQUIRES_SHARED_LOCK(ReservationSpace->ReservationLock)
+REQUIRES_EXCL_LOCK(ReservationSpace->ReservationLock)
 static
 PTR_SUCCESS
 PVMM_RESERVATION
-_VmFindFirstFreeReservation(
+_VmRetrieveFreeReservation(
     INOUT       PVMM_RESERVATION_SPACE  ReservationSpace
     )
 {
@@ -488,32 +712,298 @@ _VmFindFirstFreeReservation(
 
     pResult = NULL;
 
-    for (PVMM_RESERVATION pCurrentReservation = ReservationSpace->ReservationList;
-        (PVOID)pCurrentReservation < ReservationSpace->BitmapAddressStart;
-         pCurrentReservation = pCurrentReservation + 1
-         )
+    if (ReservationSpace->FreeReservationList != NULL)
     {
-        if (VmmReservationStateFree == pCurrentReservation->State)
-        {
-            pResult = pCurrentReservation;
+        pResult = ReservationSpace->FreeReservationList;
+        ReservationSpace->FreeReservationList = pResult->Right;
+    }
+    else if ((PVOID)(ReservationSpace->NextUnusedReservation + 1) <= ReservationSpace->BitmapAddressStart)
+    {
+        pResult = ReservationSpace->NextUnusedReservation;
+        ReservationSpace->NextUnusedReservation = ReservationSpace->NextUnusedReservation + 1;
+    }
+
+    if (pResult != NULL)
+    {
+        memzero(pResult, sizeof(VMM_RESERVATION));
+    }
+
+    return pResult;
+}
+
+REQUIRES_EXCL_LOCK(ReservationSpace->ReservationLock)
+static
+void
+_VmReleaseReservation(
+    INOUT    PVMM_RESERVATION_SPACE  ReservationSpace,
+    INOUT    PVMM_RESERVATION        Reservation
+    )
+{
+    ASSERT(ReservationSpace != NULL);
+    ASSERT(Reservation != NULL);
+    ASSERT(Reservation->State == VmmReservationStateUsed);
+
+    ReservationSpace->ReservationTreeRoot = _VmReservationTreeRemove(ReservationSpace->ReservationTreeRoot,
+                                                                     Reservation);
+
+    memzero(Reservation, sizeof(VMM_RESERVATION));
+    Reservation->State = VmmReservationStateFree;
+
+    Reservation->Right = ReservationSpace->FreeReservationList;
+    ReservationSpace->FreeReservationList = Reservation;
+}
+
+REQUIRES_SHARED_LOCK(ReservationSpace->ReservationLock)
+static
+PTR_SUCCESS
+PVMM_RESERVATION
+_VmFindOverlappingReservation(
+    IN      PVMM_RESERVATION_SPACE  ReservationSpace,
+    IN      PVOID                   Address,
+    IN      QWORD                   Size
+    )
+{
+    PVMM_RESERVATION pCurrentReservation;
+    PVOID pEndAddress;
 
+    ASSERT(ReservationSpace != NULL);
+    ASSERT(Size != 0);
+
+    pEndAddress = PtrOffset(Address, Size);
+    pCurrentReservation = ReservationSpace->ReservationTreeRoot;
+
+    while (pCurrentReservation != NULL)
+    {
+        if (pCurrentReservation->StartVa < pEndAddress
+            && Address < PtrOffset(pCurrentReservation->StartVa, pCurrentReservation->Size))
+        {
             break;
         }
 
-        if (VmmReservationStateLast == pCurrentReservation->State)
+        // if the left subtree ends after Address and it does not contain an
+        // overlapping reservation, the right subtree cannot contain one either
+        // because all its reservations start after the left subtree's ones
+        if (pCurrentReservation->Left != NULL && pCurrentReservation->Left->MaxEndVa > Address)
+        {
+            pCurrentReservation = pCurrentReservation->Left;
+        }
+        else
         {
-            pCurrentReservation->State = VmmReservationStateFree;
+            pCurrentReservation = pCurrentReservation->Right;
+        }
+    }
+
+    return pCurrentReservation;
+}
+
+__forceinline
+static
+DWORD
+_VmReservationHeight(
+    IN_OPT  PVMM_RESERVATION        Node
+    )
+{
+    return (Node == NULL) ? 0 : Node->Height;
+}
+
+static
+void
+_VmReservationTreeUpdateNode(
+    INOUT   PVMM_RESERVATION        Node
+    )
+{
+    PVOID pMaxEnd;
 
-            // set the next reservation as the last one
-            (pCurrentReservation + 1)->State = VmmReservationStateLast;
+    ASSERT(Node != NULL);
 
-            pResult = pCurrentReservation;
+    pMaxEnd = PtrOffset(Node->StartVa, Node->Size);
 
-            break;
+    if (Node->Left != NULL && Node->Left->MaxEndVa > pMaxEnd)
+    {
+        pMaxEnd = Node->Left->MaxEndVa;
+    }
+
+    if (Node->Right != NULL && Node->Right->MaxEndVa > pMaxEnd)
+    {
+        pMaxEnd = Node->Right->MaxEndVa;
+    }
+
+    Node->MaxEndVa = pMaxEnd;
+    Node->Height = 1 + max(_VmReservationHeight(Node->Left), _VmReservationHeight(Node->Right));
+}
+
+static
+PVMM_RESERVATION
+_VmReservationTreeRotateLeft(
+    INOUT   PVMM_RESERVATION        Node
+    )
+{
+    PVMM_RESERVATION pNewRoot;
+
+    pNewRoot = Node->Right;
+    ASSERT(pNewRoot != NULL);
+
+    Node->Right = pNewRoot->Left;
+    pNewRoot->Left = Node;
+
+    _VmReservationTreeUpdateNode(Node);
+    _VmReservationTreeUpdateNode(pNewRoot);
+
+    return pNewRoot;
+}
+
+static
+PVMM_RESERVATION
+_VmReservationTreeRotateRight(
+    INOUT   PVMM_RESERVATION        Node
+    )
+{
+    PVMM_RESERVATION pNewRoot;
+
+    pNewRoot = Node->Left;
+    ASSERT(pNewRoot != NULL);
+
+    Node->Left = pNewRoot->Right;
+    pNewRoot->Right = Node;
+
+    _VmReservationTreeUpdateNode(Node);
+    _VmReservationTreeUpdateNode(pNewRoot);
+
+    return pNewRoot;
+}
+
+static
+PVMM_RESERVATION
+_VmReservationTreeRebalance(
+    INOUT   PVMM_RESERVATION        Node
+    )
+{
+    INT64 balance;
+
+    _VmReservationTreeUpdateNode(Node);
+
+    balance = (INT64) _VmReservationHeight(Node->Left) - _VmReservationHeight(Node->Right);
+
+    if (balance > 1)
+    {
+        if (_VmReservationHeight(Node->Left->Left) < _VmReservationHeight(Node->Left->Right))
+        {
+            Node->Left = _VmReservationTreeRotateLeft(Node->Left);
         }
+
+        return _VmReservationTreeRotateRight(Node);
     }
 
-    return pResult;
+    if (balance < -1)
+    {
+        if (_VmReservationHeight(Node->Right->Right) < _VmReservationHeight(Node->Right->Left))
+        {
+            Node->Right = _VmReservationTreeRotateRight(Node->Right);
+        }
+
+        return _VmReservationTreeRotateLeft(Node);
+    }
+
+    return Node;
+}
+
+static
+PVMM_RESERVATION
+_VmReservationTreeInsert(
+    IN_OPT  PVMM_RESERVATION        Root,
+    INOUT   PVMM_RESERVATION        Reservation
+    )
+{
+    ASSERT(Reservation != NULL);
+
+    if (Root == NULL)
+    {
+        Reservation->Left = NULL;
+        Reservation->Right = NULL;
+        _VmReservationTreeUpdateNode(Reservation);
+
+        return Reservation;
+    }
+
+    ASSERT(Root->StartVa != Reservation->StartVa);
+
+    if (Reservation->StartVa < Root->StartVa)
+    {
+        Root->Left = _VmReservationTreeInsert(Root->Left, Reservation);
+    }
+    else
+    {
+        Root->Right = _VmReservationTreeInsert(Root->Right, Reservation);
+    }
+
+    return _VmReservationTreeRebalance(Root);
+}
+
+static
+PVMM_RESERVATION
+_VmReservationTreeRemoveMinimum(
+    INOUT   PVMM_RESERVATION        Root,
+    OUT     PVMM_RESERVATION*       Minimum
+    )
+{
+    ASSERT(Root != NULL);
+
+    if (Root->Left == NULL)
+    {
+        *Minimum = Root;
+        return Root->Right;
+    }
+
+    Root->Left = _VmReservationTreeRemoveMinimum(Root->Left, Minimum);
+
+    return _VmReservationTreeRebalance(Root);
+}
+
+static
+PVMM_RESERVATION
+_VmReservationTreeRemove(
+    INOUT   PVMM_RESERVATION        Root,
+    IN      PVMM_RESERVATION        Reservation
+    )
+{
+    PVMM_RESERVATION pSuccessor;
+
+    ASSERT_INFO(Root != NULL, "Reservation at 0x%X is not in the tree\n", Reservation->StartVa);
+
+    if (Reservation->StartVa < Root->StartVa)
+    {
+        Root->Left = _VmReservationTreeRemove(Root->Left, Reservation);
+        return _VmReservationTreeRebalance(Root);
+    }
+
+    if (Reservation->StartVa > Root->StartVa)
+    {
+        Root->Right = _VmReservationTreeRemove(Root->Right, Reservation);
+        return _VmReservationTreeRebalance(Root);
+    }
+
+    ASSERT(Root == Reservation);
+
+    if (Root->Left == NULL)
+    {
+        return Root->Right;
+    }
+
+    if (Root->Right == NULL)
+    {
+        return Root->Left;
+    }
+
+    // the entries cannot be copied => the successor takes the place of the
+    // removed node in the tree
+    pSuccessor = NULL;
+    Root->Right = _VmReservationTreeRemoveMinimum(Root->Right, &pSuccessor);
+    ASSERT(pSuccessor != NULL);
+
+    pSuccessor->Left = Root->Left;
+    pSuccessor->Right = Root->Right;
+
+    return _VmReservationTreeRebalance(pSuccessor);
 }
 
 static
@@ -523,18 +1013,45 @@ _VmUninitializeReservation(
     )
 {
     PVOID pBitmapBuffer;
-    DWORD bitmapSize;
+    QWORD bitmapSize;
 
     ASSERT( NULL != VmmReservation );
 
-    pBitmapBuffer = VmmReservation->CommitBitmap.BitmapBuffer;
-    ASSERT(IsAddressAligned( pBitmapBuffer, PAGE_SIZE ));
+    if (VmmReservation->CommitTracking == VmmCommitTrackingSparse)
+    {
+        for (QWORD i = 0; i < VmmReservation->NumberOfCommitLeaves; ++i)
+        {
+            if (VmmReservation->CommitLeaves[i] != NULL)
+            {
+                MmuUnmapMemoryEx(VmmReservation->CommitLeaves[i], PAGE_SIZE, TRUE, NULL);
+            }
+        }
+
+        pBitmapBuffer = VmmReservation->CommitLeaves;
+        bitmapSize = VmmReservation->NumberOfCommitLeaves * sizeof(PBYTE);
 
-    bitmapSize = VmmReservation->CommitBitmap.BufferSize;
+        VmmReservation->CommitLeaves = NULL;
+        VmmReservation->NumberOfCommitLeaves = 0;
+    }
+    else
+    {
+        pBitmapBuffer = VmmReservation->CommitBitmap.BitmapBuffer;
+        bitmapSize = VmmReservation->CommitBitmap.BufferSize;
 
-    BitmapUninit(&VmmReservation->CommitBitmap);
+        BitmapUninit(&VmmReservation->CommitBitmap);
 
-    MmuUnmapMemoryEx(pBitmapBuffer, bitmapSize, TRUE, NULL );
+        if (VmmReservation->CommitTracking == VmmCommitTrackingInline)
+        {
+            // the bitmap lived in the reservation structure itself
+            pBitmapBuffer = NULL;
+        }
+    }
+
+    if (pBitmapBuffer != NULL)
+    {
+        ASSERT(IsAddressAligned( pBitmapBuffer, PAGE_SIZE ));
+        MmuUnmapMemoryEx(pBitmapBuffer, bitmapSize, TRUE, NULL );
+    }
 
     if (VmmReservation->BackingFile != NULL)
     {
@@ -555,52 +1072,225 @@ _VmUninitializeReservation(
 static
 void
 _VmCommitReservation(
+    INOUT   PVMM_RESERVATION_SPACE  ReservationSpace,
     IN      PVOID                   Address,
     IN      QWORD                   Size,
     INOUT   PVMM_RESERVATION        VmmReservation
     )
 {
-    QWORD startIndex;
-    QWORD noOfPages;
-
     ASSERT(NULL != Address);
     ASSERT(0 != Size);
     ASSERT(IsAddressAligned(Address, PAGE_SIZE));
     ASSERT(IsAddressAligned(Size, PAGE_SIZE));
 
-    noOfPages = Size / PAGE_SIZE;
-    startIndex = PtrDiff(Address, VmmReservation->StartVa) / PAGE_SIZE;
-
-    ASSERT(noOfPages <= MAX_DWORD);
-    ASSERT(startIndex <= MAX_DWORD);
-
-    BitmapSetBits(&VmmReservation->CommitBitmap, (DWORD) startIndex, (DWORD) noOfPages );
+    _VmSetCommitBits(ReservationSpace,
+                     VmmReservation,
+                     PtrDiff(Address, VmmReservation->StartVa) / PAGE_SIZE,
+                     Size / PAGE_SIZE,
+                     TRUE);
 }
 
 /// REQUIRES_EXCL_LOCK(m_vmmData.ReservationLock)
 static
 void
 _VmDecommitReservation(
+    INOUT   PVMM_RESERVATION_SPACE  ReservationSpace,
     IN      PVOID                   Address,
     IN      QWORD                   Size,
     INOUT   PVMM_RESERVATION        VmmReservation
     )
 {
-    QWORD startIndex;
-    QWORD noOfPages;
-
     ASSERT(NULL != Address);
     ASSERT(0 != Size);
     ASSERT(IsAddressAligned(Address, PAGE_SIZE));
     ASSERT(IsAddressAligned(Size, PAGE_SIZE));
 
-    noOfPages = Size / PAGE_SIZE;
-    startIndex = PtrDiff(Address, VmmReservation->StartVa) / PAGE_SIZE;
+    _VmSetCommitBits(ReservationSpace,
+                     VmmReservation,
+                     PtrDiff(Address, VmmReservation->StartVa) / PAGE_SIZE,
+                     Size / PAGE_SIZE,
+                     FALSE);
+}
 
-    ASSERT(noOfPages <= MAX_DWORD);
-    ASSERT(startIndex <= MAX_DWORD);
+__forceinline
+static
+void
+_VmInitCommitLeafBitmap(
+    OUT     PBITMAP                 Bitmap,
+    IN      PBYTE                   Leaf
+    )
+{
+    BitmapPreinit(Bitmap, VMM_RESERVATION_PAGES_PER_LEAF);
 
-    BitmapClearBits(&VmmReservation->CommitBitmap, (DWORD)startIndex, (DWORD)noOfPages);
+    // the leaf already holds the bits, BitmapInit would clear them
+    Bitmap->BitmapBuffer = Leaf;
+}
+
+REQUIRES_EXCL_LOCK(ReservationSpace->ReservationLock)
+static
+void
+_VmSetCommitBits(
+    INOUT   PVMM_RESERVATION_SPACE  ReservationSpace,
+    INOUT   PVMM_RESERVATION        VmmReservation,
+    IN      QWORD                   FirstPage,
+    IN      QWORD                   NumberOfPages,
+    IN      BOOLEAN                 Commit
+    )
+{
+    QWORD currentPage;
+    QWORD pagesLeft;
+    QWORD pagesCommitted;
+
+    ASSERT(ReservationSpace != NULL);
+    ASSERT(VmmReservation != NULL);
+    ASSERT(NumberOfPages != 0);
+    ASSERT(FirstPage + NumberOfPages <= VmmReservation->Size / PAGE_SIZE);
+
+    // number of pages committed in the range before the bits are changed
+    pagesCommitted = 0;
+
+    if (VmmReservation->CommitTracking != VmmCommitTrackingSparse)
+    {
+        pagesCommitted = _VmCountSetBits(&VmmReservation->CommitBitmap, (DWORD) FirstPage, (DWORD) NumberOfPages);
+
+        BitmapSetBitsValue(&VmmReservation->CommitBitmap, (DWORD) FirstPage, (DWORD) NumberOfPages, Commit);
+
+        _VmAccountCommitChange(ReservationSpace, VmmReservation, NumberOfPages, pagesCommitted, Commit);
+        return;
+    }
+
+    currentPage = FirstPage;
+    pagesLeft = NumberOfPages;
+
+    while (pagesLeft != 0)
+    {
+        BITMAP leafBitmap;
+        QWORD leafIndex;
+        DWORD indexInLeaf;
+        DWORD pagesInLeaf;
+        PBYTE pLeaf;
+
+        leafIndex = currentPage / VMM_RESERVATION_PAGES_PER_LEAF;
+        indexInLeaf = (DWORD) (currentPage % VMM_RESERVATION_PAGES_PER_LEAF);
+        pagesInLeaf = (DWORD) min(pagesLeft, VMM_RESERVATION_PAGES_PER_LEAF - indexInLeaf);
+
+        pLeaf = VmmReservation->CommitLeaves[leafIndex];
+        if (pLeaf == NULL && Commit)
+        {
+            // reuse leaves dropped by other reservations before growing the
+            // bitmap area
+            if (ReservationSpace->FreeCommitLeafList != NULL)
+            {
+                pLeaf = ReservationSpace->FreeCommitLeafList;
+                ReservationSpace->FreeCommitLeafList = *((PBYTE*) pLeaf);
+            }
+            else
+            {
+                pLeaf = _VmAllocateBitmapBuffer(ReservationSpace, PAGE_SIZE);
+            }
+
+            memzero(pLeaf, PAGE_SIZE);
+            VmmReservation->CommitLeaves[leafIndex] = pLeaf;
+        }
+
+        if (pLeaf != NULL)
+        {
+            _VmInitCommitLeafBitmap(&leafBitmap, pLeaf);
+
+            pagesCommitted = pagesCommitted + _VmCountSetBits(&leafBitmap, indexInLeaf, pagesInLeaf);
+
+            BitmapSetBitsValue(&leafBitmap, indexInLeaf, pagesInLeaf, Commit);
+
+            if (!Commit && MAX_DWORD == BitmapScan(&leafBitmap, 1, TRUE))
+            {
+                // nothing described by this leaf is committed anymore, keep it
+                // for a future commit instead of unmapping it while holding
+                // the reservation lock
+                VmmReservation->CommitLeaves[leafIndex] = NULL;
+
+                *((PBYTE*) pLeaf) = ReservationSpace->FreeCommitLeafList;
+                ReservationSpace->FreeCommitLeafList = pLeaf;
+            }
+        }
+
+        currentPage = currentPage + pagesInLeaf;
+        pagesLeft = pagesLeft - pagesInLeaf;
+    }
+
+    _VmAccountCommitChange(ReservationSpace, VmmReservation, NumberOfPages, pagesCommitted, Commit);
+}
+
+REQUIRES_EXCL_LOCK(ReservationSpace->ReservationLock)
+static
+void
+_VmAccountCommitChange(
+    INOUT   PVMM_RESERVATION_SPACE  ReservationSpace,
+    INOUT   PVMM_RESERVATION        VmmReservation,
+    IN      QWORD                   NumberOfPages,
+    IN      QWORD                   PagesPreviouslyCommitted,
+    IN      BOOLEAN                 Commit
+    )
+{
+    QWORD pagesChanged;
+
+    ASSERT(PagesPreviouslyCommitted <= NumberOfPages);
+
+    pagesChanged = Commit ? NumberOfPages - PagesPreviouslyCommitted : PagesPreviouslyCommitted;
+
+    if (Commit)
+    {
+        VmmReservation->CommittedPages = VmmReservation->CommittedPages + pagesChanged;
+        ReservationSpace->CommittedPages = ReservationSpace->CommittedPages + pagesChanged;
+    }
+    else
+    {
+        ASSERT(VmmReservation->CommittedPages >= pagesChanged);
+
+        VmmReservation->CommittedPages = VmmReservation->CommittedPages - pagesChanged;
+        ReservationSpace->CommittedPages = ReservationSpace->CommittedPages - pagesChanged;
+    }
+}
+
+static
+DWORD
+_VmCountSetBits(
+    IN      PBITMAP                 Bitmap,
+    IN      DWORD                   Index,
+    IN      DWORD                   NumberOfBits
+    )
+{
+    DWORD setBits;
+    DWORD currentIndex;
+    DWORD endIndex;
+
+    ASSERT(Bitmap != NULL);
+
+    setBits = 0;
+    currentIndex = Index;
+    endIndex = Index + NumberOfBits;
+
+    while (currentIndex < endIndex)
+    {
+        DWORD firstSet;
+        DWORD firstClear;
+
+        firstSet = BitmapScanFromTo(Bitmap, currentIndex, endIndex, 1, TRUE);
+        if (firstSet == MAX_DWORD)
+        {
+            break;
+        }
+
+        firstClear = BitmapScanFromTo(Bitmap, firstSet, endIndex, 1, FALSE);
+        if (firstClear == MAX_DWORD)
+        {
+            firstClear = endIndex;
+        }
+
+        setBits = setBits + (firstClear - firstSet);
+        currentIndex = firstClear;
+    }
+
+    return setBits;
 }
 
 /// REQUIRES_SHARED_LOCK(m_vmmData.ReservationLock)
@@ -612,15 +1302,32 @@ _VmIsVaCommited(
     )
 {
     QWORD pageNo;
+    PBYTE pLeaf;
+    BITMAP leafBitmap;
 
     ASSERT(NULL != VmmReservation);
     ASSERT(NULL != Address);
 
     pageNo = PtrDiff(Address, VmmReservation->StartVa) / PAGE_SIZE;
 
-    ASSERT(pageNo <= MAX_DWORD);
+    if (VmmReservation->CommitTracking != VmmCommitTrackingSparse)
+    {
+        ASSERT(pageNo <= MAX_DWORD);
+
+        return BitmapGetBitValue(&VmmReservation->CommitBitmap, (DWORD) pageNo );
+    }
+
+    ASSERT(pageNo / VMM_RESERVATION_PAGES_PER_LEAF < VmmReservation->NumberOfCommitLeaves);
+
+    pLeaf = VmmReservation->CommitLeaves[pageNo / VMM_RESERVATION_PAGES_PER_LEAF];
+    if (pLeaf == NULL)
+    {
+        return FALSE;
+    }
+
+    _VmInitCommitLeafBitmap(&leafBitmap, pLeaf);
 
-    return BitmapGetBitValue(&VmmReservation->CommitBitmap, (DWORD) pageNo );
+    return BitmapGetBitValue(&leafBitmap, (DWORD) (pageNo % VMM_RESERVATION_PAGES_PER_LEAF));
 }
 
 BOOLEAN
@@ -631,7 +1338,8 @@ VmReservationCanAddressBeAccessed(
     OUT                     PAGE_RIGHTS*            MemoryRights,
     OUT                     BOOLEAN*                Uncacheable,
     OUT_PTR_MAYBE_NULL      PFILE_OBJECT*           BackingFile,
-    OUT                     QWORD*                  FileOffset
+    OUT                     QWORD*                  FileOffset,
+    OUT                     BOOLEAN*                SharedFile
     )
 {
     BOOLEAN bSolvedPageFault;
@@ -641,6 +1349,7 @@ VmReservationCanAddressBeAccessed(
     BOOLEAN uncacheable;
     PFILE_OBJECT pBackingFile;
     QWORD fileOffset;
+    BOOLEAN bSharedFile;
     PCPU* pCpu;
     STATUS status;
 
@@ -649,6 +1358,7 @@ VmReservationCanAddressBeAccessed(
     ASSERT(Uncacheable != NULL);
     ASSERT(BackingFile != NULL);
     ASSERT(FileOffset != NULL);
+    ASSERT(SharedFile != NULL);
     ASSERT(INTR_OFF == CpuIntrGetState());
 
     if (NULL == FaultingAddress)
@@ -662,6 +1372,7 @@ VmReservationCanAddressBeAccessed(
     uncacheable = FALSE;
     pBackingFile = NULL;
     fileOffset = 0;
+    bSharedFile = FALSE;
     pCpu = GetCurrentPcpu();
     status = STATUS_SUCCESS;
 
@@ -718,6 +1429,7 @@ VmReservationCanAddressBeAccessed(
             if (pBackingFile != NULL)
             {
                 fileOffset = AlignAddressLower(PtrDiff(FaultingAddress, pReservation->StartVa), PAGE_SIZE);
+                bSharedFile = pReservation->SharedFile;
             }
 
             // to solve the page fault we must have the VA already committed
@@ -745,6 +1457,7 @@ VmReservationCanAddressBeAccessed(
 
             *BackingFile = pBackingFile;
             *FileOffset = fileOffset;
+            *SharedFile = bSharedFile;
         }
     }
 
@@ -798,7 +1511,12 @@ VmReservationSpaceAllocRegion(
         // we can make sure it is aligned and we only
         // need to align the size
         alignedSize = AlignAddressUpper(Size, PAGE_SIZE);
-        pBaseAddress = VmReservationSpaceDetermineNextFreeVirtualAddress(ReservationSpace, alignedSize);
+
+        // regions of at least 2MB are placed on a 2MB boundary so the VMM may
+        // map them using large pages
+        pBaseAddress = (alignedSize >= PAGE_2MB_SIZE)
+            ? VmReservationSpaceDetermineNextFreeAlignedVirtualAddress(ReservationSpace, alignedSize, PAGE_2MB_SIZE)
+            : VmReservationSpaceDetermineNextFreeVirtualAddress(ReservationSpace, alignedSize);
     }
 
     RwSpinlockAcquireExclusive(&ReservationSpace->ReservationLock, &oldState);
@@ -820,7 +1538,8 @@ VmReservationSpaceAllocRegion(
                                                 VMM_ALLOC_TYPE_RESERVE,
                                                 Rights,
                                                 Uncacheable,
-                                                FileObject
+                                                FileObject,
+                                                IsBooleanFlagOn(AllocType, VMM_ALLOC_TYPE_SHARED_FILE)
             );
             if (!SUCCEEDED(status))
             {
@@ -840,7 +1559,8 @@ VmReservationSpaceAllocRegion(
                                                  VMM_ALLOC_TYPE_COMMIT,
                                                  Rights,
                                                  Uncacheable,
-                                                 FileObject
+                                                 FileObject,
+                                                 IsBooleanFlagOn(AllocType, VMM_ALLOC_TYPE_SHARED_FILE)
             );
             if (!SUCCEEDED(status))
             {
@@ -919,10 +1639,12 @@ VmReservationSpaceFreeRegion(
     {
         VMM_RESERVATION reservationCopy;
 
+        ASSERT(ReservationSpace->CommittedPages >= pReservation->CommittedPages);
+        ReservationSpace->CommittedPages = ReservationSpace->CommittedPages - pReservation->CommittedPages;
+
         // remove reservation
         memcpy( &reservationCopy, pReservation, sizeof(VMM_RESERVATION));
-        memzero( pReservation, sizeof(VMM_RESERVATION));
-        pReservation->State = VmmReservationStateFree;
+        _VmReleaseReservation(ReservationSpace, pReservation);
 
         _Analysis_assume_lock_held_(ReservationSpace->ReservationLock);
         RwSpinlockReleaseExclusive(&ReservationSpace->ReservationLock, oldState);
@@ -943,7 +1665,7 @@ VmReservationSpaceFreeRegion(
         alignedAddress = (PVOID)AlignAddressLower(Address, PAGE_SIZE);
         alignedSize = AlignAddressUpper(Size + ((PBYTE)Address - (PBYTE)alignedAddress), PAGE_SIZE);
 
-        _VmDecommitReservation(alignedAddress, alignedSize, pReservation );
+        _VmDecommitReservation(ReservationSpace, alignedAddress, alignedSize, pReservation );
     }
 
     if (NULL != pCpu)
@@ -1016,3 +1738,67 @@ VmReservationReturnRightsForAddress(
 
     return bFullyCommited ? STATUS_SUCCESS : STATUS_MEMORY_IS_NOT_COMMITED;
 }
+
+QWORD
+VmReservationSpaceGetCommittedSize(
+    IN      PVMM_RESERVATION_SPACE  ReservationSpace
+    )
+{
+    INTR_STATE oldState;
+    QWORD committedPages;
+
+    ASSERT(ReservationSpace != NULL);
+
+    RwSpinlockAcquireShared(&ReservationSpace->ReservationLock, &oldState);
+    committedPages = ReservationSpace->CommittedPages;
+    RwSpinlockReleaseShared(&ReservationSpace->ReservationLock, oldState);
+
+    return committedPages * PAGE_SIZE;
+}
+
+STATUS
+VmReservationSpaceGetNextReservation(
+    IN      PVMM_RESERVATION_SPACE  ReservationSpace,
+    IN_OPT  PVOID                   Address,
+    OUT     PVOID*                  StartVa,
+    OUT     QWORD*                  Size
+    )
+{
+    INTR_STATE oldState;
+    PVMM_RESERVATION pCurrentReservation;
+    PVMM_RESERVATION pNextReservation;
+
+    ASSERT(ReservationSpace != NULL);
+    ASSERT(StartVa != NULL);
+    ASSERT(Size != NULL);
+
+    pNextReservation = NULL;
+
+    RwSpinlockAcquireShared(&ReservationSpace->ReservationLock, &oldState);
+
+    // the tree is ordered by start address => the first reservation starting
+    // at or after Address is the last one for which we went left
+    pCurrentReservation = ReservationSpace->ReservationTreeRoot;
+    while (pCurrentReservation != NULL)
+    {
+        if (pCurrentReservation->StartVa >= Address)
+        {
+            pNextReservation = pCurrentReservation;
+            pCurrentReservation = pCurrentReservation->Left;
+        }
+        else
+        {
+            pCurrentReservation = pCurrentReservation->Right;
+        }
+    }
+
+    if (pNextReservation != NULL)
+    {
+        *StartVa = pNextReservation->StartVa;
+        *Size = pNextReservation->Size;
+    }
+
+    RwSpinlockReleaseShared(&ReservationSpace->ReservationLock, oldState);
+
+    return (pNextReservation != NULL) ? STATUS_SUCCESS : STATUS_ELEMENT_NOT_FOUND;
+}
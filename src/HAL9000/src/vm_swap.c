@@ -0,0 +1,1194 @@
+#include "HAL9000.h"
+#include "vm_swap.h"
+#include "vm_swap_cache.h"
+#include "vmm.h"
+#include "vm_tlb.h"
+#include "pmm.h"
+#include "bitmap.h"
+#include "synch.h"
+#include "mutex.h"
+#include "io.h"
+
+// The clock hand runs over the list at most this many times before giving up,
+// after the first pass all the accessed bits are cleared => the second pass
+// should always find a victim unless pages are re-accessed concurrently
+#define VM_SWAP_CLOCK_MAX_PASSES                2
+
+// Number of pages evicted together and written with a single transfer to
+// consecutive swap slots, it is also the number of slots read ahead on
+// swap-in. The pending and read-ahead slots are kept in QWORD masks.
+#define VM_SWAP_CLUSTER_SIZE                    16
+STATIC_ASSERT(VM_SWAP_CLUSTER_SIZE <= BITS_FOR_STRUCTURE(QWORD));
+
+#define VM_SWAP_CLUSTER_MASK(Count)             CREATE_BIT_MASK_FOR_N_BITS(Count)
+
+typedef enum _VM_SWAP_CLOCK_RESULT
+{
+    VmSwapClockResultSecondChance       = 0,
+    VmSwapClockResultStale,
+    VmSwapClockResultEvicted
+} VM_SWAP_CLOCK_RESULT;
+
+// Describes a user page which is currently mapped to a physical frame and
+// which may be evicted
+typedef struct _VM_SWAP_RESIDENT_PAGE
+{
+    LIST_ENTRY                      ListEntry;
+
+    PPAGING_LOCK_DATA               PagingData;
+    PVOID                           VirtualAddress;
+    PHYSICAL_ADDRESS                PhysicalAddress;
+
+    // Set for pages whose contents are found only in memory even if they were
+    // never written after being mapped (e.g. pages read back from swap)
+    BOOLEAN                         AlwaysWriteBack;
+} VM_SWAP_RESIDENT_PAGE, *PVM_SWAP_RESIDENT_PAGE;
+
+// A page evicted in the current batch
+typedef struct _VM_SWAP_VICTIM
+{
+    PVM_SWAP_RESIDENT_PAGE          ResidentPage;
+
+    // VMM_INVALID_SWAP_SLOT for clean pages which were dropped
+    QWORD                           SwapSlot;
+    QWORD                           PreviousEntry;
+
+    // Set if the contents are in the write buffer waiting to reach the
+    // swap file, the frame may be reused only after the write succeeds
+    BOOLEAN                         PendingWrite;
+} VM_SWAP_VICTIM, *PVM_SWAP_VICTIM;
+
+typedef struct _VM_SWAP_DATA
+{
+    // NULL until VmSwapInit succeeds, without a swap file only the pages
+    // which can be re-created from their backing store are evicted
+    PFILE_OBJECT                    SwapFile;
+
+    DWORD                           NumberOfSlots;
+
+    LOCK                            SlotLock;
+
+    _Guarded_by_(SlotLock)
+    BITMAP                          SlotBitmap;
+
+    // Number of PTEs referring to each slot
+    _Guarded_by_(SlotLock)
+    PWORD                           SlotReferences;
+
+    // Clusters are allocated next-fit => consecutive evictions end up in
+    // consecutive slots
+    _Guarded_by_(SlotLock)
+    DWORD                           NextSlotHint;
+
+    // Serializes evictions, the owner blocks while the victims are written
+    // to the swap file => a spinlock would stall the faults of the other
+    // threads running on the same CPU
+    MUTEX                           EvictionLock;
+
+    // Protects the resident pages list, the head of the list is the
+    // position of the clock hand
+    LOCK                            ResidentLock;
+
+    _Guarded_by_(ResidentLock)
+    LIST_ENTRY                      ResidentList;
+
+    _Guarded_by_(ResidentLock)
+    DWORD                           NumberOfResidentPages;
+
+    // Entries are recycled through this list so no heap allocations are
+    // required while evicting pages
+    _Guarded_by_(ResidentLock)
+    LIST_ENTRY                      FreeEntriesList;
+
+    // Holds the pages of the batch being evicted until they are written,
+    // faults on these pages are solved from this buffer. Only the owner of
+    // the eviction lock changes the buffer => it is written to the swap file
+    // without holding PendingLock.
+    LOCK                            PendingLock;
+
+    _Guarded_by_(PendingLock)
+    PBYTE                           WriteBuffer;
+
+    _Guarded_by_(PendingLock)
+    QWORD                           PendingFirstSlot;
+
+    _Guarded_by_(PendingLock)
+    QWORD                           PendingMask;
+
+    // Holds the slots following the last slot read from the swap file
+    LOCK                            ReadAheadLock;
+
+    _Guarded_by_(ReadAheadLock)
+    PBYTE                           ReadAheadBuffer;
+
+    _Guarded_by_(ReadAheadLock)
+    QWORD                           ReadAheadFirstSlot;
+
+    _Guarded_by_(ReadAheadLock)
+    QWORD                           ReadAheadMask;
+
+    // Set while the buffer is filled from the swap file without holding
+    // ReadAheadLock, the other swap-ins read their slot directly meanwhile
+    _Guarded_by_(ReadAheadLock)
+    BOOLEAN                         ReadAheadInProgress;
+
+    // Slots freed or written while the buffer is filled, their contents are
+    // outdated by the time the transfer completes
+    _Guarded_by_(ReadAheadLock)
+    QWORD                           ReadAheadStaleMask;
+} VM_SWAP_DATA, *PVM_SWAP_DATA;
+
+static VM_SWAP_DATA m_swapData;
+
+static
+DWORD
+_VmSwapAllocCluster(
+    OUT     QWORD*                  FirstSlot
+    );
+
+static
+void
+_VmSwapInvalidateReadAhead(
+    IN      QWORD                   FirstSlot,
+    IN      DWORD                   NumberOfSlots
+    );
+
+static
+STATUS
+_VmSwapTransferSlots(
+    IN      QWORD                   FirstSlot,
+    IN      DWORD                   NumberOfSlots,
+    IN      PVOID                   Buffer,
+    IN      BOOLEAN                 Write
+    );
+
+static
+STATUS
+_VmSwapFlushPendingWrites(
+    void
+    );
+
+static
+BOOLEAN
+_VmSwapReadFromMemory(
+    IN      QWORD                   SwapSlot,
+    IN      PVOID                   Page,
+    IN      BOOLEAN                 LastReference
+    );
+
+static FUNC_SwapCacheWriteBack          _VmSwapWriteBack;
+
+static
+VM_SWAP_CLOCK_RESULT
+_VmSwapTryEvictPage(
+    IN      PVM_SWAP_RESIDENT_PAGE  ResidentPage
+    );
+
+static
+void
+_VmSwapFlushVictims(
+    IN_READS(NumberOfVictims)
+            PVM_SWAP_VICTIM         Victims,
+    IN      DWORD                   NumberOfVictims
+    );
+
+static
+BOOLEAN
+_VmSwapFinishEviction(
+    INOUT   PVM_SWAP_VICTIM         Victim,
+    IN      QWORD                   SwapSlot
+    );
+
+static
+void
+_VmSwapRestoreVictim(
+    IN      PVM_SWAP_VICTIM         Victim
+    );
+
+_No_competing_thread_
+void
+VmSwapPreinit(
+    void
+    )
+{
+    memzero(&m_swapData, sizeof(VM_SWAP_DATA));
+
+    VmSwapCachePreinit();
+
+    LockInit(&m_swapData.SlotLock);
+    MutexInit(&m_swapData.EvictionLock, FALSE);
+    LockInit(&m_swapData.ResidentLock);
+    LockInit(&m_swapData.PendingLock);
+    LockInit(&m_swapData.ReadAheadLock);
+
+    InitializeListHead(&m_swapData.ResidentList);
+    InitializeListHead(&m_swapData.FreeEntriesList);
+}
+
+STATUS
+VmSwapInit(
+    IN      PFILE_OBJECT            SwapFile
+    )
+{
+    STATUS status;
+    QWORD fileSize;
+    QWORD noOfSlots;
+    DWORD bitmapSize;
+    PBYTE pBitmapBuffer;
+    PWORD pSlotReferences;
+    PHYSICAL_ADDRESS buffersPa;
+    PBYTE pBuffers;
+
+    if (SwapFile == NULL)
+    {
+        return STATUS_INVALID_PARAMETER1;
+    }
+
+    status = STATUS_SUCCESS;
+    fileSize = 0;
+    pBitmapBuffer = NULL;
+    pSlotReferences = NULL;
+    buffersPa = NULL;
+    pBuffers = NULL;
+
+    status = IoGetFileSize(SwapFile, &fileSize);
+    if (!SUCCEEDED(status))
+    {
+        LOG_FUNC_ERROR("IoGetFileSize", status);
+        return status;
+    }
+
+    noOfSlots = fileSize / PAGE_SIZE;
+    if (noOfSlots == 0)
+    {
+        LOG_ERROR("Swap file of size 0x%X cannot hold a single page\n", fileSize);
+        return STATUS_SIZE_INVALID;
+    }
+
+    if (noOfSlots > MAX_DWORD)
+    {
+        noOfSlots = MAX_DWORD;
+    }
+
+    __try
+    {
+        bitmapSize = BitmapPreinit(&m_swapData.SlotBitmap, (DWORD) noOfSlots);
+
+        pBitmapBuffer = ExAllocatePoolWithTag(PoolAllocateZeroMemory, bitmapSize, HEAP_MMU_TAG, 0);
+        if (pBitmapBuffer == NULL)
+        {
+            status = STATUS_HEAP_INSUFFICIENT_RESOURCES;
+            LOG_FUNC_ERROR_ALLOC("ExAllocatePoolWithTag", bitmapSize);
+            __leave;
+        }
+
+        pSlotReferences = ExAllocatePoolWithTag(PoolAllocateZeroMemory, (DWORD) (noOfSlots * sizeof(WORD)), HEAP_MMU_TAG, 0);
+        if (pSlotReferences == NULL)
+        {
+            status = STATUS_HEAP_INSUFFICIENT_RESOURCES;
+            LOG_FUNC_ERROR_ALLOC("ExAllocatePoolWithTag", noOfSlots * sizeof(WORD));
+            __leave;
+        }
+
+        // the write and read-ahead buffers are placed one after the other
+        buffersPa = PmmReserveMemory(2 * VM_SWAP_CLUSTER_SIZE);
+        if (buffersPa == NULL)
+        {
+            status = STATUS_INSUFFICIENT_MEMORY;
+            LOG_FUNC_ERROR("PmmReserveMemory", status);
+            __leave;
+        }
+
+        pBuffers = MmuMapSystemMemory(buffersPa, 2 * VM_SWAP_CLUSTER_SIZE * PAGE_SIZE);
+        if (pBuffers == NULL)
+        {
+            status = STATUS_MEMORY_CANNOT_BE_MAPPED;
+            LOG_FUNC_ERROR("MmuMapSystemMemory", status);
+            __leave;
+        }
+
+        BitmapInit(&m_swapData.SlotBitmap, pBitmapBuffer);
+        m_swapData.SlotReferences = pSlotReferences;
+        m_swapData.NumberOfSlots = (DWORD) noOfSlots;
+
+        m_swapData.WriteBuffer = pBuffers;
+        m_swapData.ReadAheadBuffer = pBuffers + VM_SWAP_CLUSTER_SIZE * PAGE_SIZE;
+
+        // the cache is optional, without it all the pages go to the swap file
+        status = VmSwapCacheInit((DWORD) noOfSlots, _VmSwapWriteBack);
+        if (!SUCCEEDED(status))
+        {
+            LOG_FUNC_ERROR("VmSwapCacheInit", status);
+            status = STATUS_SUCCESS;
+        }
+
+        // the slots may be used only after the bitmap is initialized
+        _InterlockedExchangePointer(&m_swapData.SwapFile, SwapFile);
+
+        LOGL("Swap file has 0x%X slots available\n", noOfSlots);
+    }
+    __finally
+    {
+        if (!SUCCEEDED(status))
+        {
+            if (buffersPa != NULL)
+            {
+                PmmReleaseMemory(buffersPa, 2 * VM_SWAP_CLUSTER_SIZE);
+                buffersPa = NULL;
+            }
+
+            if (pSlotReferences != NULL)
+            {
+                ExFreePoolWithTag(pSlotReferences, HEAP_MMU_TAG);
+                pSlotReferences = NULL;
+            }
+
+            if (pBitmapBuffer != NULL)
+            {
+                ExFreePoolWithTag(pBitmapBuffer, HEAP_MMU_TAG);
+                pBitmapBuffer = NULL;
+            }
+        }
+    }
+
+    return status;
+}
+
+void
+VmSwapTrackResidentPage(
+    IN      PPAGING_LOCK_DATA       PagingData,
+    IN      PVOID                   VirtualAddress,
+    IN      PHYSICAL_ADDRESS        PhysicalAddress,
+    IN      BOOLEAN                 AlwaysWriteBack
+    )
+{
+    PVM_SWAP_RESIDENT_PAGE pResidentPage;
+    INTR_STATE oldState;
+
+    ASSERT(PagingData != NULL);
+    ASSERT(!PagingData->Data.KernelSpace);
+    ASSERT(IsAddressAligned(VirtualAddress, PAGE_SIZE));
+
+    pResidentPage = NULL;
+
+    LockAcquire(&m_swapData.ResidentLock, &oldState);
+    if (!IsListEmpty(&m_swapData.FreeEntriesList))
+    {
+        pResidentPage = CONTAINING_RECORD(RemoveHeadList(&m_swapData.FreeEntriesList), VM_SWAP_RESIDENT_PAGE, ListEntry);
+    }
+    LockRelease(&m_swapData.ResidentLock, oldState);
+
+    if (pResidentPage == NULL)
+    {
+        pResidentPage = ExAllocatePoolWithTag(0, sizeof(VM_SWAP_RESIDENT_PAGE), HEAP_MMU_TAG, 0);
+        if (pResidentPage == NULL)
+        {
+            // not fatal, the page will simply never be evicted
+            LOG_FUNC_ERROR_ALLOC("ExAllocatePoolWithTag", sizeof(VM_SWAP_RESIDENT_PAGE));
+            return;
+        }
+    }
+
+    pResidentPage->PagingData = PagingData;
+    pResidentPage->VirtualAddress = VirtualAddress;
+    pResidentPage->PhysicalAddress = PhysicalAddress;
+    pResidentPage->AlwaysWriteBack = AlwaysWriteBack;
+
+    LockAcquire(&m_swapData.ResidentLock, &oldState);
+    InsertTailList(&m_swapData.ResidentList, &pResidentPage->ListEntry);
+    m_swapData.NumberOfResidentPages++;
+    LockRelease(&m_swapData.ResidentLock, oldState);
+}
+
+void
+VmSwapUntrackAddressSpace(
+    IN      PPAGING_LOCK_DATA       PagingData
+    )
+{
+    PLIST_ENTRY pEntry;
+    PLIST_ENTRY pNextEntry;
+    INTR_STATE oldState;
+
+    ASSERT(PagingData != NULL);
+
+    // wait for the eviction in progress, it may still refer to the pages
+    MutexAcquire(&m_swapData.EvictionLock);
+
+    LockAcquire(&m_swapData.ResidentLock, &oldState);
+    for (pEntry = m_swapData.ResidentList.Flink;
+         pEntry != &m_swapData.ResidentList;
+         pEntry = pNextEntry)
+    {
+        PVM_SWAP_RESIDENT_PAGE pResidentPage = CONTAINING_RECORD(pEntry, VM_SWAP_RESIDENT_PAGE, ListEntry);
+
+        pNextEntry = pEntry->Flink;
+
+        if (pResidentPage->PagingData == PagingData)
+        {
+            RemoveEntryList(pEntry);
+            m_swapData.NumberOfResidentPages--;
+
+            InsertTailList(&m_swapData.FreeEntriesList, pEntry);
+        }
+    }
+    LockRelease(&m_swapData.ResidentLock, oldState);
+
+    MutexRelease(&m_swapData.EvictionLock);
+}
+
+PTR_SUCCESS
+PHYSICAL_ADDRESS
+VmSwapEvictPage(
+    void
+    )
+{
+    VM_SWAP_VICTIM victims[VM_SWAP_CLUSTER_SIZE];
+    DWORD noOfVictims;
+    QWORD firstSlot;
+    DWORD clusterSize;
+    DWORD usedSlots;
+    DWORD maxSteps;
+    STATUS status;
+    PHYSICAL_ADDRESS pa;
+    INTR_STATE oldState;
+    INTR_STATE pendingState;
+
+    noOfVictims = 0;
+    firstSlot = VMM_INVALID_SWAP_SLOT;
+    usedSlots = 0;
+    pa = NULL;
+
+    MutexAcquire(&m_swapData.EvictionLock);
+
+    // 1. Pick the victims and mark their PTEs not present
+    LockAcquire(&m_swapData.ResidentLock, &oldState);
+
+    maxSteps = VM_SWAP_CLOCK_MAX_PASSES * m_swapData.NumberOfResidentPages;
+
+    for (DWORD i = 0;
+         i < maxSteps && noOfVictims < VM_SWAP_CLUSTER_SIZE && !IsListEmpty(&m_swapData.ResidentList);
+         ++i)
+    {
+        PVM_SWAP_RESIDENT_PAGE pResidentPage;
+        VM_SWAP_CLOCK_RESULT result;
+
+        pResidentPage = CONTAINING_RECORD(RemoveHeadList(&m_swapData.ResidentList), VM_SWAP_RESIDENT_PAGE, ListEntry);
+
+        result = _VmSwapTryEvictPage(pResidentPage);
+        if (result == VmSwapClockResultSecondChance)
+        {
+            // advance the clock hand past this page
+            InsertTailList(&m_swapData.ResidentList, &pResidentPage->ListEntry);
+            continue;
+        }
+
+        m_swapData.NumberOfResidentPages--;
+
+        if (result == VmSwapClockResultStale)
+        {
+            InsertTailList(&m_swapData.FreeEntriesList, &pResidentPage->ListEntry);
+            continue;
+        }
+
+        memzero(&victims[noOfVictims], sizeof(VM_SWAP_VICTIM));
+        victims[noOfVictims].ResidentPage = pResidentPage;
+        victims[noOfVictims].SwapSlot = VMM_INVALID_SWAP_SLOT;
+        noOfVictims++;
+    }
+
+    LockRelease(&m_swapData.ResidentLock, oldState);
+
+    // 2. Remove the stale translations of the victims from all the TLBs,
+    // only the eviction lock is held
+    _VmSwapFlushVictims(victims, noOfVictims);
+
+    // 3. Capture the contents of the pages which were not accessed meanwhile
+    LockAcquire(&m_swapData.ResidentLock, &oldState);
+
+    clusterSize = _VmSwapAllocCluster(&firstSlot);
+
+    LockAcquire(&m_swapData.PendingLock, &pendingState);
+    ASSERT(m_swapData.PendingMask == 0);
+    m_swapData.PendingFirstSlot = firstSlot;
+    LockRelease(&m_swapData.PendingLock, pendingState);
+
+    for (DWORD i = 0; i < noOfVictims; ++i)
+    {
+        PVM_SWAP_VICTIM pVictim = &victims[i];
+
+        if (!_VmSwapFinishEviction(pVictim, (usedSlots < clusterSize) ? firstSlot + usedSlots : VMM_INVALID_SWAP_SLOT))
+        {
+            // the page is mapped again
+            InsertTailList(&m_swapData.ResidentList, &pVictim->ResidentPage->ListEntry);
+            m_swapData.NumberOfResidentPages++;
+
+            pVictim->ResidentPage = NULL;
+            continue;
+        }
+
+        if (pVictim->SwapSlot != VMM_INVALID_SWAP_SLOT)
+        {
+            usedSlots++;
+        }
+    }
+
+    LockRelease(&m_swapData.ResidentLock, oldState);
+
+    // 4. All the dirty pages of the batch reach the swap file at once, no
+    // spinlock is held while the transfers block
+    status = _VmSwapFlushPendingWrites();
+
+    for (DWORD i = usedSlots; i < clusterSize; ++i)
+    {
+        VmSwapFreeSlot(firstSlot + i);
+    }
+
+    LockAcquire(&m_swapData.ResidentLock, &oldState);
+
+    for (DWORD i = 0; i < noOfVictims; ++i)
+    {
+        PVM_SWAP_VICTIM pVictim = &victims[i];
+        PVM_SWAP_RESIDENT_PAGE pResidentPage = pVictim->ResidentPage;
+
+        if (pResidentPage == NULL)
+        {
+            continue;
+        }
+
+        if (pVictim->PendingWrite && !SUCCEEDED(status))
+        {
+            // the frame still holds the only copy of the page
+            _VmSwapRestoreVictim(pVictim);
+            continue;
+        }
+
+        if (pa == NULL)
+        {
+            pa = pResidentPage->PhysicalAddress;
+        }
+        else
+        {
+            MmuReleaseMemory(pResidentPage->PhysicalAddress, 1);
+        }
+
+        InsertTailList(&m_swapData.FreeEntriesList, &pResidentPage->ListEntry);
+    }
+
+    LockRelease(&m_swapData.ResidentLock, oldState);
+
+    // the pages are dropped from the write buffer only after the victims
+    // whose write failed are mapped back, until then they are read from here
+    LockAcquire(&m_swapData.PendingLock, &pendingState);
+    m_swapData.PendingMask = 0;
+    m_swapData.PendingFirstSlot = VMM_INVALID_SWAP_SLOT;
+    LockRelease(&m_swapData.PendingLock, pendingState);
+
+    MutexRelease(&m_swapData.EvictionLock);
+
+    if (pa == NULL)
+    {
+        LOG_WARNING("Could not find any page to evict!\n");
+    }
+
+    return pa;
+}
+
+STATUS
+VmSwapReadPage(
+    IN      QWORD                   SwapSlot,
+    IN      PHYSICAL_ADDRESS        PhysicalAddress
+    )
+{
+    STATUS status;
+    PVOID pMapping;
+    BOOLEAN bLastReference;
+    BOOLEAN bReadAhead;
+    DWORD noOfSlots;
+    INTR_STATE oldState;
+
+    ASSERT(SwapSlot < m_swapData.NumberOfSlots);
+
+    status = STATUS_SUCCESS;
+
+    LockAcquire(&m_swapData.SlotLock, &oldState);
+    ASSERT(m_swapData.SlotReferences[SwapSlot] != 0);
+    bLastReference = (m_swapData.SlotReferences[SwapSlot] == 1);
+    LockRelease(&m_swapData.SlotLock, oldState);
+
+    pMapping = MmuMapSystemMemory(PhysicalAddress, PAGE_SIZE);
+    if (pMapping == NULL)
+    {
+        LOG_FUNC_ERROR("MmuMapSystemMemory", STATUS_MEMORY_CANNOT_BE_MAPPED);
+        return STATUS_MEMORY_CANNOT_BE_MAPPED;
+    }
+
+    __try
+    {
+        if (_VmSwapReadFromMemory(SwapSlot, pMapping, bLastReference))
+        {
+            __leave;
+        }
+
+        // read the whole cluster starting with this slot, the pages evicted
+        // together with this one are likely to be needed soon
+        noOfSlots = (DWORD) min(VM_SWAP_CLUSTER_SIZE, m_swapData.NumberOfSlots - SwapSlot);
+
+        LockAcquire(&m_swapData.ReadAheadLock, &oldState);
+        bReadAhead = !m_swapData.ReadAheadInProgress;
+        if (bReadAhead)
+        {
+            m_swapData.ReadAheadInProgress = TRUE;
+            m_swapData.ReadAheadFirstSlot = SwapSlot;
+            m_swapData.ReadAheadMask = 0;
+            m_swapData.ReadAheadStaleMask = 0;
+        }
+        LockRelease(&m_swapData.ReadAheadLock, oldState);
+
+        if (!bReadAhead)
+        {
+            // the buffer is being filled by another swap-in
+            status = _VmSwapTransferSlots(SwapSlot, 1, pMapping, FALSE);
+            __leave;
+        }
+
+        // the transfer may block => the lock is not held meanwhile
+        status = _VmSwapTransferSlots(SwapSlot, noOfSlots, m_swapData.ReadAheadBuffer, FALSE);
+
+        LockAcquire(&m_swapData.ReadAheadLock, &oldState);
+
+        if (SUCCEEDED(status))
+        {
+            pagecopy(pMapping, m_swapData.ReadAheadBuffer, PAGE_SIZE);
+
+            m_swapData.ReadAheadMask = VM_SWAP_CLUSTER_MASK(noOfSlots) & ~m_swapData.ReadAheadStaleMask;
+            if (bLastReference)
+            {
+                m_swapData.ReadAheadMask &= ~1ULL;
+            }
+        }
+
+        m_swapData.ReadAheadInProgress = FALSE;
+
+        LockRelease(&m_swapData.ReadAheadLock, oldState);
+    }
+    __finally
+    {
+        MmuUnmapSystemMemory(pMapping, PAGE_SIZE);
+    }
+
+    return status;
+}
+
+void
+VmSwapDuplicateSlot(
+    IN      QWORD                   SwapSlot
+    )
+{
+    INTR_STATE oldState;
+
+    ASSERT(SwapSlot < m_swapData.NumberOfSlots);
+
+    LockAcquire(&m_swapData.SlotLock, &oldState);
+    ASSERT(m_swapData.SlotReferences[SwapSlot] != 0);
+    ASSERT(m_swapData.SlotReferences[SwapSlot] != MAX_WORD);
+    m_swapData.SlotReferences[SwapSlot]++;
+    LockRelease(&m_swapData.SlotLock, oldState);
+}
+
+void
+VmSwapFreeSlot(
+    IN      QWORD                   SwapSlot
+    )
+{
+    BOOLEAN bFree;
+    INTR_STATE oldState;
+
+    ASSERT(SwapSlot < m_swapData.NumberOfSlots);
+
+    LockAcquire(&m_swapData.SlotLock, &oldState);
+    ASSERT(m_swapData.SlotReferences[SwapSlot] != 0);
+    m_swapData.SlotReferences[SwapSlot]--;
+    bFree = (m_swapData.SlotReferences[SwapSlot] == 0);
+    LockRelease(&m_swapData.SlotLock, oldState);
+
+    if (!bFree)
+    {
+        return;
+    }
+
+    // drop the stale copies of the slot before it can be reused
+    VmSwapCacheDiscardPage(SwapSlot);
+    _VmSwapInvalidateReadAhead(SwapSlot, 1);
+
+    LockAcquire(&m_swapData.SlotLock, &oldState);
+    ASSERT(BitmapGetBitValue(&m_swapData.SlotBitmap, (DWORD) SwapSlot));
+    BitmapClearBit(&m_swapData.SlotBitmap, (DWORD) SwapSlot);
+    LockRelease(&m_swapData.SlotLock, oldState);
+}
+
+static
+DWORD
+_VmSwapAllocCluster(
+    OUT     QWORD*                  FirstSlot
+    )
+{
+    DWORD idx;
+    DWORD clusterSize;
+    INTR_STATE oldState;
+
+    ASSERT(FirstSlot != NULL);
+
+    *FirstSlot = VMM_INVALID_SWAP_SLOT;
+
+    if (m_swapData.SwapFile == NULL)
+    {
+        return 0;
+    }
+
+    idx = MAX_DWORD;
+
+    LockAcquire(&m_swapData.SlotLock, &oldState);
+
+    // when the swap file becomes fragmented settle for smaller clusters
+    for (clusterSize = VM_SWAP_CLUSTER_SIZE; clusterSize != 0; clusterSize = clusterSize / 2)
+    {
+        idx = BitmapScanFromAndFlip(&m_swapData.SlotBitmap, m_swapData.NextSlotHint, clusterSize, FALSE);
+        if (idx != MAX_DWORD)
+        {
+            break;
+        }
+    }
+
+    if (idx != MAX_DWORD)
+    {
+        for (DWORD i = 0; i < clusterSize; ++i)
+        {
+            ASSERT(m_swapData.SlotReferences[idx + i] == 0);
+            m_swapData.SlotReferences[idx + i] = 1;
+        }
+
+        m_swapData.NextSlotHint = (idx + clusterSize) % m_swapData.NumberOfSlots;
+        *FirstSlot = idx;
+    }
+
+    LockRelease(&m_swapData.SlotLock, oldState);
+
+    return clusterSize;
+}
+
+static
+void
+_VmSwapInvalidateReadAhead(
+    IN      QWORD                   FirstSlot,
+    IN      DWORD                   NumberOfSlots
+    )
+{
+    INTR_STATE oldState;
+
+    LockAcquire(&m_swapData.ReadAheadLock, &oldState);
+
+    for (QWORD slot = FirstSlot; slot < FirstSlot + NumberOfSlots; ++slot)
+    {
+        if (slot >= m_swapData.ReadAheadFirstSlot && slot - m_swapData.ReadAheadFirstSlot < VM_SWAP_CLUSTER_SIZE)
+        {
+            m_swapData.ReadAheadMask &= ~(1ULL << (slot - m_swapData.ReadAheadFirstSlot));
+
+            // the buffer may be in the middle of being filled
+            m_swapData.ReadAheadStaleMask |= (1ULL << (slot - m_swapData.ReadAheadFirstSlot));
+        }
+    }
+
+    LockRelease(&m_swapData.ReadAheadLock, oldState);
+}
+
+static
+STATUS
+_VmSwapTransferSlots(
+    IN      QWORD                   FirstSlot,
+    IN      DWORD                   NumberOfSlots,
+    IN      PVOID                   Buffer,
+    IN      BOOLEAN                 Write
+    )
+{
+    STATUS status;
+    QWORD fileOffset;
+    QWORD bytesToTransfer;
+    QWORD bytesTransferred;
+
+    ASSERT(m_swapData.SwapFile != NULL);
+    ASSERT(FirstSlot + NumberOfSlots <= m_swapData.NumberOfSlots);
+    ASSERT(Buffer != NULL);
+
+    fileOffset = FirstSlot * PAGE_SIZE;
+    bytesToTransfer = (QWORD) NumberOfSlots * PAGE_SIZE;
+    bytesTransferred = 0;
+
+    status = Write ? IoWriteFile(m_swapData.SwapFile, bytesToTransfer, &fileOffset, Buffer, &bytesTransferred)
+                   : IoReadFile(m_swapData.SwapFile, bytesToTransfer, &fileOffset, Buffer, &bytesTransferred);
+    if (!SUCCEEDED(status))
+    {
+        LOG_FUNC_ERROR(Write ? "IoWriteFile" : "IoReadFile", status);
+        return status;
+    }
+
+    if (bytesTransferred != bytesToTransfer)
+    {
+        LOG_ERROR("Transferred only 0x%X bytes out of 0x%X for swap slot 0x%X\n",
+                  bytesTransferred, bytesToTransfer, FirstSlot);
+        return STATUS_DEVICE_INVALID_OPERATION;
+    }
+
+    if (Write)
+    {
+        // the pages read ahead before this write are outdated
+        _VmSwapInvalidateReadAhead(FirstSlot, NumberOfSlots);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static
+STATUS
+_VmSwapFlushPendingWrites(
+    void
+    )
+{
+    STATUS status;
+    QWORD firstSlot;
+    QWORD pendingMask;
+    DWORD runStart;
+    INTR_STATE oldState;
+
+    status = STATUS_SUCCESS;
+    runStart = 0;
+
+    // the buffer does not change until the eviction lock is released =>
+    // the transfers are done without holding PendingLock and faults on the
+    // pending pages keep reading them from the buffer meanwhile
+    LockAcquire(&m_swapData.PendingLock, &oldState);
+    firstSlot = m_swapData.PendingFirstSlot;
+    pendingMask = m_swapData.PendingMask;
+    LockRelease(&m_swapData.PendingLock, oldState);
+
+    for (DWORD i = 0; i <= VM_SWAP_CLUSTER_SIZE && SUCCEEDED(status); ++i)
+    {
+        BOOLEAN bPending = (i < VM_SWAP_CLUSTER_SIZE) && IsBooleanFlagOn(pendingMask, 1ULL << i);
+
+        if (bPending)
+        {
+            if (i == 0 || !IsBooleanFlagOn(pendingMask, 1ULL << (i - 1)))
+            {
+                runStart = i;
+            }
+
+            continue;
+        }
+
+        // write each run of consecutive pending slots with a single transfer
+        if (i != 0 && IsBooleanFlagOn(pendingMask, 1ULL << (i - 1)))
+        {
+            status = _VmSwapTransferSlots(firstSlot + runStart,
+                                          i - runStart,
+                                          m_swapData.WriteBuffer + (QWORD) runStart * PAGE_SIZE,
+                                          TRUE);
+        }
+    }
+
+    return status;
+}
+
+static
+BOOLEAN
+_VmSwapReadFromMemory(
+    IN      QWORD                   SwapSlot,
+    IN      PVOID                   Page,
+    IN      BOOLEAN                 LastReference
+    )
+{
+    BOOLEAN bFound;
+    QWORD index;
+    INTR_STATE oldState;
+
+    if (VmSwapCacheRetrievePage(SwapSlot, Page, LastReference))
+    {
+        return TRUE;
+    }
+
+    bFound = FALSE;
+
+    LockAcquire(&m_swapData.PendingLock, &oldState);
+    index = SwapSlot - m_swapData.PendingFirstSlot;
+    if (SwapSlot >= m_swapData.PendingFirstSlot
+        && index < VM_SWAP_CLUSTER_SIZE
+        && IsBooleanFlagOn(m_swapData.PendingMask, 1ULL << index))
+    {
+        pagecopy(Page, m_swapData.WriteBuffer + index * PAGE_SIZE, PAGE_SIZE);
+        bFound = TRUE;
+    }
+    LockRelease(&m_swapData.PendingLock, oldState);
+
+    if (bFound)
+    {
+        return TRUE;
+    }
+
+    LockAcquire(&m_swapData.ReadAheadLock, &oldState);
+    index = SwapSlot - m_swapData.ReadAheadFirstSlot;
+    if (SwapSlot >= m_swapData.ReadAheadFirstSlot
+        && index < VM_SWAP_CLUSTER_SIZE
+        && IsBooleanFlagOn(m_swapData.ReadAheadMask, 1ULL << index))
+    {
+        pagecopy(Page, m_swapData.ReadAheadBuffer + index * PAGE_SIZE, PAGE_SIZE);
+
+        if (LastReference)
+        {
+            m_swapData.ReadAheadMask &= ~(1ULL << index);
+        }
+
+        bFound = TRUE;
+    }
+    LockRelease(&m_swapData.ReadAheadLock, oldState);
+
+    return bFound;
+}
+
+static
+STATUS
+(__cdecl _VmSwapWriteBack)(
+    IN      QWORD                   SwapSlot,
+    IN_READS_BYTES(PAGE_SIZE)
+            PVOID                   Page
+    )
+{
+    return _VmSwapTransferSlots(SwapSlot, 1, Page, TRUE);
+}
+
+static
+VM_SWAP_CLOCK_RESULT
+_VmSwapTryEvictPage(
+    IN      PVM_SWAP_RESIDENT_PAGE  ResidentPage
+    )
+{
+    VM_SWAP_CLOCK_RESULT result;
+    PPAGING_LOCK_DATA pPagingData;
+    PHYSICAL_ADDRESS pa;
+    BOOLEAN bAccessed;
+    PML4 cr3;
+    INTR_STATE oldState;
+
+    ASSERT(ResidentPage != NULL);
+
+    pPagingData = ResidentPage->PagingData;
+    bAccessed = FALSE;
+    result = VmSwapClockResultSecondChance;
+
+    RecRwSpinlockAcquireExclusive(&pPagingData->Lock, &oldState);
+
+    __try
+    {
+        cr3.Raw = (QWORD) pPagingData->Data.BasePhysicalAddress;
+
+        // retrieving the accessed bit also clears it => if the page is not
+        // accessed until the hand comes back it will be evicted
+        pa = VmmGetPhysicalAddressEx(cr3, ResidentPage->VirtualAddress, &bAccessed, NULL);
+        if (pa != ResidentPage->PhysicalAddress)
+        {
+            // the page was unmapped (and perhaps re-mapped) since it was tracked
+            result = VmSwapClockResultStale;
+            __leave;
+        }
+
+        if (bAccessed)
+        {
+            __leave;
+        }
+
+        pa = VmmBeginPageEviction(&pPagingData->Data, ResidentPage->VirtualAddress);
+        if (pa == NULL)
+        {
+            // mapped through a large page, these are not evicted
+            result = VmSwapClockResultStale;
+            __leave;
+        }
+        ASSERT(pa == ResidentPage->PhysicalAddress);
+
+        result = VmSwapClockResultEvicted;
+    }
+    __finally
+    {
+        RecRwSpinlockReleaseExclusive(&pPagingData->Lock, oldState);
+    }
+
+    return result;
+}
+
+static
+void
+_VmSwapFlushVictims(
+    IN_READS(NumberOfVictims)
+            PVM_SWAP_VICTIM         Victims,
+    IN      DWORD                   NumberOfVictims
+    )
+{
+    VM_TLB_BATCH batch;
+    QWORD flushedMask;
+
+    ASSERT(Victims != NULL || NumberOfVictims == 0);
+    ASSERT(NumberOfVictims <= VM_SWAP_CLUSTER_SIZE);
+
+    flushedMask = 0;
+
+    // a single shootdown for all the victims of each address space
+    for (DWORD i = 0; i < NumberOfVictims; ++i)
+    {
+        PPAGING_LOCK_DATA pPagingData;
+
+        if (IsBooleanFlagOn(flushedMask, 1ULL << i))
+        {
+            continue;
+        }
+
+        pPagingData = Victims[i].ResidentPage->PagingData;
+        VmTlbBatchInit(&batch, &pPagingData->Data);
+
+        for (DWORD j = i; j < NumberOfVictims; ++j)
+        {
+            if (Victims[j].ResidentPage->PagingData == pPagingData)
+            {
+                VmTlbBatchAddPage(&batch, Victims[j].ResidentPage->VirtualAddress);
+                flushedMask |= (1ULL << j);
+            }
+        }
+
+        VmTlbBatchFlush(&batch);
+    }
+}
+
+static
+BOOLEAN
+_VmSwapFinishEviction(
+    INOUT   PVM_SWAP_VICTIM         Victim,
+    IN      QWORD                   SwapSlot
+    )
+{
+    PVM_SWAP_RESIDENT_PAGE pResidentPage;
+    PPAGING_LOCK_DATA pPagingData;
+    BOOLEAN bUnmapped;
+    BOOLEAN bWriteBack;
+    QWORD prevEntry;
+    PVOID pMapping;
+    INTR_STATE oldState;
+    INTR_STATE pendingState;
+
+    ASSERT(Victim != NULL);
+    ASSERT(LockIsOwner(&m_swapData.ResidentLock));
+
+    pResidentPage = Victim->ResidentPage;
+    pPagingData = pResidentPage->PagingData;
+    bUnmapped = FALSE;
+    bWriteBack = FALSE;
+    prevEntry = 0;
+    pMapping = NULL;
+
+    RecRwSpinlockAcquireExclusive(&pPagingData->Lock, &oldState);
+
+    __try
+    {
+        // no TLB holds the translation anymore => the dirty bit is final and
+        // the contents can no longer change
+        bUnmapped = VmmSwapOutPage(&pPagingData->Data,
+                                   pResidentPage->VirtualAddress,
+                                   pResidentPage->PhysicalAddress,
+                                   SwapSlot,
+                                   pResidentPage->AlwaysWriteBack,
+                                   &bWriteBack,
+                                   &prevEntry);
+        if (!bUnmapped || !bWriteBack)
+        {
+            // either accessed in the meantime or a clean page which will be
+            // read again from its backing file or zeroed on the next access
+            __leave;
+        }
+
+        pMapping = MmuMapSystemMemory(pResidentPage->PhysicalAddress, PAGE_SIZE);
+        if (pMapping == NULL)
+        {
+            LOG_FUNC_ERROR("MmuMapSystemMemory", STATUS_MEMORY_CANNOT_BE_MAPPED);
+            VmmRestorePageEntry(&pPagingData->Data, pResidentPage->VirtualAddress, SwapSlot, prevEntry);
+            bUnmapped = FALSE;
+            __leave;
+        }
+
+        // the compressed cache is tried first, the page goes to the swap file
+        // only if it cannot be cached
+        if (!VmSwapCacheInsertPage(SwapSlot, pMapping))
+        {
+            QWORD index;
+
+            LockAcquire(&m_swapData.PendingLock, &pendingState);
+
+            index = SwapSlot - m_swapData.PendingFirstSlot;
+            ASSERT(index < VM_SWAP_CLUSTER_SIZE);
+
+            pagecopy(m_swapData.WriteBuffer + index * PAGE_SIZE, pMapping, PAGE_SIZE);
+            m_swapData.PendingMask |= (1ULL << index);
+
+            LockRelease(&m_swapData.PendingLock, pendingState);
+
+            Victim->PendingWrite = TRUE;
+        }
+
+        MmuUnmapSystemMemory(pMapping, PAGE_SIZE);
+
+        Victim->SwapSlot = SwapSlot;
+        Victim->PreviousEntry = prevEntry;
+    }
+    __finally
+    {
+        RecRwSpinlockReleaseExclusive(&pPagingData->Lock, oldState);
+    }
+
+    return bUnmapped;
+}
+
+static
+void
+_VmSwapRestoreVictim(
+    IN      PVM_SWAP_VICTIM         Victim
+    )
+{
+    PVM_SWAP_RESIDENT_PAGE pResidentPage;
+    PPAGING_LOCK_DATA pPagingData;
+    BOOLEAN bRestored;
+    INTR_STATE oldState;
+
+    ASSERT(Victim != NULL);
+    ASSERT(LockIsOwner(&m_swapData.ResidentLock));
+
+    pResidentPage = Victim->ResidentPage;
+    pPagingData = pResidentPage->PagingData;
+
+    RecRwSpinlockAcquireExclusive(&pPagingData->Lock, &oldState);
+    bRestored = VmmRestorePageEntry(&pPagingData->Data,
+                                    pResidentPage->VirtualAddress,
+                                    Victim->SwapSlot,
+                                    Victim->PreviousEntry);
+    RecRwSpinlockReleaseExclusive(&pPagingData->Lock, oldState);
+
+    if (bRestored)
+    {
+        // the PTE no longer refers to the slot
+        VmSwapFreeSlot(Victim->SwapSlot);
+
+        InsertTailList(&m_swapData.ResidentList, &pResidentPage->ListEntry);
+        m_swapData.NumberOfResidentPages++;
+    }
+    else
+    {
+        // the page was already read from the write buffer (or unmapped) and
+        // the slot released => the frame is no longer needed
+        MmuReleaseMemory(pResidentPage->PhysicalAddress, 1);
+
+        InsertTailList(&m_swapData.FreeEntriesList, &pResidentPage->ListEntry);
+    }
+}
@@ -0,0 +1,835 @@
+#include "HAL9000.h"
+#include "vm_swap_cache.h"
+#include "mmu.h"
+#include "pmm.h"
+#include "bitmap.h"
+#include "hash_table.h"
+#include "synch.h"
+
+#define VM_SWAP_CACHE_BASE_MEMORY               (1 * MB_SIZE)
+
+// this is in hundreds of percentage => 200 == 2%
+#define VM_SWAP_CACHE_PERCENTAGE                200
+
+// The pool is split into blocks, a compressed page occupies a contiguous
+// run of blocks
+#define VM_SWAP_CACHE_BLOCK_SIZE                64
+
+// Pages which do not compress at least to this size are not worth keeping
+// in memory, they go straight to the swap file
+#define VM_SWAP_CACHE_MAX_ENTRY_SIZE            (3 * PAGE_SIZE / 4)
+
+// Average number of compressed pages chained in a hash bucket
+#define VM_SWAP_CACHE_ENTRIES_PER_KEY           4
+
+// Maximum number of pages written back to make room for a single page
+#define VM_SWAP_CACHE_MAX_WRITE_BACKS           4
+
+// LZ77 compression using the LZ4 block layout: each sequence starts with a
+// token holding the literal length in the high nibble and the match length
+// in the low nibble, a nibble value of 15 means the length continues with
+// extra bytes (each 255 byte adds to the length). The literals follow, then
+// a 2 byte offset of the match. The last sequence has only literals.
+#define VM_SWAP_LZ_HASH_BITS                    12
+#define VM_SWAP_LZ_HASH_ENTRIES                 (1 << VM_SWAP_LZ_HASH_BITS)
+#define VM_SWAP_LZ_MIN_MATCH                    4
+#define VM_SWAP_LZ_LAST_LITERALS                5
+#define VM_SWAP_LZ_NIBBLE_MAX                   15
+
+#define VM_SWAP_LZ_HASH(Seq)                    (((Seq) * 2654435761UL) >> (32 - VM_SWAP_LZ_HASH_BITS))
+
+#pragma warning(push)
+
+// warning C4200: nonstandard extension used: zero-sized array in struct/union
+#pragma warning(disable:4200)
+// Header of a compressed page, placed at the start of its first block
+typedef struct _VM_SWAP_CACHE_ENTRY
+{
+    HASH_ENTRY                      HashEntry;
+
+    LIST_ENTRY                      LruEntry;
+
+    QWORD                           SwapSlot;
+
+    WORD                            CompressedSize;
+
+    BYTE                            Data[0];
+} VM_SWAP_CACHE_ENTRY, *PVM_SWAP_CACHE_ENTRY;
+#pragma warning(pop)
+
+typedef struct _VM_SWAP_CACHE_DATA
+{
+    LOCK                            Lock;
+
+    // NULL if the cache was not initialized, in that case all the pages go
+    // directly to the swap file
+    _Guarded_by_(Lock)
+    PBYTE                           PoolBase;
+
+    PHYSICAL_ADDRESS                PoolPhysicalAddress;
+
+    _Guarded_by_(Lock)
+    BITMAP                          BlockBitmap;
+
+    // Slots whose page contains only zeroes
+    _Guarded_by_(Lock)
+    BITMAP                          ZeroSlotsBitmap;
+
+    // Maps swap slots to the compressed pages
+    _Guarded_by_(Lock)
+    HASH_TABLE                      Entries;
+
+    // The least recently inserted entries are at the head and are the first
+    // ones written back
+    _Guarded_by_(Lock)
+    LIST_ENTRY                      LruList;
+
+    PFUNC_SwapCacheWriteBack        WriteBack;
+
+    // Scratch buffers, these are too large to be kept on the stack
+    _Guarded_by_(Lock)
+    WORD                            LzHashTable[VM_SWAP_LZ_HASH_ENTRIES];
+
+    _Guarded_by_(Lock)
+    BYTE                            CompressBuffer[VM_SWAP_CACHE_MAX_ENTRY_SIZE];
+
+    _Guarded_by_(Lock)
+    BYTE                            WriteBackBuffer[PAGE_SIZE];
+} VM_SWAP_CACHE_DATA, *PVM_SWAP_CACHE_DATA;
+
+static VM_SWAP_CACHE_DATA m_swapCacheData;
+
+static
+BOOLEAN
+_VmSwapCacheIsZeroPage(
+    IN_READS_BYTES(PAGE_SIZE)
+            PVOID                   Page
+    );
+
+static
+DWORD
+_VmSwapLzCompress(
+    IN_READS_BYTES(PAGE_SIZE)
+            PBYTE                   Source,
+    OUT_WRITES_BYTES(DestinationSize)
+            PBYTE                   Destination,
+    IN      DWORD                   DestinationSize
+    );
+
+static
+BOOLEAN
+_VmSwapLzDecompress(
+    IN_READS_BYTES(SourceSize)
+            PBYTE                   Source,
+    IN      DWORD                   SourceSize,
+    OUT_WRITES_BYTES(PAGE_SIZE)
+            PBYTE                   Destination
+    );
+
+static
+PVM_SWAP_CACHE_ENTRY
+_VmSwapCacheAllocEntry(
+    IN      DWORD                   CompressedSize
+    );
+
+static
+void
+_VmSwapCacheFreeEntry(
+    IN      PVM_SWAP_CACHE_ENTRY    Entry
+    );
+
+static
+STATUS
+_VmSwapCacheWriteBackOldestEntry(
+    void
+    );
+
+_No_competing_thread_
+void
+VmSwapCachePreinit(
+    void
+    )
+{
+    memzero(&m_swapCacheData, sizeof(VM_SWAP_CACHE_DATA));
+
+    LockInit(&m_swapCacheData.Lock);
+    InitializeListHead(&m_swapCacheData.LruList);
+}
+
+STATUS
+VmSwapCacheInit(
+    IN      DWORD                       NumberOfSlots,
+    IN      PFUNC_SwapCacheWriteBack    WriteBackFunction
+    )
+{
+    STATUS status;
+    QWORD poolSize;
+    DWORD noOfBlocks;
+    DWORD blockBitmapSize;
+    DWORD zeroBitmapSize;
+    DWORD hashTableSize;
+    PBYTE pBlockBitmapBuffer;
+    PBYTE pZeroBitmapBuffer;
+    PHASH_TABLE_DATA pHashTableData;
+    PHYSICAL_ADDRESS poolPa;
+    PVOID pPool;
+
+    if (NumberOfSlots == 0)
+    {
+        return STATUS_INVALID_PARAMETER1;
+    }
+
+    if (WriteBackFunction == NULL)
+    {
+        return STATUS_INVALID_PARAMETER2;
+    }
+
+    status = STATUS_SUCCESS;
+    pBlockBitmapBuffer = NULL;
+    pZeroBitmapBuffer = NULL;
+    pHashTableData = NULL;
+    poolPa = NULL;
+    pPool = NULL;
+
+    poolSize = AlignAddressUpper(VM_SWAP_CACHE_BASE_MEMORY +
+                                 CalculatePercentage(MmuGetTotalSystemMemory(), VM_SWAP_CACHE_PERCENTAGE),
+                                 PAGE_SIZE);
+    noOfBlocks = (DWORD) (poolSize / VM_SWAP_CACHE_BLOCK_SIZE);
+
+    __try
+    {
+        blockBitmapSize = BitmapPreinit(&m_swapCacheData.BlockBitmap, noOfBlocks);
+        zeroBitmapSize = BitmapPreinit(&m_swapCacheData.ZeroSlotsBitmap, NumberOfSlots);
+        // assume pages compress on average to half their size
+        hashTableSize = HashTablePreinit(&m_swapCacheData.Entries,
+                                         (DWORD) max(1, poolSize / (PAGE_SIZE / 2) / VM_SWAP_CACHE_ENTRIES_PER_KEY),
+                                         sizeof(QWORD));
+
+        pBlockBitmapBuffer = ExAllocatePoolWithTag(PoolAllocateZeroMemory, blockBitmapSize, HEAP_MMU_TAG, 0);
+        if (pBlockBitmapBuffer == NULL)
+        {
+            status = STATUS_HEAP_INSUFFICIENT_RESOURCES;
+            LOG_FUNC_ERROR_ALLOC("ExAllocatePoolWithTag", blockBitmapSize);
+            __leave;
+        }
+
+        pZeroBitmapBuffer = ExAllocatePoolWithTag(PoolAllocateZeroMemory, zeroBitmapSize, HEAP_MMU_TAG, 0);
+        if (pZeroBitmapBuffer == NULL)
+        {
+            status = STATUS_HEAP_INSUFFICIENT_RESOURCES;
+            LOG_FUNC_ERROR_ALLOC("ExAllocatePoolWithTag", zeroBitmapSize);
+            __leave;
+        }
+
+        pHashTableData = ExAllocatePoolWithTag(PoolAllocateZeroMemory, hashTableSize, HEAP_MMU_TAG, 0);
+        if (pHashTableData == NULL)
+        {
+            status = STATUS_HEAP_INSUFFICIENT_RESOURCES;
+            LOG_FUNC_ERROR_ALLOC("ExAllocatePoolWithTag", hashTableSize);
+            __leave;
+        }
+
+        poolPa = PmmReserveMemory((DWORD) (poolSize / PAGE_SIZE));
+        if (poolPa == NULL)
+        {
+            status = STATUS_INSUFFICIENT_MEMORY;
+            LOG_FUNC_ERROR("PmmReserveMemory", status);
+            __leave;
+        }
+
+        pPool = MmuMapSystemMemory(poolPa, poolSize);
+        if (pPool == NULL)
+        {
+            status = STATUS_MEMORY_CANNOT_BE_MAPPED;
+            LOG_FUNC_ERROR("MmuMapSystemMemory", status);
+            __leave;
+        }
+
+        BitmapInit(&m_swapCacheData.BlockBitmap, pBlockBitmapBuffer);
+        BitmapInit(&m_swapCacheData.ZeroSlotsBitmap, pZeroBitmapBuffer);
+        HashTableInit(&m_swapCacheData.Entries,
+                      pHashTableData,
+                      HashFuncGenericIncremental,
+                      FIELD_OFFSET(VM_SWAP_CACHE_ENTRY, SwapSlot) - FIELD_OFFSET(VM_SWAP_CACHE_ENTRY, HashEntry));
+
+        m_swapCacheData.WriteBack = WriteBackFunction;
+        m_swapCacheData.PoolPhysicalAddress = poolPa;
+        m_swapCacheData.PoolBase = pPool;
+
+        LOGL("Swap cache pool of 0x%X bytes at 0x%X\n", poolSize, pPool);
+    }
+    __finally
+    {
+        if (!SUCCEEDED(status))
+        {
+            if (poolPa != NULL)
+            {
+                PmmReleaseMemory(poolPa, (DWORD) (poolSize / PAGE_SIZE));
+                poolPa = NULL;
+            }
+
+            if (pHashTableData != NULL)
+            {
+                ExFreePoolWithTag(pHashTableData, HEAP_MMU_TAG);
+                pHashTableData = NULL;
+            }
+
+            if (pZeroBitmapBuffer != NULL)
+            {
+                ExFreePoolWithTag(pZeroBitmapBuffer, HEAP_MMU_TAG);
+                pZeroBitmapBuffer = NULL;
+            }
+
+            if (pBlockBitmapBuffer != NULL)
+            {
+                ExFreePoolWithTag(pBlockBitmapBuffer, HEAP_MMU_TAG);
+                pBlockBitmapBuffer = NULL;
+            }
+        }
+    }
+
+    return status;
+}
+
+BOOLEAN
+VmSwapCacheInsertPage(
+    IN      QWORD                   SwapSlot,
+    IN_READS_BYTES(PAGE_SIZE)
+            PVOID                   Page
+    )
+{
+    PVM_SWAP_CACHE_ENTRY pEntry;
+    DWORD compressedSize;
+    BOOLEAN bCached;
+    INTR_STATE oldState;
+
+    ASSERT(Page != NULL);
+
+    if (m_swapCacheData.PoolBase == NULL)
+    {
+        return FALSE;
+    }
+
+    pEntry = NULL;
+    bCached = FALSE;
+
+    // zero pages are very common (untouched stacks, freshly allocated memory
+    // which was only read) => there is no need to compress them
+    if (_VmSwapCacheIsZeroPage(Page))
+    {
+        LockAcquire(&m_swapCacheData.Lock, &oldState);
+        BitmapSetBit(&m_swapCacheData.ZeroSlotsBitmap, (DWORD) SwapSlot);
+        LockRelease(&m_swapCacheData.Lock, oldState);
+
+        return TRUE;
+    }
+
+    LockAcquire(&m_swapCacheData.Lock, &oldState);
+
+    __try
+    {
+        compressedSize = _VmSwapLzCompress(Page,
+                                           m_swapCacheData.CompressBuffer,
+                                           VM_SWAP_CACHE_MAX_ENTRY_SIZE - sizeof(VM_SWAP_CACHE_ENTRY));
+        if (compressedSize == 0)
+        {
+            __leave;
+        }
+
+        pEntry = _VmSwapCacheAllocEntry(compressedSize);
+        for (DWORD i = 0; i < VM_SWAP_CACHE_MAX_WRITE_BACKS && pEntry == NULL; ++i)
+        {
+            // the pool is full, the oldest pages go to the swap file
+            if (!SUCCEEDED(_VmSwapCacheWriteBackOldestEntry()))
+            {
+                __leave;
+            }
+
+            pEntry = _VmSwapCacheAllocEntry(compressedSize);
+        }
+
+        if (pEntry == NULL)
+        {
+            __leave;
+        }
+
+        pEntry->SwapSlot = SwapSlot;
+        pEntry->CompressedSize = (WORD) compressedSize;
+        memcpy(pEntry->Data, m_swapCacheData.CompressBuffer, compressedSize);
+
+        HashTableInsert(&m_swapCacheData.Entries, &pEntry->HashEntry);
+        InsertTailList(&m_swapCacheData.LruList, &pEntry->LruEntry);
+
+        bCached = TRUE;
+    }
+    __finally
+    {
+        LockRelease(&m_swapCacheData.Lock, oldState);
+    }
+
+    return bCached;
+}
+
+BOOLEAN
+VmSwapCacheRetrievePage(
+    IN      QWORD                   SwapSlot,
+    OUT_WRITES_BYTES(PAGE_SIZE)
+            PVOID                   Page,
+    IN      BOOLEAN                 Discard
+    )
+{
+    PHASH_ENTRY pHashEntry;
+    BOOLEAN bFound;
+    INTR_STATE oldState;
+
+    ASSERT(Page != NULL);
+
+    if (m_swapCacheData.PoolBase == NULL)
+    {
+        return FALSE;
+    }
+
+    bFound = FALSE;
+
+    LockAcquire(&m_swapCacheData.Lock, &oldState);
+
+    if (BitmapGetBitValue(&m_swapCacheData.ZeroSlotsBitmap, (DWORD) SwapSlot))
+    {
+        if (Discard)
+        {
+            BitmapClearBit(&m_swapCacheData.ZeroSlotsBitmap, (DWORD) SwapSlot);
+        }
+
+        pagezero(Page, PAGE_SIZE);
+
+        bFound = TRUE;
+    }
+    else
+    {
+        pHashEntry = HashTableLookup(&m_swapCacheData.Entries, (PHASH_KEY) &SwapSlot);
+        if (pHashEntry != NULL)
+        {
+            PVM_SWAP_CACHE_ENTRY pEntry = CONTAINING_RECORD(pHashEntry, VM_SWAP_CACHE_ENTRY, HashEntry);
+
+            bFound = _VmSwapLzDecompress(pEntry->Data, pEntry->CompressedSize, Page);
+            ASSERT(bFound);
+
+            if (Discard)
+            {
+                _VmSwapCacheFreeEntry(pEntry);
+            }
+        }
+    }
+
+    LockRelease(&m_swapCacheData.Lock, oldState);
+
+    return bFound;
+}
+
+void
+VmSwapCacheDiscardPage(
+    IN      QWORD                   SwapSlot
+    )
+{
+    PHASH_ENTRY pHashEntry;
+    INTR_STATE oldState;
+
+    if (m_swapCacheData.PoolBase == NULL)
+    {
+        return;
+    }
+
+    LockAcquire(&m_swapCacheData.Lock, &oldState);
+
+    BitmapClearBit(&m_swapCacheData.ZeroSlotsBitmap, (DWORD) SwapSlot);
+
+    pHashEntry = HashTableLookup(&m_swapCacheData.Entries, (PHASH_KEY) &SwapSlot);
+    if (pHashEntry != NULL)
+    {
+        _VmSwapCacheFreeEntry(CONTAINING_RECORD(pHashEntry, VM_SWAP_CACHE_ENTRY, HashEntry));
+    }
+
+    LockRelease(&m_swapCacheData.Lock, oldState);
+}
+
+static
+BOOLEAN
+_VmSwapCacheIsZeroPage(
+    IN_READS_BYTES(PAGE_SIZE)
+            PVOID                   Page
+    )
+{
+    const QWORD* pData = (const QWORD*) Page;
+
+    for (DWORD i = 0; i < PAGE_SIZE / sizeof(QWORD); ++i)
+    {
+        if (pData[i] != 0)
+        {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+__forceinline
+static
+DWORD
+_VmSwapLzRead32(
+    IN      PBYTE                   Address
+    )
+{
+    return *((DWORD*) Address);
+}
+
+__forceinline
+static
+BOOLEAN
+_VmSwapLzWriteLength(
+    INOUT   PBYTE*                  Output,
+    IN      PBYTE                   OutputEnd,
+    IN      DWORD                   Length
+    )
+{
+    PBYTE pOutput = *Output;
+
+    // the nibble in the token already holds VM_SWAP_LZ_NIBBLE_MAX
+    for (Length = Length - VM_SWAP_LZ_NIBBLE_MAX; Length >= MAX_BYTE; Length = Length - MAX_BYTE)
+    {
+        if (pOutput >= OutputEnd)
+        {
+            return FALSE;
+        }
+
+        *pOutput++ = MAX_BYTE;
+    }
+
+    if (pOutput >= OutputEnd)
+    {
+        return FALSE;
+    }
+
+    *pOutput++ = (BYTE) Length;
+    *Output = pOutput;
+
+    return TRUE;
+}
+
+static
+BOOLEAN
+_VmSwapLzWriteSequence(
+    INOUT   PBYTE*                  Output,
+    IN      PBYTE                   OutputEnd,
+    IN      PBYTE                   Literals,
+    IN      DWORD                   LiteralLength,
+    IN      WORD                    MatchOffset,
+    IN      DWORD                   MatchLength
+    )
+{
+    PBYTE pOutput;
+    PBYTE pToken;
+    DWORD matchLengthCode;
+
+    pOutput = *Output;
+    matchLengthCode = (MatchLength != 0) ? MatchLength - VM_SWAP_LZ_MIN_MATCH : 0;
+
+    if (pOutput >= OutputEnd)
+    {
+        return FALSE;
+    }
+
+    pToken = pOutput++;
+    *pToken = (BYTE) ((min(LiteralLength, VM_SWAP_LZ_NIBBLE_MAX) << 4) | min(matchLengthCode, VM_SWAP_LZ_NIBBLE_MAX));
+
+    if (LiteralLength >= VM_SWAP_LZ_NIBBLE_MAX && !_VmSwapLzWriteLength(&pOutput, OutputEnd, LiteralLength))
+    {
+        return FALSE;
+    }
+
+    if ((QWORD) PtrDiff(OutputEnd, pOutput) < LiteralLength)
+    {
+        return FALSE;
+    }
+
+    memcpy(pOutput, Literals, LiteralLength);
+    pOutput = pOutput + LiteralLength;
+
+    if (MatchLength != 0)
+    {
+        if ((QWORD) PtrDiff(OutputEnd, pOutput) < sizeof(WORD))
+        {
+            return FALSE;
+        }
+
+        *((WORD*) pOutput) = MatchOffset;
+        pOutput = pOutput + sizeof(WORD);
+
+        if (matchLengthCode >= VM_SWAP_LZ_NIBBLE_MAX && !_VmSwapLzWriteLength(&pOutput, OutputEnd, matchLengthCode))
+        {
+            return FALSE;
+        }
+    }
+
+    *Output = pOutput;
+
+    return TRUE;
+}
+
+static
+DWORD
+_VmSwapLzCompress(
+    IN_READS_BYTES(PAGE_SIZE)
+            PBYTE                   Source,
+    OUT_WRITES_BYTES(DestinationSize)
+            PBYTE                   Destination,
+    IN      DWORD                   DestinationSize
+    )
+{
+    PWORD pHashTable;
+    PBYTE pOutput;
+    PBYTE pOutputEnd;
+    DWORD anchor;
+    DWORD pos;
+    DWORD matchLimit;
+
+    ASSERT(Source != NULL);
+    ASSERT(Destination != NULL);
+
+    // the table holds positions + 1, 0 means no previous occurrence
+    pHashTable = m_swapCacheData.LzHashTable;
+    memzero(pHashTable, sizeof(m_swapCacheData.LzHashTable));
+
+    pOutput = Destination;
+    pOutputEnd = Destination + DestinationSize;
+    anchor = 0;
+    pos = 0;
+    matchLimit = PAGE_SIZE - VM_SWAP_LZ_LAST_LITERALS;
+
+    while (pos + VM_SWAP_LZ_MIN_MATCH <= matchLimit)
+    {
+        DWORD sequence = _VmSwapLzRead32(Source + pos);
+        DWORD hash = VM_SWAP_LZ_HASH(sequence);
+        DWORD candidate = pHashTable[hash];
+
+        pHashTable[hash] = (WORD) (pos + 1);
+
+        if (candidate == 0 || _VmSwapLzRead32(Source + candidate - 1) != sequence)
+        {
+            pos++;
+            continue;
+        }
+
+        candidate = candidate - 1;
+
+        DWORD matchLength = VM_SWAP_LZ_MIN_MATCH;
+        while (pos + matchLength < matchLimit && Source[candidate + matchLength] == Source[pos + matchLength])
+        {
+            matchLength++;
+        }
+
+        if (!_VmSwapLzWriteSequence(&pOutput,
+                                    pOutputEnd,
+                                    Source + anchor,
+                                    pos - anchor,
+                                    (WORD) (pos - candidate),
+                                    matchLength))
+        {
+            return 0;
+        }
+
+        pos = pos + matchLength;
+        anchor = pos;
+    }
+
+    if (!_VmSwapLzWriteSequence(&pOutput, pOutputEnd, Source + anchor, PAGE_SIZE - anchor, 0, 0))
+    {
+        return 0;
+    }
+
+    return (DWORD) PtrDiff(pOutput, Destination);
+}
+
+__forceinline
+static
+BOOLEAN
+_VmSwapLzReadLength(
+    INOUT   PBYTE*                  Input,
+    IN      PBYTE                   InputEnd,
+    INOUT   DWORD*                  Length
+    )
+{
+    PBYTE pInput = *Input;
+    BYTE value;
+
+    do
+    {
+        if (pInput >= InputEnd)
+        {
+            return FALSE;
+        }
+
+        value = *pInput++;
+        *Length = *Length + value;
+    } while (value == MAX_BYTE);
+
+    *Input = pInput;
+
+    return TRUE;
+}
+
+static
+BOOLEAN
+_VmSwapLzDecompress(
+    IN_READS_BYTES(SourceSize)
+            PBYTE                   Source,
+    IN      DWORD                   SourceSize,
+    OUT_WRITES_BYTES(PAGE_SIZE)
+            PBYTE                   Destination
+    )
+{
+    PBYTE pInput;
+    PBYTE pInputEnd;
+    DWORD outPos;
+
+    ASSERT(Source != NULL);
+    ASSERT(Destination != NULL);
+
+    pInput = Source;
+    pInputEnd = Source + SourceSize;
+    outPos = 0;
+
+    while (pInput < pInputEnd)
+    {
+        BYTE token = *pInput++;
+        DWORD literalLength = token >> 4;
+        DWORD matchLength = token & VM_SWAP_LZ_NIBBLE_MAX;
+        WORD matchOffset;
+
+        if (literalLength == VM_SWAP_LZ_NIBBLE_MAX && !_VmSwapLzReadLength(&pInput, pInputEnd, &literalLength))
+        {
+            return FALSE;
+        }
+
+        if ((QWORD) PtrDiff(pInputEnd, pInput) < literalLength || PAGE_SIZE - outPos < literalLength)
+        {
+            return FALSE;
+        }
+
+        memcpy(Destination + outPos, pInput, literalLength);
+        pInput = pInput + literalLength;
+        outPos = outPos + literalLength;
+
+        if (pInput == pInputEnd)
+        {
+            // the last sequence has no match
+            break;
+        }
+
+        if ((QWORD) PtrDiff(pInputEnd, pInput) < sizeof(WORD))
+        {
+            return FALSE;
+        }
+
+        matchOffset = *((WORD*) pInput);
+        pInput = pInput + sizeof(WORD);
+
+        if (matchLength == VM_SWAP_LZ_NIBBLE_MAX && !_VmSwapLzReadLength(&pInput, pInputEnd, &matchLength))
+        {
+            return FALSE;
+        }
+        matchLength = matchLength + VM_SWAP_LZ_MIN_MATCH;
+
+        if (matchOffset == 0 || matchOffset > outPos || PAGE_SIZE - outPos < matchLength)
+        {
+            return FALSE;
+        }
+
+        // the match may overlap with the bytes being written => copy one byte at a time
+        for (DWORD i = 0; i < matchLength; ++i)
+        {
+            Destination[outPos + i] = Destination[outPos - matchOffset + i];
+        }
+        outPos = outPos + matchLength;
+    }
+
+    return outPos == PAGE_SIZE;
+}
+
+static
+PVM_SWAP_CACHE_ENTRY
+_VmSwapCacheAllocEntry(
+    IN      DWORD                   CompressedSize
+    )
+{
+    DWORD noOfBlocks;
+    DWORD idx;
+
+    ASSERT(LockIsOwner(&m_swapCacheData.Lock));
+
+    noOfBlocks = (DWORD) AlignAddressUpper(sizeof(VM_SWAP_CACHE_ENTRY) + CompressedSize, VM_SWAP_CACHE_BLOCK_SIZE) / VM_SWAP_CACHE_BLOCK_SIZE;
+
+    idx = BitmapScanAndFlip(&m_swapCacheData.BlockBitmap, noOfBlocks, FALSE);
+    if (idx == MAX_DWORD)
+    {
+        return NULL;
+    }
+
+    return (PVM_SWAP_CACHE_ENTRY) (m_swapCacheData.PoolBase + (QWORD) idx * VM_SWAP_CACHE_BLOCK_SIZE);
+}
+
+static
+void
+_VmSwapCacheFreeEntry(
+    IN      PVM_SWAP_CACHE_ENTRY    Entry
+    )
+{
+    DWORD firstBlock;
+    DWORD noOfBlocks;
+
+    ASSERT(Entry != NULL);
+    ASSERT(LockIsOwner(&m_swapCacheData.Lock));
+
+    HashTableRemoveEntry(&m_swapCacheData.Entries, &Entry->HashEntry);
+    RemoveEntryList(&Entry->LruEntry);
+
+    firstBlock = (DWORD) (PtrDiff(Entry, m_swapCacheData.PoolBase) / VM_SWAP_CACHE_BLOCK_SIZE);
+    noOfBlocks = (DWORD) AlignAddressUpper(sizeof(VM_SWAP_CACHE_ENTRY) + Entry->CompressedSize, VM_SWAP_CACHE_BLOCK_SIZE) / VM_SWAP_CACHE_BLOCK_SIZE;
+
+    BitmapClearBits(&m_swapCacheData.BlockBitmap, firstBlock, noOfBlocks);
+}
+
+static
+STATUS
+_VmSwapCacheWriteBackOldestEntry(
+    void
+    )
+{
+    PVM_SWAP_CACHE_ENTRY pEntry;
+    STATUS status;
+
+    ASSERT(LockIsOwner(&m_swapCacheData.Lock));
+
+    if (IsListEmpty(&m_swapCacheData.LruList))
+    {
+        return STATUS_ELEMENT_NOT_FOUND;
+    }
+
+    pEntry = CONTAINING_RECORD(m_swapCacheData.LruList.Flink, VM_SWAP_CACHE_ENTRY, LruEntry);
+
+    if (!_VmSwapLzDecompress(pEntry->Data, pEntry->CompressedSize, m_swapCacheData.WriteBackBuffer))
+    {
+        ASSERT_INFO(FALSE, "Corrupted compressed page for slot 0x%X\n", pEntry->SwapSlot);
+        return STATUS_ASSERTION_FAILURE;
+    }
+
+    status = m_swapCacheData.WriteBack(pEntry->SwapSlot, m_swapCacheData.WriteBackBuffer);
+    if (!SUCCEEDED(status))
+    {
+        LOG_FUNC_ERROR("WriteBack", status);
+        return status;
+    }
+
+    _VmSwapCacheFreeEntry(pEntry);
+
+    return STATUS_SUCCESS;
+}
@@ -0,0 +1,436 @@
+#include "HAL9000.h"
+#include "vm_tlb.h"
+#include "vmm.h"
+#include "smp.h"
+
+// Each CPU is identified by its bit in the logical (flat) destination
+// => there is room for a request from each CPU which can be targeted
+#define VM_TLB_MAX_CPUS                 BITS_FOR_STRUCTURE(CPU_AFFINITY)
+
+// Number of address spaces whose translations a CPU keeps in its TLB at the
+// same time, each of them is tagged with a different PCID
+#define VM_TLB_PCIDS_PER_CPU            32
+STATIC_ASSERT(PCID_FIRST_VALID_VALUE + VM_TLB_PCIDS_PER_CPU <= PCID_TOTAL_NO_OF_VALUES);
+
+#define VM_TLB_SLOT_TO_PCID(Slot)       ((PCID)(PCID_FIRST_VALID_VALUE + (Slot)))
+
+// The batch being flushed by a CPU, the batch lives on the stack of the CPU
+// which waits until all the bits in PendingCpus are cleared by the targets
+typedef struct _VM_TLB_REQUEST
+{
+    PVM_TLB_BATCH volatile          Batch;
+    volatile CPU_AFFINITY           PendingCpus;
+} VM_TLB_REQUEST, *PVM_TLB_REQUEST;
+
+// The address space tagged with a PCID on a CPU and the generation of its
+// translations the TLB may hold
+typedef struct _VM_TLB_PCID_SLOT
+{
+    // 0 if the PCID was never used
+    QWORD                           ContextId;
+    QWORD                           Generation;
+} VM_TLB_PCID_SLOT, *PVM_TLB_PCID_SLOT;
+
+// Accessed only by its CPU with interrupts disabled
+typedef struct _VM_TLB_CPU_DATA
+{
+    VM_TLB_PCID_SLOT                Slots[VM_TLB_PCIDS_PER_CPU];
+
+    // The slots are recycled round-robin
+    DWORD                           NextVictim;
+} VM_TLB_CPU_DATA, *PVM_TLB_CPU_DATA;
+
+typedef struct _VM_TLB_DATA
+{
+    // Indexed by the APIC ID of the CPU flushing the batch, a CPU flushes a
+    // single batch at a time and does it with interrupts disabled
+    VM_TLB_REQUEST                  Requests[VM_TLB_MAX_CPUS];
+
+    // Indexed by APIC ID
+    VM_TLB_CPU_DATA                 Cpus[VM_TLB_MAX_CPUS];
+
+    volatile QWORD                  LastContextId;
+} VM_TLB_DATA, *PVM_TLB_DATA;
+
+static VM_TLB_DATA m_tlbData;
+
+static FUNC_IpcProcessEvent         _VmTlbShootdownIpi;
+
+static
+void
+_VmTlbInvalidateLocal(
+    IN      PVM_TLB_BATCH           Batch,
+    IN      CPU_AFFINITY            CpuBit
+    );
+
+static
+PCID
+_VmTlbAssignPcid(
+    INOUT   PVM_TLB_CPU_DATA        CpuData,
+    IN      QWORD                   ContextId,
+    IN      QWORD                   Generation,
+    OUT     BOOLEAN*                Invalidate
+    );
+
+void
+VmTlbInitAddressSpace(
+    OUT     PPAGING_DATA            PagingData
+    )
+{
+    ASSERT(PagingData != NULL);
+
+    PagingData->ActiveCpus = 0;
+    PagingData->ContextId = _InterlockedIncrement64((volatile __int64*) &m_tlbData.LastContextId);
+    PagingData->TlbGeneration = 0;
+}
+
+void
+VmTlbBatchInit(
+    OUT     PVM_TLB_BATCH           Batch,
+    IN      PPAGING_DATA            PagingData
+    )
+{
+    ASSERT(Batch != NULL);
+    ASSERT(PagingData != NULL);
+
+    Batch->PagingData = PagingData;
+    Batch->FlushAll = FALSE;
+    Batch->NumberOfPages = 0;
+    Batch->NumberOfFrameRuns = 0;
+}
+
+void
+VmTlbBatchAddPage(
+    INOUT   PVM_TLB_BATCH           Batch,
+    IN      PVOID                   VirtualAddress
+    )
+{
+    ASSERT(Batch != NULL);
+
+    if (Batch->PagingData->KernelSpace)
+    {
+        PageInvalidateTlb(VirtualAddress);
+        return;
+    }
+
+    if (Batch->FlushAll)
+    {
+        return;
+    }
+
+    if (Batch->NumberOfPages == VM_TLB_BATCH_MAX_PAGES)
+    {
+        // a single flush is cheaper than this many INVLPGs on each CPU
+        Batch->FlushAll = TRUE;
+        return;
+    }
+
+    Batch->Pages[Batch->NumberOfPages] = VirtualAddress;
+    Batch->NumberOfPages++;
+}
+
+void
+VmTlbBatchReleaseFrames(
+    INOUT   PVM_TLB_BATCH           Batch,
+    IN      PHYSICAL_ADDRESS        PhysicalAddress,
+    IN      DWORD                   NumberOfFrames
+    )
+{
+    PVM_TLB_FRAME_RUN pRun;
+
+    ASSERT(Batch != NULL);
+    ASSERT(NumberOfFrames != 0);
+
+    // kernel frames are deferred too: contiguous frames are coalesced and
+    // each run is handed to the zero worker as a single item
+    if (Batch->NumberOfFrameRuns != 0)
+    {
+        pRun = &Batch->FrameRuns[Batch->NumberOfFrameRuns - 1];
+
+        if (PtrOffset(pRun->PhysicalAddress, (QWORD) pRun->NumberOfFrames * PAGE_SIZE) == PhysicalAddress)
+        {
+            pRun->NumberOfFrames += NumberOfFrames;
+            return;
+        }
+    }
+
+    ASSERT(Batch->NumberOfFrameRuns < VM_TLB_BATCH_MAX_FRAME_RUNS);
+
+    pRun = &Batch->FrameRuns[Batch->NumberOfFrameRuns];
+    pRun->PhysicalAddress = PhysicalAddress;
+    pRun->NumberOfFrames = NumberOfFrames;
+
+    Batch->NumberOfFrameRuns++;
+}
+
+BOOLEAN
+VmTlbBatchIsFull(
+    IN      PVM_TLB_BATCH           Batch
+    )
+{
+    ASSERT(Batch != NULL);
+
+    return Batch->NumberOfFrameRuns == VM_TLB_BATCH_MAX_FRAME_RUNS;
+}
+
+void
+VmTlbBatchFlush(
+    INOUT   PVM_TLB_BATCH           Batch
+    )
+{
+    PPCPU pCpu;
+    CPU_AFFINITY selfBit;
+    CPU_AFFINITY targetCpus;
+    PVM_TLB_REQUEST pRequest;
+    SMP_DESTINATION destination = { 0 };
+    STATUS status;
+    INTR_STATE oldState;
+
+    ASSERT(Batch != NULL);
+
+    if (Batch->NumberOfPages == 0 && !Batch->FlushAll && Batch->NumberOfFrameRuns == 0)
+    {
+        return;
+    }
+
+    // the kernel pages were already invalidated locally
+    if (!Batch->PagingData->KernelSpace && (Batch->NumberOfPages != 0 || Batch->FlushAll))
+    {
+        // we must not be moved to another CPU while our request is pending
+        oldState = CpuIntrDisable();
+
+        pCpu = GetCurrentPcpu();
+        ASSERT(pCpu != NULL && pCpu->ApicId < VM_TLB_MAX_CPUS);
+
+        selfBit = (CPU_AFFINITY) pCpu->LogicalApicId;
+
+        // pairs with the interlocked OR in VmTlbActivateAddressSpace: either
+        // the CPU is seen here or it sees the new generation and flushes its
+        // PCID when it loads the paging tables
+        _InterlockedIncrement64((volatile __int64*) &Batch->PagingData->TlbGeneration);
+        targetCpus = Batch->PagingData->ActiveCpus;
+
+        if (IsBooleanFlagOn(targetCpus, selfBit))
+        {
+            _VmTlbInvalidateLocal(Batch, selfBit);
+        }
+
+        targetCpus &= ~selfBit;
+
+        if (targetCpus != 0)
+        {
+            pRequest = &m_tlbData.Requests[pCpu->ApicId];
+            ASSERT(pRequest->Batch == NULL && pRequest->PendingCpus == 0);
+
+            // the batch must be visible before the targets find their bits set
+            pRequest->Batch = Batch;
+            _ReadWriteBarrier();
+            pRequest->PendingCpus = targetCpus;
+
+            destination.Group.Affinity = targetCpus;
+
+            // the IPI only rings the doorbell, the targets pick up the
+            // requests from m_tlbData => we don't need the IPC wait mechanism
+            status = SmpSendGenericIpiEx(_VmTlbShootdownIpi,
+                                         NULL,
+                                         NULL,
+                                         NULL,
+                                         FALSE,
+                                         SmpIpiSendToGroup,
+                                         destination);
+            ASSERT_INFO(SUCCEEDED(status), "SmpSendGenericIpiEx failed with status 0x%x\n", status);
+
+            // the targets may be waiting for us at the same time
+            while (pRequest->PendingCpus != 0)
+            {
+                VmTlbServiceRequests();
+                _mm_pause();
+            }
+
+            pRequest->Batch = NULL;
+        }
+
+        CpuIntrSetState(oldState);
+    }
+
+    // no CPU can reach the frames anymore
+    for (DWORD i = 0; i < Batch->NumberOfFrameRuns; ++i)
+    {
+        MmuReleaseMemory(Batch->FrameRuns[i].PhysicalAddress, Batch->FrameRuns[i].NumberOfFrames);
+    }
+
+    VmTlbBatchInit(Batch, Batch->PagingData);
+}
+
+void
+VmTlbActivateAddressSpace(
+    INOUT   PPAGING_DATA            PagingData
+    )
+{
+    PPCPU pCpu;
+    PCID pcid;
+    BOOLEAN bInvalidate;
+    INTR_STATE oldState;
+
+    ASSERT(PagingData != NULL);
+
+    // a TLB shootdown must not be handled between marking the CPU as a user
+    // of the address space and loading its paging tables
+    oldState = CpuIntrDisable();
+
+    pCpu = GetCurrentPcpu();
+    ASSERT(pCpu != NULL && pCpu->ApicId < VM_TLB_MAX_CPUS);
+
+    // the kernel address space is never shot down
+    if (!PagingData->KernelSpace && !IsBooleanFlagOn(PagingData->ActiveCpus, pCpu->LogicalApicId))
+    {
+        _InterlockedOr8((char volatile*) &PagingData->ActiveCpus, (char) pCpu->LogicalApicId);
+    }
+
+    if (IsBooleanFlagOn(__readcr4(), CR4_PCIDE))
+    {
+        pcid = _VmTlbAssignPcid(&m_tlbData.Cpus[pCpu->ApicId],
+                                PagingData->ContextId,
+                                PagingData->TlbGeneration,
+                                &bInvalidate);
+    }
+    else
+    {
+        // each CR3 load flushes the whole TLB anyway
+        pcid = PCID_FIRST_VALID_VALUE;
+        bInvalidate = TRUE;
+    }
+
+    VmmChangeCr3(PagingData->BasePhysicalAddress, pcid, bInvalidate);
+
+    CpuIntrSetState(oldState);
+}
+
+void
+VmTlbServiceRequests(
+    void
+    )
+{
+    PPCPU pCpu;
+    CPU_AFFINITY selfBit;
+
+    ASSERT(INTR_OFF == CpuIntrGetState());
+
+    pCpu = GetCurrentPcpu();
+    ASSERT(pCpu != NULL);
+
+    selfBit = (CPU_AFFINITY) pCpu->LogicalApicId;
+
+    for (DWORD i = 0; i < VM_TLB_MAX_CPUS; ++i)
+    {
+        PVM_TLB_REQUEST pRequest = &m_tlbData.Requests[i];
+
+        if (!IsBooleanFlagOn(pRequest->PendingCpus, selfBit))
+        {
+            continue;
+        }
+
+        // the sender waits for our bit => the batch is still valid
+        _VmTlbInvalidateLocal(pRequest->Batch, selfBit);
+
+        _InterlockedAnd8((char volatile*) &pRequest->PendingCpus, (char) ~selfBit);
+    }
+}
+
+static
+STATUS
+(__cdecl _VmTlbShootdownIpi)(
+    IN_OPT  PVOID                   Context
+    )
+{
+    ASSERT(Context == NULL);
+
+    // the request may have already been serviced by a CPU spinning with
+    // interrupts disabled, the loop simply finds nothing to do
+    VmTlbServiceRequests();
+
+    return STATUS_SUCCESS;
+}
+
+static
+void
+_VmTlbInvalidateLocal(
+    IN      PVM_TLB_BATCH           Batch,
+    IN      CPU_AFFINITY            CpuBit
+    )
+{
+    PPAGING_DATA pPagingData;
+    BOOLEAN bCurrent;
+
+    ASSERT(Batch != NULL);
+    ASSERT(INTR_OFF == CpuIntrGetState());
+
+    pPagingData = Batch->PagingData;
+    bCurrent = AlignAddressLower(__readcr3(), PAGE_SIZE) == (QWORD) pPagingData->BasePhysicalAddress;
+
+    if (bCurrent)
+    {
+        if (Batch->FlushAll)
+        {
+            // bit 63 is never set when reading CR3 => this invalidates all
+            // the translations of the current PCID
+            __writecr3(__readcr3());
+        }
+        else
+        {
+            for (DWORD i = 0; i < Batch->NumberOfPages; ++i)
+            {
+                PageInvalidateTlb(Batch->Pages[i]);
+            }
+        }
+
+        return;
+    }
+
+    // the generation of the address space was incremented => the PCID we
+    // use for it is flushed the next time the paging tables are loaded
+    _InterlockedAnd8((char volatile*) &pPagingData->ActiveCpus, (char) ~CpuBit);
+}
+
+static
+PCID
+_VmTlbAssignPcid(
+    INOUT   PVM_TLB_CPU_DATA        CpuData,
+    IN      QWORD                   ContextId,
+    IN      QWORD                   Generation,
+    OUT     BOOLEAN*                Invalidate
+    )
+{
+    PVM_TLB_PCID_SLOT pSlot;
+    DWORD slot;
+
+    ASSERT(CpuData != NULL);
+    ASSERT(ContextId != 0);
+    ASSERT(Invalidate != NULL);
+
+    for (slot = 0; slot < VM_TLB_PCIDS_PER_CPU; ++slot)
+    {
+        pSlot = &CpuData->Slots[slot];
+
+        if (pSlot->ContextId == ContextId)
+        {
+            // the TLB may hold translations of the address space which were
+            // shot down while we were not running it
+            *Invalidate = (pSlot->Generation != Generation);
+            pSlot->Generation = Generation;
+
+            return VM_TLB_SLOT_TO_PCID(slot);
+        }
+    }
+
+    slot = CpuData->NextVictim;
+    CpuData->NextVictim = (slot + 1) % VM_TLB_PCIDS_PER_CPU;
+
+    // the translations left by the previous owner of the PCID must go
+    pSlot = &CpuData->Slots[slot];
+    pSlot->ContextId = ContextId;
+    pSlot->Generation = Generation;
+    *Invalidate = TRUE;
+
+    return VM_TLB_SLOT_TO_PCID(slot);
+}
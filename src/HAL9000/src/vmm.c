@@ -10,13 +10,56 @@
 #include "thread_internal.h"
 #include "process_internal.h"
 #include "mdl.h"
+#include "vm_swap.h"
+#include "vm_file_map.h"
+#include "iomu.h"
 
 #define VMM_SIZE_FOR_RESERVATION_METADATA            (5*TB_SIZE)
 
+// A page written to swap is described by a not present PTE with bit 1 set,
+// the swap slot is kept in the bits used for the physical address
+#define VMM_SWAP_ENTRY_PRESENT_BIT                   (1ULL << 0)
+#define VMM_SWAP_ENTRY_MARKER_BIT                    (1ULL << 1)
+
+// A page being evicted is described by a not present PTE with bit 10 set
+// (ignored by the CPU) which keeps all the other bits of the mapping until
+// the TLBs of all the CPUs are flushed, a fault on the page maps it back
+#define VMM_TRANSITION_ENTRY_BIT                     (1ULL << 10)
+
+// A page being read back from swap keeps its swap entry with bit 11 set
+// (ignored by the CPU), the slot is read without holding the paging lock and
+// belongs to the faulting thread until it locks the paging tables again
+#define VMM_SWAP_ENTRY_IN_PROGRESS_BIT               (1ULL << 11)
+
+#define VMM_IS_SWAP_ENTRY(Entry)                     (((Entry) & (VMM_SWAP_ENTRY_PRESENT_BIT | VMM_SWAP_ENTRY_MARKER_BIT | VMM_TRANSITION_ENTRY_BIT)) == VMM_SWAP_ENTRY_MARKER_BIT)
+#define VMM_SWAP_ENTRY_FOR_SLOT(Slot)                (((QWORD)(Slot) << PAGE_SHIFT) | VMM_SWAP_ENTRY_MARKER_BIT)
+#define VMM_SWAP_SLOT_FROM_ENTRY(Entry)              ((QWORD)(Entry) >> PAGE_SHIFT)
+#define VMM_IS_SWAP_IN_PROGRESS_ENTRY(Entry)         (VMM_IS_SWAP_ENTRY(Entry) && IsBooleanFlagOn((Entry), VMM_SWAP_ENTRY_IN_PROGRESS_BIT))
+
+#define VMM_IS_TRANSITION_ENTRY(Entry)               (((Entry) & (VMM_SWAP_ENTRY_PRESENT_BIT | VMM_TRANSITION_ENTRY_BIT)) == VMM_TRANSITION_ENTRY_BIT)
+#define VMM_TRANSITION_ENTRY_FROM_PRESENT(Entry)     (((Entry) & ~VMM_SWAP_ENTRY_PRESENT_BIT) | VMM_TRANSITION_ENTRY_BIT)
+#define VMM_PRESENT_ENTRY_FROM_TRANSITION(Entry)     (((Entry) & ~VMM_TRANSITION_ENTRY_BIT) | VMM_SWAP_ENTRY_PRESENT_BIT)
+
+#define VMM_ENTRIES_PER_PAGING_STRUCTURE             (PAGE_SIZE / sizeof(PT_ENTRY))
+
+// Size of the range described by an entry of a paging structure on Level
+#define VMM_SIZE_DESCRIBED_BY_ENTRY(Level)           ((QWORD)PAGE_SIZE << (9 * (PAGING_TABLES_LAST_LEVEL - (Level))))
+
+// A present PTE with this bit set (ignored by the CPU) maps a shared frame
+// read-only although the reservation allows writes, the first write to the
+// page gives it a private copy of the frame
+#define VMM_COW_ENTRY_BIT                            (1ULL << 9)
+
+#define VMM_IS_COW_ENTRY(Entry)                      IsBooleanFlagOn((Entry), VMM_COW_ENTRY_BIT)
+
 typedef struct _VMM_DATA
 {
     VMM_RESERVATION_SPACE   VmmReservationSpace;
 
+    // Frame filled with zeroes mapped copy-on-write in place of all the
+    // anonymous user pages which were read but never written, NULL if it
+    // could not be allocated
+    PHYSICAL_ADDRESS        ZeroFrame;
 
     // Global paging related defines
     // No matter what CR3 we're using the same WB and UC indexes will be used
@@ -24,6 +67,9 @@ typedef struct _VMM_DATA
     BYTE                    UncacheableIndex;
 } VMM_DATA, *PVMM_DATA;
 
+// Called for each entry of the paging structures describing the walked range,
+// when FALSE is returned for an entry which is not on the last level the whole
+// range it describes is skipped
 typedef
 BOOLEAN
 (__cdecl FUNC_PageWalkCallback)(
@@ -38,17 +84,33 @@ typedef FUNC_PageWalkCallback *PFUNC_PageWalkCallback;
 
 typedef struct _VMM_MAP_UNMAP_PAGE_WALK_CONTEXT
 {
-    // These fields are valid only when mapping memory in _VmMapPage
+    // These fields are valid both when mapping and unmapping memory, the
+    // paging data is needed on unmap to split large pages
     PPAGING_DATA                    PagingData;
-    PHYSICAL_ADDRESS                PhysicalAddressBase;
     PVOID                           VirtualAddressBase;
+    QWORD                           Size;
+
+    // These fields are valid only when mapping memory in _VmMapPage
+    PHYSICAL_ADDRESS                PhysicalAddressBase;
 
     PAGE_RIGHTS                     PageRights;
     BOOLEAN                         Invalidate;
     BOOLEAN                         Uncacheable;
 
+    // If set 2MB aligned chunks backed by 2MB aligned physical memory will
+    // be mapped using large pages
+    BOOLEAN                         LargePages;
+
     // Valid only when unmapping memory in _VmUnmapPage;
     BOOLEAN                         ReleaseMemory;
+
+    // First address left mapped because the batch could not hold any more
+    // frames, NULL if the whole range was unmapped
+    PVOID                           StopAddress;
+
+    // Receives the pages which must be invalidated on all the CPUs, when
+    // mapping it may be NULL
+    PVM_TLB_BATCH                   Batch;
 } VMM_MAP_UNMAP_PAGE_WALK_CONTEXT, *PVMM_MAP_UNMAP_PAGE_WALK_CONTEXT;
 
 // Used when determining the physical address, a/d bits and when resetting them
@@ -65,6 +127,14 @@ typedef struct _VMM_RETRIEVE_PHYS_ACCESS_PAGE_WALK_CONTEXT
     BOOLEAN                         ClearDirty;
 } VMM_RETRIEVE_PHYS_ACCESS_PAGE_WALK_CONTEXT, *PVMM_RETRIEVE_PHYS_ACCESS_PAGE_WALK_CONTEXT;
 
+// Used when the last level entry of an address must be inspected or modified
+// directly (i.e. when swapping pages)
+typedef struct _VMM_RETRIEVE_ENTRY_PAGE_WALK_CONTEXT
+{
+    // NULL if the address is not described by a 4KB PTE
+    PT_ENTRY*                       Entry;
+} VMM_RETRIEVE_ENTRY_PAGE_WALK_CONTEXT, *PVMM_RETRIEVE_ENTRY_PAGE_WALK_CONTEXT;
+
 static VMM_DATA m_vmmData;
 
 static
@@ -74,6 +144,23 @@ _VmSetupPagingStructure(
     IN      PVOID                   PagingStructure
     );
 
+static
+void
+_VmDemoteLargePage(
+    IN      PPAGING_DATA            PagingData,
+    IN      PVOID                   PageTable,
+    IN      PVOID                   VirtualAddress
+    );
+
+static
+void
+_VmBuildPageTable(
+    IN      PVMM_MAP_UNMAP_PAGE_WALK_CONTEXT    Context,
+    IN      PVOID                               PageDirectoryEntry,
+    IN      PVOID                               VirtualAddress,
+    IN      PHYSICAL_ADDRESS                    PhysicalAddress
+    );
+
 static
 BOOL_SUCCESS
 BOOLEAN
@@ -96,6 +183,140 @@ _VmWalkPagingTables(
 static FUNC_PageWalkCallback            _VmMapPage;
 static FUNC_PageWalkCallback            _VmUnmapPage;
 static FUNC_PageWalkCallback            _VmRetrievePhyAccess;
+static FUNC_PageWalkCallback            _VmRetrieveLastLevelEntry;
+
+static
+PT_ENTRY*
+_VmGetLastLevelEntry(
+    IN      PPAGING_DATA            PagingData,
+    IN      PVOID                   VirtualAddress
+    );
+
+static
+PTR_SUCCESS
+PHYSICAL_ADDRESS
+_VmReserveFrame(
+    void
+    );
+
+static
+BOOLEAN
+_VmTryMapZeroFrame(
+    IN      PPAGING_LOCK_DATA       PagingData,
+    IN      PVOID                   VirtualAddress,
+    IN      PAGE_RIGHTS             RightsRequested,
+    IN      PAGE_RIGHTS             PageRights,
+    IN      BOOLEAN                 Uncacheable,
+    IN_OPT  PFILE_OBJECT            BackingFile
+    );
+
+static
+BOOLEAN
+_VmTryRestoreEvictedPage(
+    IN      PPAGING_LOCK_DATA       PagingData,
+    IN      PVOID                   VirtualAddress
+    );
+
+static
+STATUS
+_VmCopyOnWrite(
+    INOUT   PT_ENTRY*               Entry,
+    IN      PVOID                   VirtualAddress,
+    IN      PHYSICAL_ADDRESS        PhysicalAddress,
+    INOUT   PVM_TLB_BATCH           Batch
+    );
+
+static
+STATUS
+_VmFillFrame(
+    IN_OPT  PFILE_OBJECT            File,
+    IN      QWORD                   FileOffset,
+    IN      PHYSICAL_ADDRESS        PhysicalAddress
+    );
+
+static
+BOOLEAN
+_VmTryMapFilledFrame(
+    IN      PPAGING_LOCK_DATA       PagingData,
+    IN      PVOID                   VirtualAddress,
+    IN      QWORD                   ExpectedEntry,
+    IN      PHYSICAL_ADDRESS        PhysicalAddress,
+    IN      PAGE_RIGHTS             PageRights,
+    IN      BOOLEAN                 Uncacheable
+    );
+
+static
+STATUS
+_VmSwapInPage(
+    IN      PPAGING_LOCK_DATA       PagingData,
+    IN      PVOID                   VirtualAddress,
+    IN      QWORD                   SwapSlot,
+    IN      PHYSICAL_ADDRESS        PhysicalAddress,
+    IN      PAGE_RIGHTS             PageRights,
+    IN      BOOLEAN                 Uncacheable,
+    OUT     BOOLEAN*                Mapped
+    );
+
+__forceinline
+static
+void
+_VmInvalidatePage(
+    IN_OPT  PVM_TLB_BATCH           Batch,
+    IN      PVOID                   VirtualAddress
+    )
+{
+    if (Batch != NULL)
+    {
+        VmTlbBatchAddPage(Batch, VirtualAddress);
+    }
+    else
+    {
+        PageInvalidateTlb(VirtualAddress);
+    }
+}
+
+__forceinline
+static
+void
+_VmUpdateMaximum(
+    INOUT   volatile QWORD*         Maximum,
+    IN      QWORD                   Value
+    )
+{
+    QWORD currentMaximum;
+
+    do
+    {
+        currentMaximum = *Maximum;
+        if (Value <= currentMaximum)
+        {
+            return;
+        }
+    } while (_InterlockedCompareExchange64((volatile __int64*) Maximum,
+                                           (__int64) Value,
+                                           (__int64) currentMaximum) != (__int64) currentMaximum);
+}
+
+// Called each time leaf entries become present or are removed, entries in
+// transition still count as resident until the eviction completes
+__forceinline
+static
+void
+_VmAccountResidentPages(
+    INOUT   PPAGING_DATA            PagingData,
+    IN      INT64                   NumberOfPages
+    )
+{
+    QWORD residentPages;
+
+    residentPages = _InterlockedExchangeAdd64((volatile __int64*) &PagingData->Statistics.ResidentPages,
+                                              NumberOfPages) + NumberOfPages;
+
+    if (NumberOfPages > 0)
+    {
+        _VmUpdateMaximum(&PagingData->Statistics.PeakResidentPages, residentPages);
+    }
+}
 
 __forceinline
 static
@@ -119,6 +340,37 @@ _VmRetrieveNextPhysicalAddressForPagingStructure(
     return (PHYSICAL_ADDRESS) nextAddress;
 }
 
+__forceinline
+static
+QWORD
+_VmBytesLeftInRange(
+    IN      PVMM_MAP_UNMAP_PAGE_WALK_CONTEXT    Context,
+    IN      PVOID                               VirtualAddress
+    )
+{
+    ASSERT(Context != NULL);
+    ASSERT(VirtualAddress >= Context->VirtualAddressBase);
+
+    return Context->Size - PtrDiff(VirtualAddress, Context->VirtualAddressBase);
+}
+
+__forceinline
+static
+BOOLEAN
+_VmCanMapLargePage(
+    IN      PVMM_MAP_UNMAP_PAGE_WALK_CONTEXT    Context,
+    IN      PVOID                               VirtualAddress,
+    IN      PHYSICAL_ADDRESS                    PhysicalAddress
+    )
+{
+    ASSERT(Context != NULL);
+
+    return Context->LargePages
+        && IsAddressAligned(VirtualAddress, PAGE_2MB_SIZE)
+        && IsAddressAligned(PhysicalAddress, PAGE_2MB_SIZE)
+        && _VmBytesLeftInRange(Context, VirtualAddress) >= PAGE_2MB_SIZE;
+}
+
 __forceinline
 static
 BOOLEAN
@@ -178,6 +430,9 @@ VmmPreinit(
     )
 {
     memzero(&m_vmmData, sizeof(VMM_DATA));
+
+    VmSwapPreinit();
+    VmFileMapPreinit();
 }
 
 _No_competing_thread_
@@ -244,14 +499,16 @@ VmmMapMemoryEx(
 }
 
 void
-VmmMapMemoryInternal(
+VmmMapMemoryInternalEx(
     IN      PPAGING_DATA            PagingData,
     IN      PHYSICAL_ADDRESS        PhysicalAddress,
     IN      QWORD                   Size,
     IN      PVOID                   BaseAddress,
     IN      PAGE_RIGHTS             PageRights,
     IN      BOOLEAN                 Invalidate,
-    IN      BOOLEAN                 Uncacheable
+    IN      BOOLEAN                 Uncacheable,
+    IN      BOOLEAN                 LargePages,
+    IN_OPT  PVM_TLB_BATCH           Batch
     )
 {
     VMM_MAP_UNMAP_PAGE_WALK_CONTEXT ctx = { 0 };
@@ -264,9 +521,12 @@ VmmMapMemoryInternal(
     ctx.PagingData = PagingData;
     ctx.PhysicalAddressBase = PhysicalAddress;
     ctx.VirtualAddressBase = BaseAddress;
+    ctx.Size = Size;
     ctx.PageRights = PageRights;
     ctx.Invalidate = Invalidate;
     ctx.Uncacheable = Uncacheable;
+    ctx.LargePages = LargePages;
+    ctx.Batch = Batch;
 
     cr3.Raw = (QWORD) PagingData->BasePhysicalAddress;
 
@@ -277,33 +537,62 @@ VmmMapMemoryInternal(
                         &ctx);
 }
 
-void
+QWORD
 VmmUnmapMemoryEx(
-    IN      PML4                    Cr3,
+    IN      PPAGING_DATA            PagingData,
     IN      PVOID                   VirtualAddress,
     IN      QWORD                   Size,
-    IN      BOOLEAN                 ReleaseMemory
+    IN      BOOLEAN                 ReleaseMemory,
+    INOUT   PVM_TLB_BATCH           Batch
     )
 {
     VMM_MAP_UNMAP_PAGE_WALK_CONTEXT ctx = { 0 };
+    PML4 cr3;
+    QWORD chunkSize;
+
+    ASSERT(PagingData != NULL);
+    ASSERT(Batch != NULL && Batch->PagingData == PagingData);
 
     if ((NULL == VirtualAddress) || (!IsAddressAligned(VirtualAddress, PAGE_SIZE)))
     {
-        return;
+        return Size;
     }
 
     if ((0 == Size) || (!IsAddressAligned(Size, PAGE_SIZE)))
     {
-        return;
+        return Size;
     }
 
+    ctx.PagingData = PagingData;
+    ctx.VirtualAddressBase = VirtualAddress;
+    ctx.Size = Size;
     ctx.ReleaseMemory = ReleaseMemory;
+    ctx.Batch = Batch;
 
-    _VmWalkPagingTables(Cr3,
-                        VirtualAddress,
-                        Size,
-                        _VmUnmapPage,
-                        &ctx);
+    cr3.Raw = (QWORD) PagingData->BasePhysicalAddress;
+
+    // walk the range one large page at a time so we can stop shortly after
+    // the batch fills up
+    for (QWORD offset = 0;
+         offset < Size && ctx.StopAddress == NULL;
+         offset = offset + chunkSize)
+    {
+        PVOID pCurrentVa = PtrOffset(VirtualAddress, offset);
+
+        chunkSize = PAGE_2MB_SIZE - AddressOffset(pCurrentVa, PAGE_2MB_SIZE);
+        if (chunkSize > Size - offset)
+        {
+            chunkSize = Size - offset;
+        }
+
+        _VmWalkPagingTables(cr3,
+                            pCurrentVa,
+                            chunkSize,
+                            _VmUnmapPage,
+                            &ctx);
+    }
+
+    return (ctx.StopAddress == NULL) ? Size : PtrDiff(ctx.StopAddress, VirtualAddress);
 }
 
 PTR_SUCCESS
@@ -343,6 +632,167 @@ VmmGetPhysicalAddressEx(
     return ctx.PhysicalAddress;
 }
 
+PTR_SUCCESS
+PHYSICAL_ADDRESS
+VmmBeginPageEviction(
+    IN      PPAGING_DATA            PagingData,
+    IN      PVOID                   VirtualAddress
+    )
+{
+    PT_ENTRY* pEntry;
+
+    ASSERT(PagingData != NULL);
+    ASSERT(!PagingData->KernelSpace);
+    ASSERT(IsAddressAligned(VirtualAddress, PAGE_SIZE));
+
+    pEntry = _VmGetLastLevelEntry(PagingData, VirtualAddress);
+    if (pEntry == NULL || !PteIsPresent(pEntry))
+    {
+        return NULL;
+    }
+
+    // the other CPUs may still write the page through their TLBs => the
+    // contents are captured (and the dirty bit checked) only after the
+    // caller flushes the TLBs
+    *((QWORD*)pEntry) = VMM_TRANSITION_ENTRY_FROM_PRESENT(*((QWORD*)pEntry));
+
+    return PteGetPhysicalAddress(pEntry);
+}
+
+BOOLEAN
+VmmSwapOutPage(
+    IN      PPAGING_DATA            PagingData,
+    IN      PVOID                   VirtualAddress,
+    IN      PHYSICAL_ADDRESS        PhysicalAddress,
+    IN      QWORD                   SwapSlot,
+    IN      BOOLEAN                 AlwaysWriteBack,
+    OUT     BOOLEAN*                WriteBack,
+    OUT_OPT QWORD*                  PreviousEntry
+    )
+{
+    PT_ENTRY* pEntry;
+    QWORD presentEntry;
+    BOOLEAN bWriteBack;
+
+    ASSERT(PagingData != NULL);
+    ASSERT(IsAddressAligned(VirtualAddress, PAGE_SIZE));
+    ASSERT(WriteBack != NULL);
+
+    *WriteBack = FALSE;
+
+    pEntry = _VmGetLastLevelEntry(PagingData, VirtualAddress);
+    if (pEntry == NULL)
+    {
+        return TRUE;
+    }
+
+    if (!VMM_IS_TRANSITION_ENTRY(*((QWORD*)pEntry)) || PteGetPhysicalAddress(pEntry) != PhysicalAddress)
+    {
+        // the page was either accessed and mapped back or it was unmapped,
+        // in which case the frame was left to us
+        return !(PteIsPresent(pEntry) && PteGetPhysicalAddress(pEntry) == PhysicalAddress);
+    }
+
+    presentEntry = VMM_PRESENT_ENTRY_FROM_TRANSITION(*((QWORD*)pEntry));
+    bWriteBack = AlwaysWriteBack || pEntry->Dirty;
+
+    if (PreviousEntry != NULL)
+    {
+        *PreviousEntry = presentEntry;
+    }
+
+    if (bWriteBack && SwapSlot == VMM_INVALID_SWAP_SLOT)
+    {
+        // the contents would be lost => map the page back
+        *((QWORD*)pEntry) = presentEntry;
+        return FALSE;
+    }
+
+    // no CPU caches the transition entry => there is nothing to invalidate
+    *((QWORD*)pEntry) = bWriteBack ? VMM_SWAP_ENTRY_FOR_SLOT(SwapSlot) : 0;
+    _VmAccountResidentPages(PagingData, -1);
+
+    *WriteBack = bWriteBack;
+
+    return TRUE;
+}
+
+BOOLEAN
+VmmRestorePageEntry(
+    IN      PPAGING_DATA            PagingData,
+    IN      PVOID                   VirtualAddress,
+    IN      QWORD                   SwapSlot,
+    IN      QWORD                   PreviousEntry
+    )
+{
+    PT_ENTRY* pEntry;
+
+    ASSERT(PagingData != NULL);
+    ASSERT(IsAddressAligned(VirtualAddress, PAGE_SIZE));
+    ASSERT(SwapSlot != VMM_INVALID_SWAP_SLOT);
+
+    pEntry = _VmGetLastLevelEntry(PagingData, VirtualAddress);
+    if (pEntry == NULL || *((QWORD*)pEntry) != VMM_SWAP_ENTRY_FOR_SLOT(SwapSlot))
+    {
+        return FALSE;
+    }
+
+    *((QWORD*)pEntry) = PreviousEntry;
+    _VmAccountResidentPages(PagingData, 1);
+
+    // the entry was not present => there is nothing to invalidate
+
+    return TRUE;
+}
+
+PTR_SUCCESS
+PHYSICAL_ADDRESS
+VmmCleanPage(
+    IN      PPAGING_DATA            PagingData,
+    IN      PVOID                   VirtualAddress,
+    INOUT   PVM_TLB_BATCH           Batch
+    )
+{
+    PT_ENTRY* pEntry;
+
+    ASSERT(PagingData != NULL);
+    ASSERT(IsAddressAligned(VirtualAddress, PAGE_SIZE));
+    ASSERT(Batch != NULL && Batch->PagingData == PagingData);
+
+    pEntry = _VmGetLastLevelEntry(PagingData, VirtualAddress);
+    if (pEntry == NULL || !PteIsPresent(pEntry) || !pEntry->Dirty)
+    {
+        return NULL;
+    }
+
+    // the CPUs caching the translation would keep writing the page without
+    // setting the dirty bit again
+    pEntry->Dirty = FALSE;
+    VmTlbBatchAddPage(Batch, VirtualAddress);
+
+    return PteGetPhysicalAddress(pEntry);
+}
+
+void
+VmmMarkPageDirty(
+    IN      PPAGING_DATA            PagingData,
+    IN      PVOID                   VirtualAddress,
+    IN      PHYSICAL_ADDRESS        PhysicalAddress
+    )
+{
+    PT_ENTRY* pEntry;
+
+    ASSERT(PagingData != NULL);
+    ASSERT(IsAddressAligned(VirtualAddress, PAGE_SIZE));
+
+    pEntry = _VmGetLastLevelEntry(PagingData, VirtualAddress);
+    if (pEntry != NULL && PteIsPresent(pEntry) && PteGetPhysicalAddress(pEntry) == PhysicalAddress)
+    {
+        // setting the bit requires no invalidation
+        pEntry->Dirty = TRUE;
+    }
+}
+
 _No_competing_thread_
 STATUS
 VmmPreparePagingData(
@@ -401,6 +851,8 @@ VmmSetupPageTables(
     PagingData->BasePhysicalAddress = BasePhysicalAddress;
     PagingData->KernelSpace = KernelStructures;
 
+    VmTlbInitAddressSpace(PagingData);
+
     LOG_TRACE_VMM("Will setup paging tables at physical address: 0x%X\n", PagingData->BasePhysicalAddress);
     LOG_TRACE_VMM("BaseAddress: 0x%X\n", pBaseVirtualAddress);
     LOG_TRACE_VMM("Size of paging tables: 0x%x\n", sizeReservedForPagingStructures);
@@ -426,7 +878,7 @@ VmmSetupPageTables(
     {
         // Zero the newly mapped PML4 if we didn't map it in it's own
         // paging structures - else it would already be populated
-        memzero(pBaseVirtualAddress, PAGE_SIZE);
+        pagezero(pBaseVirtualAddress, PAGE_SIZE);
     }
 
     return STATUS_SUCCESS;
@@ -454,8 +906,6 @@ VmmChangeCr3(
     // If CR4.PCIDE = 1 and bit 63 of the instructions source operand is 1, the instruction is not required to
     // invalidate any TLB entries or entries in paging - structure caches.
     __writecr3((Invalidate ? 0 : MOV_TO_CR3_DO_NOT_INVALIDATE_PCID_MAPPINGS) | (QWORD)Pml4Base | Pcid);
-
-    /// TODO: This should be broadcast on all CPUs to invalidate their mappings for PCID Pcid
 }
 
 _No_competing_thread_
@@ -467,15 +917,146 @@ VmmInitReservationSystem(
     VmReservationSpaceFinishInit(&m_vmmData.VmmReservationSpace);
 }
 
-static
-void
-_VmmMapDescribedRegion(
-    IN      PVOID                   BaseAddress,
-    IN      PMDL                    Mdl,
-    IN      PAGE_RIGHTS             Rights,
-    IN_OPT  PPAGING_LOCK_DATA       PagingData
-    )
-{
+_No_competing_thread_
+STATUS
+VmmInitZeroFrame(
+    void
+    )
+{
+    PHYSICAL_ADDRESS pa;
+    PVOID pMapping;
+
+    ASSERT(m_vmmData.ZeroFrame == NULL);
+
+    pa = PmmReserveMemory(1);
+    if (pa == NULL)
+    {
+        LOG_FUNC_ERROR("PmmReserveMemory", STATUS_INSUFFICIENT_MEMORY);
+        return STATUS_INSUFFICIENT_MEMORY;
+    }
+
+    // frames are not guaranteed to be zeroed before the zero worker runs
+    pMapping = MmuMapSystemMemory(pa, PAGE_SIZE);
+    if (pMapping == NULL)
+    {
+        LOG_FUNC_ERROR("MmuMapSystemMemory", STATUS_MEMORY_CANNOT_BE_MAPPED);
+        PmmReleaseMemory(pa, 1);
+        return STATUS_MEMORY_CANNOT_BE_MAPPED;
+    }
+
+    pagezero(pMapping, PAGE_SIZE);
+
+    MmuUnmapSystemMemory(pMapping, PAGE_SIZE);
+
+    m_vmmData.ZeroFrame = pa;
+
+    return STATUS_SUCCESS;
+}
+
+STATUS
+VmmBreakCopyOnWrite(
+    IN      PVOID                   VirtualAddress,
+    IN      QWORD                   Size,
+    IN      PPAGING_LOCK_DATA       PagingData
+    )
+{
+    STATUS status;
+    PVOID pCurrentPage;
+    PVOID pEndAddress;
+    PT_ENTRY* pEntry;
+    PHYSICAL_ADDRESS pa;
+    VM_TLB_BATCH batch;
+    INTR_STATE oldState;
+
+    if (VirtualAddress == NULL)
+    {
+        return STATUS_INVALID_PARAMETER1;
+    }
+
+    if (Size == 0)
+    {
+        return STATUS_INVALID_PARAMETER2;
+    }
+
+    if (PagingData == NULL)
+    {
+        return STATUS_INVALID_PARAMETER3;
+    }
+
+    status = STATUS_SUCCESS;
+    VmTlbBatchInit(&batch, &PagingData->Data);
+    pEndAddress = (PVOID) AlignAddressUpper(PtrOffset(VirtualAddress, Size), PAGE_SIZE);
+
+    for (pCurrentPage = (PVOID) AlignAddressLower(VirtualAddress, PAGE_SIZE);
+         pCurrentPage < pEndAddress && SUCCEEDED(status);
+         pCurrentPage = PtrOffset(pCurrentPage, PAGE_SIZE))
+    {
+        BOOLEAN bShared;
+
+        RecRwSpinlockAcquireShared(&PagingData->Lock, &oldState);
+        pEntry = _VmGetLastLevelEntry(&PagingData->Data, pCurrentPage);
+        bShared = (pEntry != NULL && PteIsPresent(pEntry) && VMM_IS_COW_ENTRY(*((QWORD*)pEntry)));
+        RecRwSpinlockReleaseShared(&PagingData->Lock, oldState);
+
+        if (!bShared)
+        {
+            continue;
+        }
+
+        // the frame must be reserved without holding the paging lock, an
+        // eviction may need to lock the same paging structures
+        pa = _VmReserveFrame();
+        if (pa == NULL)
+        {
+            LOG_ERROR("No physical frame available to break COW at 0x%X\n", pCurrentPage);
+            status = STATUS_INSUFFICIENT_MEMORY;
+            break;
+        }
+
+        RecRwSpinlockAcquireExclusive(&PagingData->Lock, &oldState);
+
+        // the page may have been written (or unmapped) in the meantime
+        pEntry = _VmGetLastLevelEntry(&PagingData->Data, pCurrentPage);
+        if (pEntry != NULL && PteIsPresent(pEntry) && VMM_IS_COW_ENTRY(*((QWORD*)pEntry)))
+        {
+            status = _VmCopyOnWrite(pEntry, pCurrentPage, pa, &batch);
+        }
+        else
+        {
+            MmuReleaseMemory(pa, 1);
+            pa = NULL;
+        }
+
+        RecRwSpinlockReleaseExclusive(&PagingData->Lock, oldState);
+
+        // the other CPUs must stop reading the shared frame
+        VmTlbBatchFlush(&batch);
+
+        if (!SUCCEEDED(status))
+        {
+            LOG_FUNC_ERROR("_VmCopyOnWrite", status);
+            MmuReleaseMemory(pa, 1);
+            break;
+        }
+
+        if (pa != NULL && !PagingData->Data.KernelSpace)
+        {
+            VmSwapTrackResidentPage(PagingData, pCurrentPage, pa, FALSE);
+        }
+    }
+
+    return status;
+}
+
+static
+void
+_VmmMapDescribedRegion(
+    IN      PVOID                   BaseAddress,
+    IN      PMDL                    Mdl,
+    IN      PAGE_RIGHTS             Rights,
+    IN_OPT  PPAGING_LOCK_DATA       PagingData
+    )
+{
     QWORD currentOffset = 0;
 
     ASSERT(BaseAddress != NULL);
@@ -544,6 +1125,15 @@ VmmAllocRegionEx(
     // frames or it is backed up by a file, or it is not backed up by anything
     ASSERT((Mdl == NULL) || (FileObject == NULL));
 
+    // Shared file mappings are faulted in lazily and only in user address spaces: the writeback relies on the
+    // dirty bits being cleared and shot down on all the CPUs, for the kernel space only the local TLB is flushed
+    ASSERT(!IsBooleanFlagOn(AllocType, VMM_ALLOC_TYPE_SHARED_FILE)
+           || (FileObject != NULL
+               && !IsBooleanFlagOn(AllocType, VMM_ALLOC_TYPE_NOT_LAZY)
+               && VaSpace != NULL
+               && PagingData != NULL
+               && !PagingData->Data.KernelSpace));
+
     status = STATUS_SUCCESS;
     pBaseAddress = NULL;
     pa = NULL;
@@ -570,6 +1160,16 @@ VmmAllocRegionEx(
         }
         ASSERT(NULL != pBaseAddress);
 
+        if (IsBooleanFlagOn(AllocType, VMM_ALLOC_TYPE_SHARED_FILE))
+        {
+            status = VmFileMapRegister(pVaSpace, PagingData, pBaseAddress, alignedSize, FileObject);
+            if (!SUCCEEDED(status))
+            {
+                LOG_FUNC_ERROR("VmFileMapRegister", status);
+                __leave;
+            }
+        }
+
         if (IsBooleanFlagOn(AllocType, VMM_ALLOC_TYPE_NOT_LAZY))
         {
             ASSERT(IsBooleanFlagOn(AllocType, VMM_ALLOC_TYPE_COMMIT));
@@ -593,20 +1193,32 @@ VmmAllocRegionEx(
                 ASSERT(alignedSize / PAGE_SIZE <= MAX_DWORD);
                 DWORD noOfFrames = (DWORD)(alignedSize / PAGE_SIZE);
 
-                pa = PmmReserveMemory(noOfFrames);
+                // If the VA is 2MB aligned try to receive 2MB aligned frames as well, this
+                // way the whole region (except for the tail) can be mapped using large pages
+                if (IsAddressAligned(pBaseAddress, PAGE_2MB_SIZE) && alignedSize >= PAGE_2MB_SIZE)
+                {
+                    pa = PmmReserveAlignedMemory(noOfFrames, PAGE_2MB_SIZE);
+                }
+
+                if (NULL == pa)
+                {
+                    pa = PmmReserveMemory(noOfFrames);
+                }
+
                 if (NULL == pa)
                 {
                     LOG_ERROR("PmmReserverMemory failed!\n");
                     __leave;
                 }
 
-                MmuMapMemoryInternal(pa,
-                                     alignedSize,
-                                     Rights,
-                                     pBaseAddress,
-                                     TRUE,
-                                     Uncacheable,
-                                     PagingData
+                MmuMapMemoryInternalEx(pa,
+                                       alignedSize,
+                                       Rights,
+                                       pBaseAddress,
+                                       TRUE,
+                                       Uncacheable,
+                                       PagingData,
+                                       TRUE
                 );
 
                 // Check if the mapping is backed up by a file
@@ -664,7 +1276,7 @@ VmmAllocRegionEx(
 
                 if (pa != NULL)
                 {
-                    MmuUnmapMemoryEx(pAlignedAddress, (DWORD) alignedSize, TRUE, PagingData);
+                    MmuUnmapMemoryEx(pAlignedAddress, alignedSize, TRUE, PagingData);
                     pa = NULL;
                 }
             }
@@ -697,6 +1309,7 @@ VmmFreeRegionEx(
 {
     PVOID alignedAddress;
     QWORD alignedSize;
+    BOOLEAN bFileMapLocked;
 
     ASSERT(Address != NULL);
     ASSERT(IsBooleanFlagOn( FreeType, VMM_FREE_TYPE_RELEASE ) ^ IsBooleanFlagOn(FreeType, VMM_FREE_TYPE_DECOMMIT ));
@@ -706,6 +1319,10 @@ VmmFreeRegionEx(
     alignedAddress = NULL;
     alignedSize = 0;
 
+    // The dirty pages of shared file mappings must be written back before the frames are released and before
+    // the reservation closes the backing file
+    bFileMapLocked = (VaSpace != NULL) ? VmFileMapBeginUnmap(VaSpace, Address, Size, FreeType) : FALSE;
+
     VmReservationSpaceFreeRegion((VaSpace == NULL) ? &m_vmmData.VmmReservationSpace : VaSpace,
                                  Address,
                                  Size,
@@ -727,6 +1344,11 @@ VmmFreeRegionEx(
                          Release,
                          PagingData);
     }
+
+    if (bFileMapLocked)
+    {
+        VmFileMapEndUnmap();
+    }
 }
 
 BOOLEAN
@@ -744,15 +1366,28 @@ VmmSolvePageFault(
     BOOLEAN uncacheable;
     PFILE_OBJECT pBackingFile;
     QWORD fileOffset;
+    BOOLEAN bSharedFile;
     BOOLEAN bKernelAddress;
-    QWORD bytesReadFromFile;
+    QWORD faultEntry;
+    QWORD swapSlot;
+    BOOLEAN bFrameFilled;
+    BOOLEAN bCollidedFault;
+    VM_TLB_BATCH batch;
+    INTR_STATE oldState;
+    PPAGING_STATISTICS pStatistics;
+    volatile QWORD* pFaultCounter;
+    QWORD startTicks;
 
     ASSERT(INTR_OFF == CpuIntrGetState());
     ASSERT(PagingData != NULL);
 
+    startTicks = IomuGetSystemTicks(NULL);
+    pStatistics = &PagingData->Data.Statistics;
+
     // we will certainly not use the first virtual page of memory
     if (NULL == (PVOID) AlignAddressLower(FaultingAddress, PAGE_SIZE))
     {
+        _InterlockedIncrement64((volatile __int64*) &pStatistics->ProtectionFaults);
         return FALSE;
     }
 
@@ -761,11 +1396,13 @@ VmmSolvePageFault(
     if (bKernelAddress && !PagingData->Data.KernelSpace)
     {
         LOG_TRACE_VMM("User code should not access KM pages!\n");
+        _InterlockedIncrement64((volatile __int64*) &pStatistics->ProtectionFaults);
         return FALSE;
     }
     else if (!bKernelAddress && PagingData->Data.KernelSpace)
     {
         LOG_ERROR("Kernel code should not access UM pages!\n");
+        _InterlockedIncrement64((volatile __int64*) &pStatistics->ProtectionFaults);
         return FALSE;
     }
 
@@ -777,7 +1414,12 @@ VmmSolvePageFault(
     uncacheable = FALSE;
     pBackingFile = NULL;
     fileOffset = 0;
-    bytesReadFromFile = 0;
+    bSharedFile = FALSE;
+    faultEntry = 0;
+    swapSlot = VMM_INVALID_SWAP_SLOT;
+    bFrameFilled = FALSE;
+    bCollidedFault = FALSE;
+    pFaultCounter = &pStatistics->ProtectionFaults;
 
     // See if the VA is already committed and retrieve its description (the page rights with which it was mapped,
     // cacheability and for memory backed by files the FILE_OBJECT and corresponding offset in file)
@@ -787,7 +1429,8 @@ VmmSolvePageFault(
                                                      &pageRights,
                                                      &uncacheable,
                                                      &pBackingFile,
-                                                     &fileOffset);
+                                                     &fileOffset,
+                                                     &bSharedFile);
 
     __try
     {
@@ -798,66 +1441,202 @@ VmmSolvePageFault(
 
             // solve #PF
 
-            // 1. Reserve one frame of physical memory
-            pa = PmmReserveMemory(1);
-            ASSERT(NULL != pa);
-
             alignedAddress = (PVOID)AlignAddressLower(FaultingAddress, PAGE_SIZE);
 
-            // 2. Map the aligned faulting address to the newly acquired physical frame
-            MmuMapMemoryInternal(pa,
-                                 PAGE_SIZE,
-                                 pageRights,
-                                 alignedAddress,
-                                 TRUE,
-                                 uncacheable,
-                                 PagingData
-                                 );
-
-            // 3. If the virtual address is backed by a file read its contents
-            if (pBackingFile != NULL)
+            // 1. If the page is being evicted its frame is still intact, the eviction is
+            // canceled by simply marking the PTE present again
+            if (_VmTryRestoreEvictedPage(PagingData, alignedAddress))
+            {
+                pFaultCounter = &pStatistics->SwapInFaults;
+                bSolvedPageFault = TRUE;
+                __leave;
+            }
+
+            // 2. Reads of anonymous user pages which were never written are solved by mapping
+            // the shared zero frame, a private frame is allocated only on the first write
+            if (_VmTryMapZeroFrame(PagingData, alignedAddress, RightsRequested, pageRights, uncacheable, pBackingFile))
+            {
+                pFaultCounter = &pStatistics->DemandZeroFaults;
+                bSolvedPageFault = TRUE;
+                __leave;
+            }
+
+            // 3. Reserve one frame of physical memory, if there is none left
+            // evict a user page to make room
+            pa = _VmReserveFrame();
+            if (NULL == pa)
+            {
+                LOG_ERROR("No physical frame available to solve #PF at 0x%X\n", FaultingAddress);
+                __leave;
+            }
+
+            // 4. If the page was previously evicted read it back from the swap file, if it
+            // was shared copy-on-write copy its contents into the new frame
+            if (!PagingData->Data.KernelSpace)
             {
-                LOGL("Will read data from file 0x%X and offset 0x%X\n", pBackingFile, fileOffset);
+                PT_ENTRY* pEntry;
+
+                VmTlbBatchInit(&batch, &PagingData->Data);
+
+                RecRwSpinlockAcquireExclusive(&PagingData->Lock, &oldState);
+
+                pEntry = _VmGetLastLevelEntry(&PagingData->Data, alignedAddress);
+
+                // the fresh frame is mapped only if the entry is still the same
+                faultEntry = (pEntry != NULL) ? *((QWORD*)pEntry) : 0;
+
+                if (pEntry != NULL && VMM_IS_SWAP_IN_PROGRESS_ENTRY(*((QWORD*)pEntry)))
+                {
+                    // another thread is reading the page back, the access is
+                    // retried until the page is mapped
+                    bCollidedFault = TRUE;
+                }
+                else if (pEntry != NULL && VMM_IS_SWAP_ENTRY(*((QWORD*)pEntry)))
+                {
+                    // the slot is read after the paging lock is released
+                    swapSlot = VMM_SWAP_SLOT_FROM_ENTRY(*((QWORD*)pEntry));
+                    *((QWORD*)pEntry) |= VMM_SWAP_ENTRY_IN_PROGRESS_BIT;
+                }
+                else if (pEntry != NULL
+                         && ((PteIsPresent(pEntry) && !VMM_IS_COW_ENTRY(*((QWORD*)pEntry))) || VMM_IS_TRANSITION_ENTRY(*((QWORD*)pEntry))))
+                {
+                    // another CPU solved the fault meanwhile or the page started
+                    // being evicted, a fresh frame must never be mapped over it
+                    bCollidedFault = TRUE;
+                }
+                else if (pEntry != NULL && PteIsPresent(pEntry) && VMM_IS_COW_ENTRY(*((QWORD*)pEntry)))
+                {
+                    status = _VmCopyOnWrite(pEntry, alignedAddress, pa, &batch);
+                    if (SUCCEEDED(status))
+                    {
+                        pFaultCounter = &pStatistics->CopyOnWriteFaults;
+                        bFrameFilled = TRUE;
+                    }
+                    else
+                    {
+                        LOG_FUNC_ERROR("_VmCopyOnWrite", status);
+                    }
+                }
+
+                RecRwSpinlockReleaseExclusive(&PagingData->Lock, oldState);
+
+                VmTlbBatchFlush(&batch);
+
+                if (swapSlot != VMM_INVALID_SWAP_SLOT)
+                {
+                    status = _VmSwapInPage(PagingData, alignedAddress, swapSlot, pa, pageRights, uncacheable, &bFrameFilled);
+                    if (!SUCCEEDED(status))
+                    {
+                        LOG_FUNC_ERROR("_VmSwapInPage", status);
+                    }
+                    else if (!bFrameFilled)
+                    {
+                        // the page was unmapped while it was read, the access
+                        // is retried and checked against the reservations again
+                        bCollidedFault = TRUE;
+                    }
+                    else
+                    {
+                        pFaultCounter = &pStatistics->SwapInFaults;
+                    }
+                }
+
+                if (!SUCCEEDED(status) || bCollidedFault)
+                {
+                    MmuReleaseMemory(pa, 1);
+                    bSolvedPageFault = bCollidedFault;
+                    __leave;
+                }
+            }
 
-                status = IoReadFile(pBackingFile,
-                                    PAGE_SIZE,
-                                    &fileOffset,
-                                    alignedAddress,
-                                    &bytesReadFromFile);
+            // The pages of shared file mappings must be mapped clean, writing the file contents through the
+            // user VA would set the dirty bit and the page would be written back without being modified
+            if (!bFrameFilled && bSharedFile)
+            {
+                status = _VmFillFrame(pBackingFile, fileOffset, pa);
                 if (!SUCCEEDED(status))
                 {
-                    LOG_FUNC_ERROR("IoReadFile", status);
+                    LOG_FUNC_ERROR("_VmFillFrame", status);
+                    MmuReleaseMemory(pa, 1);
+                    __leave;
+                }
+
+                // another CPU may have mapped the page while the file was read, its
+                // frame may already be dirty and must not be replaced
+                if (!_VmTryMapFilledFrame(PagingData, alignedAddress, faultEntry, pa, pageRights, uncacheable))
+                {
+                    MmuReleaseMemory(pa, 1);
+                    bCollidedFault = TRUE;
+                    bSolvedPageFault = TRUE;
                     __leave;
                 }
 
-                LOGL("Bytes read 0x%X\n", bytesReadFromFile);
-                ASSERT(bytesReadFromFile <= PAGE_SIZE);
+                pFaultCounter = &pStatistics->FileBackedFaults;
+                bFrameFilled = TRUE;
             }
 
-            // 4. Zero the rest of the memory (in case the remaining file size was smaller than a page
-            /// TODO: check if this is really necessary (we have a ZERO worker thread already!)
-            if (bytesReadFromFile != PAGE_SIZE)
+            if (!bFrameFilled)
             {
-                /// TODO: Check if we really need to remove the WP (I'd rather not do this)
-                /// According to the Intel manual the WP flag has nothing to do with accessing UM pages
-                /// It is more generic, if WP is set => supervisor accesses can write to any virtual address
-                /// even if it is read-only
-                __writecr0(__readcr0() & ~CR0_WP);
-                memzero(PtrOffset(alignedAddress, bytesReadFromFile), PAGE_SIZE - (DWORD)bytesReadFromFile);
-                __writecr0(__readcr0() | CR0_WP);
+                pFaultCounter = (pBackingFile != NULL) ? &pStatistics->FileBackedFaults : &pStatistics->DemandZeroFaults;
+
+                // 5. Fill the frame with the file contents or with zeroes before it is mapped,
+                // no other CPU may access the page while it is partially filled
+                status = _VmFillFrame(pBackingFile, fileOffset, pa);
+                if (!SUCCEEDED(status))
+                {
+                    LOG_FUNC_ERROR("_VmFillFrame", status);
+                    MmuReleaseMemory(pa, 1);
+                    __leave;
+                }
+
+                // 6. Map the aligned faulting address to the filled frame, if another CPU
+                // solved the fault meanwhile its page (and any write to it) is kept
+                if (!_VmTryMapFilledFrame(PagingData, alignedAddress, faultEntry, pa, pageRights, uncacheable))
+                {
+                    MmuReleaseMemory(pa, 1);
+                    bCollidedFault = TRUE;
+                    bSolvedPageFault = TRUE;
+                    __leave;
+                }
             }
 
-            if (NULL != pCpu)
+            // 7. User pages may be evicted when physical memory runs out, the pages read from swap
+            // are found nowhere else once their slot is freed => these must always be written back
+            // The pages of shared file mappings are written back to their file and are never evicted
+            if (!PagingData->Data.KernelSpace && !bSharedFile)
             {
-                // solved another page fault :)
-                pCpu->PageFaults = pCpu->PageFaults + 1;
+                VmSwapTrackResidentPage(PagingData, alignedAddress, pa, swapSlot != VMM_INVALID_SWAP_SLOT);
             }
+
             bSolvedPageFault = TRUE;
         }
     }
     __finally
     {
+        QWORD serviceTicks;
+
+        if (bSolvedPageFault && NULL != pCpu)
+        {
+            // solved another page fault :)
+            pCpu->PageFaults = pCpu->PageFaults + 1;
+        }
+
+        // a fault which could not be solved is an access violation no matter
+        // how far it got
+        if (!bSolvedPageFault)
+        {
+            pFaultCounter = &pStatistics->ProtectionFaults;
+        }
+
+        // the page of a collided fault is accounted by the fault which maps it
+        if (!bCollidedFault || !bSolvedPageFault)
+        {
+            _InterlockedIncrement64((volatile __int64*) pFaultCounter);
+        }
 
+        serviceTicks = IomuGetSystemTicks(NULL) - startTicks;
+        _InterlockedExchangeAdd64((volatile __int64*) &pStatistics->FaultServiceTicks, serviceTicks);
+        _VmUpdateMaximum(&pStatistics->MaxFaultServiceTicks, serviceTicks);
     }
 
     return bSolvedPageFault;
@@ -961,16 +1740,32 @@ VmmCreateVirtualAddressSpace(
 void
 VmmDestroyVirtualAddressSpace(
     _Pre_valid_ _Post_ptr_invalid_
-        struct _VMM_RESERVATION_SPACE*      ReservationSpace
+        struct _VMM_RESERVATION_SPACE*      ReservationSpace,
+    IN_OPT  PPAGING_LOCK_DATA               PagingData
     )
 {
+    PVOID pCurrentVa;
+    PVOID pStartVa;
+    QWORD size;
+
     ASSERT(ReservationSpace != NULL);
 
-    if (ReservationSpace->ReservationList != NULL)
+    if (PagingData != NULL)
     {
-        /// TODO: go through each reservation belonging to the process and
-        /// release all the physical frames used (else we have physical memory leaks :) - not fun)
+        // only the committed pages which were accessed have frames behind
+        // them => walking the paging tables finds exactly the frames to
+        // release, MmuUnmapMemoryEx releases them a TLB batch at a time
+        pCurrentVa = NULL;
+        while (SUCCEEDED(VmReservationSpaceGetNextReservation(ReservationSpace, pCurrentVa, &pStartVa, &size)))
+        {
+            MmuUnmapMemoryEx(pStartVa, size, TRUE, PagingData);
+
+            pCurrentVa = PtrOffset(pStartVa, size);
+        }
+    }
 
+    if (ReservationSpace->ReservationList != NULL)
+    {
         VmmFreeRegion(ReservationSpace->ReservationList, 0, VMM_FREE_TYPE_RELEASE);
         ReservationSpace->ReservationList = NULL;
     }
@@ -1022,6 +1817,38 @@ VmmIsBufferValid(
     return STATUS_SUCCESS;
 }
 
+void
+VmmRetrieveStatistics(
+    IN          PPAGING_LOCK_DATA                   PagingData,
+    IN_OPT      PVMM_RESERVATION_SPACE              ReservationSpace,
+    OUT         PPROCESS_MEMORY_STATISTICS          Statistics
+    )
+{
+    PPAGING_STATISTICS pStatistics;
+
+    ASSERT(PagingData != NULL);
+    ASSERT(Statistics != NULL);
+
+    pStatistics = &PagingData->Data.Statistics;
+
+    // the counters are read one by one => they may not be consistent with
+    // each other if faults are taken concurrently
+    Statistics->ResidentBytes = pStatistics->ResidentPages * PAGE_SIZE;
+    Statistics->PeakResidentBytes = pStatistics->PeakResidentPages * PAGE_SIZE;
+    Statistics->CommittedBytes = VmReservationSpaceGetCommittedSize((ReservationSpace == NULL) ?
+                                                                    &m_vmmData.VmmReservationSpace :
+                                                                    ReservationSpace);
+
+    Statistics->DemandZeroFaults = pStatistics->DemandZeroFaults;
+    Statistics->FileBackedFaults = pStatistics->FileBackedFaults;
+    Statistics->SwapInFaults = pStatistics->SwapInFaults;
+    Statistics->CopyOnWriteFaults = pStatistics->CopyOnWriteFaults;
+    Statistics->ProtectionFaults = pStatistics->ProtectionFaults;
+
+    Statistics->FaultServiceTimeUs = IomuTickCountToUs(pStatistics->FaultServiceTicks);
+    Statistics->MaxFaultServiceTimeUs = IomuTickCountToUs(pStatistics->MaxFaultServiceTicks);
+}
+
 static
 void
 _VmSetupPagingStructure(
@@ -1048,7 +1875,108 @@ _VmSetupPagingStructure(
     PageInvalidateTlb((PVOID)PA2VA(physicalAddr));
 
     // Zero the current paging structure entry => we cannot get stray memory accesses
-    memzero((PVOID)PA2VA(physicalAddr), PAGE_SIZE);
+    pagezero((PVOID)PA2VA(physicalAddr), PAGE_SIZE);
+}
+
+static
+void
+_VmDemoteLargePage(
+    IN      PPAGING_DATA            PagingData,
+    IN      PVOID                   PageTable,
+    IN      PVOID                   VirtualAddress
+    )
+{
+    PD_ENTRY_2MB* pLargeEntry;
+    PT_ENTRY* pPageTable;
+    PHYSICAL_ADDRESS largePagePa;
+    PHYSICAL_ADDRESS pageTablePa;
+    PTE_MAP_FLAGS pageFlags = { 0 };
+    PTE_MAP_FLAGS tableFlags = { 0 };
+
+    ASSERT(NULL != PagingData);
+    ASSERT(NULL != PageTable);
+    ASSERT(PteIsLargePage(PageTable));
+
+    pLargeEntry = (PD_ENTRY_2MB*) PageTable;
+    largePagePa = PteLargePageGetPhysicalAddress(PageTable);
+
+    pageFlags.Writable = (WORD) pLargeEntry->ReadWrite;
+    pageFlags.Executable = !pLargeEntry->XD;
+    pageFlags.UserAccess = (WORD) pLargeEntry->UserSupervisor;
+    pageFlags.GlobalPage = (WORD) pLargeEntry->Global;
+    pageFlags.PatIndex = (WORD) ((pLargeEntry->PAT << 2) | (pLargeEntry->PCD << 1) | pLargeEntry->PWT);
+
+    // populate the whole page table before linking it in the PD, the processor
+    // must never see a half filled table
+    pageTablePa = _VmRetrieveNextPhysicalAddressForPagingStructure(PagingData);
+    pPageTable = (PT_ENTRY*) PA2VA(pageTablePa);
+
+    for (DWORD i = 0; i < PAGE_2MB_SIZE / PAGE_SIZE; ++i)
+    {
+        PteMap(&pPageTable[i], (PHYSICAL_ADDRESS) PtrOffset(largePagePa, (QWORD) i * PAGE_SIZE), pageFlags);
+
+        // keep the A/D bits so we don't lose track of the pages already written
+        pPageTable[i].Accessed = pLargeEntry->Accessed;
+        pPageTable[i].Dirty = pLargeEntry->Dirty;
+    }
+
+    tableFlags.Writable = TRUE;
+    tableFlags.Executable = TRUE;
+    tableFlags.PagingStructure = TRUE;
+    tableFlags.UserAccess = !PagingData->KernelSpace;
+
+    PteMap(PageTable, pageTablePa, tableFlags);
+
+    // invalidating any address inside the large page invalidates the whole 2MB translation
+    PageInvalidateTlb((PVOID) AlignAddressLower(VirtualAddress, PAGE_2MB_SIZE));
+
+    LOG_TRACE_VMM("Split large page at VA 0x%X PA 0x%X\n",
+                  AlignAddressLower(VirtualAddress, PAGE_2MB_SIZE), largePagePa);
+}
+
+static
+void
+_VmBuildPageTable(
+    IN      PVMM_MAP_UNMAP_PAGE_WALK_CONTEXT    Context,
+    IN      PVOID                               PageDirectoryEntry,
+    IN      PVOID                               VirtualAddress,
+    IN      PHYSICAL_ADDRESS                    PhysicalAddress
+    )
+{
+    PT_ENTRY* pPageTable;
+    PHYSICAL_ADDRESS pageTablePa;
+    PTE_MAP_FLAGS pageFlags = { 0 };
+    PTE_MAP_FLAGS tableFlags = { 0 };
+
+    ASSERT(NULL != Context);
+    ASSERT(NULL != PageDirectoryEntry);
+    ASSERT(!PteIsPresent(PageDirectoryEntry));
+    ASSERT(IsAddressAligned(VirtualAddress, PAGE_2MB_SIZE));
+
+    pageFlags.Executable = IsBooleanFlagOn(Context->PageRights, PAGE_RIGHTS_EXECUTE);
+    pageFlags.Writable = IsBooleanFlagOn(Context->PageRights, PAGE_RIGHTS_WRITE);
+    pageFlags.PatIndex = Context->Uncacheable ? m_vmmData.UncacheableIndex : m_vmmData.WriteBackIndex;
+    pageFlags.GlobalPage = Context->PagingData->KernelSpace;
+    pageFlags.UserAccess = !Context->PagingData->KernelSpace;
+
+    // all the entries are written => unlike _VmSetupPagingStructure there is
+    // no need to zero the frame first
+    pageTablePa = _VmRetrieveNextPhysicalAddressForPagingStructure(Context->PagingData);
+    pPageTable = (PT_ENTRY*) PA2VA(pageTablePa);
+
+    for (DWORD i = 0; i < VMM_ENTRIES_PER_PAGING_STRUCTURE; ++i)
+    {
+        PteMap(&pPageTable[i], (PHYSICAL_ADDRESS) PtrOffset(PhysicalAddress, (QWORD) i * PAGE_SIZE), pageFlags);
+    }
+
+    tableFlags.Writable = TRUE;
+    tableFlags.Executable = TRUE;
+    tableFlags.PagingStructure = TRUE;
+    tableFlags.UserAccess = !Context->PagingData->KernelSpace;
+
+    // the table is linked in the PD only after it is complete, the PDE was not
+    // present => no translation of the range may be cached
+    PteMap(PageDirectoryEntry, pageTablePa, tableFlags);
 }
 
 static
@@ -1103,14 +2031,15 @@ _VmWalkPagingTables(
     IN_OPT  PVOID                       Context
     )
 {
-    // we may need to map multiple pages => we iterate until we map all the
-    // addresses
+    QWORD stepSize;
+
+    // the paging structures are walked from the PML4 once for each page table,
+    // the entries of the page table are then visited one after the other
     for(QWORD offset = 0;
         offset < Size;
-        offset = offset + PAGE_SIZE)
+        offset = offset + stepSize)
     {
         WORD offsets[4];
-        BOOLEAN bContinue;
         PVOID currentVa;
         PHYSICAL_ADDRESS curStructPa;
 
@@ -1122,7 +2051,7 @@ _VmWalkPagingTables(
         offsets[2] = MASK_PDE_OFFSET(currentVa);
         offsets[3] = MASK_PTE_OFFSET(currentVa);
 
-        bContinue = FALSE;
+        stepSize = PAGE_SIZE;
 
         curStructPa = (PHYSICAL_ADDRESS)(Cr3.Pcide.PhysicalAddress << SHIFT_FOR_PHYSICAL_ADDR);
 
@@ -1142,21 +2071,46 @@ _VmWalkPagingTables(
                               i,
                               Context))
             {
-                bContinue = TRUE;
+                // the callback is done with the whole range described by the entry
+                // (e.g. it is not present or it was unmapped)
+                stepSize = VMM_SIZE_DESCRIBED_BY_ENTRY(i) - AddressOffset(currentVa, VMM_SIZE_DESCRIBED_BY_ENTRY(i));
+                break;
+            }
+
+            if (i == PAGING_TABLES_LAST_LEVEL)
+            {
+                QWORD entriesLeft;
+
+                entriesLeft = VMM_ENTRIES_PER_PAGING_STRUCTURE - offsets[i-1];
+                if (entriesLeft > (Size - offset) / PAGE_SIZE)
+                {
+                    entriesLeft = (Size - offset) / PAGE_SIZE;
+                }
+
+                // on the last level returning FALSE only means the entry was handled
+                for (DWORD j = 1; j < entriesLeft; ++j)
+                {
+                    WalkCallback(Cr3,
+                                 &pCurrentEntry[j],
+                                 PtrOffset(currentVa, (QWORD) j * PAGE_SIZE),
+                                 i,
+                                 Context);
+                }
+
+                stepSize = entriesLeft * PAGE_SIZE;
                 break;
             }
 
-            if (i != PAGING_TABLES_LAST_LEVEL)
+            if ((i == PAGING_TABLES_LAST_LEVEL - 1) && PteIsLargePage(pCurrentEntry))
             {
-                ASSERT(((PD_ENTRY_PT*)pCurrentEntry)->PageSize == 0);
+                // the entry maps a 2MB page => there are no more paging structures to walk
+                stepSize = PAGE_2MB_SIZE - AddressOffset(currentVa, PAGE_2MB_SIZE);
+                break;
             }
 
-            curStructPa = PteGetPhysicalAddress(pCurrentEntry);
-        }
+            ASSERT(((PD_ENTRY_PT*)pCurrentEntry)->PageSize == 0);
 
-        if (bContinue)
-        {
-            continue;
+            curStructPa = PteGetPhysicalAddress(pCurrentEntry);
         }
     }
 }
@@ -1172,6 +2126,7 @@ BOOLEAN
     )
 {
     PVMM_MAP_UNMAP_PAGE_WALK_CONTEXT pPageContext;
+    PHYSICAL_ADDRESS physAddr;
 
     UNREFERENCED_PARAMETER(Cr3);
 
@@ -1182,29 +2137,103 @@ BOOLEAN
     pPageContext = (PVMM_MAP_UNMAP_PAGE_WALK_CONTEXT) Context;
     ASSERT(pPageContext != NULL);
 
-    if (PteIsPresent(PageTable) &&
-        !((PageLevel == PAGING_TABLES_LAST_LEVEL) && pPageContext->Invalidate))
-    {
-        return TRUE;
-    }
+    physAddr = (PHYSICAL_ADDRESS)(PtrOffset(pPageContext->PhysicalAddressBase,
+                                  PtrDiff(VirtualAddress, pPageContext->VirtualAddressBase)));
 
-    if (PageLevel == PAGING_TABLES_LAST_LEVEL)
+    if (PageLevel == PAGING_TABLES_LAST_LEVEL - 1)
     {
-        PHYSICAL_ADDRESS physAddr = (PHYSICAL_ADDRESS)(PtrOffset(pPageContext->PhysicalAddressBase,
-                                                       PtrDiff(VirtualAddress, pPageContext->VirtualAddressBase)));
-        PTE_MAP_FLAGS flags = { 0 };
+        BOOLEAN bCanMapLargePage = _VmCanMapLargePage(pPageContext, VirtualAddress, physAddr);
 
-        flags.Executable = IsBooleanFlagOn(pPageContext->PageRights, PAGE_RIGHTS_EXECUTE);
-        flags.Writable = IsBooleanFlagOn(pPageContext->PageRights, PAGE_RIGHTS_WRITE);
-        flags.PatIndex = pPageContext->Uncacheable ? m_vmmData.UncacheableIndex : m_vmmData.WriteBackIndex;
-        flags.GlobalPage = pPageContext->PagingData->KernelSpace;
-        flags.UserAccess = !pPageContext->PagingData->KernelSpace;
+        if (PteIsLargePage(PageTable))
+        {
+            if (!pPageContext->Invalidate)
+            {
+                // the walk will skip the whole large page
+                return TRUE;
+            }
 
-        PteMap(PageTable, physAddr, flags);
+            if (!bCanMapLargePage)
+            {
+                // we need to remap only a part of the large page, split it and
+                // continue the walk through the newly created page table
+                _VmDemoteLargePage(pPageContext->PagingData, PageTable, VirtualAddress);
+                return TRUE;
+            }
+        }
+        else if (PteIsPresent(PageTable))
+        {
+            // we already have a page table here, the 4KB pages will be mapped through it
+            bCanMapLargePage = FALSE;
+        }
+        else if (!bCanMapLargePage
+                 && IsAddressAligned(VirtualAddress, PAGE_2MB_SIZE)
+                 && _VmBytesLeftInRange(pPageContext, VirtualAddress) >= PAGE_2MB_SIZE)
+        {
+            // the page table will be completely filled => build it in one go
+            // instead of zeroing it and mapping each page separately
+            _VmBuildPageTable(pPageContext, PageTable, VirtualAddress, physAddr);
+            _VmAccountResidentPages(pPageContext->PagingData, VMM_ENTRIES_PER_PAGING_STRUCTURE);
 
-        PageInvalidateTlb(VirtualAddress);
+            // the walk will skip the 2MB described by the table
+            return FALSE;
+        }
+
+        if (bCanMapLargePage)
+        {
+            PTE_MAP_FLAGS flags = { 0 };
+
+            flags.Executable = IsBooleanFlagOn(pPageContext->PageRights, PAGE_RIGHTS_EXECUTE);
+            flags.Writable = IsBooleanFlagOn(pPageContext->PageRights, PAGE_RIGHTS_WRITE);
+            flags.PatIndex = pPageContext->Uncacheable ? m_vmmData.UncacheableIndex : m_vmmData.WriteBackIndex;
+            flags.GlobalPage = pPageContext->PagingData->KernelSpace;
+            flags.UserAccess = !pPageContext->PagingData->KernelSpace;
+            flags.LargePage = TRUE;
+
+            if (!PteIsPresent(PageTable))
+            {
+                _VmAccountResidentPages(pPageContext->PagingData, PAGE_2MB_SIZE / PAGE_SIZE);
+            }
+
+            PteMap(PageTable, physAddr, flags);
+
+            // any address inside the large page invalidates the whole translation
+            _VmInvalidatePage(pPageContext->Batch, VirtualAddress);
+
+            // the walk will see the PS flag and will not descend any further
+            return TRUE;
+        }
+    }
 
-        /// TODO: signal other processors to invalidate the mapping
+    if (PteIsPresent(PageTable) &&
+        !((PageLevel == PAGING_TABLES_LAST_LEVEL) && pPageContext->Invalidate))
+    {
+        return TRUE;
+    }
+
+    if (PageLevel == PAGING_TABLES_LAST_LEVEL)
+    {
+        PTE_MAP_FLAGS flags = { 0 };
+        BOOLEAN bWasPresent = PteIsPresent(PageTable);
+
+        flags.Executable = IsBooleanFlagOn(pPageContext->PageRights, PAGE_RIGHTS_EXECUTE);
+        flags.Writable = IsBooleanFlagOn(pPageContext->PageRights, PAGE_RIGHTS_WRITE);
+        flags.PatIndex = pPageContext->Uncacheable ? m_vmmData.UncacheableIndex : m_vmmData.WriteBackIndex;
+        flags.GlobalPage = pPageContext->PagingData->KernelSpace;
+        flags.UserAccess = !pPageContext->PagingData->KernelSpace;
+
+        PteMap(PageTable, physAddr, flags);
+
+        // not present entries are never cached => only a replaced mapping
+        // must be removed from the TLBs of the other CPUs
+        if (bWasPresent)
+        {
+            _VmInvalidatePage(pPageContext->Batch, VirtualAddress);
+        }
+        else
+        {
+            PageInvalidateTlb(VirtualAddress);
+            _VmAccountResidentPages(pPageContext->PagingData, 1);
+        }
     }
     else
     {
@@ -1237,25 +2266,85 @@ BOOLEAN
     pPageContext = (PVMM_MAP_UNMAP_PAGE_WALK_CONTEXT) Context;
     ASSERT(pPageContext != NULL);
 
+    if (pPageContext->StopAddress != NULL)
+    {
+        return FALSE;
+    }
+
     if (!PteIsPresent(PageTable))
     {
+        if ((PageLevel == PAGING_TABLES_LAST_LEVEL) && VMM_IS_SWAP_ENTRY(*((QWORD*)PageTable)))
+        {
+            // nobody can reach the contents of the slot after the entry is gone,
+            // the slot of a page being read back is freed by the faulting thread
+            if (!VMM_IS_SWAP_IN_PROGRESS_ENTRY(*((QWORD*)PageTable)))
+            {
+                VmSwapFreeSlot(VMM_SWAP_SLOT_FROM_ENTRY(*((QWORD*)PageTable)));
+            }
+
+            PteUnmap(PageTable);
+        }
+        else if ((PageLevel == PAGING_TABLES_LAST_LEVEL) && VMM_IS_TRANSITION_ENTRY(*((QWORD*)PageTable)))
+        {
+            // the frame belongs to the eviction in progress which also takes
+            // care of flushing the TLBs
+            PteUnmap(PageTable);
+            _VmAccountResidentPages(pPageContext->PagingData, -1);
+        }
+
         return FALSE;
     }
 
+    if (pPageContext->ReleaseMemory
+        && ((PageLevel == PAGING_TABLES_LAST_LEVEL) || ((PageLevel == PAGING_TABLES_LAST_LEVEL - 1) && PteIsLargePage(PageTable)))
+        && VmTlbBatchIsFull(pPageContext->Batch))
+    {
+        // the rest of the range is unmapped after the caller flushes the batch
+        pPageContext->StopAddress = VirtualAddress;
+        return FALSE;
+    }
+
+    if ((PageLevel == PAGING_TABLES_LAST_LEVEL - 1) && PteIsLargePage(PageTable))
+    {
+        if (IsAddressAligned(VirtualAddress, PAGE_2MB_SIZE)
+            && _VmBytesLeftInRange(pPageContext, VirtualAddress) >= PAGE_2MB_SIZE)
+        {
+            PHYSICAL_ADDRESS pa = PteLargePageGetPhysicalAddress(PageTable);
+
+            // the whole large page is unmapped
+            PteUnmap(PageTable);
+            _VmAccountResidentPages(pPageContext->PagingData, -(INT64)(PAGE_2MB_SIZE / PAGE_SIZE));
+
+            VmTlbBatchAddPage(pPageContext->Batch, VirtualAddress);
+
+            if (pPageContext->ReleaseMemory)
+            {
+                VmTlbBatchReleaseFrames(pPageContext->Batch, pa, PAGE_2MB_SIZE / PAGE_SIZE);
+            }
+
+            // nothing left to walk, the walk will skip to the next large page
+            return FALSE;
+        }
+
+        // only a part of the large page is unmapped => split it and unmap the
+        // 4KB pages from the newly created page table
+        _VmDemoteLargePage(pPageContext->PagingData, PageTable, VirtualAddress);
+    }
+
     if (PageLevel == PAGING_TABLES_LAST_LEVEL)
     {
         PHYSICAL_ADDRESS pa = PteGetPhysicalAddress(PageTable);
 
         PteUnmap(PageTable);
+        _VmAccountResidentPages(pPageContext->PagingData, -1);
 
-        PageInvalidateTlb(VirtualAddress);
+        VmTlbBatchAddPage(pPageContext->Batch, VirtualAddress);
 
-        if (pPageContext->ReleaseMemory)
+        // the zero frame is shared by all the pages which were never written
+        if (pPageContext->ReleaseMemory && pa != m_vmmData.ZeroFrame)
         {
-            MmuReleaseMemory(pa, 1);
+            VmTlbBatchReleaseFrames(pPageContext->Batch, pa, 1);
         }
-
-        /// TODO: signal other processors to invalidate the mapping
     }
 
     // continue iteration
@@ -1362,12 +2451,395 @@ BOOLEAN
                 // processor not setting that bit in response to a subsequent write to a linear address whose
                 // translation uses the entry.Software cannot interpret the bit being clear as an indication
                 // that such a write has not occurred.
-                PageInvalidateTlb(VirtualAddress);
 
-                /// TODO: signal other processors to invalidate the mapping
+                // The other CPUs are not signaled: clearing the accessed bit needs only an optional
+                // invalidation and the swap clock tolerates a page looking idle while it is used on
+                // another CPU, the eviction flushes all the TLBs before the contents are captured.
+                PageInvalidateTlb(VirtualAddress);
             }
         }
     }
 
     return bContinue;
-}
\ No newline at end of file
+}
+
+static
+BOOLEAN
+(__cdecl _VmRetrieveLastLevelEntry)(
+    IN      PML4                    Cr3,
+    IN      PVOID                   PageTable,
+    IN      PVOID                   VirtualAddress,
+    IN      BYTE                    PageLevel,
+    IN_OPT  PVOID                   Context
+    )
+{
+    PVMM_RETRIEVE_ENTRY_PAGE_WALK_CONTEXT pPageContext;
+
+    UNREFERENCED_PARAMETER(Cr3);
+    UNREFERENCED_PARAMETER(VirtualAddress);
+
+    ASSERT(PageTable != NULL);
+    ASSERT(PAGING_TABLES_FIRST_LEVEL <= PageLevel && PageLevel <= PAGING_TABLES_LAST_LEVEL);
+
+    pPageContext = (PVMM_RETRIEVE_ENTRY_PAGE_WALK_CONTEXT) Context;
+    ASSERT(pPageContext != NULL);
+
+    if (PageLevel == PAGING_TABLES_LAST_LEVEL)
+    {
+        // the entry may also be not present (i.e. a swapped out page)
+        pPageContext->Entry = (PT_ENTRY*) PageTable;
+        return FALSE;
+    }
+
+    // stop on missing paging structures and on large pages
+    return PteIsPresent(PageTable) && !PteIsLargePage(PageTable);
+}
+
+static
+PT_ENTRY*
+_VmGetLastLevelEntry(
+    IN      PPAGING_DATA            PagingData,
+    IN      PVOID                   VirtualAddress
+    )
+{
+    VMM_RETRIEVE_ENTRY_PAGE_WALK_CONTEXT ctx = { 0 };
+    PML4 cr3;
+
+    ASSERT(PagingData != NULL);
+
+    cr3.Raw = (QWORD) PagingData->BasePhysicalAddress;
+
+    _VmWalkPagingTables(cr3,
+                        VirtualAddress,
+                        PAGE_SIZE,
+                        _VmRetrieveLastLevelEntry,
+                        &ctx);
+
+    return ctx.Entry;
+}
+
+static
+PTR_SUCCESS
+PHYSICAL_ADDRESS
+_VmReserveFrame(
+    void
+    )
+{
+    PHYSICAL_ADDRESS pa;
+
+    pa = PmmReserveMemory(1);
+    if (pa == NULL)
+    {
+        pa = VmSwapEvictPage();
+    }
+
+    return pa;
+}
+
+static
+BOOLEAN
+_VmTryMapZeroFrame(
+    IN      PPAGING_LOCK_DATA       PagingData,
+    IN      PVOID                   VirtualAddress,
+    IN      PAGE_RIGHTS             RightsRequested,
+    IN      PAGE_RIGHTS             PageRights,
+    IN      BOOLEAN                 Uncacheable,
+    IN_OPT  PFILE_OBJECT            BackingFile
+    )
+{
+    PT_ENTRY* pEntry;
+    BOOLEAN bMapped;
+    INTR_STATE oldState;
+
+    ASSERT(PagingData != NULL);
+    ASSERT(IsAddressAligned(VirtualAddress, PAGE_SIZE));
+
+    // kernel buffers may be handed to devices by their physical addresses
+    // => kernel memory always gets private frames
+    if (PagingData->Data.KernelSpace || m_vmmData.ZeroFrame == NULL)
+    {
+        return FALSE;
+    }
+
+    if (IsBooleanFlagOn(RightsRequested, PAGE_RIGHTS_WRITE) || BackingFile != NULL || Uncacheable)
+    {
+        return FALSE;
+    }
+
+    bMapped = FALSE;
+
+    RecRwSpinlockAcquireExclusive(&PagingData->Lock, &oldState);
+
+    // only pages which were never mapped, the page tables may not exist yet
+    pEntry = _VmGetLastLevelEntry(&PagingData->Data, VirtualAddress);
+    if (pEntry == NULL || *((QWORD*)pEntry) == 0)
+    {
+        MmuMapMemoryInternal(m_vmmData.ZeroFrame,
+                             PAGE_SIZE,
+                             PageRights & ~PAGE_RIGHTS_WRITE,
+                             VirtualAddress,
+                             TRUE,
+                             FALSE,
+                             PagingData
+                             );
+
+        // read-only pages keep the zero frame forever
+        if (IsBooleanFlagOn(PageRights, PAGE_RIGHTS_WRITE))
+        {
+            pEntry = _VmGetLastLevelEntry(&PagingData->Data, VirtualAddress);
+            ASSERT(pEntry != NULL && PteIsPresent(pEntry));
+
+            *((QWORD*)pEntry) |= VMM_COW_ENTRY_BIT;
+        }
+
+        bMapped = TRUE;
+    }
+
+    RecRwSpinlockReleaseExclusive(&PagingData->Lock, oldState);
+
+    return bMapped;
+}
+
+static
+BOOLEAN
+_VmTryRestoreEvictedPage(
+    IN      PPAGING_LOCK_DATA       PagingData,
+    IN      PVOID                   VirtualAddress
+    )
+{
+    PT_ENTRY* pEntry;
+    BOOLEAN bRestored;
+    INTR_STATE oldState;
+
+    ASSERT(PagingData != NULL);
+    ASSERT(IsAddressAligned(VirtualAddress, PAGE_SIZE));
+
+    // only user pages are evicted
+    if (PagingData->Data.KernelSpace)
+    {
+        return FALSE;
+    }
+
+    bRestored = FALSE;
+
+    RecRwSpinlockAcquireExclusive(&PagingData->Lock, &oldState);
+
+    pEntry = _VmGetLastLevelEntry(&PagingData->Data, VirtualAddress);
+    if (pEntry != NULL && VMM_IS_TRANSITION_ENTRY(*((QWORD*)pEntry)))
+    {
+        // the eviction will find the page mapped again and will leave it be
+        *((QWORD*)pEntry) = VMM_PRESENT_ENTRY_FROM_TRANSITION(*((QWORD*)pEntry));
+        bRestored = TRUE;
+    }
+
+    RecRwSpinlockReleaseExclusive(&PagingData->Lock, oldState);
+
+    return bRestored;
+}
+
+static
+STATUS
+_VmCopyOnWrite(
+    INOUT   PT_ENTRY*               Entry,
+    IN      PVOID                   VirtualAddress,
+    IN      PHYSICAL_ADDRESS        PhysicalAddress,
+    INOUT   PVM_TLB_BATCH           Batch
+    )
+{
+    PHYSICAL_ADDRESS sharedPa;
+    PVOID pDestination;
+    PVOID pSource;
+
+    ASSERT(Entry != NULL);
+    ASSERT(PteIsPresent(Entry) && VMM_IS_COW_ENTRY(*((QWORD*)Entry)));
+    ASSERT(PhysicalAddress != NULL);
+
+    sharedPa = PteGetPhysicalAddress(Entry);
+
+    pDestination = MmuMapSystemMemory(PhysicalAddress, PAGE_SIZE);
+    if (pDestination == NULL)
+    {
+        return STATUS_MEMORY_CANNOT_BE_MAPPED;
+    }
+
+    if (sharedPa == m_vmmData.ZeroFrame)
+    {
+        pagezero(pDestination, PAGE_SIZE);
+    }
+    else
+    {
+        pSource = MmuMapSystemMemory(sharedPa, PAGE_SIZE);
+        if (pSource == NULL)
+        {
+            MmuUnmapSystemMemory(pDestination, PAGE_SIZE);
+            return STATUS_MEMORY_CANNOT_BE_MAPPED;
+        }
+
+        pagecopy(pDestination, pSource, PAGE_SIZE);
+
+        MmuUnmapSystemMemory(pSource, PAGE_SIZE);
+    }
+
+    MmuUnmapSystemMemory(pDestination, PAGE_SIZE);
+
+    // the caching, user access and execution rights stay the same
+    Entry->PhysicalAddress = (QWORD) PhysicalAddress >> SHIFT_FOR_PHYSICAL_ADDR;
+    Entry->ReadWrite = 1;
+    *((QWORD*)Entry) &= ~VMM_COW_ENTRY_BIT;
+
+    // the caller flushes the batch after releasing the paging lock
+    VmTlbBatchAddPage(Batch, VirtualAddress);
+
+    return STATUS_SUCCESS;
+}
+
+static
+STATUS
+_VmFillFrame(
+    IN_OPT  PFILE_OBJECT            File,
+    IN      QWORD                   FileOffset,
+    IN      PHYSICAL_ADDRESS        PhysicalAddress
+    )
+{
+    PVOID pMapping;
+    QWORD bytesRead;
+    STATUS status;
+
+    ASSERT(PhysicalAddress != NULL);
+
+    bytesRead = 0;
+    status = STATUS_SUCCESS;
+
+    pMapping = MmuMapSystemMemory(PhysicalAddress, PAGE_SIZE);
+    if (pMapping == NULL)
+    {
+        return STATUS_MEMORY_CANNOT_BE_MAPPED;
+    }
+
+    if (File != NULL)
+    {
+        status = IoReadFile(File,
+                            PAGE_SIZE,
+                            &FileOffset,
+                            pMapping,
+                            &bytesRead);
+    }
+
+    if (SUCCEEDED(status))
+    {
+        ASSERT(bytesRead <= PAGE_SIZE);
+
+        // frames taken from evicted pages are not zeroed, the part of the
+        // page past the end of the file is never written back
+        memzero(PtrOffset(pMapping, bytesRead), PAGE_SIZE - (DWORD)bytesRead);
+    }
+
+    MmuUnmapSystemMemory(pMapping, PAGE_SIZE);
+
+    return status;
+}
+
+static
+BOOLEAN
+_VmTryMapFilledFrame(
+    IN      PPAGING_LOCK_DATA       PagingData,
+    IN      PVOID                   VirtualAddress,
+    IN      QWORD                   ExpectedEntry,
+    IN      PHYSICAL_ADDRESS        PhysicalAddress,
+    IN      PAGE_RIGHTS             PageRights,
+    IN      BOOLEAN                 Uncacheable
+    )
+{
+    PT_ENTRY* pEntry;
+    BOOLEAN bMapped;
+    INTR_STATE oldState;
+
+    ASSERT(PagingData != NULL);
+    ASSERT(IsAddressAligned(VirtualAddress, PAGE_SIZE));
+    ASSERT(PhysicalAddress != NULL);
+
+    RecRwSpinlockAcquireExclusive(&PagingData->Lock, &oldState);
+
+    // the page tables may not exist yet for pages which were never mapped
+    pEntry = _VmGetLastLevelEntry(&PagingData->Data, VirtualAddress);
+    bMapped = (((pEntry != NULL) ? *((QWORD*)pEntry) : 0) == ExpectedEntry);
+    if (bMapped)
+    {
+        MmuMapMemoryInternal(PhysicalAddress,
+                             PAGE_SIZE,
+                             PageRights,
+                             VirtualAddress,
+                             TRUE,
+                             Uncacheable,
+                             PagingData
+                             );
+    }
+
+    RecRwSpinlockReleaseExclusive(&PagingData->Lock, oldState);
+
+    return bMapped;
+}
+
+static
+STATUS
+_VmSwapInPage(
+    IN      PPAGING_LOCK_DATA       PagingData,
+    IN      PVOID                   VirtualAddress,
+    IN      QWORD                   SwapSlot,
+    IN      PHYSICAL_ADDRESS        PhysicalAddress,
+    IN      PAGE_RIGHTS             PageRights,
+    IN      BOOLEAN                 Uncacheable,
+    OUT     BOOLEAN*                Mapped
+    )
+{
+    PT_ENTRY* pEntry;
+    STATUS status;
+    BOOLEAN bEntryUnchanged;
+    INTR_STATE oldState;
+
+    ASSERT(PagingData != NULL);
+    ASSERT(IsAddressAligned(VirtualAddress, PAGE_SIZE));
+    ASSERT(SwapSlot != VMM_INVALID_SWAP_SLOT);
+    ASSERT(PhysicalAddress != NULL);
+    ASSERT(Mapped != NULL);
+
+    *Mapped = FALSE;
+
+    // the read may block on the swap file => it is done without holding the
+    // paging lock, the entry marked in progress holds off the other faults
+    status = VmSwapReadPage(SwapSlot, PhysicalAddress);
+
+    RecRwSpinlockAcquireExclusive(&PagingData->Lock, &oldState);
+
+    // the page may have been unmapped (and the address mapped again) meanwhile
+    pEntry = _VmGetLastLevelEntry(&PagingData->Data, VirtualAddress);
+    bEntryUnchanged = (pEntry != NULL) && (*((QWORD*)pEntry) == (VMM_SWAP_ENTRY_FOR_SLOT(SwapSlot) | VMM_SWAP_ENTRY_IN_PROGRESS_BIT));
+
+    if (bEntryUnchanged && SUCCEEDED(status))
+    {
+        MmuMapMemoryInternal(PhysicalAddress,
+                             PAGE_SIZE,
+                             PageRights,
+                             VirtualAddress,
+                             TRUE,
+                             Uncacheable,
+                             PagingData
+                             );
+        *Mapped = TRUE;
+    }
+    else if (bEntryUnchanged)
+    {
+        // the page stays in its slot, the next fault tries again
+        *((QWORD*)pEntry) = VMM_SWAP_ENTRY_FOR_SLOT(SwapSlot);
+    }
+
+    RecRwSpinlockReleaseExclusive(&PagingData->Lock, oldState);
+
+    if (!bEntryUnchanged || *Mapped)
+    {
+        // no entry refers to the slot anymore
+        VmSwapFreeSlot(SwapSlot);
+    }
+
+    return status;
+}
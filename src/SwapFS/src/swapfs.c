@@ -262,9 +262,21 @@ STATUS
     {
         bytesRead = pStackLocation->Parameters.ReadWrite.Length;
 
-        if (bytesRead != PAGE_SIZE)
+        // multiple consecutive pages may be transferred at once, but only
+        // whole pages
+        if (bytesRead == 0 || !IsAddressAligned(bytesRead, PAGE_SIZE)
+            || !IsAddressAligned(pStackLocation->Parameters.ReadWrite.Offset, PAGE_SIZE))
         {
-            LOG_ERROR("We cannot read more than a page at time!Bytes requested: %U\n", bytesRead);
+            LOG_ERROR("We can only read whole pages! Bytes requested: %U at offset 0x%X\n",
+                      bytesRead, pStackLocation->Parameters.ReadWrite.Offset);
+            status = STATUS_DEVICE_NOT_SUPPORTED;
+            __leave;
+        }
+
+        if (pStackLocation->Parameters.ReadWrite.Offset + bytesRead > pSwapFsData->FileSystemSize)
+        {
+            LOG_ERROR("Cannot read 0x%X bytes at offset 0x%X, swap file size is 0x%X\n",
+                      bytesRead, pStackLocation->Parameters.ReadWrite.Offset, pSwapFsData->FileSystemSize);
             status = STATUS_DEVICE_NOT_SUPPORTED;
             __leave;
         }
@@ -325,9 +337,21 @@ STATUS
     {
         bytesWritten = pStackLocation->Parameters.ReadWrite.Length;
 
-        if (bytesWritten != PAGE_SIZE)
+        // multiple consecutive pages may be transferred at once, but only
+        // whole pages
+        if (bytesWritten == 0 || !IsAddressAligned(bytesWritten, PAGE_SIZE)
+            || !IsAddressAligned(pStackLocation->Parameters.ReadWrite.Offset, PAGE_SIZE))
+        {
+            LOG_ERROR("We can only write whole pages! Bytes requested: %U at offset 0x%X\n",
+                      bytesWritten, pStackLocation->Parameters.ReadWrite.Offset);
+            status = STATUS_DEVICE_NOT_SUPPORTED;
+            __leave;
+        }
+
+        if (pStackLocation->Parameters.ReadWrite.Offset + bytesWritten > pSwapFsData->FileSystemSize)
         {
-            LOG_ERROR("We cannot write more than a page at time!Bytes requested: %U\n", bytesWritten);
+            LOG_ERROR("Cannot write 0x%X bytes at offset 0x%X, swap file size is 0x%X\n",
+                      bytesWritten, pStackLocation->Parameters.ReadWrite.Offset, pSwapFsData->FileSystemSize);
             status = STATUS_DEVICE_NOT_SUPPORTED;
             __leave;
         }
@@ -120,6 +120,16 @@ SyscallProcessCloseHandle(
     return SyscallEntry(SyscallIdProcessCloseHandle, ProcessHandle);
 }
 
+// SyscallIdProcessGetMemoryStatistics
+STATUS
+SyscallProcessGetMemoryStatistics(
+    IN_OPT  UM_HANDLE                   ProcessHandle,
+    OUT     PROCESS_MEMORY_STATISTICS*  Statistics
+    )
+{
+    return SyscallEntry(SyscallIdProcessGetMemoryStatistics, ProcessHandle, Statistics);
+}
+
 // SyscallIdVirtualAlloc
 STATUS
 SyscallVirtualAlloc(
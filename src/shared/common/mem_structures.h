@@ -16,6 +16,8 @@ typedef DWORD                       VMM_ALLOC_TYPE;
 #define VMM_ALLOC_TYPE_COMMIT       0x2
 #define VMM_ALLOC_TYPE_NOT_LAZY     0x4
 #define VMM_ALLOC_TYPE_ZERO         0x8
+// Valid only for file mappings, the modified pages are written back to the file
+#define VMM_ALLOC_TYPE_SHARED_FILE  0x10
 
 typedef DWORD                       VMM_FREE_TYPE;
 
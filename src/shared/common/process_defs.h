@@ -1,3 +1,33 @@
 #pragma once
 
-typedef QWORD       PID, *PPID;
\ No newline at end of file
+typedef QWORD       PID, *PPID;
+
+typedef struct _PROCESS_MEMORY_STATISTICS
+{
+    // Bytes of the address space currently backed by physical frames
+    QWORD           ResidentBytes;
+    QWORD           PeakResidentBytes;
+
+    // Bytes of the virtual memory allocations which are committed
+    QWORD           CommittedBytes;
+
+    // Anonymous pages accessed for the first time
+    QWORD           DemandZeroFaults;
+
+    // Pages read from the file they map
+    QWORD           FileBackedFaults;
+
+    // Pages read back from the swap file or whose eviction was canceled
+    QWORD           SwapInFaults;
+
+    // Writes to pages shared copy-on-write
+    QWORD           CopyOnWriteFaults;
+
+    // Accesses to memory which is not committed or which does not grant the
+    // rights requested, these are never solved
+    QWORD           ProtectionFaults;
+
+    // Time spent solving the page faults of the process
+    QWORD           FaultServiceTimeUs;
+    QWORD           MaxFaultServiceTimeUs;
+} PROCESS_MEMORY_STATISTICS, *PPROCESS_MEMORY_STATISTICS;
\ No newline at end of file
@@ -176,6 +176,23 @@ SyscallProcessCloseHandle(
     IN      UM_HANDLE               ProcessHandle
     );
 
+// SyscallIdProcessGetMemoryStatistics
+//******************************************************************************
+// Function:     SyscallProcessGetMemoryStatistics
+// Description:  Retrieves the resident and committed memory of ProcessHandle
+//               and the page faults taken in its address space. If
+//               ProcessHandle is UM_INVALID_HANDLE_VALUE the statistics of
+//               the current process are retrieved.
+// Returns:      STATUS
+// Parameter:    IN_OPT UM_HANDLE ProcessHandle
+// Parameter:    OUT PROCESS_MEMORY_STATISTICS * Statistics
+//******************************************************************************
+STATUS
+SyscallProcessGetMemoryStatistics(
+    IN_OPT  UM_HANDLE                   ProcessHandle,
+    OUT     PROCESS_MEMORY_STATISTICS*  Statistics
+    );
+
 // SyscallIdVirtualAlloc
 //******************************************************************************
 // Function:     SyscallVirtualAlloc
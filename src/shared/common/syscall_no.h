@@ -17,6 +17,7 @@ typedef enum _SYSCALL_ID
     SyscallIdProcessGetPid,
     SyscallIdProcessWaitForTermination,
     SyscallIdProcessCloseHandle,
+    SyscallIdProcessGetMemoryStatistics,
 
     // Memory management 
     SyscallIdVirtualAlloc,